@@ -0,0 +1,119 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "ProtocolTrace.h"
+
+#include <algorithm>
+#include <atomic>
+
+extern "C"
+{
+	#include <esp_timer.h>
+}
+
+namespace
+{
+#if CONFIG_IDFIX_PROTOCOLS_TRACE
+
+	constexpr size_t powerOfTwoBelow(size_t value)
+	{
+		return value < 2 ? 1 : 2 * powerOfTwoBelow(value / 2);
+	}
+
+	// the capacity is a power of two, so the running number maps to an entry with a mask
+	constexpr size_t	TRACE_CAPACITY	= powerOfTwoBelow(CONFIG_IDFIX_PROTOCOLS_TRACE_ENTRIES);
+	constexpr uint32_t	TRACE_MASK		= TRACE_CAPACITY - 1;
+
+	IDFix::Protocols::ProtocolTrace::Entry	traceEntries[TRACE_CAPACITY];
+	std::atomic<uint32_t>					traceIndex = { 0 };
+
+#endif
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+
+		void ProtocolTrace::record(Event event, uint32_t argument0, uint32_t argument1)
+		{
+#if CONFIG_IDFIX_PROTOCOLS_TRACE
+			uint32_t	index = traceIndex.fetch_add(1, std::memory_order_relaxed);
+			Entry		&entry = traceEntries[index & TRACE_MASK];
+
+			entry.timestamp = static_cast<uint32_t>( esp_timer_get_time() );
+			entry.event = event;
+			entry.argument0 = argument0;
+			entry.argument1 = argument1;
+
+			// the sequence is written last, so a reader can tell a complete entry from one being written
+			std::atomic_thread_fence(std::memory_order_release);
+			entry.sequence = static_cast<uint16_t>(index);
+#else
+			(void) event;
+			(void) argument0;
+			(void) argument1;
+#endif
+		}
+
+		size_t ProtocolTrace::read(Entry *entries, size_t maxEntries)
+		{
+#if CONFIG_IDFIX_PROTOCOLS_TRACE
+			uint32_t	endIndex = traceIndex.load(std::memory_order_acquire);
+			size_t		count = std::min( { static_cast<size_t>(endIndex), TRACE_CAPACITY, maxEntries } );
+			size_t		copied = 0;
+
+			for ( uint32_t index = endIndex - static_cast<uint32_t>(count); index != endIndex; index++ )
+			{
+				Entry entry = traceEntries[index & TRACE_MASK];
+				std::atomic_thread_fence(std::memory_order_acquire);
+
+				if ( entry.sequence != static_cast<uint16_t>(index) )
+				{
+					// the entry is still being written
+					continue;
+				}
+
+				if ( traceIndex.load(std::memory_order_acquire) - index > TRACE_CAPACITY )
+				{
+					// the entry was overwritten while it was copied
+					continue;
+				}
+
+				entries[copied++] = entry;
+			}
+
+			return copied;
+#else
+			(void) entries;
+			(void) maxEntries;
+			return 0;
+#endif
+		}
+
+		size_t ProtocolTrace::capacity()
+		{
+#if CONFIG_IDFIX_PROTOCOLS_TRACE
+			return TRACE_CAPACITY;
+#else
+			return 0;
+#endif
+		}
+
+	}
+}
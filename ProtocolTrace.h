@@ -0,0 +1,147 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PROTOCOLTRACE_H
+#define PROTOCOLTRACE_H
+
+extern "C"
+{
+	#include <stddef.h>
+	#include <stdint.h>
+	#include <esp_log.h>
+	#include "sdkconfig.h"
+}
+
+#ifndef CONFIG_IDFIX_PROTOCOLS_HOT_PATH_LOG_LEVEL
+	#define CONFIG_IDFIX_PROTOCOLS_HOT_PATH_LOG_LEVEL	3
+#endif
+
+#ifndef CONFIG_IDFIX_PROTOCOLS_TRACE_ENTRIES
+	#define CONFIG_IDFIX_PROTOCOLS_TRACE_ENTRIES		256
+#endif
+
+/**
+ * Log macros for the data path. Messages above CONFIG_IDFIX_PROTOCOLS_HOT_PATH_LOG_LEVEL are removed at compile time,
+ * including the evaluation of their arguments. Errors and warnings are always logged with ESP_LOGE and ESP_LOGW.
+ */
+#if CONFIG_IDFIX_PROTOCOLS_HOT_PATH_LOG_LEVEL >= 3
+	#define IDFIX_HOT_LOGI(tag, format, ...)	ESP_LOGI(tag, format, ##__VA_ARGS__)
+#else
+	#define IDFIX_HOT_LOGI(tag, format, ...)	((void) 0)
+#endif
+
+#if CONFIG_IDFIX_PROTOCOLS_HOT_PATH_LOG_LEVEL >= 4
+	#define IDFIX_HOT_LOGD(tag, format, ...)	ESP_LOGD(tag, format, ##__VA_ARGS__)
+#else
+	#define IDFIX_HOT_LOGD(tag, format, ...)	((void) 0)
+#endif
+
+#if CONFIG_IDFIX_PROTOCOLS_HOT_PATH_LOG_LEVEL >= 5
+	#define IDFIX_HOT_LOGV(tag, format, ...)	ESP_LOGV(tag, format, ##__VA_ARGS__)
+#else
+	#define IDFIX_HOT_LOGV(tag, format, ...)	((void) 0)
+#endif
+
+/**
+ * Records an event in the trace buffer if CONFIG_IDFIX_PROTOCOLS_TRACE is enabled, otherwise the macro is removed at compile time.
+ */
+#if CONFIG_IDFIX_PROTOCOLS_TRACE
+	#define IDFIX_TRACE(event, argument0, argument1)	IDFix::Protocols::ProtocolTrace::record(IDFix::Protocols::ProtocolTrace::event, \
+														static_cast<uint32_t>(argument0), static_cast<uint32_t>(argument1) )
+#else
+	#define IDFIX_TRACE(event, argument0, argument1)	((void) 0)
+#endif
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+        /**
+         * @brief The ProtocolTrace class provides a binary trace of the data path events in a ring buffer.
+         *
+         * Each event is recorded as a fixed size Entry of a timestamp, an event id and two integer arguments. Recording does not format
+         * anything and does not take a lock: the writer reserves an entry with a single atomic increment, so the events of all tasks can be
+         * recorded concurrently. The oldest entries are overwritten.
+         *
+         * The entries are copied out with \c read, e.g. on request of a diagnostic interface, and decoded offline by mapping the event ids
+         * below to their names. The arguments of each event are documented with the Event enum.
+         */
+		class ProtocolTrace
+		{
+			public:
+
+				enum Event : uint16_t
+				{
+					TLSConnectionAccepted	= 1,	/**< socket descriptor, peer IPv4 address (network byte order) */
+					TLSConnectionRejected	= 2,	/**< socket descriptor, TLSAdmissionControl::Decision */
+					TLSHandshakeCompleted	= 3,	/**< socket descriptor, handshake duration in milliseconds */
+					TLSRecordReceived		= 4,	/**< socket descriptor, plaintext bytes */
+					TLSRecordSent			= 5,	/**< socket descriptor, plaintext bytes */
+					TLSBytesQueued			= 6,	/**< socket descriptor, bytes in the outbound queue */
+					TLSSocketClosed			= 7,	/**< socket descriptor, 0 */
+
+					WebSocketConnected		= 32,	/**< 0, 0 */
+					WebSocketDisconnected	= 33,	/**< 0, 0 */
+					WebSocketFrameSent		= 34,	/**< opcode, payload bytes */
+					WebSocketFrameReceived	= 35,	/**< opcode, payload bytes */
+					WebSocketMessageQueued	= 36,	/**< opcode, payload bytes, the time until WebSocketFrameSent is the send latency */
+					WebSocketBatchSent		= 37,	/**< frames, bytes written, batched frames are not traced as WebSocketFrameSent */
+
+					DNSQueryAnswered		= 64,	/**< client IPv4 address (network byte order), response bytes */
+					DNSQueryRejected		= 65,	/**< DNS response code, response bytes */
+				};
+
+				struct Entry
+				{
+					uint32_t	timestamp;		/**< microseconds since boot, wraps after about 71 minutes */
+					uint16_t	event;			/**< the Event */
+					uint16_t	sequence;		/**< the lower 16 bit of the running number of the entry */
+					uint32_t	argument0;
+					uint32_t	argument1;
+				};
+
+                /**
+                 * @brief Records an event. Can be called from any task, but not from an interrupt.
+                 *
+                 * @param event         the event id
+                 * @param argument0     the first argument of the event
+                 * @param argument1     the second argument of the event
+                 */
+				static void		record(Event event, uint32_t argument0, uint32_t argument1);
+
+                /**
+                 * @brief Copies the most recent entries in chronological order
+                 *
+                 * Entries which are overwritten while copying are skipped.
+                 *
+                 * @param entries       the buffer receiving the entries
+                 * @param maxEntries    the capacity of the buffer
+                 *
+                 * @return  the number of copied entries
+                 */
+				static size_t	read(Entry *entries, size_t maxEntries);
+
+                /**
+                 * @brief Returns the number of entries the trace buffer holds
+                 */
+				static size_t	capacity(void);
+		};
+	}
+}
+
+#endif
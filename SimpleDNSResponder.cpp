@@ -17,6 +17,7 @@
 
 #include "SimpleDNSResponder.h"
 #include "MutexLocker.h"
+#include "ProtocolTrace.h"
 
 extern "C"
 {
@@ -122,6 +123,7 @@ namespace IDFix
 
 				if ( responseMessageSize > 0 )
 				{
+					IDFIX_TRACE(DNSQueryAnswered, clientSocketAddress.sin_addr.s_addr, responseMessageSize);
 					sendto(_serverSocket, messageBuffer, responseMessageSize, 0, reinterpret_cast<struct sockaddr *>(&clientSocketAddress), socketAddressLen);
 				}
 			}
@@ -279,7 +281,9 @@ namespace IDFix
 
 		size_t SimpleDNSResponder::processError(SimpleDNSResponder::DNSMessageHeader *header, SimpleDNSResponder::DNSResponseCode responseCode, size_t messageSize)
 		{
-			ESP_LOGW(LOG_TAG, "DNS message error: %d", static_cast<uint8_t>(responseCode));
+			// e.g. every AAAA query ends here, so this is not worth a warning
+			IDFIX_HOT_LOGD(LOG_TAG, "DNS message error: %d", static_cast<uint8_t>(responseCode));
+			IDFIX_TRACE(DNSQueryRejected, responseCode, messageSize);
 
 			header->QR = DNS_RESPONSE;
 			header->RCode = static_cast<uint8_t>(responseCode);
@@ -0,0 +1,373 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "SocketPoller.h"
+#include "MutexLocker.h"
+
+extern "C"
+{
+	#include <errno.h>
+	#include <unistd.h>
+	#include <esp_log.h>
+}
+
+namespace
+{
+	const char*		LOG_TAG					= "IDFix::SocketPoller";
+
+#if defined(IDFIX_SOCKETPOLLER_EPOLL)
+	const size_t	MIN_EPOLL_EVENTS		= 16;
+	const size_t	MAX_EPOLL_EVENTS		= 256;
+
+	uint32_t toEpollEvents(uint8_t events)
+	{
+		uint32_t epollEvents = 0;
+
+		if ( events & IDFix::Protocols::SocketPoller::Readable )
+		{
+			epollEvents |= EPOLLIN;
+		}
+
+		if ( events & IDFix::Protocols::SocketPoller::Writable )
+		{
+			epollEvents |= EPOLLOUT;
+		}
+
+		return epollEvents;
+	}
+#else
+	short toPollEvents(uint8_t events)
+	{
+		short pollEvents = 0;
+
+		if ( events & IDFix::Protocols::SocketPoller::Readable )
+		{
+			pollEvents |= POLLIN;
+		}
+
+		if ( events & IDFix::Protocols::SocketPoller::Writable )
+		{
+			pollEvents |= POLLOUT;
+		}
+
+		return pollEvents;
+	}
+#endif
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+
+		SocketPoller::SocketPoller()
+		{
+
+		}
+
+		SocketPoller::~SocketPoller()
+		{
+			deinit();
+		}
+
+		const std::vector<SocketPoller::ReadyEvent> &SocketPoller::readyEvents() const
+		{
+			return _readyEvents;
+		}
+
+#if defined(IDFIX_SOCKETPOLLER_EPOLL)
+
+		bool SocketPoller::init()
+		{
+			if ( _epollDescriptor >= 0 )
+			{
+				return true;
+			}
+
+			_epollDescriptor = epoll_create1(EPOLL_CLOEXEC);
+
+			if ( _epollDescriptor < 0 )
+			{
+				ESP_LOGE(LOG_TAG, "epoll_create1() failed (errno=%d) at file %s:%d.", errno, __FILE__, __LINE__);
+				return false;
+			}
+
+			_registeredCount = 0;
+			_epollEvents.resize(MIN_EPOLL_EVENTS);
+
+			return true;
+		}
+
+		void SocketPoller::deinit()
+		{
+			if ( _epollDescriptor >= 0 )
+			{
+				::close(_epollDescriptor);
+				_epollDescriptor = -1;
+			}
+
+			_registeredCount = 0;
+			_readyEvents.clear();
+		}
+
+		bool SocketPoller::addDescriptor(int descriptor, uint8_t events)
+		{
+			struct epoll_event event = {};
+			event.events	= toEpollEvents(events);
+			event.data.fd	= descriptor;
+
+			if ( epoll_ctl(_epollDescriptor, EPOLL_CTL_ADD, descriptor, &event) < 0 )
+			{
+				ESP_LOGE(LOG_TAG, "epoll_ctl(ADD, %d) failed (errno=%d) at file %s:%d.", descriptor, errno, __FILE__, __LINE__);
+				return false;
+			}
+
+			_registeredCount++;
+			return true;
+		}
+
+		bool SocketPoller::modifyDescriptor(int descriptor, uint8_t events)
+		{
+			struct epoll_event event = {};
+			event.events	= toEpollEvents(events);
+			event.data.fd	= descriptor;
+
+			return epoll_ctl(_epollDescriptor, EPOLL_CTL_MOD, descriptor, &event) == 0;
+		}
+
+		void SocketPoller::removeDescriptor(int descriptor)
+		{
+			if ( epoll_ctl(_epollDescriptor, EPOLL_CTL_DEL, descriptor, nullptr) == 0 )
+			{
+				_registeredCount--;
+			}
+		}
+
+		int SocketPoller::wait(int timeoutMS)
+		{
+			_readyEvents.clear();
+
+			// grow the event buffer with the number of registered descriptors, so a single wakeup can
+			// report all of them. Descriptors exceeding the buffer will simply be reported by the next call
+			size_t wantedEvents = _registeredCount < MIN_EPOLL_EVENTS ? MIN_EPOLL_EVENTS : _registeredCount;
+			if ( wantedEvents > MAX_EPOLL_EVENTS )
+			{
+				wantedEvents = MAX_EPOLL_EVENTS;
+			}
+
+			if ( _epollEvents.size() < wantedEvents )
+			{
+				_epollEvents.resize(wantedEvents);
+			}
+
+			int result = epoll_wait(_epollDescriptor, _epollEvents.data(), static_cast<int>(_epollEvents.size()), timeoutMS);
+
+			if ( result <= 0 )
+			{
+				return ( result < 0 && errno == EINTR ) ? 0 : result;
+			}
+
+			for (int index = 0; index < result; index++)
+			{
+				const struct epoll_event &event = _epollEvents[index];
+				ReadyEvent readyEvent = { event.data.fd, None };
+
+				if ( event.events & EPOLLIN )
+				{
+					readyEvent.events |= Readable;
+				}
+
+				if ( event.events & EPOLLOUT )
+				{
+					readyEvent.events |= Writable;
+				}
+
+				if ( event.events & (EPOLLERR | EPOLLHUP) )
+				{
+					readyEvent.events |= Closed;
+				}
+
+				_readyEvents.push_back(readyEvent);
+			}
+
+			return result;
+		}
+
+#else
+
+		bool SocketPoller::init()
+		{
+			MutexLocker locker(_mutex);
+
+			_pollDescriptors.clear();
+			_pollIndex.clear();
+			_snapshotIsDirty = true;
+
+			return true;
+		}
+
+		void SocketPoller::deinit()
+		{
+			MutexLocker locker(_mutex);
+
+			_pollDescriptors.clear();
+			_pollIndex.clear();
+			_snapshotIsDirty = true;
+			_readyEvents.clear();
+		}
+
+		bool SocketPoller::isRegistered(int descriptor) const
+		{
+			return descriptor >= 0 && static_cast<size_t>(descriptor) < _pollIndex.size() && _pollIndex[descriptor] >= 0;
+		}
+
+		bool SocketPoller::addDescriptor(int descriptor, uint8_t events)
+		{
+			MutexLocker locker(_mutex);
+
+			if ( descriptor < 0 || isRegistered(descriptor) )
+			{
+				return false;
+			}
+
+			if ( static_cast<size_t>(descriptor) >= _pollIndex.size() )
+			{
+				_pollIndex.resize(descriptor + 1, -1);
+			}
+
+			struct pollfd pollDescriptor = {};
+			pollDescriptor.fd		= descriptor;
+			pollDescriptor.events	= toPollEvents(events);
+
+			_pollIndex[descriptor] = static_cast<int>(_pollDescriptors.size());
+			_pollDescriptors.push_back(pollDescriptor);
+			_snapshotIsDirty = true;
+
+			return true;
+		}
+
+		bool SocketPoller::modifyDescriptor(int descriptor, uint8_t events)
+		{
+			MutexLocker locker(_mutex);
+
+			if ( ! isRegistered(descriptor) )
+			{
+				return false;
+			}
+
+			_pollDescriptors[_pollIndex[descriptor]].events = toPollEvents(events);
+			_snapshotIsDirty = true;
+
+			return true;
+		}
+
+		void SocketPoller::removeDescriptor(int descriptor)
+		{
+			MutexLocker locker(_mutex);
+
+			if ( ! isRegistered(descriptor) )
+			{
+				return;
+			}
+
+			// swap the last entry into the free position, so removal stays O(1)
+			int index = _pollIndex[descriptor];
+			int lastIndex = static_cast<int>(_pollDescriptors.size()) - 1;
+
+			if ( index != lastIndex )
+			{
+				_pollDescriptors[index] = _pollDescriptors[lastIndex];
+				_pollIndex[_pollDescriptors[index].fd] = index;
+			}
+
+			_pollDescriptors.pop_back();
+			_pollIndex[descriptor] = -1;
+			_snapshotIsDirty = true;
+		}
+
+		int SocketPoller::wait(int timeoutMS)
+		{
+			_readyEvents.clear();
+
+			_mutex.lock();
+
+				// poll() works on a snapshot, so other tasks can alter the registered descriptors while we are blocked
+				// the snapshot keeps its capacity, so it only allocates if the number of descriptors grows
+				if ( _snapshotIsDirty )
+				{
+					_pollSnapshot = _pollDescriptors;
+					_snapshotIsDirty = false;
+				}
+
+			_mutex.unlock();
+
+			int result = poll(_pollSnapshot.data(), static_cast<nfds_t>(_pollSnapshot.size()), timeoutMS);
+
+			if ( result <= 0 )
+			{
+				return ( result < 0 && errno == EINTR ) ? 0 : result;
+			}
+
+			MutexLocker locker(_mutex);
+
+			int remaining = result;
+
+			// stop scanning as soon as all ready descriptors were found
+			for (size_t index = 0; index < _pollSnapshot.size() && remaining > 0; index++)
+			{
+				const struct pollfd &pollDescriptor = _pollSnapshot[index];
+
+				if ( pollDescriptor.revents == 0 )
+				{
+					continue;
+				}
+
+				remaining--;
+
+				if ( ! isRegistered(pollDescriptor.fd) )
+				{
+					// descriptor was removed while we were waiting
+					continue;
+				}
+
+				ReadyEvent readyEvent = { pollDescriptor.fd, None };
+
+				if ( pollDescriptor.revents & POLLIN )
+				{
+					readyEvent.events |= Readable;
+				}
+
+				if ( pollDescriptor.revents & POLLOUT )
+				{
+					readyEvent.events |= Writable;
+				}
+
+				if ( pollDescriptor.revents & (POLLERR | POLLHUP | POLLNVAL) )
+				{
+					readyEvent.events |= Closed;
+				}
+
+				_readyEvents.push_back(readyEvent);
+			}
+
+			return static_cast<int>(_readyEvents.size());
+		}
+
+#endif
+
+	}
+}
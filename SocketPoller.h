@@ -0,0 +1,174 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SOCKETPOLLER_H
+#define SOCKETPOLLER_H
+
+#include <vector>
+#include "Mutex.h"
+
+extern "C"
+{
+	#include <stdint.h>
+	#include <stddef.h>
+}
+
+// the poll() backend may be forced on Linux by defining IDFIX_SOCKETPOLLER_POLL
+#if defined(__linux__) && !defined(IDFIX_SOCKETPOLLER_POLL)
+	#define IDFIX_SOCKETPOLLER_EPOLL	1
+#elif !defined(IDFIX_SOCKETPOLLER_POLL)
+	#define IDFIX_SOCKETPOLLER_POLL		1
+#endif
+
+extern "C"
+{
+#if defined(IDFIX_SOCKETPOLLER_EPOLL)
+	#include <sys/epoll.h>
+#else
+	#include <sys/poll.h>
+	#include "lwip/sockets.h"
+#endif
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+        /**
+         * @brief The SocketPoller class provides a readiness notification backend for socket descriptors.
+         *
+         * On the Linux host build the poller is backed by epoll, on lwIP it is backed by poll(). Both backends report
+         * level triggered readiness, so a descriptor which was not completely drained will be reported again by the next
+         * call of \c wait. The number of descriptors is not limited by FD_SETSIZE and with the epoll backend the cost of a wakeup
+         * only depends on the number of ready descriptors.
+         *
+         * Descriptors may be added, modified and removed from any task while another task is blocked in \c wait.
+         */
+		class SocketPoller
+		{
+			public:
+
+				enum Events : uint8_t
+				{
+					None		= 0x00,
+					Readable	= 0x01,
+					Writable	= 0x02,
+					Closed		= 0x04		/**< error or hang up on the descriptor, only reported, never requested */
+				};
+
+				struct ReadyEvent
+				{
+					int			descriptor;
+					uint8_t		events;
+				};
+
+								SocketPoller();
+								~SocketPoller();
+
+                /**
+                 * @brief A SocketPoller owns operating system resources and therefore cannot be copied
+                 */
+								SocketPoller(const SocketPoller&) = delete;
+
+                /**
+                 * @brief Creates the backend resources
+                 *
+                 * @return  true on success
+                 * @return  false on failure
+                 */
+				bool			init(void);
+
+                /**
+                 * @brief Releases the backend resources and forgets all registered descriptors
+                 */
+				void			deinit(void);
+
+                /**
+                 * @brief Registers a descriptor for the given events.
+                 *
+                 * @param descriptor    the socket descriptor to watch
+                 * @param events        combination of #Events the caller is interested in
+                 *
+                 * @return  true on success
+                 * @return  false on failure
+                 */
+				bool			addDescriptor(int descriptor, uint8_t events);
+
+                /**
+                 * @brief Changes the events a registered descriptor is watched for.
+                 *
+                 * @param descriptor    the registered socket descriptor
+                 * @param events        combination of #Events the caller is interested in, #None suspends the descriptor
+                 *
+                 * @return  true on success
+                 * @return  false if the descriptor is not registered or the backend failed
+                 */
+				bool			modifyDescriptor(int descriptor, uint8_t events);
+
+                /**
+                 * @brief Unregisters a descriptor. Must be called before the descriptor is closed.
+                 *
+                 * @param descriptor    the registered socket descriptor
+                 */
+				void			removeDescriptor(int descriptor);
+
+                /**
+                 * @brief Blocks until at least one registered descriptor is ready or the timeout expired.
+                 *
+                 * The ready descriptors can be obtained by \c readyEvents afterwards. Events of descriptors which were removed
+                 * while waiting are not reported.
+                 *
+                 * @param timeoutMS     the maximum time to wait in milliseconds, \c -1 waits infinitely
+                 *
+                 * @return  the number of ready descriptors, \c 0 on timeout
+                 * @return  < \c 0 on failure
+                 */
+				int				wait(int timeoutMS);
+
+                /**
+                 * @brief Returns the ready descriptors of the last \c wait call.
+                 */
+				const std::vector<ReadyEvent>&	readyEvents(void) const;
+
+			private:
+
+				std::vector<ReadyEvent>		_readyEvents = {};
+
+#if defined(IDFIX_SOCKETPOLLER_EPOLL)
+				int							_epollDescriptor = { -1 };
+				std::vector<struct epoll_event>	_epollEvents = {};
+				size_t						_registeredCount = { 0 };
+#else
+				Mutex						_mutex = { Mutex::Recursive };
+
+				bool						isRegistered(int descriptor) const;
+
+				/** \brief the registered descriptors, used as template for the next poll() call */
+				std::vector<struct pollfd>	_pollDescriptors = {};
+
+				/** \brief a copy of _pollDescriptors, only updated if descriptors were changed since the last wait() */
+				std::vector<struct pollfd>	_pollSnapshot = {};
+				bool						_snapshotIsDirty = { true };
+
+				/** \brief maps a descriptor to its index in _pollDescriptors, -1 if not registered */
+				std::vector<int>			_pollIndex = {};
+#endif
+		};
+	}
+}
+
+#endif
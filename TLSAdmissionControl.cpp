@@ -0,0 +1,158 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "TLSAdmissionControl.h"
+#include "MutexLocker.h"
+
+extern "C"
+{
+	#include <esp_heap_caps.h>
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+
+		TLSAdmissionControl::TLSAdmissionControl()
+		{
+
+		}
+
+		void TLSAdmissionControl::setLimits(uint16_t maxConnections, uint16_t maxHandshakes, uint16_t maxConnectionsPerPeer)
+		{
+			MutexLocker locker(_mutex);
+
+			_maxConnections = maxConnections;
+			_maxHandshakes = maxHandshakes;
+			_maxConnectionsPerPeer = maxConnectionsPerPeer;
+		}
+
+		void TLSAdmissionControl::setHeapLowWatermark(size_t heapLowWatermark)
+		{
+			MutexLocker locker(_mutex);
+
+			_heapLowWatermark = heapLowWatermark;
+		}
+
+		bool TLSAdmissionControl::heapIsLow()
+		{
+			MutexLocker locker(_mutex);
+
+			return _heapLowWatermark > 0 && heap_caps_get_free_size(MALLOC_CAP_8BIT) < _heapLowWatermark;
+		}
+
+		TLSAdmissionControl::Decision TLSAdmissionControl::admit(uint32_t peerAddress)
+		{
+			MutexLocker locker(_mutex);
+
+			if ( heapIsLow() )
+			{
+				_statistics.shedLowHeap++;
+				return LowHeap;
+			}
+
+			if ( _maxConnections > 0 && _connections >= _maxConnections )
+			{
+				_statistics.rejectedConnectionLimit++;
+				return ConnectionLimit;
+			}
+
+			if ( _maxHandshakes > 0 && _handshakes >= _maxHandshakes )
+			{
+				_statistics.rejectedHandshakeLimit++;
+				return HandshakeLimit;
+			}
+
+			// the connections per peer are always counted, so the limit can be enabled at any time
+			std::unordered_map<uint32_t, uint16_t>::iterator it = _connectionsPerPeer.find(peerAddress);
+
+			if ( _maxConnectionsPerPeer > 0 && it != _connectionsPerPeer.end() && it->second >= _maxConnectionsPerPeer )
+			{
+				_statistics.rejectedPeerLimit++;
+				return PeerLimit;
+			}
+
+			// the peer is only inserted once admitted, so a flood of rejected connections does not allocate
+			if ( it != _connectionsPerPeer.end() )
+			{
+				it->second++;
+			}
+			else
+			{
+				_connectionsPerPeer.emplace(peerAddress, 1);
+			}
+
+			_connections++;
+			_handshakes++;
+			_statistics.admitted++;
+
+			return Admitted;
+		}
+
+		void TLSAdmissionControl::handshakeFinished()
+		{
+			MutexLocker locker(_mutex);
+
+			if ( _handshakes > 0 )
+			{
+				_handshakes--;
+			}
+		}
+
+		void TLSAdmissionControl::connectionClosed(uint32_t peerAddress, bool handshakeInProgress)
+		{
+			MutexLocker locker(_mutex);
+
+			if ( handshakeInProgress && _handshakes > 0 )
+			{
+				_handshakes--;
+			}
+
+			if ( _connections > 0 )
+			{
+				_connections--;
+			}
+
+			std::unordered_map<uint32_t, uint16_t>::iterator it = _connectionsPerPeer.find(peerAddress);
+
+			if ( it != _connectionsPerPeer.end() )
+			{
+				if ( it->second <= 1 )
+				{
+					_connectionsPerPeer.erase(it);
+				}
+				else
+				{
+					it->second--;
+				}
+			}
+		}
+
+		TLSAdmissionControl::Statistics TLSAdmissionControl::statistics()
+		{
+			MutexLocker locker(_mutex);
+
+			Statistics statistics = _statistics;
+			statistics.connections = _connections;
+			statistics.handshakes = _handshakes;
+
+			return statistics;
+		}
+
+	}
+}
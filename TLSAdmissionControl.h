@@ -0,0 +1,136 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TLSADMISSIONCONTROL_H
+#define TLSADMISSIONCONTROL_H
+
+extern "C"
+{
+	#include <stddef.h>
+	#include <stdint.h>
+}
+
+#include <unordered_map>
+#include "Mutex.h"
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+        /**
+         * @brief The TLSAdmissionControl class decides whether a TLSServer admits a new connection.
+         *
+         * It limits the number of open connections, the number of concurrent TLS handshakes and the number of connections per peer
+         * address, and it sheds connections while the free heap is below a low watermark. The decision is made right after accepting the
+         * TCP connection, before any TLS resources are allocated, so rejecting a connection is cheap. All limits default to \c 0 (unlimited).
+         *
+         * An admitted connection is counted as handshake until \c handshakeFinished is called and as connection until \c connectionClosed
+         * is called. The class is thread safe, as the connections are released by the TLSServerWorkers owning them.
+         */
+		class TLSAdmissionControl
+		{
+			public:
+
+				enum Decision
+				{
+					Admitted,
+					ConnectionLimit,
+					HandshakeLimit,
+					PeerLimit,
+					LowHeap
+				};
+
+				struct Statistics
+				{
+					uint32_t	admitted;					/**< connections admitted */
+					uint32_t	rejectedConnectionLimit;	/**< connections rejected because of the connection limit */
+					uint32_t	rejectedHandshakeLimit;		/**< connections rejected because of the handshake limit */
+					uint32_t	rejectedPeerLimit;			/**< connections rejected because of the per peer limit */
+					uint32_t	shedLowHeap;				/**< connections shed because the free heap was below the low watermark */
+					uint32_t	connections;				/**< connections currently open */
+					uint32_t	handshakes;					/**< handshakes currently in progress */
+				};
+
+								TLSAdmissionControl();
+
+								TLSAdmissionControl(const TLSAdmissionControl&) = delete;
+
+                /**
+                 * @brief Sets the connection limits, \c 0 disables a limit.
+                 *
+                 * @param maxConnections            the maximum number of open connections
+                 * @param maxHandshakes             the maximum number of concurrent handshakes
+                 * @param maxConnectionsPerPeer     the maximum number of open connections per peer address
+                 */
+				void			setLimits(uint16_t maxConnections, uint16_t maxHandshakes, uint16_t maxConnectionsPerPeer);
+
+                /**
+                 * @brief Sets the free heap (in bytes) below which new connections are shed, \c 0 disables shedding.
+                 */
+				void			setHeapLowWatermark(size_t heapLowWatermark);
+
+                /**
+                 * @brief Returns true if the free heap is below the low watermark
+                 */
+				bool			heapIsLow(void);
+
+                /**
+                 * @brief Decides whether a new connection is admitted and counts it if so.
+                 *
+                 * @param peerAddress   the IPv4 address of the peer (network byte order)
+                 *
+                 * @return  \c Admitted or the reason of the rejection
+                 */
+				Decision		admit(uint32_t peerAddress);
+
+                /**
+                 * @brief Indicates that the handshake of an admitted connection finished successfully.
+                 */
+				void			handshakeFinished(void);
+
+                /**
+                 * @brief Indicates that an admitted connection was closed.
+                 *
+                 * @param peerAddress           the IPv4 address of the peer (network byte order)
+                 * @param handshakeInProgress   true if \c handshakeFinished was not called for the connection
+                 */
+				void			connectionClosed(uint32_t peerAddress, bool handshakeInProgress);
+
+                /**
+                 * @brief Returns a snapshot of the admission counters
+                 */
+				Statistics		statistics(void);
+
+			private:
+
+				uint16_t		_maxConnections = { 0 };
+				uint16_t		_maxHandshakes = { 0 };
+				uint16_t		_maxConnectionsPerPeer = { 0 };
+				size_t			_heapLowWatermark = { 0 };
+
+				uint32_t		_connections = { 0 };
+				uint32_t		_handshakes = { 0 };
+				std::unordered_map<uint32_t, uint16_t>	_connectionsPerPeer = {};
+
+				Statistics		_statistics = {};
+
+				Mutex			_mutex = { Mutex::Recursive };
+		};
+	}
+}
+
+#endif
@@ -0,0 +1,134 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "TLSBufferPool.h"
+
+namespace
+{
+	// the capacities include one additional byte for the transparent 0 termination of received data
+	// the largest class holds the maximum plaintext of a TLS record (16 KiB)
+	const size_t SIZE_CLASSES[]			= { 512, 2*1024, 16*1024 + 1 };
+
+	// the maximum number of idle buffers kept per size class
+	const size_t MAX_FREE_BUFFERS[]		= { 4, 4, 2 };
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+
+		TLSBufferPool::TLSBufferPool()
+		{
+			static_assert( sizeof(SIZE_CLASSES) / sizeof(SIZE_CLASSES[0]) == SIZE_CLASS_COUNT, "size class count mismatch");
+
+			// reserves the free lists
+			clear();
+		}
+
+		void TLSBufferPool::acquire(ByteArray &buffer, size_t capacity)
+		{
+			buffer.clear();
+
+			for ( size_t sizeClass = 0; sizeClass < SIZE_CLASS_COUNT; sizeClass++ )
+			{
+				if ( SIZE_CLASSES[sizeClass] < capacity )
+				{
+					continue;
+				}
+
+				std::vector<ByteArray> &freeBuffers = _freeBuffers[sizeClass];
+
+				if ( ! freeBuffers.empty() )
+				{
+					buffer.swap( freeBuffers.back() );
+					freeBuffers.pop_back();
+					buffer.clear();
+					return;
+				}
+
+				// allocate the full class size, so the buffer can be pooled later on
+				capacity = SIZE_CLASSES[sizeClass];
+				break;
+			}
+
+			// the (empty) storage of buffer might still be too small, e.g. if it was taken by the pool before
+			if ( buffer.capacity() < capacity )
+			{
+				ByteArray newBuffer;
+				newBuffer.reserve(capacity);
+				buffer.swap(newBuffer);
+				_allocations.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+
+		void TLSBufferPool::grow(ByteArray &buffer, size_t capacity)
+		{
+			if ( buffer.capacity() >= capacity )
+			{
+				return;
+			}
+
+			ByteArray largerBuffer;
+			acquire(largerBuffer, capacity);
+			largerBuffer.insert(largerBuffer.end(), buffer.begin(), buffer.end() );
+
+			release(buffer);
+			buffer.swap(largerBuffer);
+		}
+
+		void TLSBufferPool::release(ByteArray &buffer)
+		{
+			// find the largest size class the buffer can serve
+			for ( size_t sizeClass = SIZE_CLASS_COUNT; sizeClass-- > 0; )
+			{
+				if ( buffer.capacity() < SIZE_CLASSES[sizeClass] )
+				{
+					continue;
+				}
+
+				std::vector<ByteArray> &freeBuffers = _freeBuffers[sizeClass];
+
+				if ( freeBuffers.size() < MAX_FREE_BUFFERS[sizeClass] )
+				{
+					// the free list was reserved in advance, so this does not allocate
+					freeBuffers.emplace_back();
+					freeBuffers.back().swap(buffer);
+				}
+
+				return;
+			}
+		}
+
+		void TLSBufferPool::clear()
+		{
+			for ( size_t sizeClass = 0; sizeClass < SIZE_CLASS_COUNT; sizeClass++ )
+			{
+				std::vector<ByteArray> &freeBuffers = _freeBuffers[sizeClass];
+
+				freeBuffers.clear();
+				freeBuffers.reserve(MAX_FREE_BUFFERS[sizeClass]);
+			}
+		}
+
+		size_t TLSBufferPool::allocations() const
+		{
+			return _allocations.load(std::memory_order_relaxed);
+		}
+
+	}
+}
@@ -0,0 +1,101 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TLSBUFFERPOOL_H
+#define TLSBUFFERPOOL_H
+
+#include <ByteArray.h>
+#include <atomic>
+#include <vector>
+
+extern "C"
+{
+	#include <stddef.h>
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+        /**
+         * @brief The TLSBufferPool class recycles the receive buffers of the TLSSockets of a TLSServerWorker.
+         *
+         * Buffers are kept in a few size classes matching typical TLS record lengths, the largest class holds a full record. A buffer is
+         * handed out with \c acquire and handed back with \c release, both swap the storage of the given ByteArray, so no bytes are copied
+         * and no memory is allocated as long as the pool holds a buffer of the requested class. This keeps the number of heap operations
+         * per received record at zero in the steady state and avoids fragmenting the heap.
+         *
+         * The pool is not thread safe, it is only used by the task of the worker owning it.
+         */
+		class TLSBufferPool
+		{
+			public:
+
+								TLSBufferPool();
+
+								TLSBufferPool(const TLSBufferPool&) = delete;
+
+                /**
+                 * @brief Replaces the storage of \c buffer by an empty buffer of at least \c capacity bytes.
+                 *
+                 * @param buffer        the ByteArray receiving the buffer, its previous content is discarded
+                 * @param capacity      the minimum capacity
+                 */
+				void			acquire(ByteArray &buffer, size_t capacity);
+
+                /**
+                 * @brief Enlarges \c buffer to a capacity of at least \c capacity bytes, keeping its content.
+                 *
+                 * The previous storage of \c buffer is returned to the pool.
+                 *
+                 * @param buffer        the ByteArray to enlarge
+                 * @param capacity      the minimum capacity
+                 */
+				void			grow(ByteArray &buffer, size_t capacity);
+
+                /**
+                 * @brief Hands the storage of \c buffer back to the pool.
+                 *
+                 * Buffers smaller than the smallest size class or exceeding the limit of their size class are left untouched
+                 * and released by the ByteArray as usual.
+                 *
+                 * @param buffer        the ByteArray to recycle, it is empty afterwards if it was taken by the pool
+                 */
+				void			release(ByteArray &buffer);
+
+                /**
+                 * @brief Frees all pooled buffers
+                 */
+				void			clear(void);
+
+                /**
+                 * @brief Returns the number of buffers the pool had to allocate because no pooled buffer was available. Can be called from any task.
+                 */
+				size_t			allocations(void) const;
+
+			private:
+
+				static const size_t		SIZE_CLASS_COUNT = 3;
+
+				std::vector<ByteArray>	_freeBuffers[SIZE_CLASS_COUNT];
+				/** \brief  Atomic, so TLSServer::statistics can read it while the worker is receiving */
+				std::atomic<size_t>		_allocations = { 0 };
+		};
+	}
+}
+
+#endif
@@ -0,0 +1,95 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "TLSCommandQueue.h"
+#include "TLSSocket.h"
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+
+		TLSCommandQueue::TLSCommandQueue() : _head(&_stub), _tail(&_stub)
+		{
+
+		}
+
+		TLSCommandQueue::~TLSCommandQueue()
+		{
+			TLSCommand *command;
+
+			while ( ( command = pop() ) != nullptr )
+			{
+				delete command;
+			}
+		}
+
+		void TLSCommandQueue::push(TLSCommand *command)
+		{
+			command->next.store(nullptr, std::memory_order_relaxed);
+
+			// publish the command as new head, then link it to its predecessor
+			TLSCommand *previous = _head.exchange(command, std::memory_order_acq_rel);
+			previous->next.store(command, std::memory_order_release);
+		}
+
+		TLSCommand* TLSCommandQueue::pop()
+		{
+			TLSCommand *tail = _tail;
+			TLSCommand *next = tail->next.load(std::memory_order_acquire);
+
+			if ( tail == &_stub )
+			{
+				if ( next == nullptr )
+				{
+					return nullptr;
+				}
+
+				// skip the stub
+				_tail = next;
+				tail = next;
+				next = next->next.load(std::memory_order_acquire);
+			}
+
+			if ( next != nullptr )
+			{
+				_tail = next;
+				return tail;
+			}
+
+			if ( tail != _head.load(std::memory_order_acquire) )
+			{
+				// a producer exchanged the head but did not link its command yet
+				return nullptr;
+			}
+
+			// tail is the last command, put the stub behind it, so it can be removed
+			push(&_stub);
+
+			next = tail->next.load(std::memory_order_acquire);
+
+			if ( next != nullptr )
+			{
+				_tail = next;
+				return tail;
+			}
+
+			return nullptr;
+		}
+
+	}
+}
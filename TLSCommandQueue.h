@@ -0,0 +1,114 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TLSCOMMANDQUEUE_H
+#define TLSCOMMANDQUEUE_H
+
+#include <ByteArray.h>
+#include "auxiliary.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+
+extern "C"
+{
+	#include <stdint.h>
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+		DeclarePointers(TLSSocket);
+		class TLSSocket;
+
+        /**
+         * @brief The TLSCommand struct describes a piece of work another task hands to the event loop of a TLSServerWorker
+         */
+		struct TLSCommand
+		{
+			enum Type : uint8_t
+			{
+				Stop,				/**< leave the event loop */
+				AdoptSocket,		/**< take over a newly accepted socket */
+				CloseSocket,		/**< close the socket */
+				WriteSocket,		/**< write the payload to the socket */
+				HandshakeSucceeded,	/**< the TLSHandshakePool established the connection of the socket */
+				HandshakeFailed,	/**< the handshake performed by the TLSHandshakePool failed or was cancelled */
+				Drain,				/**< close the sockets gracefully and leave the event loop, see TLSServer::drain */
+				Broadcast			/**< write the shared payload to the established sockets accepted by the filter, see TLSServer::multicast */
+			};
+
+			Type						type = { Stop };
+			TLSSocket_sharedPtr			tlsSocket = {};
+			ByteArray					payload = {};
+
+			/** \brief  Payload written without a copy, see TLSSharedPayload. Is used instead of \c payload if set */
+			std::shared_ptr<const ByteArray>	sharedPayload = {};
+
+			/** \brief  Selects the sockets of a \c Broadcast, all established sockets if empty */
+			std::function<bool(TLSSocket&)>		filter = {};
+
+			std::atomic<TLSCommand*>	next = { nullptr };
+		};
+
+        /**
+         * @brief The TLSCommandQueue class provides a lock-free multi producer, single consumer queue of TLSCommands.
+         *
+         * Any task may \c push commands, only the event loop owning the queue may \c pop them. Commands are popped in the order they were
+         * pushed. Pushing never blocks and never waits for the consumer: it is a single atomic exchange on the head of an intrusive list.
+         * The queue takes the ownership of pushed commands, a popped command has to be deleted by the consumer.
+         *
+         * The consumer may see an empty queue while a producer is in the middle of a push. As every producer wakes up the event loop after
+         * pushing, the command is picked up with the next wakeup.
+         */
+		class TLSCommandQueue
+		{
+			public:
+
+								TLSCommandQueue();
+								~TLSCommandQueue();
+
+								TLSCommandQueue(const TLSCommandQueue&) = delete;
+
+                /**
+                 * @brief Appends a command to the queue. Can be called from any task.
+                 *
+                 * @param command   the command allocated with \c new, the queue takes its ownership
+                 */
+				void			push(TLSCommand *command);
+
+                /**
+                 * @brief Removes the oldest command from the queue. Must only be called by the consumer.
+                 *
+                 * @return  the command, which has to be deleted by the caller
+                 * @return  \c nullptr if the queue is empty
+                 */
+				TLSCommand*		pop(void);
+
+			private:
+
+				std::atomic<TLSCommand*>	_head;
+				TLSCommand					*_tail;
+
+				/** \brief  Placeholder keeping the list non-empty, so producers and the consumer never touch the same pointer */
+				TLSCommand					_stub;
+		};
+	}
+}
+
+#endif
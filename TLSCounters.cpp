@@ -0,0 +1,60 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "TLSCounters.h"
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+
+		TLSCounters::TLSCounters()
+		{
+			for ( std::atomic<uint32_t> &counter : _counters )
+			{
+				counter.store(0, std::memory_order_relaxed);
+			}
+		}
+
+		TLSCounters::Statistics TLSCounters::statistics() const
+		{
+			Statistics statistics = {};
+
+			accumulate(statistics);
+
+			return statistics;
+		}
+
+		void TLSCounters::accumulate(Statistics &statistics) const
+		{
+			statistics.bytesReceived	+= _counters[BytesReceived].load(std::memory_order_relaxed);
+			statistics.recordsReceived	+= _counters[RecordsReceived].load(std::memory_order_relaxed);
+			statistics.bytesSent		+= _counters[BytesSent].load(std::memory_order_relaxed);
+			statistics.recordsSent		+= _counters[RecordsSent].load(std::memory_order_relaxed);
+			statistics.readCalls		+= _counters[ReadCalls].load(std::memory_order_relaxed);
+			statistics.writeCalls		+= _counters[WriteCalls].load(std::memory_order_relaxed);
+			statistics.handshakes		+= _counters[Handshakes].load(std::memory_order_relaxed);
+			statistics.handshakeTimeMS	+= _counters[HandshakeTimeMS].load(std::memory_order_relaxed);
+			statistics.callbacks		+= _counters[Callbacks].load(std::memory_order_relaxed);
+			statistics.callbackTimeUS	+= _counters[CallbackTimeUS].load(std::memory_order_relaxed);
+			statistics.queuedBytes		+= _counters[QueuedBytes].load(std::memory_order_relaxed);
+			statistics.pendingCommands	+= _counters[PendingCommands].load(std::memory_order_relaxed);
+		}
+
+	}
+}
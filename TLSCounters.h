@@ -0,0 +1,117 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TLSCOUNTERS_H
+#define TLSCOUNTERS_H
+
+#include <atomic>
+
+extern "C"
+{
+	#include <stdint.h>
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+        /**
+         * @brief The TLSCounters class holds the traffic counters of a TLSSocket or of all TLSSockets of a TLSServerWorker.
+         *
+         * Counting is a single relaxed atomic operation, so the counters are updated on the data path without any lock. They are read by
+         * \c statistics from any task, the values of different counters are not taken at exactly the same instant. All counters are 32 bit
+         * wide, as 64 bit atomics are not lock-free on the ESP32, and wrap around. Monitoring should therefore compute the difference
+         * of two snapshots modulo 2^32.
+         */
+		class TLSCounters
+		{
+			public:
+
+				enum Counter : uint8_t
+				{
+					BytesReceived,		/**< decrypted bytes received */
+					RecordsReceived,	/**< TLS records received */
+					BytesSent,			/**< bytes accepted by the TLS library for sending */
+					RecordsSent,		/**< TLS records sent */
+					ReadCalls,			/**< calls of SSL_read */
+					WriteCalls,			/**< calls of SSL_write */
+					Handshakes,			/**< completed TLS handshakes */
+					HandshakeTimeMS,	/**< time from accepting the connection until the handshake completed */
+					Callbacks,			/**< calls of the receive callbacks of the TLSSocketEventHandler */
+					CallbackTimeUS,		/**< time spent in the receive callbacks */
+					QueuedBytes,		/**< bytes currently waiting in outbound queues, a gauge */
+					PendingCommands,	/**< commands currently posted to the event loop, a gauge */
+					CounterCount
+				};
+
+				struct Statistics
+				{
+					uint32_t	bytesReceived;		/**< decrypted bytes received */
+					uint32_t	recordsReceived;	/**< TLS records received */
+					uint32_t	bytesSent;			/**< bytes accepted by the TLS library for sending */
+					uint32_t	recordsSent;		/**< TLS records sent */
+					uint32_t	readCalls;			/**< calls of SSL_read */
+					uint32_t	writeCalls;			/**< calls of SSL_write */
+					uint32_t	handshakes;			/**< completed TLS handshakes */
+					uint32_t	handshakeTimeMS;	/**< total time from accepting a connection until its handshake completed */
+					uint32_t	callbacks;			/**< calls of the receive callbacks of the TLSSocketEventHandler */
+					uint32_t	callbackTimeUS;		/**< total time spent in the receive callbacks */
+					uint32_t	queuedBytes;		/**< bytes currently waiting in outbound queues */
+					uint32_t	pendingCommands;	/**< commands currently posted to the event loop */
+				};
+
+								TLSCounters();
+
+								TLSCounters(const TLSCounters&) = delete;
+
+                /**
+                 * @brief Adds \c value to a counter. Can be called from any task.
+                 */
+				inline void		add(Counter counter, uint32_t value = 1)
+				{
+					_counters[counter].fetch_add(value, std::memory_order_relaxed);
+				}
+
+                /**
+                 * @brief Subtracts \c value from a gauge. Can be called from any task.
+                 */
+				inline void		subtract(Counter counter, uint32_t value = 1)
+				{
+					_counters[counter].fetch_sub(value, std::memory_order_relaxed);
+				}
+
+                /**
+                 * @brief Returns a snapshot of all counters. Can be called from any task.
+                 */
+				Statistics		statistics(void) const;
+
+                /**
+                 * @brief Adds the counters to a snapshot, used to aggregate the counters of several TLSServerWorkers
+                 *
+                 * @param statistics    the snapshot to add the counters to
+                 */
+				void			accumulate(Statistics &statistics) const;
+
+			protected:
+
+				std::atomic<uint32_t>	_counters[CounterCount];
+		};
+	}
+}
+
+#endif
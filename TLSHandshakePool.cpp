@@ -0,0 +1,409 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "TLSHandshakePool.h"
+#include "TLSServerWorker.h"
+#include "TLSSocket.h"
+#include "MutexLocker.h"
+
+#include <algorithm>
+#include <new>
+
+extern "C"
+{
+	#include <esp_log.h>
+	#include <sys/poll.h>
+	#include "lwip/sockets.h"
+}
+
+namespace
+{
+	const char*		LOG_TAG					= "IDFix::TLSHandshakePool";
+
+	// the handshake runs the asymmetric cryptography of the TLS library, which needs a larger stack than the workers
+	const uint16_t	HANDSHAKE_TASK_STACK	= 8192;
+
+	// below the priority of the workers, so handshakes never delay the events of established connections
+	const uint8_t	HANDSHAKE_TASK_PRIORITY	= CONFIG_IDFIX_PROTOCOLS_TLS_TASK_PRIORITY > 1 ? CONFIG_IDFIX_PROTOCOLS_TLS_TASK_PRIORITY - 1 : 1;
+
+	// the interval in which a waiting handshake checks whether its socket was closed meanwhile
+	const int		CANCEL_CHECK_INTERVAL	= 100; // ms
+
+	// the time stop waits for a task to take its stop request and to finish its cancelled handshake
+	const uint32_t	STOP_TIMEOUT			= 2000; // ms
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+
+		TLSHandshakePool::TLSHandshakePool()
+		{
+
+		}
+
+		TLSHandshakePool::~TLSHandshakePool()
+		{
+			stop();
+
+			if ( joinTasks(0) )
+			{
+				// the stopped tasks wait for their resume token, so they hold no locks and can be deleted
+				for ( std::unique_ptr<HandshakeTask> &task : _tasks )
+				{
+					task->stopTask();
+				}
+
+				_tasks.clear();
+			}
+			else
+			{
+				// a task still uses the queue and the semaphores, which are kept together with the tasks
+				ESP_LOGE(LOG_TAG, "Handshake tasks are still running at file %s:%d.", __FILE__, __LINE__);
+
+				for ( std::unique_ptr<HandshakeTask> &task : _tasks )
+				{
+					task.release();
+				}
+
+				return;
+			}
+
+			if ( _queue != nullptr )
+			{
+				vQueueDelete(_queue);
+			}
+
+			if ( _resumeSemaphore != nullptr )
+			{
+				vSemaphoreDelete(_resumeSemaphore);
+				vSemaphoreDelete(_stoppedSemaphore);
+			}
+		}
+
+		bool TLSHandshakePool::start(uint8_t taskCount, uint8_t queueLength)
+		{
+			MutexLocker locker(_mutex);
+
+			if ( _isRunning )
+			{
+				_acceptsSubmissions = true;
+				return true;
+			}
+
+			if ( ! joinTasks(0) )
+			{
+				// a task still performs a cancelled handshake, so the queue cannot be replaced yet
+				ESP_LOGE(LOG_TAG, "Handshake tasks are still stopping at file %s:%d.", __FILE__, __LINE__);
+				return false;
+			}
+
+			if ( _queue != nullptr && _queueLength != queueLength )
+			{
+				vQueueDelete(_queue);
+				_queue = nullptr;
+			}
+
+			if ( _queue == nullptr )
+			{
+				_queue = xQueueCreate(queueLength, sizeof(TLSSocket_sharedPtr*) );
+
+				if ( _queue == nullptr )
+				{
+					ESP_LOGE(LOG_TAG, "Could not create handshake queue at file %s:%d.", __FILE__, __LINE__);
+					return false;
+				}
+
+				_queueLength = queueLength;
+			}
+
+			if ( _resumeSemaphore == nullptr )
+			{
+				_resumeSemaphore = xSemaphoreCreateCounting(UINT8_MAX, 0);
+				_stoppedSemaphore = xSemaphoreCreateCounting(UINT8_MAX, 0);
+
+				if ( _resumeSemaphore == nullptr || _stoppedSemaphore == nullptr )
+				{
+					ESP_LOGE(LOG_TAG, "Could not create handshake semaphores at file %s:%d.", __FILE__, __LINE__);
+
+					if ( _resumeSemaphore != nullptr )
+					{
+						vSemaphoreDelete(_resumeSemaphore);
+						_resumeSemaphore = nullptr;
+					}
+
+					if ( _stoppedSemaphore != nullptr )
+					{
+						vSemaphoreDelete(_stoppedSemaphore);
+						_stoppedSemaphore = nullptr;
+					}
+
+					return false;
+				}
+			}
+
+			// the tasks of a previous start wait for their resume token, only missing tasks are created
+			while ( _tasks.size() < taskCount )
+			{
+				_tasks.emplace_back( new HandshakeTask(this, "tls-handshake-" + std::to_string( _tasks.size() ) ) );
+				_tasks.back()->startTask();
+			}
+
+			_activeHandshakes.reserve(taskCount);
+			_runningTasks = taskCount;
+
+			for ( uint8_t index = 0; index < taskCount; index++ )
+			{
+				xSemaphoreGive(_resumeSemaphore);
+			}
+
+			_isRunning = true;
+			_acceptsSubmissions = true;
+
+			return true;
+		}
+
+		void TLSHandshakePool::stop()
+		{
+			_mutex.lock();
+
+				if ( ! _isRunning )
+				{
+					_mutex.unlock();
+					return;
+				}
+
+				// no more sockets are submitted
+				_isRunning = false;
+				_acceptsSubmissions = false;
+
+				std::vector<TLSSocket_sharedPtr>	activeHandshakes = _activeHandshakes;
+				uint8_t								runningTasks = _runningTasks;
+
+			_mutex.unlock();
+
+			// the handshakes in progress are cancelled by their tasks at the next cancellation check
+			for ( TLSSocket_sharedPtr &tlsSocket : activeHandshakes )
+			{
+				cancelHandshake(*tlsSocket);
+			}
+
+			// the queued handshakes are cancelled without being started
+			TLSSocket_sharedPtr *handshake = nullptr;
+
+			while ( xQueueReceive(_queue, &handshake, 0) == pdTRUE )
+			{
+				if ( handshake != nullptr )
+				{
+					cancelHandshake(**handshake);
+					(*handshake)->offloadedHandshakeFinished(false);
+					delete handshake;
+				}
+			}
+
+			TLSSocket_sharedPtr *stopRequest = nullptr;
+
+			for ( uint8_t index = 0; index < runningTasks; index++ )
+			{
+				if ( xQueueSend(_queue, &stopRequest, pdMS_TO_TICKS(STOP_TIMEOUT) ) != pdTRUE )
+				{
+					ESP_LOGE(LOG_TAG, "Could not send stop request to handshake task at file %s:%d.", __FILE__, __LINE__);
+				}
+			}
+
+			if ( ! joinTasks(STOP_TIMEOUT) )
+			{
+				ESP_LOGW(LOG_TAG, "Handshake tasks did not stop in time at file %s:%d.", __FILE__, __LINE__);
+			}
+		}
+
+		void TLSHandshakePool::stopSubmissions()
+		{
+			MutexLocker locker(_mutex);
+
+			// the workers perform new handshakes themselves, the submitted ones are left to the tasks
+			_acceptsSubmissions = false;
+		}
+
+		bool TLSHandshakePool::joinTasks(uint32_t timeoutMS)
+		{
+			while ( _runningTasks > 0 )
+			{
+				if ( xSemaphoreTake(_stoppedSemaphore, pdMS_TO_TICKS(timeoutMS) ) != pdTRUE )
+				{
+					return false;
+				}
+
+				_runningTasks--;
+			}
+
+			return true;
+		}
+
+		void TLSHandshakePool::cancelHandshake(TLSSocket &tlsSocket)
+		{
+			tlsSocket._mutex.lock();
+				tlsSocket._closePending = true;
+			tlsSocket._mutex.unlock();
+		}
+
+		bool TLSHandshakePool::isRunning()
+		{
+			MutexLocker locker(_mutex);
+
+			return _isRunning;
+		}
+
+		bool TLSHandshakePool::submit(TLSSocket_sharedPtr tlsSocket)
+		{
+			MutexLocker locker(_mutex);
+
+			if ( ! _isRunning || ! _acceptsSubmissions )
+			{
+				return false;
+			}
+
+			// the queue holds the shared pointer, so the socket stays alive until the handshake task is done with it
+			TLSSocket_sharedPtr *handshake = new (std::nothrow) TLSSocket_sharedPtr(tlsSocket);
+
+			if ( handshake == nullptr )
+			{
+				return false;
+			}
+
+			if ( xQueueSend(_queue, &handshake, 0) != pdTRUE )
+			{
+				// all handshake tasks are busy and the queue is full
+				delete handshake;
+				return false;
+			}
+
+			return true;
+		}
+
+		void TLSHandshakePool::processHandshakes()
+		{
+			while ( true )
+			{
+				TLSSocket_sharedPtr *handshake = nullptr;
+
+				if ( xQueueReceive(_queue, &handshake, portMAX_DELAY) != pdTRUE )
+				{
+					continue;
+				}
+
+				if ( handshake == nullptr )
+				{
+					// stop request
+					return;
+				}
+
+				_mutex.lock();
+
+					_activeHandshakes.push_back(*handshake);
+
+					// stop did not see the handshake in progress, so it is cancelled here
+					bool isCancelled = ! _isRunning;
+
+				_mutex.unlock();
+
+				if ( isCancelled )
+				{
+					cancelHandshake( **handshake );
+				}
+
+				performHandshake( **handshake );
+
+				_mutex.lock();
+					_activeHandshakes.erase( std::find(_activeHandshakes.begin(), _activeHandshakes.end(), *handshake) );
+				_mutex.unlock();
+
+				delete handshake;
+			}
+		}
+
+		void TLSHandshakePool::performHandshake(TLSSocket &tlsSocket)
+		{
+			// the worker neither watches nor touches the socket while the handshake is offloaded
+			// and closing the socket is deferred, so the descriptor and the TLS connection stay valid
+			int		descriptor = tlsSocket._socketDescriptor;
+			SSL		*tlsPeer = tlsSocket._tlsPeer;
+			bool	succeeded = false;
+
+			while ( true )
+			{
+				tlsSocket._mutex.lock();
+					bool isCancelled = tlsSocket._closePending;
+				tlsSocket._mutex.unlock();
+
+				if ( isCancelled )
+				{
+					// the handshake deadline expired or the server is shutting down
+					break;
+				}
+
+				int result = SSL_accept(tlsPeer);
+
+				if ( result > 0 )
+				{
+					succeeded = true;
+					break;
+				}
+
+				int error = SSL_get_error(tlsPeer, result);
+
+				if ( error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE )
+				{
+					ESP_LOGE(LOG_TAG, "SSL_accept() failed at file %s:%d.", __FILE__, __LINE__);
+					break;
+				}
+
+				// wait until the client sent more data or its TCP window opened, but wake up regularly to check for cancellation
+				// a single pollfd has no limit on the descriptor number, unlike the fd_set of select
+				struct pollfd pollDescriptor = {};
+				pollDescriptor.fd		= descriptor;
+				pollDescriptor.events	= error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+
+				poll(&pollDescriptor, 1, CANCEL_CHECK_INTERVAL);
+			}
+
+			tlsSocket.offloadedHandshakeFinished(succeeded);
+		}
+
+		TLSHandshakePool::HandshakeTask::HandshakeTask(TLSHandshakePool *pool, const std::string &name)
+			: Task(name, HANDSHAKE_TASK_STACK, HANDSHAKE_TASK_PRIORITY), _pool(pool)
+		{
+
+		}
+
+		void TLSHandshakePool::HandshakeTask::run()
+		{
+			// the task never leaves, a stopped task waits until the pool is started again
+			while ( true )
+			{
+				xSemaphoreTake(_pool->_resumeSemaphore, portMAX_DELAY);
+
+				_pool->processHandshakes();
+
+				ESP_LOGI(LOG_TAG, "Handshake task stopped. Reason: shutdown");
+				xSemaphoreGive(_pool->_stoppedSemaphore);
+			}
+		}
+	}
+}
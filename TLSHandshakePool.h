@@ -0,0 +1,181 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TLSHANDSHAKEPOOL_H
+#define TLSHANDSHAKEPOOL_H
+
+#include "IDFixTask.h"
+#include "auxiliary.h"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Mutex.h"
+
+extern "C"
+{
+	#include <stdint.h>
+	#include <freertos/FreeRTOS.h>
+	#include <freertos/queue.h>
+	#include <freertos/semphr.h>
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+		DeclarePointers(TLSSocket);
+		class TLSSocket;
+
+        /**
+         * @brief The TLSHandshakePool class performs the TLS handshakes of new connections on a few dedicated tasks.
+         *
+         * The asymmetric cryptography of a handshake takes tens to hundreds of milliseconds. Performed by a TLSServerWorker, it delays the events
+         * of all established connections of the worker. Instead a worker \c submit s a socket to the pool as soon as its client starts the handshake
+         * and stops watching the socket. A handshake task then owns the TLS connection until the handshake finished, and hands the socket back
+         * to its worker by posting a TLSCommand. The handshake tasks run one priority below the workers (see CONFIG_IDFIX_PROTOCOLS_TLS_TASK_PRIORITY),
+         * so they only use the time left over by the data path.
+         *
+         * Submitted sockets wait in a bounded queue. If the queue is full, \c submit fails and the worker performs the handshake itself.
+         */
+		class TLSHandshakePool
+		{
+			public:
+
+								TLSHandshakePool();
+								~TLSHandshakePool();
+
+								TLSHandshakePool(const TLSHandshakePool&) = delete;
+
+                /**
+                 * @brief Starts the handshake tasks
+                 *
+                 * The tasks are created by the first start. \c stop keeps them waiting for the next start, so a restarted pool never races
+                 * with a task still leaving.
+                 *
+                 * @param taskCount     the number of handshake tasks
+                 * @param queueLength   the maximum number of sockets waiting for a handshake task
+                 *
+                 * @return  true on success
+                 * @return  false on failure or if the tasks did not finish the handshakes of the last \c stop yet
+                 */
+				bool			start(uint8_t taskCount, uint8_t queueLength);
+
+                /**
+                 * @brief Stops the handshake tasks
+                 *
+                 * The handshakes in progress and the queued handshakes are cancelled, which closes their sockets. Waits a bounded time
+                 * until the tasks finished their handshakes, the tasks left after the timeout are waited for by the next \c start.
+                 */
+				void			stop(void);
+
+                /**
+                 * @brief Rejects further submissions, but keeps performing the queued handshakes and the handshakes in progress
+                 *
+                 * Never blocks. A draining server uses it, so its handshakes either finish or are closed by the drain. The tasks keep running
+                 * until \c stop.
+                 */
+				void			stopSubmissions(void);
+
+                /**
+                 * @brief Returns true if the handshake tasks are running
+                 */
+				bool			isRunning(void);
+
+                /**
+                 * @brief Hands the handshake of a TLSSocket over to the pool. Never blocks.
+                 *
+                 * @param tlsSocket     the TLSSocket, which must not be watched or touched by its worker until the handshake finished
+                 *
+                 * @return  true if the handshake will be performed by the pool
+                 * @return  false if the pool is not running, rejects submissions or its queue is full
+                 */
+				bool			submit(TLSSocket_sharedPtr tlsSocket);
+
+			protected:
+
+                /**
+                 * @brief The HandshakeTask class is a single task of the pool
+                 */
+				class HandshakeTask : private Task
+				{
+					friend class TLSHandshakePool;
+
+					public:
+
+										HandshakeTask(TLSHandshakePool *pool, const std::string &name);
+
+					protected:
+
+						virtual void	run() override;
+
+						TLSHandshakePool	*_pool;
+				};
+
+                /**
+                 * @brief Performs the submitted handshakes until the task receives its stop request
+                 */
+				void			processHandshakes(void);
+
+                /**
+                 * @brief Waits until the tasks of the last \c start finished their handshakes
+                 *
+                 * @param timeoutMS     the maximum time to wait per task
+                 *
+                 * @return  true if no task is processing handshakes any more
+                 */
+				bool			joinTasks(uint32_t timeoutMS);
+
+                /**
+                 * @brief Cancels a submitted handshake, its task closes the socket at the next cancellation check
+                 */
+				static void		cancelHandshake(TLSSocket &tlsSocket);
+
+                /**
+                 * @brief Performs the handshake of a TLSSocket and hands the socket back to its worker
+                 *
+                 * @param tlsSocket     the submitted TLSSocket
+                 */
+				void			performHandshake(TLSSocket &tlsSocket);
+
+				/** \brief  Holds a heap allocated TLSSocket_sharedPtr per submitted socket, \c nullptr requests a task to stop */
+				QueueHandle_t	_queue = { nullptr };
+				uint8_t			_queueLength = { 0 };
+
+				std::vector<std::unique_ptr<HandshakeTask>>	_tasks = {};
+				bool			_isRunning = { false };
+
+				/** \brief  Cleared by \c stopSubmissions, so \c submit fails while the tasks still perform the submitted handshakes */
+				bool			_acceptsSubmissions = { false };
+
+				/** \brief  The sockets whose handshakes are in progress, so \c stop can cancel them */
+				std::vector<TLSSocket_sharedPtr>	_activeHandshakes = {};
+
+				/** \brief  A token lets a waiting task process handshakes, a task gives a stopped token after its stop request */
+				SemaphoreHandle_t	_resumeSemaphore = { nullptr };
+				SemaphoreHandle_t	_stoppedSemaphore = { nullptr };
+
+				/** \brief  The number of tasks processing handshakes, which did not give their stopped token yet */
+				std::atomic<uint8_t>	_runningTasks = { 0 };
+
+				Mutex			_mutex = { Mutex::Recursive };
+		};
+	}
+}
+
+#endif
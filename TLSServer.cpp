@@ -20,17 +20,33 @@
 #include "TLSServerEventHandler.h"
 #include "TLSSocket.h"
 #include "MutexLocker.h"
+#include "ProtocolTrace.h"
 
 extern "C"
 {
+	#include <errno.h>
 	#include <esp_log.h>
+	#include <fcntl.h>
+	#include <freertos/FreeRTOS.h>
 	#include "lwip/sockets.h"
 	#include <mbedtls/ssl.h>
 }
 
 namespace
 {
-	const char* LOG_TAG = "IDFix::TLSServer";
+	const char*	LOG_TAG					= "IDFix::TLSServer";
+	const int	HEAP_RECHECK_INTERVAL	= 100; // ms
+
+	void rejectConnection(int socketDescriptor)
+	{
+		// reset the connection instead of a graceful close, so the rejected connection does not hold any resources
+		struct linger lingerOption;
+		lingerOption.l_onoff	= 1;
+		lingerOption.l_linger	= 0;
+		setsockopt(socketDescriptor, SOL_SOCKET, SO_LINGER, &lingerOption, sizeof(lingerOption) );
+
+		close(socketDescriptor);
+	}
 }
 
 namespace IDFix
@@ -39,7 +55,7 @@ namespace IDFix
 	{
 
 		TLSServer::TLSServer(TLSServerEventHandler *eventHandler)
-            : Task("tls-server", 4072), _eventHandler(eventHandler)
+            : Task("tls-server", 4072, CONFIG_IDFIX_PROTOCOLS_TLS_TASK_PRIORITY), _eventHandler(eventHandler), _localWorker(this, "tls-server-local")
 		{
 
 		}
@@ -94,7 +110,7 @@ namespace IDFix
 				return false;
 			}
 
-			result = ::listen(_serverSocket, 32);
+			result = ::listen(_serverSocket, _listenBacklog);
 			if ( result )
 			{
 				ESP_LOGE(LOG_TAG, "Could not set socket to listen at file %s:%d.", __FILE__, __LINE__);
@@ -103,6 +119,57 @@ namespace IDFix
 				return false;
 			}
 
+			if ( ! _localWorker.begin() || ! _localWorker.watchListener(_serverSocket) )
+			{
+				ESP_LOGE(LOG_TAG, "Could not watch server socket at file %s:%d.", __FILE__, __LINE__);
+				_localWorker.closeAllSockets();
+				close( _serverSocket );
+				_serverSocket = -1;
+				return false;
+			}
+
+			// accept all pending connections of a reconnect storm with a single wakeup, see acceptConnections
+			fcntl(_serverSocket, F_SETFL, fcntl(_serverSocket, F_GETFL, 0) | O_NONBLOCK);
+
+			if ( _workers.size() != _workerCount )
+			{
+				_workers.clear();
+
+				for ( uint8_t index = 0; index < _workerCount; index++ )
+				{
+					_workers.emplace_back( new TLSServerWorker(this, "tls-worker-" + std::to_string(index) ) );
+				}
+			}
+
+			for ( size_t index = 0; index < _workers.size(); index++ )
+			{
+				int core = _pinWorkersToCores ? static_cast<int>( index % portNUM_PROCESSORS ) : -1;
+
+				if ( ! _workers[index]->start(core) )
+				{
+					ESP_LOGE(LOG_TAG, "Could not start worker %zu at file %s:%d.", index, __FILE__, __LINE__);
+
+					for ( size_t startedIndex = 0; startedIndex < index; startedIndex++ )
+					{
+						_workers[startedIndex]->requestStop();
+					}
+
+					_localWorker.closeAllSockets();
+					close( _serverSocket );
+					_serverSocket = -1;
+					return false;
+				}
+			}
+
+			if ( _handshakeTaskCount > 0 && ! _handshakePool.start(_handshakeTaskCount, _handshakeQueueLength) )
+			{
+				// the workers perform the handshakes themselves
+				ESP_LOGW(LOG_TAG, "Could not start handshake tasks at file %s:%d.", __FILE__, __LINE__);
+			}
+
+			_nextWorker = 0;
+			_acceptingPaused = false;
+			_isDraining = false;
 			_serverIsRunning = true;
 			_serverIsShutdown = false;
 
@@ -115,17 +182,237 @@ namespace IDFix
 
 		void TLSServer::shutdown()
 		{
+			bool stopHandshakes = false;
+
 			_mutex.lock();
-				// we indicate a shutdown to the task (closing the server socket will cause select() to unblock)
-				// cleanup will be done after the task finishes
+				// we post a stop command to the server task and the workers (which wakes up their loops)
+				// cleanup will be done after the tasks finish, the server socket is closed by the server task
 
 				if ( _serverIsRunning && ! _serverIsShutdown )
 				{
 					_serverIsRunning = false;
-					close(_serverSocket);
+
+					for ( std::unique_ptr<TLSServerWorker> &worker : _workers )
+					{
+						worker->requestStop();
+					}
+
+					_localWorker.requestStop();
+					stopHandshakes = true;
 				}
 
 			_mutex.unlock();
+
+			// stopping the pool waits for the handshake tasks, which must not block the tasks waiting for the server mutex meanwhile
+			if ( stopHandshakes )
+			{
+				_handshakePool.stop();
+			}
+		}
+
+		bool TLSServer::drain(uint32_t timeoutMS, uint16_t batchSize, uint32_t batchIntervalMS)
+		{
+			MutexLocker	locker(_mutex);
+
+			if ( ! _serverIsRunning || _serverIsShutdown || _isDraining )
+			{
+				return false;
+			}
+
+			// the workers take over the drain parameters when they process the drain command
+			_isDraining = true;
+			_drainTimeout = timeoutMS;
+			_drainBatchSize = batchSize > 0 ? batchSize : 1;
+			_drainBatchInterval = batchIntervalMS;
+
+			for ( std::unique_ptr<TLSServerWorker> &worker : _workers )
+			{
+				worker->requestDrain();
+			}
+
+			_localWorker.requestDrain();
+
+			locker.unlock();
+
+			// new handshakes are performed by the workers, the submitted ones finish or are closed by the drain batches
+			// the pool is stopped by the server task after the drain, so drain never waits for a handshake task
+			_handshakePool.stopSubmissions();
+
+			return true;
+		}
+
+		bool TLSServer::broadcast(TLSSharedPayload payload)
+		{
+			return multicast(payload, nullptr);
+		}
+
+		bool TLSServer::multicast(TLSSharedPayload payload, TLSSocketFilter filter)
+		{
+			MutexLocker	locker(_mutex);
+
+			if ( ! _serverIsRunning || _serverIsShutdown || payload == nullptr )
+			{
+				return false;
+			}
+
+			if ( payload->empty() )
+			{
+				return true;
+			}
+
+			// one command per worker instead of one per connection, the workers fan the payload out on their own event loops
+			// a worker which already finished its drain has no connections left and is skipped, but does not count as delivered
+			bool isPosted = _localWorker.isRunning() && _localWorker.post(TLSCommand::Broadcast, nullptr, payload, filter);
+
+			for ( std::unique_ptr<TLSServerWorker> &worker : _workers )
+			{
+				isPosted = worker->isRunning() && worker->post(TLSCommand::Broadcast, nullptr, payload, filter) && isPosted;
+			}
+
+			return isPosted;
+		}
+
+		bool TLSServer::setSessionCache(size_t capacity, uint32_t lifetimeSeconds)
+		{
+			MutexLocker	locker(_mutex);
+
+			return _sessionCache.setCache(_tlsContext, capacity, lifetimeSeconds);
+		}
+
+		bool TLSServer::setSessionTickets(bool enabled, uint32_t keyRotationSeconds)
+		{
+			MutexLocker	locker(_mutex);
+
+			return _sessionCache.setTickets(_tlsContext, enabled, keyRotationSeconds);
+		}
+
+		TLSSessionCache::Statistics TLSServer::sessionCacheStatistics()
+		{
+			return _sessionCache.statistics();
+		}
+
+		bool TLSServer::setTimeouts(uint32_t handshakeTimeoutMS, uint32_t idleTimeoutMS)
+		{
+			MutexLocker	locker(_mutex);
+
+			if ( ! _serverIsShutdown )
+			{
+				return false;
+			}
+
+			_handshakeTimeout = handshakeTimeoutMS;
+			_idleTimeout = idleTimeoutMS;
+
+			return true;
+		}
+
+		void TLSServer::setConnectionLimits(uint16_t maxConnections, uint16_t maxHandshakes, uint16_t maxConnectionsPerPeer)
+		{
+			_admissionControl.setLimits(maxConnections, maxHandshakes, maxConnectionsPerPeer);
+		}
+
+		void TLSServer::setHeapLowWatermark(size_t heapLowWatermark)
+		{
+			_admissionControl.setHeapLowWatermark(heapLowWatermark);
+		}
+
+		void TLSServer::setAcceptBatchLimit(uint8_t acceptBatchLimit)
+		{
+			MutexLocker	locker(_mutex);
+
+			_acceptBatchLimit = acceptBatchLimit > 0 ? acceptBatchLimit : 1;
+		}
+
+		bool TLSServer::setReadBudget(size_t maxBytes, uint16_t maxRecords)
+		{
+			MutexLocker	locker(_mutex);
+
+			if ( ! _serverIsShutdown )
+			{
+				return false;
+			}
+
+			_readBudgetBytes = maxBytes > 0 ? maxBytes : 1;
+			_readBudgetRecords = maxRecords > 0 ? maxRecords : 1;
+
+			return true;
+		}
+
+		void TLSServer::setRecordSizing(size_t smallRecordLength, size_t boostThreshold, uint32_t idleResetMS)
+		{
+			MutexLocker	locker(_mutex);
+
+			_smallRecordLength = smallRecordLength;
+			_recordBoostThreshold = boostThreshold;
+			_recordIdleReset = idleResetMS;
+		}
+
+		bool TLSServer::setListenBacklog(uint8_t backlog)
+		{
+			MutexLocker	locker(_mutex);
+
+			if ( ! _serverIsShutdown )
+			{
+				return false;
+			}
+
+			_listenBacklog = backlog;
+
+			return true;
+		}
+
+		TLSAdmissionControl::Statistics TLSServer::admissionStatistics()
+		{
+			return _admissionControl.statistics();
+		}
+
+		TLSServer::Statistics TLSServer::statistics()
+		{
+			MutexLocker	locker(_mutex);
+			Statistics	statistics = {};
+
+			_localWorker._counters.accumulate(statistics.traffic);
+			statistics.bufferAllocations = _localWorker._bufferPool.allocations();
+
+			for ( std::unique_ptr<TLSServerWorker> &worker : _workers )
+			{
+				worker->_counters.accumulate(statistics.traffic);
+				statistics.bufferAllocations += worker->_bufferPool.allocations();
+			}
+
+			statistics.admission = _admissionControl.statistics();
+
+			return statistics;
+		}
+
+		bool TLSServer::setWorkerCount(uint8_t workerCount, bool pinToCores)
+		{
+			MutexLocker	locker(_mutex);
+
+			if ( ! _serverIsShutdown )
+			{
+				return false;
+			}
+
+			_workerCount = workerCount;
+			_pinWorkersToCores = pinToCores;
+
+			return true;
+		}
+
+		bool TLSServer::setHandshakeTasks(uint8_t taskCount, uint8_t queueLength)
+		{
+			MutexLocker	locker(_mutex);
+
+			if ( ! _serverIsShutdown )
+			{
+				return false;
+			}
+
+			_handshakeTaskCount = taskCount;
+			_handshakeQueueLength = queueLength > 0 ? queueLength : 1;
+
+			return true;
 		}
 
 		bool TLSServer::setPrivateKey(const unsigned char *key, long keyLength)
@@ -154,240 +441,190 @@ namespace IDFix
 
 		void TLSServer::run()
 		{
-			SSL					*tlsPeer;
-			int					newClientSocket;
-			struct sockaddr_in	peerSocketAddress;
-			socklen_t			peerSocketAddressLength;
-
-			int					maxDescriptor, newMaxDescriptor;
-			int					currentDescriptor;
-			fd_set				readReadyDescriptors;
 			bool				continueRunning;
 
-			// Initialize the set of active sockets
-
 			_mutex.lock();
-				FD_ZERO(&_activeDescriptors);
-				FD_SET(_serverSocket, &_activeDescriptors);
 				continueRunning = _serverIsRunning;
 			_mutex.unlock();
 
-			maxDescriptor = _serverSocket;
-
 			while ( continueRunning )
 			{
-				// compiler generates asign operator, so readReadyDescriptors will be an independent copy
-				_mutex.lock();
-					readReadyDescriptors = _activeDescriptors;
-				_mutex.unlock();
+				// while accepting is paused, wake up regularly to check if the heap recovered
+				int timeout = _acceptingPaused ? HEAP_RECHECK_INTERVAL : -1;
 
-				// block until input arrives on one or more active sockets
-				if ( select(maxDescriptor + 1, &readReadyDescriptors, nullptr, nullptr, nullptr) < 0 )
+				if ( ! _localWorker.processEvents(timeout) )
 				{
-					ESP_LOGW(LOG_TAG, "select() failed at file %s:%d.", __FILE__, __LINE__);
-
-					_mutex.lock();
-
-						if ( _serverIsRunning )
-						{
-							// select did not fail because of closed server socket ( _serverIsRunning => shutdown not intended )
-							// as shutdown was not intended by user ( shutdown() was not called ) close the socket here
-							_serverIsRunning = false;
-							close(_serverSocket);
-						}
+					// as shutdown was not intended by user ( shutdown() was not called ) shut down here
+					// so the workers leave their loops as well. shutdown() does nothing if it was already called
+					shutdown();
 
-					_mutex.unlock();
-
-					// select may be fail by "Bad file descriptor" e.g. a socket was closed but not removed from activeDescriptors
-					// TODO: update activeDescriptors (by TLSClients in map) and try to recover from error (if no shutdown indicated)
 					return;
 				}
 
+				if ( _acceptingPaused )
+				{
+					resumeAccepting();
+				}
+
+				// after draining the local worker leaves its loop by itself
 				_mutex.lock();
-					continueRunning = _serverIsRunning;
+					continueRunning = _serverIsRunning && _localWorker.isRunning();
 				_mutex.unlock();
+			}
 
-				if ( ! continueRunning )
-				{
-					// if we want to shut down the server, we set _serverIsRunning = false and
-					// close the server socket, which causes select() to return (e.g. unblock)
-					ESP_LOGI(LOG_TAG, "Exiting server loop. Reason: shutdown");
-					return;
-				}
+			// the handshake tasks are joined on the server task before a new listen may restart them, after a shutdown the pool is already stopped
+			_handshakePool.stop();
 
-				// handle possible pending connection request on server socket
-				if ( FD_ISSET(_serverSocket, &readReadyDescriptors) )
-				{
-					peerSocketAddressLength = sizeof(peerSocketAddress);
-					newClientSocket = accept(_serverSocket, reinterpret_cast<struct sockaddr *>(&peerSocketAddress), &peerSocketAddressLength);
+			// the drain finished, so the server no longer accepts broadcasts or another drain
+			// workers still draining stop by themselves, at the latest with the drain deadline
+			_mutex.lock();
+				_serverIsRunning = false;
+				_isDraining = false;
+			_mutex.unlock();
 
-					if ( newClientSocket < 0 )
-					{
-						ESP_LOGE(LOG_TAG, "accept() failed at file %s:%d.", __FILE__, __LINE__);
-					}
-					else
-					{
-						struct sockaddr_in peerAddr;
-						socklen_t addrSize = sizeof(struct sockaddr_in);
-						getpeername(newClientSocket, reinterpret_cast<struct sockaddr *>(&peerAddr), &addrSize);
-
-						char clientip[20];
-						strcpy(clientip, inet_ntoa(peerAddr.sin_addr));
-						ESP_LOGI(LOG_TAG, "Incomming TCP connection from %s (newClientSocket: %d)", clientip, newClientSocket);
-
-						tlsPeer = SSL_new(_tlsContext);
-						if ( ! tlsPeer )
-						{
-							ESP_LOGE(LOG_TAG, "Could not create TLS peer at file %s:%d.", __FILE__, __LINE__);
-							close(newClientSocket);
-						}
-						else
-						{
-							SSL_set_fd(tlsPeer, newClientSocket);
-
-							// Do not call SSL_accept yet, as it waits for any incomming data
-							// instead create the socket and wait for any incomming data
-							// SSL_accept will be called delayed
-
-							TLSSocket_sharedPtr newTLSSocket = std::make_shared<TLSSocket>(newClientSocket, tlsPeer, this);
-							_mutex.lock();
-								_socketMap.insert( TLSSocketMap::value_type(newClientSocket, newTLSSocket) );
-								FD_SET(newClientSocket, &_activeDescriptors);
-							_mutex.unlock();
-
-							if ( newClientSocket > maxDescriptor )
-							{
-								maxDescriptor = newClientSocket;
-							}
-							ESP_LOGV(LOG_TAG, "maxDescriptor = %d ", maxDescriptor);
-
-							// As we don't call SSL_accept yet, we don't send the event yet
-							// the event will be send by the socket indirectly when SSL_accept was called
-						}
-					}
+			ESP_LOGI(LOG_TAG, "Exiting server loop. Reason: shutdown");
+		}
 
-					// we remove the server socket from the input pending fd_set so it will not be processed
-					// again in the following loop
-					FD_CLR (_serverSocket, &readReadyDescriptors);
-				}
+		void TLSServer::acceptConnections()
+		{
+			uint8_t acceptedConnections = 0;
+
+			// the server socket is non-blocking, so accept all pending connections (up to the batch limit) with a single wakeup
+			while ( acceptedConnections < _acceptBatchLimit && ! _acceptingPaused )
+			{
+				struct sockaddr_in	peerSocketAddress;
+				socklen_t			peerSocketAddressLength = sizeof(peerSocketAddress);
 
-				newMaxDescriptor = _serverSocket;
+				int newClientSocket = accept(_serverSocket, reinterpret_cast<struct sockaddr *>(&peerSocketAddress), &peerSocketAddressLength);
 
-				// loop through all possible descriptors up to maxDescriptor
-				for (currentDescriptor = 0; currentDescriptor <= maxDescriptor; currentDescriptor++)
+				if ( newClientSocket < 0 )
 				{
-					TLSSocket_sharedPtr currentSocket;
-
-					_mutex.lock();
-						if ( ! FD_ISSET(currentDescriptor, &_activeDescriptors) )
-						{
-							// if this descriptor is currently not actively used, skip it
-							_mutex.unlock();
-							continue;
-						}
-					_mutex.unlock();
-
-					// up to this point we have an active descriptor
-					// as we iterate ascending, it can be considered the current maximum descriptor
-					newMaxDescriptor = currentDescriptor;
-
-					// is there any input pending on this descriptor
-					if ( FD_ISSET(currentDescriptor, &readReadyDescriptors) )
+					if ( errno != EAGAIN && errno != EWOULDBLOCK )
 					{
-						_mutex.lock();
-							currentSocket = _socketMap.at(currentDescriptor);
-						_mutex.unlock();
-
-						if ( currentSocket != nullptr )
-						{
-							if ( currentSocket->socketReadyRead() <= 0 )
-							{
-								// socket was closed
-								currentSocket->close();
-								currentSocket.reset();
-
-								// as the socket was closed, newMaxDescriptor may stay at an uncorrect value
-								// however, it does not do any harm and will be corrected in the next loop
-							}
-						}
+						ESP_LOGE(LOG_TAG, "accept() failed at file %s:%d.", __FILE__, __LINE__);
 					}
-				}
 
-				maxDescriptor = newMaxDescriptor;
-				ESP_LOGV(LOG_TAG, "maxDescriptor = %d ", maxDescriptor);
+					break;
+				}
 
-				_mutex.lock();
-					continueRunning = _serverIsRunning;
-				_mutex.unlock();
+				acceptedConnections++;
+				acceptConnection(newClientSocket, peerSocketAddress.sin_addr.s_addr);
 			}
-			ESP_LOGI(LOG_TAG, "Exiting server loop. Reason: shutdown");
+
+			IDFIX_HOT_LOGD(LOG_TAG, "Accepted %d connections", acceptedConnections);
 		}
 
-		void TLSServer::stopTask()
+		void TLSServer::acceptConnection(int newClientSocket, uint32_t peerAddress)
 		{
-			ESP_LOGI(LOG_TAG, "TLSServer task has finished. Do cleanup and call base class stop()");
+			SSL *tlsPeer;
 
-			_mutex.lock();
+			// the address bytes are in network order, formatting them is cheaper than inet_ntoa and only compiled in with debug logging
+			IDFIX_HOT_LOGD(LOG_TAG, "Incomming TCP connection from %u.%u.%u.%u (newClientSocket: %d)",
+						   reinterpret_cast<const uint8_t *>(&peerAddress)[0], reinterpret_cast<const uint8_t *>(&peerAddress)[1],
+						   reinterpret_cast<const uint8_t *>(&peerAddress)[2], reinterpret_cast<const uint8_t *>(&peerAddress)[3], newClientSocket);
+
+			// decide before any TLS resources are allocated, so rejecting a connection is cheap
+			TLSAdmissionControl::Decision decision = _admissionControl.admit(peerAddress);
 
-				TLSSocket_sharedPtr tlsSocket;
+			if ( decision != TLSAdmissionControl::Admitted )
+			{
+				IDFIX_HOT_LOGD(LOG_TAG, "Rejected connection %d (reason: %d)", newClientSocket, decision);
+				IDFIX_TRACE(TLSConnectionRejected, newClientSocket, decision);
+				rejectConnection(newClientSocket);
 
-				// first make sure all current TLSSockets are closed
-				for (auto const& x : _socketMap)
+				if ( decision == TLSAdmissionControl::LowHeap )
 				{
-					tlsSocket = x.second;
+					// leave further connections in the backlog until the heap recovered
+					_acceptingPaused = true;
+					_localWorker.setListenerPaused(true);
+				}
+
+				return;
+			}
+
+			tlsPeer = SSL_new(_tlsContext);
+			if ( ! tlsPeer )
+			{
+				ESP_LOGE(LOG_TAG, "Could not create TLS peer at file %s:%d.", __FILE__, __LINE__);
+				_admissionControl.connectionClosed(peerAddress, true);
+				close(newClientSocket);
+				return;
+			}
 
-					ESP_LOGI(LOG_TAG, "Closing socket: %d", tlsSocket->_socketDescriptor);
+			_sessionCache.attach(tlsPeer);
 
-					FD_CLR(tlsSocket->_socketDescriptor, &_activeDescriptors);
+			// all client sockets are non-blocking, so a stalled client can never block the server loop
+			fcntl(newClientSocket, F_SETFL, fcntl(newClientSocket, F_GETFL, 0) | O_NONBLOCK);
 
-					// first release owner (this TLSServer) from socket, to prevent calling TLSServer::removeSocket
-					// by closing the socket, as removeSocket would alter current iterating _socketMap
-					tlsSocket->releaseOwner();
+			SSL_set_fd(tlsPeer, newClientSocket);
 
-					tlsSocket->close();
+			// without workers the server task owns all sockets, otherwise distribute them in a round robin manner
+			TLSServerWorker *worker = &_localWorker;
 
-					// as task will be immediately deleted afterwards, the destructor of the last shared pointer
-					// instance will not be called. so delete this (local) shared pointer here explicitly
-					tlsSocket.reset();
-				}
+			if ( ! _workers.empty() )
+			{
+				worker = _workers[_nextWorker].get();
+				_nextWorker = (_nextWorker + 1) % _workers.size();
+			}
+
+			IDFIX_TRACE(TLSConnectionAccepted, newClientSocket, peerAddress);
+
+			// Do not call SSL_accept yet, as there is no incomming data yet
+			// instead create the socket and wait for any incomming data
+			// SSL_accept will be called delayed and resumed whenever the socket becomes ready again
+
+			TLSSocket_sharedPtr newTLSSocket = std::make_shared<TLSSocket>(newClientSocket, tlsPeer, worker);
 
-				// now delete all TLSSockets
-				_socketMap.clear();
+			// the admission is released by the worker when the socket is closed
+			newTLSSocket->_peerAddress = peerAddress;
+			newTLSSocket->_admitted = true;
 
+			_mutex.lock();
+				newTLSSocket->setRecordSizing(_smallRecordLength, _recordBoostThreshold, _recordIdleReset);
 			_mutex.unlock();
 
-			Task::stopTask();
+			worker->addSocket(newTLSSocket);
+
+			// As we don't call SSL_accept yet, we don't send the event yet
+			// the event will be send by the socket indirectly when SSL_accept was called
 		}
 
-		void TLSServer::removeSocket(TLSSocket *tlsSocket)
+		void TLSServer::resumeAccepting()
 		{
-			_mutex.lock();
+			if ( _admissionControl.heapIsLow() || _isDraining )
+			{
+				return;
+			}
 
-				if ( ! _serverIsRunning )
-				{
-					// if server is not running (anymore) don't remove the sockets this way
-					// if server is shut down, sockets will be removed in separate clean up
-					_mutex.unlock();
-					return;
-				}
+			ESP_LOGI(LOG_TAG, "Heap recovered, resume accepting connections");
+
+			_acceptingPaused = false;
+			_localWorker.setListenerPaused(false);
+		}
 
-				FD_CLR(tlsSocket->_socketDescriptor, &_activeDescriptors);
-				_socketMap.erase(tlsSocket->_socketDescriptor);
+		void TLSServer::stopTask()
+		{
+			ESP_LOGI(LOG_TAG, "TLSServer task has finished. Do cleanup and call base class stop()");
+
+			// the workers close their own sockets after leaving their event loops
+			_localWorker.closeAllSockets();
+
+			_mutex.lock();
+				close(_serverSocket);
+				_serverSocket = -1;
 			_mutex.unlock();
 
-			tlsSocket->releaseOwner();
+			Task::stopTask();
 		}
 
-		void TLSServer::sendNewConnectionEvent(TLSSocket *newTLSSocket)
+		void TLSServer::sendNewConnectionEvent(TLSSocket_sharedPtr newTLSSocket)
 		{
 			_mutex.lock();
 
 				// don't emit new connections when we're about to shut down
 				if ( _eventHandler && _serverIsRunning )
 				{
-					// we have to send the (original) shared pointer stored by the server
-					TLSSocket_sharedPtr sharedPointer = _socketMap.at(newTLSSocket->_socketDescriptor);
-					_eventHandler->tlsNewConnection(sharedPointer);
+					_eventHandler->tlsNewConnection(newTLSSocket);
 				}
 
 			_mutex.unlock();
@@ -26,8 +26,13 @@ extern "C"
 
 #include "IDFixTask.h"
 #include "auxiliary.h"
-#include <map>
+#include <memory>
+#include <vector>
 #include "Mutex.h"
+#include "TLSServerWorker.h"
+#include "TLSSessionCache.h"
+#include "TLSAdmissionControl.h"
+#include "TLSHandshakePool.h"
 
 namespace IDFix
 {
@@ -37,17 +42,26 @@ namespace IDFix
 		class TLSServerEventHandler;
 		class TLSSocket;
 
-		typedef std::map<int, TLSSocket_sharedPtr>	TLSSocketMap;
-
         /**
          * @brief The TLSServer class provides a TCP-based TLS server.
+         *
+         * By default the server task accepts connections and services all TLSSockets itself. If workers are configured with
+         * \c setWorkerCount, the server task only accepts connections and hands each new connection to one of the worker tasks
+         * in a round robin manner. Each worker then owns its share of TLSSockets.
          */
 		class TLSServer : private Task
 		{
-			friend class TLSSocket;
+			friend class TLSServerWorker;
 
 			public:
 
+				struct Statistics
+				{
+					TLSCounters::Statistics			traffic;	/**< the traffic counters of all connections of the server */
+					TLSAdmissionControl::Statistics	admission;	/**< the admitted and rejected connections and the current connections */
+					size_t							bufferAllocations;	/**< the receive buffers the buffer pools of the workers had to allocate */
+				};
+
 								TLSServer(TLSServerEventHandler *eventHandler);
 
                 /**
@@ -72,9 +86,66 @@ namespace IDFix
 
                 /**
                  * @brief Shuts down the server. The server will no longer listen for incoming connections.
+                 *
+                 * All connections are closed immediately, bytes still queued for writing are discarded. Can also be called while the server
+                 * is draining, to close the remaining connections right away.
                  */
 				void			shutdown();
 
+                /**
+                 * @brief Shuts down the server gracefully.
+                 *
+                 * The server stops accepting connections, new clients are kept in the listen backlog until the server socket is closed. The
+                 * established connections are closed in batches of \c batchSize every \c batchIntervalMS, so the clients do not reconnect
+                 * all at once. A connection with queued bytes is only closed after the bytes were written, closing sends the close_notify
+                 * alert. Connections not closed after \c timeoutMS are closed regardless of their queued bytes. The server stops after all
+                 * connections were closed.
+                 *
+                 * Never blocks. New handshakes are no longer offloaded to the handshake tasks, the offloaded ones either finish and are
+                 * drained like any other connection, or are closed by a drain batch at the next cancellation check of their task. The
+                 * handshake tasks are stopped by the server task after the drain.
+                 *
+                 * @param timeoutMS         the deadline for closing all connections in milliseconds
+                 * @param batchSize         the maximum number of connections closed at once per worker
+                 * @param batchIntervalMS   the time between two batches in milliseconds
+                 *
+                 * @return  true on success
+                 * @return  false if the server is not listening or already draining
+                 */
+				bool			drain(uint32_t timeoutMS, uint16_t batchSize = 8, uint32_t batchIntervalMS = 100);
+
+                /**
+                 * @brief Writes a payload to all established connections. Can be called from any task.
+                 *
+                 * The payload is not copied per connection. Each worker writes it to its own connections on its event loop, bytes a peer does
+                 * not accept immediately are queued as a reference to the payload (see TLSSocket::write). So a slow connection neither delays
+                 * the others nor holds a copy, and the payload is released after it was written to the last connection. The payload must not
+                 * be modified afterwards.
+                 *
+                 * The payload is also queued on connections in backpressure state. To skip slow connections, use \c multicast with a filter
+                 * checking TLSSocket::bytesToWrite.
+                 *
+                 * @param payload   the payload to write
+                 *
+                 * @return  true if the payload was handed to all workers
+                 * @return  false if the server is not running, a worker already stopped or a command could not be allocated
+                 */
+				bool			broadcast(TLSSharedPayload payload);
+
+                /**
+                 * @brief Writes a payload to the established connections selected by a filter. Can be called from any task.
+                 *
+                 * Behaves like \c broadcast. The filter is called by the worker owning the connection, i.e. from the worker task, and must
+                 * therefore not block. It may be called concurrently by several workers.
+                 *
+                 * @param payload   the payload to write
+                 * @param filter    returns true for the connections to write to
+                 *
+                 * @return  true if the payload was handed to all workers
+                 * @return  false if the server is not running, a worker already stopped or a command could not be allocated
+                 */
+				bool			multicast(TLSSharedPayload payload, TLSSocketFilter filter);
+
                 /**
                  * @brief Sets the private key for the server.
                  *
@@ -101,6 +172,182 @@ namespace IDFix
                  */
 				bool			setCertificate(const unsigned char *cert, long certLength);
 
+                /**
+                 * @brief Sets the number of worker tasks servicing the TLSSockets.
+                 *
+                 * With \c 0 workers (default) the server task services all connections itself. Otherwise the server task only accepts
+                 * connections and distributes them to the workers, each running its own event loop. All TLSSocketEventHandler callbacks
+                 * and the TLSServerEventHandler::tlsNewConnection event of a socket are called from the worker owning the socket.
+                 *
+                 * \note    This method can only be called while the server is not listening.
+                 *
+                 * @param workerCount       the number of worker tasks
+                 * @param pinToCores        if true, the workers are pinned to the available cores in a round robin manner
+                 *
+                 * @return  true on success
+                 * @return  false if the server is currently listening
+                 */
+				bool			setWorkerCount(uint8_t workerCount, bool pinToCores = false);
+
+                /**
+                 * @brief Sets the number of tasks performing the TLS handshakes of new connections.
+                 *
+                 * With \c 0 handshake tasks (default) the worker owning a connection performs its handshake, which delays the events of the
+                 * other connections of the worker by the time of the asymmetric cryptography. Otherwise the handshakes are performed by
+                 * dedicated tasks running at a lower priority than the workers, see TLSHandshakePool. If all handshake tasks are busy and
+                 * \c queueLength connections are waiting, the workers perform further handshakes themselves.
+                 *
+                 * \note    This method can only be called while the server is not listening.
+                 *
+                 * @param taskCount         the number of handshake tasks
+                 * @param queueLength       the maximum number of connections waiting for a handshake task
+                 *
+                 * @return  true on success
+                 * @return  false if the server is currently listening
+                 */
+				bool			setHandshakeTasks(uint8_t taskCount, uint8_t queueLength = 8);
+
+                /**
+                 * @brief Configures the server side TLS session cache.
+                 *
+                 * Reconnecting clients presenting a cached session id resume their session and skip the asymmetric part of the handshake.
+                 * The cache holds at most \c capacity sessions and evicts the least recently used session if it is full.
+                 * On ESP-IDF the session cache of mbedtls is used, which evicts the oldest session instead.
+                 *
+                 * \note    Must be called after \c init. Applies to connections accepted afterwards.
+                 *
+                 * @param capacity          the maximum number of cached sessions, \c 0 disables the cache (default)
+                 * @param lifetimeSeconds   the time a session can be resumed after it was established
+                 *
+                 * @return  true on success
+                 * @return  false on failure
+                 */
+				bool			setSessionCache(size_t capacity, uint32_t lifetimeSeconds = 3600);
+
+                /**
+                 * @brief Enables or disables stateless TLS session tickets.
+                 *
+                 * With session tickets the client stores its session encrypted by the server, so resumption does not need any server memory.
+                 * The ticket key is rotated every \c keyRotationSeconds, tickets of the previous key are still accepted.
+                 *
+                 * \note    Must be called after \c init. Applies to connections accepted afterwards.
+                 *
+                 * @param enabled               true to issue and accept session tickets
+                 * @param keyRotationSeconds    the lifetime of a ticket key
+                 *
+                 * @return  true on success
+                 * @return  false on failure
+                 */
+				bool			setSessionTickets(bool enabled, uint32_t keyRotationSeconds = 3600);
+
+                /**
+                 * @brief Returns the hit and miss counters of the session cache and the session tickets.
+                 */
+				TLSSessionCache::Statistics	sessionCacheStatistics(void);
+
+                /**
+                 * @brief Sets the timeouts after which a connection is closed.
+                 *
+                 * A client which does not complete the TLS handshake within \c handshakeTimeoutMS after connecting is disconnected, as well as
+                 * an established connection without any reads or writes for \c idleTimeoutMS. \c 0 disables a timeout.
+                 *
+                 * \note    This method can only be called while the server is not listening.
+                 *
+                 * @param handshakeTimeoutMS    the handshake deadline in milliseconds (default \c 10000)
+                 * @param idleTimeoutMS         the idle timeout in milliseconds (default \c 0)
+                 *
+                 * @return  true on success
+                 * @return  false if the server is currently listening
+                 */
+				bool			setTimeouts(uint32_t handshakeTimeoutMS, uint32_t idleTimeoutMS);
+
+                /**
+                 * @brief Limits the connections admitted by the server.
+                 *
+                 * Connections exceeding a limit are closed right after they were accepted, before any TLS resources are allocated.
+                 * A handshake counts from accepting the connection until the TLS connection is fully established. \c 0 disables a limit (default).
+                 *
+                 * @param maxConnections            the maximum number of open connections
+                 * @param maxHandshakes             the maximum number of concurrent TLS handshakes
+                 * @param maxConnectionsPerPeer     the maximum number of open connections per client IP address
+                 */
+				void			setConnectionLimits(uint16_t maxConnections, uint16_t maxHandshakes = 0, uint16_t maxConnectionsPerPeer = 0);
+
+                /**
+                 * @brief Sets the free heap below which the server sheds new connections and pauses accepting.
+                 *
+                 * While the free heap is below the watermark, pending connections stay in the listen backlog of the TCP stack.
+                 * Accepting is resumed as soon as the free heap recovered.
+                 *
+                 * @param heapLowWatermark  the free heap in bytes, \c 0 disables shedding (default)
+                 */
+				void			setHeapLowWatermark(size_t heapLowWatermark);
+
+                /**
+                 * @brief Sets the maximum number of connections accepted per wakeup of the server socket (default \c 16).
+                 *
+                 * After a reconnect storm (e.g. an access point reboot) many connections are pending at once. Accepting them in a batch saves
+                 * a loop iteration per connection, while the limit keeps the established connections responsive.
+                 *
+                 * @param acceptBatchLimit  the maximum number of connections accepted at once, at least \c 1
+                 */
+				void			setAcceptBatchLimit(uint8_t acceptBatchLimit);
+
+                /**
+                 * @brief Sets the backlog of pending connections of the server socket (default \c 32).
+                 *
+                 * \note    This method can only be called while the server is not listening.
+                 *
+                 * @param backlog       the maximum number of pending connections
+                 *
+                 * @return  true on success
+                 * @return  false if the server is currently listening
+                 */
+				bool			setListenBacklog(uint8_t backlog);
+
+                /**
+                 * @brief Limits the data read from a single connection before the other connections of a worker are serviced.
+                 *
+                 * A readable connection is read until all received TLS records are consumed, but at most \c maxBytes or \c maxRecords
+                 * at once. A connection exceeding the budget is read again after the other ready connections, so a single fast sender
+                 * cannot starve them.
+                 *
+                 * \note    This method can only be called while the server is not listening, the workers take the budget over when it starts.
+                 *
+                 * @param maxBytes      the maximum number of bytes read at once (default \c 16384)
+                 * @param maxRecords    the maximum number of records read at once (default \c 8)
+                 *
+                 * @return  true on success
+                 * @return  false if the server is currently listening
+                 */
+				bool			setReadBudget(size_t maxBytes, uint16_t maxRecords);
+
+                /**
+                 * @brief Sets the record sizing policy of new connections, see TLSSocket::setRecordSizing.
+                 *
+                 * By default the first \c 32 KiB of a burst are written in records of \c 1400 bytes, which fit into a single TCP segment,
+                 * and a burst ends after \c 1000 ms without writes.
+                 *
+                 * @param smallRecordLength     the plaintext length of the small records, \c 0 always writes full-size records
+                 * @param boostThreshold        the number of bytes of a burst written in small records
+                 * @param idleResetMS           the time without writes in milliseconds after which small records are written again,
+                 *                              \c 0 never starts a new burst, so only the first \c boostThreshold bytes are written in small records
+                 */
+				void			setRecordSizing(size_t smallRecordLength, size_t boostThreshold = 32*1024, uint32_t idleResetMS = 1000);
+
+                /**
+                 * @brief Returns the counters of admitted, rejected and shed connections.
+                 */
+				TLSAdmissionControl::Statistics	admissionStatistics(void);
+
+                /**
+                 * @brief Returns a snapshot of the server-wide counters. Can be called from any task.
+                 *
+                 * The traffic counters are updated by the workers without locking and are only summed up here, so polling the snapshot
+                 * does not disturb the data path. The counters wrap around at 2^32, see TLSCounters.
+                 */
+				Statistics		statistics(void);
+
 			protected:
 
                 /**
@@ -114,39 +361,69 @@ namespace IDFix
 				virtual void	stopTask() override;
 
                 /**
-                 * @brief Removes the socket from the server handling.
+                 * @brief Accepts the pending connections on the server socket, up to the accept batch limit.
                  *
-                 * This method is used by the TLSSocket when it is closing. It will remove the socket from all
-                 * internal containers and stops handling any event on the socket. It will also call \c releaseOwner
-                 * on the TLSSocket to indicate that the server is no longer managing the socket.
+                 * This method is called by the worker watching the server socket, e.g. by the server task.
+                 */
+				void			acceptConnections(void);
+
+                /**
+                 * @brief Admits an accepted connection and hands it over to a worker.
                  *
-                 * @param tlsSocket pointer to the TLSSocket to remove
+                 * @param newClientSocket   the socket descriptor of the accepted connection
+                 * @param peerAddress       the IPv4 address of the client (network byte order)
                  */
-				void			removeSocket(TLSSocket* tlsSocket);
+				void			acceptConnection(int newClientSocket, uint32_t peerAddress);
 
                 /**
                  * @brief Calls the servers event handler when a new TLS connection is fully established.
                  *
                  * While handling of the TLS handshake is managed by the TLSSocket itself, new connection
-                 * events are handled by the servers event handler. Therefore TLSSocket uses this method
+                 * events are handled by the servers event handler. Therefore the TLSServerWorker owning the socket uses this method
                  * to call the servers event handler when a new TLS connection is fully established.
                  *
-                 * @param newTLSSocket  pointer to the TLSSocket which established a new connection.
+                 * @param newTLSSocket  the (original) shared pointer of the TLSSocket which established a new connection.
+                 */
+				void			sendNewConnectionEvent(TLSSocket_sharedPtr newTLSSocket);
+
+                /**
+                 * @brief Resumes accepting connections if it was paused because of low heap and the heap recovered.
                  */
-				void			sendNewConnectionEvent(TLSSocket* newTLSSocket);
+				void			resumeAccepting(void);
 
 				TLSServerEventHandler	*_eventHandler;
 				SSL_CTX					*_tlsContext	= { nullptr };
+				TLSSessionCache			_sessionCache;
+				TLSAdmissionControl		_admissionControl;
 				int						_serverSocket	= { -1 };
 				uint16_t				_serverPort		= { 0 };
+				uint8_t					_listenBacklog	= { 32 };
+				uint8_t					_acceptBatchLimit = { 16 };
+				uint32_t				_handshakeTimeout = { 10*1000 };
+				uint32_t				_idleTimeout	= { 0 };
+				size_t					_readBudgetBytes = { 16*1024 };
+				uint16_t				_readBudgetRecords = { 8 };
+				size_t					_smallRecordLength = { 1400 };
+				size_t					_recordBoostThreshold = { 32*1024 };
+				uint32_t				_recordIdleReset = { 1000 };
+				bool					_acceptingPaused = { false };
+				bool					_isDraining		= { false };
+				uint32_t				_drainTimeout	= { 0 };
+				uint16_t				_drainBatchSize	= { 0 };
+				uint32_t				_drainBatchInterval = { 0 };
 				bool					_serverIsRunning = { false };
 				bool					_serverIsShutdown = { true };
 
-				/** \brief fd_set to hold the currently open sockets  */
-				fd_set					_activeDescriptors;
+				/** \brief the event loop driven by the server task, it watches the server socket and owns the sockets if there are no workers */
+				TLSServerWorker			_localWorker;
 
-				/** \brief  Maps a socket descriptor to it's TLSSocket object */
-				TLSSocketMap			_socketMap = {};
+				std::vector<std::unique_ptr<TLSServerWorker>>	_workers = {};
+				TLSHandshakePool		_handshakePool;
+				uint8_t					_handshakeTaskCount = { 0 };
+				uint8_t					_handshakeQueueLength = { 8 };
+				uint8_t					_workerCount = { 0 };
+				bool					_pinWorkersToCores = { false };
+				size_t					_nextWorker = { 0 };
 
 				Mutex					_mutex = { Mutex::Recursive };
 		};
@@ -0,0 +1,792 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "TLSServerWorker.h"
+
+#include "TLSServer.h"
+#include "TLSSocket.h"
+#include "MutexLocker.h"
+
+#include <algorithm>
+#include <new>
+
+extern "C"
+{
+	#include <esp_log.h>
+	#include <freertos/FreeRTOS.h>
+	#include <freertos/task.h>
+	#include <esp_timer.h>
+}
+
+namespace
+{
+	const char*		LOG_TAG					= "IDFix::TLSServerWorker";
+
+#if defined(CONFIG_LWIP_MAX_SOCKETS)
+	const size_t	EXPECTED_SOCKET_COUNT	= CONFIG_LWIP_MAX_SOCKETS;
+#else
+	const size_t	EXPECTED_SOCKET_COUNT	= 16;
+#endif
+
+	uint32_t currentTimeMS()
+	{
+		return static_cast<uint32_t>( esp_timer_get_time() / 1000 );
+	}
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+
+		TLSServerWorker::TLSServerWorker(TLSServer *server, const std::string &name)
+			: Task(name, 4072, CONFIG_IDFIX_PROTOCOLS_TLS_TASK_PRIORITY), _server(server), _drainTimer(this)
+		{
+
+		}
+
+		bool TLSServerWorker::begin()
+		{
+			MutexLocker locker(_mutex);
+
+			if ( ! _poller.init() || ! _wakeupChannel.init() || ! _poller.addDescriptor(_wakeupChannel.descriptor(), SocketPoller::Readable) )
+			{
+				ESP_LOGE(LOG_TAG, "Could not initialize worker at file %s:%d.", __FILE__, __LINE__);
+				_wakeupChannel.deinit();
+				_poller.deinit();
+				return false;
+			}
+
+			// allocate the socket table once, so accepting connections does not allocate table memory
+			_socketTable.reserve(EXPECTED_SOCKET_COUNT);
+
+			_handshakeTimeout = _server->_handshakeTimeout;
+			_idleTimeout = _server->_idleTimeout;
+			_readBudgetBytes = _server->_readBudgetBytes;
+			_readBudgetRecords = _server->_readBudgetRecords;
+
+			_listenDescriptor = -1;
+			_isRunning = true;
+
+			_commandMutex.lock();
+				_acceptingCommands = true;
+			_commandMutex.unlock();
+
+			return true;
+		}
+
+		bool TLSServerWorker::start(int core)
+		{
+			if ( ! begin() )
+			{
+				return false;
+			}
+
+			if ( core >= 0 )
+			{
+				setCore(core);
+			}
+
+			startTask();
+
+			return true;
+		}
+
+		void TLSServerWorker::requestStop()
+		{
+			// the loop leaves after finishing the commands posted before
+			post(TLSCommand::Stop);
+		}
+
+		bool TLSServerWorker::post(TLSCommand::Type type, TLSSocket_sharedPtr tlsSocket, const char *payload, size_t length)
+		{
+			TLSCommand *command = new (std::nothrow) TLSCommand();
+
+			if ( command == nullptr )
+			{
+				ESP_LOGE(LOG_TAG, "Could not allocate command at file %s:%d.", __FILE__, __LINE__);
+				return false;
+			}
+
+			command->type = type;
+			command->tlsSocket = tlsSocket;
+
+			if ( length > 0 )
+			{
+				command->payload.insert(command->payload.end(), payload, payload + length);
+			}
+
+			return pushCommand(command);
+		}
+
+		bool TLSServerWorker::post(TLSCommand::Type type, TLSSocket_sharedPtr tlsSocket, const struct iovec *buffers, int count)
+		{
+			TLSCommand *command = new (std::nothrow) TLSCommand();
+
+			if ( command == nullptr )
+			{
+				ESP_LOGE(LOG_TAG, "Could not allocate command at file %s:%d.", __FILE__, __LINE__);
+				return false;
+			}
+
+			command->type = type;
+			command->tlsSocket = tlsSocket;
+
+			size_t length = 0;
+
+			for ( int index = 0; index < count; index++ )
+			{
+				length += buffers[index].iov_len;
+			}
+
+			// a single allocation for the whole message, which is written by the loop like a contiguous write
+			command->payload.reserve(length);
+
+			for ( int index = 0; index < count; index++ )
+			{
+				const char *bytes = static_cast<const char*>(buffers[index].iov_base);
+				command->payload.insert(command->payload.end(), bytes, bytes + buffers[index].iov_len);
+			}
+
+			return pushCommand(command);
+		}
+
+		bool TLSServerWorker::post(TLSCommand::Type type, TLSSocket_sharedPtr tlsSocket, const TLSSharedPayload &payload, const TLSSocketFilter &filter)
+		{
+			TLSCommand *command = new (std::nothrow) TLSCommand();
+
+			if ( command == nullptr )
+			{
+				ESP_LOGE(LOG_TAG, "Could not allocate command at file %s:%d.", __FILE__, __LINE__);
+				return false;
+			}
+
+			command->type = type;
+			command->tlsSocket = tlsSocket;
+			command->sharedPayload = payload;
+			command->filter = filter;
+
+			return pushCommand(command);
+		}
+
+		bool TLSServerWorker::pushCommand(TLSCommand *command)
+		{
+			_commandMutex.lock();
+
+				if ( ! _acceptingCommands )
+				{
+					// the command would never be processed, and the wakeup channel may already be closed
+					_commandMutex.unlock();
+					delete command;
+					return false;
+				}
+
+				_counters.add(TLSCounters::PendingCommands);
+				_commandQueue.push(command);
+				_wakeupChannel.signal();
+
+			_commandMutex.unlock();
+
+			return true;
+		}
+
+		void TLSServerWorker::stopAcceptingCommands()
+		{
+			_commandMutex.lock();
+				_acceptingCommands = false;
+			_commandMutex.unlock();
+		}
+
+		bool TLSServerWorker::isLoopTask()
+		{
+			return _loopTask == xTaskGetCurrentTaskHandle();
+		}
+
+		bool TLSServerWorker::isRunning()
+		{
+			MutexLocker locker(_mutex);
+
+			return _isRunning;
+		}
+
+		bool TLSServerWorker::watchListener(int descriptor)
+		{
+			MutexLocker locker(_mutex);
+
+			if ( ! _poller.addDescriptor(descriptor, SocketPoller::Readable) )
+			{
+				return false;
+			}
+
+			_listenDescriptor = descriptor;
+			return true;
+		}
+
+		void TLSServerWorker::setListenerPaused(bool paused)
+		{
+			MutexLocker locker(_mutex);
+
+			if ( _listenDescriptor != -1 )
+			{
+				_poller.modifyDescriptor(_listenDescriptor, paused ? SocketPoller::None : SocketPoller::Readable);
+			}
+		}
+
+		void TLSServerWorker::requestDrain()
+		{
+			// the sockets are drained after finishing the commands posted before
+			post(TLSCommand::Drain);
+		}
+
+		void TLSServerWorker::addSocket(TLSSocket_sharedPtr tlsSocket)
+		{
+			if ( ! post(TLSCommand::AdoptSocket, tlsSocket) )
+			{
+				tlsSocket->releaseOwner();
+				tlsSocket->close();
+			}
+		}
+
+		void TLSServerWorker::run()
+		{
+			while ( isRunning() )
+			{
+				if ( ! processEvents(-1) )
+				{
+					ESP_LOGW(LOG_TAG, "Exiting worker loop. Reason: error");
+					return;
+				}
+			}
+
+			ESP_LOGI(LOG_TAG, "Exiting worker loop. Reason: shutdown");
+		}
+
+		void TLSServerWorker::stopTask()
+		{
+			ESP_LOGI(LOG_TAG, "TLSServerWorker task has finished. Do cleanup and call base class stop()");
+
+			closeAllSockets();
+
+			Task::stopTask();
+		}
+
+		bool TLSServerWorker::processEvents(int timeoutMS)
+		{
+			// the task driving the loop, cross-task requests are posted as commands to this task
+			_loopTask = xTaskGetCurrentTaskHandle();
+
+			// do not wait beyond the next timer
+			int timerTimeout = _timerWheel.nextTimeout();
+
+			if ( timerTimeout >= 0 && ( timeoutMS < 0 || timerTimeout < timeoutMS ) )
+			{
+				timeoutMS = timerTimeout;
+			}
+
+			// sockets which exhausted their read budget are read again without waiting
+			if ( ! _rescheduledSockets.empty() )
+			{
+				timeoutMS = 0;
+			}
+
+			// block until one or more registered sockets are ready
+			if ( _poller.wait(timeoutMS) < 0 )
+			{
+				ESP_LOGW(LOG_TAG, "SocketPoller::wait() failed at file %s:%d.", __FILE__, __LINE__);
+				return false;
+			}
+
+			if ( ! isRunning() )
+			{
+				return true;
+			}
+
+			// the sockets rescheduled in the last iteration are read after the ready sockets, so they queue up behind them
+			_pendingReadSockets.swap(_rescheduledSockets);
+
+			// only the ready sockets are visited, so the cost of a wakeup does not depend on the number of open sockets
+			for ( const SocketPoller::ReadyEvent &readyEvent : _poller.readyEvents() )
+			{
+				if ( readyEvent.descriptor == _wakeupChannel.descriptor() )
+				{
+					// posted commands are processed below
+					_wakeupChannel.drain();
+					continue;
+				}
+
+				if ( readyEvent.descriptor == _listenDescriptor )
+				{
+					_server->acceptConnections();
+					continue;
+				}
+
+				// the local shared pointer keeps the socket alive, even if it is closed and erased from the table while dispatching
+				_mutex.lock();
+					TLSSocket_sharedPtr currentSocket = _socketTable.find(readyEvent.descriptor);
+				_mutex.unlock();
+
+				if ( currentSocket != nullptr )
+				{
+					int result = 1;
+
+					if ( readyEvent.events & SocketPoller::Writable )
+					{
+						result = currentSocket->socketReadyWrite();
+					}
+
+					if ( result > 0 && ( readyEvent.events & (SocketPoller::Readable | SocketPoller::Closed) ) && ! currentSocket->_readRescheduled )
+					{
+						result = readSocket(currentSocket);
+					}
+
+					if ( result <= 0 )
+					{
+						// socket was closed
+						currentSocket->close();
+						currentSocket.reset();
+					}
+				}
+			}
+
+			for ( TLSSocket_sharedPtr &pendingSocket : _pendingReadSockets )
+			{
+				pendingSocket->_readRescheduled = false;
+
+				if ( readSocket(pendingSocket) <= 0 )
+				{
+					// socket was closed
+					pendingSocket->close();
+				}
+			}
+
+			_pendingReadSockets.clear();
+
+			_timerWheel.advance();
+
+			processCommands();
+
+			return true;
+		}
+
+		int TLSServerWorker::readSocket(const TLSSocket_sharedPtr &tlsSocket)
+		{
+			int result = tlsSocket->socketReadyRead();
+
+			if ( result == TLSSocket::READ_BUDGET_EXHAUSTED )
+			{
+				// the records left in the socket are read in the next iteration, after the other ready sockets were serviced
+				tlsSocket->_readRescheduled = true;
+				_rescheduledSockets.push_back(tlsSocket);
+			}
+
+			return result;
+		}
+
+		void TLSServerWorker::processCommands()
+		{
+			TLSCommand *command;
+
+			while ( ( command = _commandQueue.pop() ) != nullptr )
+			{
+				_counters.subtract(TLSCounters::PendingCommands);
+
+				switch ( command->type )
+				{
+					case TLSCommand::Stop:
+
+						stopAcceptingCommands();
+
+						_mutex.lock();
+							_isRunning = false;
+						_mutex.unlock();
+						break;
+
+					case TLSCommand::AdoptSocket:
+
+						adoptSocket(command->tlsSocket);
+						break;
+
+					case TLSCommand::CloseSocket:
+
+						command->tlsSocket->close();
+						break;
+
+					case TLSCommand::WriteSocket:
+
+						if ( command->sharedPayload != nullptr )
+						{
+							command->tlsSocket->writePosted(command->sharedPayload->data(), command->sharedPayload->size(), command->sharedPayload);
+						}
+						else
+						{
+							command->tlsSocket->writePosted(command->payload.data(), command->payload.size() );
+						}
+						break;
+
+					case TLSCommand::HandshakeSucceeded:
+					case TLSCommand::HandshakeFailed:
+
+						command->tlsSocket->offloadedHandshakeCompleted(command->type == TLSCommand::HandshakeSucceeded);
+						break;
+
+					case TLSCommand::Drain:
+
+						startDrain();
+						break;
+
+					case TLSCommand::Broadcast:
+
+						broadcast(command->sharedPayload, command->filter);
+						break;
+				}
+
+				delete command;
+			}
+		}
+
+		void TLSServerWorker::adoptSocket(TLSSocket_sharedPtr tlsSocket)
+		{
+			if ( tlsSocket->_socketDescriptor == -1 )
+			{
+				return;
+			}
+
+			_mutex.lock();
+				_socketTable.insert(tlsSocket->_socketDescriptor, tlsSocket);
+			_mutex.unlock();
+
+			if ( ! _poller.addDescriptor(tlsSocket->_socketDescriptor, SocketPoller::Readable) )
+			{
+				tlsSocket->close();
+				return;
+			}
+
+			tlsSocket->_idleTimeout = _idleTimeout;
+
+			if ( _handshakeTimeout > 0 )
+			{
+				// a client which does not finish the handshake in time is disconnected
+				_timerWheel.arm(tlsSocket->_connectionTimer, _handshakeTimeout);
+			}
+		}
+
+		bool TLSServerWorker::offloadHandshake(TLSSocket *tlsSocket)
+		{
+			TLSHandshakePool &handshakePool = _server->_handshakePool;
+
+			if ( ! handshakePool.isRunning() )
+			{
+				return false;
+			}
+
+			TLSSocket_sharedPtr currentSocket = tlsSocket->weak_from_this().lock();
+
+			if ( currentSocket == nullptr )
+			{
+				return false;
+			}
+
+			// from now on only the handshake task touches the TLS connection, the handshake deadline stays armed and closes the socket if it expires
+			tlsSocket->_handshakeOffloaded = true;
+			_poller.removeDescriptor(tlsSocket->_socketDescriptor);
+
+			if ( ! handshakePool.submit(currentSocket) )
+			{
+				tlsSocket->_handshakeOffloaded = false;
+				_poller.addDescriptor(tlsSocket->_socketDescriptor, tlsSocket->_watchedEvents);
+				return false;
+			}
+
+			return true;
+		}
+
+		void TLSServerWorker::startDrain()
+		{
+			if ( _isDraining )
+			{
+				return;
+			}
+
+			_server->_mutex.lock();
+				uint32_t drainTimeout = _server->_drainTimeout;
+				_drainBatchSize = _server->_drainBatchSize;
+				_drainBatchInterval = _server->_drainBatchInterval;
+			_server->_mutex.unlock();
+
+			_isDraining = true;
+			_drainDeadline = currentTimeMS() + drainTimeout;
+
+			// new connections stay in the backlog until the server socket is closed
+			setListenerPaused(true);
+
+			drainNextBatch();
+		}
+
+		void TLSServerWorker::broadcast(const TLSSharedPayload &payload, const TLSSocketFilter &filter)
+		{
+			_mutex.lock();
+				_socketTable.snapshot(_broadcastSockets);
+			_mutex.unlock();
+
+			// each socket writes what its peer's TCP window accepts and queues a reference to the payload for the rest,
+			// so a slow peer neither delays the other sockets nor costs a copy of the payload
+			for ( TLSSocket_sharedPtr &tlsSocket : _broadcastSockets )
+			{
+				if ( ! tlsSocket->_sslAccepted || ( filter && ! filter(*tlsSocket) ) )
+				{
+					continue;
+				}
+
+				if ( tlsSocket->writeBytes(payload->data(), payload->size(), true, payload) < 0 )
+				{
+					tlsSocket->close();
+					continue;
+				}
+
+				tlsSocket->updateBackpressure();
+			}
+
+			_broadcastSockets.clear();
+		}
+
+		void TLSServerWorker::drainNextBatch()
+		{
+			uint32_t	now = currentTimeMS();
+			bool		deadlineExpired = static_cast<int32_t>(now - _drainDeadline) >= 0;
+			size_t		closedSockets = 0;
+
+			_mutex.lock();
+				_socketTable.snapshot(_closingSockets);
+			_mutex.unlock();
+
+			// closing a socket writes what the peer's TCP window accepts and sends the close_notify alert
+			// sockets still flushing their outbound queue are closed in a later batch, unless the deadline expired
+			for ( TLSSocket_sharedPtr &tlsSocket : _closingSockets )
+			{
+				if ( ! deadlineExpired && closedSockets >= _drainBatchSize )
+				{
+					break;
+				}
+
+				if ( ! deadlineExpired && tlsSocket->_sslAccepted && tlsSocket->hasPendingWrites() )
+				{
+					continue;
+				}
+
+				tlsSocket->close();
+				closedSockets++;
+			}
+
+			if ( deadlineExpired && closedSockets > 0 )
+			{
+				ESP_LOGW(LOG_TAG, "Drain deadline expired, closed %zu sockets", closedSockets);
+			}
+
+			_closingSockets.clear();
+
+			_mutex.lock();
+				bool isDrained = _socketTable.empty();
+			_mutex.unlock();
+
+			if ( isDrained || deadlineExpired )
+			{
+				// leave the event loop, the remaining resources are released by closeAllSockets
+				stopAcceptingCommands();
+
+				_mutex.lock();
+					_isRunning = false;
+				_mutex.unlock();
+				return;
+			}
+
+			// the next batch is staggered, so the clients do not reconnect all at once, but the deadline is never missed
+			_timerWheel.arm(_drainTimer, std::min(_drainBatchInterval, _drainDeadline - now) );
+		}
+
+		TLSServerWorker::DrainTimer::DrainTimer(TLSServerWorker *worker)
+			: _worker(worker)
+		{
+
+		}
+
+		void TLSServerWorker::DrainTimer::timerExpired()
+		{
+			_worker->drainNextBatch();
+		}
+
+		void TLSServerWorker::closeAllSockets()
+		{
+			// commands posted from now on are rejected, so nothing is left in the queue after draining it below
+			stopAcceptingCommands();
+
+			_mutex.lock();
+
+				_isRunning = false;
+
+				_socketTable.snapshot(_closingSockets);
+
+				// sockets which were handed over but not adopted yet are closed as well, other commands are dropped
+				TLSCommand *command;
+
+				while ( ( command = _commandQueue.pop() ) != nullptr )
+				{
+					_counters.subtract(TLSCounters::PendingCommands);
+
+					if ( command->type == TLSCommand::AdoptSocket )
+					{
+						_closingSockets.push_back(command->tlsSocket);
+					}
+
+					if ( command->type == TLSCommand::HandshakeSucceeded || command->type == TLSCommand::HandshakeFailed )
+					{
+						// the handshake pool is done with the socket, so it is closed below instead of waiting for the handshake
+						command->tlsSocket->_handshakeOffloaded = false;
+					}
+
+					delete command;
+				}
+
+				// first make sure all current TLSSockets are closed
+				for ( TLSSocket_sharedPtr &tlsSocket : _closingSockets )
+				{
+					ESP_LOGI(LOG_TAG, "Closing socket: %d", tlsSocket->_socketDescriptor);
+
+					_poller.removeDescriptor(tlsSocket->_socketDescriptor);
+					cancelSocketTimers( tlsSocket.get() );
+					releaseAdmission( tlsSocket.get() );
+					_counters.subtract(TLSCounters::QueuedBytes, static_cast<uint32_t>(tlsSocket->_outboundBytes) );
+
+					// first release owner (this worker) from socket, to prevent calling TLSServerWorker::removeSocket
+					// by closing the socket, as removeSocket would alter the socket table
+					tlsSocket->releaseOwner();
+
+					tlsSocket->close();
+
+					// as task will be immediately deleted afterwards, the destructor of the last shared pointer
+					// instance will not be called. so delete this (local) shared pointer here explicitly
+					tlsSocket.reset();
+				}
+
+				// now delete all TLSSockets
+				_closingSockets.clear();
+				_broadcastSockets.clear();
+				_rescheduledSockets.clear();
+				_pendingReadSockets.clear();
+				_socketTable.clear();
+
+				_isDraining = false;
+
+				_bufferPool.clear();
+				ByteArray().swap(_recordBuffer);
+				ByteArray().swap(_gatherBuffer);
+				_timerWheel.clear();
+
+				_listenDescriptor = -1;
+				_wakeupChannel.deinit();
+				_poller.deinit();
+
+			_mutex.unlock();
+		}
+
+		void TLSServerWorker::removeSocket(TLSSocket *tlsSocket)
+		{
+			_mutex.lock();
+
+				if ( ! _isRunning )
+				{
+					// if worker is not running (anymore) don't remove the sockets this way
+					// if worker is shut down, sockets will be removed in separate clean up
+					_mutex.unlock();
+					return;
+				}
+
+				_poller.removeDescriptor(tlsSocket->_socketDescriptor);
+				_socketTable.erase(tlsSocket->_socketDescriptor);
+				cancelSocketTimers(tlsSocket);
+
+				// the bytes still queued by the socket no longer count for this worker
+				_counters.subtract(TLSCounters::QueuedBytes, static_cast<uint32_t>(tlsSocket->_outboundBytes) );
+			_mutex.unlock();
+
+			releaseAdmission(tlsSocket);
+
+			tlsSocket->releaseOwner();
+		}
+
+		void TLSServerWorker::updateSocketEvents(TLSSocket *tlsSocket, uint8_t events)
+		{
+			_poller.modifyDescriptor(tlsSocket->_socketDescriptor, events);
+		}
+
+		void TLSServerWorker::socketTimerExpired(TLSSocket *tlsSocket, bool isApplicationTimer)
+		{
+			// the local shared pointer keeps the socket alive, even if it is closed and erased from the table by the timer
+			_mutex.lock();
+				TLSSocket_sharedPtr currentSocket = _socketTable.find(tlsSocket->_socketDescriptor);
+			_mutex.unlock();
+
+			if ( currentSocket == nullptr )
+			{
+				return;
+			}
+
+			int result = isApplicationTimer ? currentSocket->applicationTimerExpired() : currentSocket->connectionTimerExpired();
+
+			if ( result <= 0 )
+			{
+				// expired connections are closed like any other socket
+				currentSocket->close();
+			}
+		}
+
+		void TLSServerWorker::cancelSocketTimers(TLSSocket *tlsSocket)
+		{
+			_timerWheel.cancel(tlsSocket->_connectionTimer);
+			_timerWheel.cancel(tlsSocket->_applicationTimer);
+		}
+
+		void TLSServerWorker::releaseAdmission(TLSSocket *tlsSocket)
+		{
+			if ( tlsSocket->_admitted )
+			{
+				tlsSocket->_admitted = false;
+				_server->_admissionControl.connectionClosed(tlsSocket->_peerAddress, tlsSocket->_handshakeInProgress);
+			}
+		}
+
+		void TLSServerWorker::sendNewConnectionEvent(TLSSocket *newTLSSocket)
+		{
+			if ( newTLSSocket->_admitted && newTLSSocket->_handshakeInProgress )
+			{
+				// the connection no longer counts against the handshake limit
+				newTLSSocket->_handshakeInProgress = false;
+				_server->_admissionControl.handshakeFinished();
+			}
+
+			// we have to send the (original) shared pointer stored by the worker
+			_mutex.lock();
+				TLSSocket_sharedPtr sharedPointer = _socketTable.find(newTLSSocket->_socketDescriptor);
+			_mutex.unlock();
+
+			if ( sharedPointer != nullptr )
+			{
+				_server->sendNewConnectionEvent(sharedPointer);
+			}
+		}
+
+	}
+}
@@ -0,0 +1,400 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TLSSERVERWORKER_H
+#define TLSSERVERWORKER_H
+
+#include "IDFixTask.h"
+#include "auxiliary.h"
+#include <string>
+#include <vector>
+#include "Mutex.h"
+
+extern "C"
+{
+	#include <sys/uio.h>
+	#include "sdkconfig.h"
+}
+
+#ifndef CONFIG_IDFIX_PROTOCOLS_TLS_TASK_PRIORITY
+	#define CONFIG_IDFIX_PROTOCOLS_TLS_TASK_PRIORITY	5
+#endif
+
+#include "SocketPoller.h"
+#include "WakeupChannel.h"
+#include "TLSSocketTable.h"
+#include "TLSBufferPool.h"
+#include "TimerWheel.h"
+#include "TLSCommandQueue.h"
+#include "TLSCounters.h"
+#include "TLSSocket.h"
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+		DeclarePointers(TLSSocket);
+		class TLSServer;
+		class TLSSocket;
+
+        /**
+         * @brief The TLSServerWorker class provides an event loop servicing a share of the TLSSockets of a TLSServer.
+         *
+         * Each worker owns its TLSSockets, its socket table and its own SocketPoller. All TLSSocketEventHandler callbacks and the
+         * TLSServerEventHandler::tlsNewConnection event of a socket are called from the worker owning the socket.
+         *
+         * A worker either runs its own task (see \c start) or is driven by the task of the TLSServer calling \c processEvents,
+         * which is how a TLSServer without additional workers operates.
+         *
+         * Other tasks never touch the sockets, the poller or the timers of a worker directly. Instead they \c post a TLSCommand, which is
+         * executed by the event loop in the order it was posted. Posting wakes up the loop by the WakeupChannel.
+         */
+		class TLSServerWorker : private Task
+		{
+			friend class TLSServer;
+			friend class TLSSocket;
+
+			public:
+
+                /**
+                 * @brief Constructs a TLSServerWorker
+                 *
+                 * @param server    the TLSServer this worker belongs to
+                 * @param name      the name of the worker task
+                 */
+								TLSServerWorker(TLSServer *server, const std::string &name);
+
+								TLSServerWorker(const TLSServerWorker&) = delete;
+
+			protected:
+
+                /**
+                 * @brief Prepares the worker for processing events
+                 *
+                 * @return  true on success
+                 * @return  false on failure
+                 */
+				bool			begin(void);
+
+                /**
+                 * @brief Starts the worker task
+                 *
+                 * @param core      the core to pin the worker task to, \c -1 to let the scheduler decide
+                 *
+                 * @return  true on success
+                 * @return  false on failure
+                 */
+				bool			start(int core = -1);
+
+                /**
+                 * @brief Requests the worker to stop. The worker closes all of its sockets after leaving the event loop.
+                 */
+				void			requestStop(void);
+
+                /**
+                 * @brief Posts a command to the event loop. Can be called from any task.
+                 *
+                 * @param type          the type of the command
+                 * @param tlsSocket     the TLSSocket the command refers to
+                 * @param payload       the bytes to write for \c TLSCommand::WriteSocket, they are copied
+                 * @param length        the number of bytes to write
+                 *
+                 * @return  true on success
+                 * @return  false if the command could not be allocated or the worker stopped
+                 */
+				bool			post(TLSCommand::Type type, TLSSocket_sharedPtr tlsSocket = nullptr, const char *payload = nullptr, size_t length = 0);
+
+                /**
+                 * @brief Posts a command with a payload gathered from several buffers to the event loop. Can be called from any task.
+                 *
+                 * @param type          the type of the command
+                 * @param tlsSocket     the TLSSocket the command refers to
+                 * @param buffers       the buffers to write for \c TLSCommand::WriteSocket, they are copied into a single payload
+                 * @param count         the number of buffers
+                 *
+                 * @return  true on success
+                 * @return  false if the command could not be allocated or the worker stopped
+                 */
+				bool			post(TLSCommand::Type type, TLSSocket_sharedPtr tlsSocket, const struct iovec *buffers, int count);
+
+                /**
+                 * @brief Posts a command with a shared payload to the event loop. Can be called from any task.
+                 *
+                 * @param type          the type of the command
+                 * @param tlsSocket     the TLSSocket the command refers to, \c nullptr for \c TLSCommand::Broadcast
+                 * @param payload       the payload to write, only a reference is posted
+                 * @param filter        the filter selecting the sockets of a \c TLSCommand::Broadcast
+                 *
+                 * @return  true on success
+                 * @return  false if the command could not be allocated or the worker stopped
+                 */
+				bool			post(TLSCommand::Type type, TLSSocket_sharedPtr tlsSocket, const TLSSharedPayload &payload, const TLSSocketFilter &filter = nullptr);
+
+                /**
+                 * @brief Appends an allocated command to the command queue and wakes up the event loop
+                 *
+                 * The command is deleted if the worker stopped, as a stopped worker never processes it.
+                 *
+                 * @return  true on success
+                 * @return  false if the worker stopped
+                 */
+				bool			pushCommand(TLSCommand *command);
+
+                /**
+                 * @brief Requests the worker to close its sockets gracefully and stop afterwards, see TLSServer::drain
+                 */
+				void			requestDrain(void);
+
+                /**
+                 * @brief Returns true if the calling task is the task driving the event loop
+                 */
+				bool			isLoopTask(void);
+
+                /**
+                 * @brief Returns true as long as the worker was not requested to stop
+                 */
+				bool			isRunning(void);
+
+                /**
+                 * @brief Lets the worker watch the listening socket of the TLSServer for incomming connections
+                 *
+                 * @param descriptor    the listening socket descriptor
+                 *
+                 * @return  true on success
+                 * @return  false on failure
+                 */
+				bool			watchListener(int descriptor);
+
+                /**
+                 * @brief Stops or resumes watching the listening socket for incomming connections
+                 *
+                 * @param paused        true to stop watching
+                 */
+				void			setListenerPaused(bool paused);
+
+                /**
+                 * @brief Hands a new TLSSocket over to the worker. Can be called from any task.
+                 *
+                 * The socket will be adopted by the worker when it processes the posted commands.
+                 *
+                 * @param tlsSocket     the new TLSSocket
+                 */
+				void			addSocket(TLSSocket_sharedPtr tlsSocket);
+
+                /**
+                 * @brief Waits for ready sockets and dispatches their events
+                 *
+                 * @param timeoutMS     the maximum time to wait in milliseconds, \c -1 waits infinitely
+                 *
+                 * @return  true on success
+                 * @return  false if waiting for the sockets failed
+                 */
+				bool			processEvents(int timeoutMS);
+
+                /**
+                 * @brief Closes all sockets owned by the worker and releases the worker's resources
+                 */
+				void			closeAllSockets(void);
+
+                /**
+                 * @brief Processes events until the worker is requested to stop
+                 */
+				virtual void	run() override;
+
+                /**
+                 * @brief Overrides the default stopTask method to perform proper resource deallocation
+                 */
+				virtual void	stopTask() override;
+
+                /**
+                 * @brief Removes the socket from the worker handling.
+                 *
+                 * This method is used by the TLSSocket when it is closing. It will remove the socket from all
+                 * internal containers and stops handling any event on the socket. It will also call \c releaseOwner
+                 * on the TLSSocket to indicate that the worker is no longer managing the socket.
+                 *
+                 * It is only called by the event loop, as a TLSSocket closed by another task posts a \c TLSCommand::CloseSocket.
+                 *
+                 * @param tlsSocket pointer to the TLSSocket to remove
+                 */
+				void			removeSocket(TLSSocket* tlsSocket);
+
+                /**
+                 * @brief Changes the events the worker watches a TLSSocket for.
+                 *
+                 * @param tlsSocket pointer to the TLSSocket
+                 * @param events    combination of SocketPoller::Events
+                 */
+				void			updateSocketEvents(TLSSocket* tlsSocket, uint8_t events);
+
+                /**
+                 * @brief Forwards the new connection event of a TLSSocket to the TLSServer
+                 *
+                 * @param newTLSSocket  pointer to the TLSSocket which established a new connection.
+                 */
+				void			sendNewConnectionEvent(TLSSocket* newTLSSocket);
+
+                /**
+                 * @brief Dispatches the expiration of a timer of a TLSSocket and closes the socket if required
+                 *
+                 * @param tlsSocket             pointer to the TLSSocket
+                 * @param isApplicationTimer    true for the application timer, false for the handshake deadline or idle timeout
+                 */
+				void			socketTimerExpired(TLSSocket* tlsSocket, bool isApplicationTimer);
+
+                /**
+                 * @brief Cancels the timers of a TLSSocket
+                 */
+				void			cancelSocketTimers(TLSSocket* tlsSocket);
+
+                /**
+                 * @brief Releases the admission of the TLSSocket at the TLSAdmissionControl of the server, if not released yet
+                 *
+                 * @param tlsSocket pointer to the closed TLSSocket
+                 */
+				void			releaseAdmission(TLSSocket* tlsSocket);
+
+                /**
+                 * @brief Executes all commands posted to the event loop
+                 */
+				void			processCommands(void);
+
+                /**
+                 * @brief Takes over a socket handed over by \c addSocket
+                 */
+				void			adoptSocket(TLSSocket_sharedPtr tlsSocket);
+
+                /**
+                 * @brief Hands the TLS handshake of a TLSSocket over to the TLSHandshakePool of the server and stops watching the socket.
+                 *
+                 * The socket is watched again when the pool posts \c TLSCommand::HandshakeSucceeded.
+                 *
+                 * @param tlsSocket     pointer to the TLSSocket whose client started the handshake
+                 *
+                 * @return  true if the pool performs the handshake
+                 * @return  false if there is no handshake pool or its queue is full, the caller performs the handshake itself
+                 */
+				bool			offloadHandshake(TLSSocket* tlsSocket);
+
+                /**
+                 * @brief Writes a shared payload to the established sockets of the worker, called by the event loop for \c TLSCommand::Broadcast
+                 *
+                 * @param payload       the payload to write
+                 * @param filter        selects the sockets to write to, all established sockets if empty
+                 */
+				void			broadcast(const TLSSharedPayload &payload, const TLSSocketFilter &filter);
+
+                /**
+                 * @brief Starts draining the sockets, called by the event loop for \c TLSCommand::Drain
+                 */
+				void			startDrain(void);
+
+                /**
+                 * @brief Closes the next batch of idle sockets, or all sockets if the drain deadline expired, and stops the worker when no
+                 * socket is left.
+                 */
+				void			drainNextBatch(void);
+
+                /**
+                 * @brief The DrainTimer class schedules the batches of a drain
+                 */
+				class DrainTimer : public TimerWheel::Timer
+				{
+					public:
+
+										DrainTimer(TLSServerWorker *worker);
+
+					protected:
+
+						virtual void	timerExpired(void) override;
+
+						TLSServerWorker	*_worker;
+				};
+
+                /**
+                 * @brief Reads the arrived data of a TLSSocket and reschedules the socket if it exhausted its read budget
+                 *
+                 * @param tlsSocket     the readable TLSSocket
+                 *
+                 * @return  the result of TLSSocket::socketReadyRead, a value <= \c 0 means the socket has to be closed
+                 */
+				int				readSocket(const TLSSocket_sharedPtr &tlsSocket);
+
+                /**
+                 * @brief Rejects all further commands, called when the event loop is about to stop
+                 */
+				void			stopAcceptingCommands(void);
+
+				TLSServer				*_server;
+				bool					_isRunning = { false };
+				int						_listenDescriptor = { -1 };
+
+				SocketPoller			_poller;
+				WakeupChannel			_wakeupChannel;
+
+				/** \brief  Handshake deadlines, idle timeouts and application timers of the sockets */
+				TimerWheel				_timerWheel;
+				uint32_t				_handshakeTimeout = { 0 };
+				uint32_t				_idleTimeout = { 0 };
+
+				/** \brief  Drain state, see TLSServer::drain */
+				DrainTimer				_drainTimer;
+				bool					_isDraining = { false };
+				uint32_t				_drainDeadline = { 0 };
+				uint16_t				_drainBatchSize = { 0 };
+				uint32_t				_drainBatchInterval = { 0 };
+
+				/** \brief  Maps a socket descriptor to it's TLSSocket object */
+				TLSSocketTable			_socketTable;
+
+				/** \brief  Maximum bytes and records read from a single socket per loop iteration, see TLSServer::setReadBudget */
+				size_t					_readBudgetBytes = { 0 };
+				uint16_t				_readBudgetRecords = { 0 };
+
+				/** \brief  Sockets which exhausted their read budget and are read again in the next loop iteration */
+				std::vector<TLSSocket_sharedPtr>	_rescheduledSockets = {};
+				std::vector<TLSSocket_sharedPtr>	_pendingReadSockets = {};
+
+				/** \brief  Receive buffers shared by the sockets of this worker */
+				TLSBufferPool			_bufferPool;
+
+				/** \brief  Buffer the TLS records are decrypted to for event handlers preferring a data view, allocated on first use */
+				ByteArray				_recordBuffer = {};
+
+				/** \brief  Buffer the buffers of TLSSocket::writev are gathered in, allocated on first use */
+				ByteArray				_gatherBuffer = {};
+
+				/** \brief  Commands posted by other tasks and the task driving the loop */
+				TLSCommandQueue			_commandQueue;
+				void					*_loopTask = { nullptr };
+
+				/** \brief  Guards pushing commands against a stopping worker, it is never held while taking another mutex */
+				Mutex					_commandMutex;
+				bool					_acceptingCommands = { false };
+
+				std::vector<TLSSocket_sharedPtr>	_closingSockets = {};
+				std::vector<TLSSocket_sharedPtr>	_broadcastSockets = {};
+
+				/** \brief  Traffic counters of all sockets of this worker, see TLSServer::statistics */
+				TLSCounters				_counters;
+
+				Mutex					_mutex = { Mutex::Recursive };
+		};
+	}
+}
+
+#endif
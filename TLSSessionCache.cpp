@@ -0,0 +1,665 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "TLSSessionCache.h"
+#include "MutexLocker.h"
+#include "auxiliary.h"
+
+extern "C"
+{
+	#include <string.h>
+	#include <esp_log.h>
+	#include <esp_timer.h>
+#if defined(IDFIX_TLS_SESSION_TICKETS_OPENSSL)
+	#include "openssl/evp.h"
+	#include "openssl/hmac.h"
+	#include "openssl/rand.h"
+#endif
+#if defined(IDFIX_TLS_SESSION_CACHE_MBEDTLS) || defined(IDFIX_TLS_SESSION_TICKETS_MBEDTLS)
+	#include <mbedtls/net_sockets.h>
+#endif
+#if defined(IDFIX_TLS_SESSION_TICKETS_MBEDTLS)
+	#include <esp_idf_version.h>
+	#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+		#include <esp_random.h>
+	#else
+		#include <esp_system.h>
+	#endif
+#endif
+}
+
+namespace
+{
+	const char*				LOG_TAG				= "IDFix::TLSSessionCache";
+
+#if defined(IDFIX_TLS_SESSION_CACHE_OPENSSL)
+	// the session id context is mandatory for server side session caching, its value is arbitrary
+	const unsigned char		SESSION_ID_CONTEXT[]	= "idfix-tls";
+
+	int						contextDataIndex	= -1;
+#endif
+
+#if defined(IDFIX_TLS_SESSION_CACHE_MBEDTLS) || defined(IDFIX_TLS_SESSION_TICKETS_MBEDTLS)
+	// mirrors the head of struct ssl_pm of the OpenSSL layer of ESP-IDF (openssl/platform/ssl_pm.c), which keeps the mbedtls configuration of an SSL
+	struct PlatformSsl
+	{
+		mbedtls_net_context		fd;
+		mbedtls_net_context		clientFd;
+		mbedtls_ssl_config		config;
+	};
+
+	mbedtls_ssl_config *platformConfig(SSL *tlsPeer)
+	{
+		if ( tlsPeer == nullptr || tlsPeer->ssl_pm == nullptr )
+		{
+			return nullptr;
+		}
+
+		return &static_cast<PlatformSsl*>(tlsPeer->ssl_pm)->config;
+	}
+#endif
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+
+		TLSSessionCache::TLSSessionCache()
+		{
+#if defined(IDFIX_TLS_SESSION_CACHE_MBEDTLS)
+			mbedtls_ssl_cache_init(&_cacheContext);
+#endif
+		}
+
+		TLSSessionCache::~TLSSessionCache()
+		{
+#if defined(IDFIX_TLS_SESSION_CACHE_OPENSSL)
+			clear();
+#endif
+#if defined(IDFIX_TLS_SESSION_CACHE_MBEDTLS)
+			mbedtls_ssl_cache_free(&_cacheContext);
+#endif
+#if defined(IDFIX_TLS_SESSION_TICKETS_MBEDTLS)
+			if ( _ticketContextReady )
+			{
+				mbedtls_ssl_ticket_free(&_ticketContext);
+			}
+#endif
+		}
+
+		int64_t TLSSessionCache::now()
+		{
+			// monotonic seconds, independent from the (maybe not yet synchronized) wall clock
+			return esp_timer_get_time() / 1000000;
+		}
+
+#if defined(IDFIX_TLS_SESSION_CACHE_OPENSSL)
+
+		TLSSessionCache *TLSSessionCache::fromContext(SSL_CTX *tlsContext)
+		{
+			return static_cast<TLSSessionCache*>( SSL_CTX_get_ex_data(tlsContext, contextDataIndex) );
+		}
+
+		bool TLSSessionCache::bindContext(SSL_CTX *tlsContext)
+		{
+			if ( tlsContext == nullptr )
+			{
+				return false;
+			}
+
+			if ( contextDataIndex < 0 )
+			{
+				contextDataIndex = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+			}
+
+			return contextDataIndex >= 0 && SSL_CTX_set_ex_data(tlsContext, contextDataIndex, this);
+		}
+
+#endif
+
+		bool TLSSessionCache::setCache(SSL_CTX *tlsContext, size_t capacity, uint32_t lifetimeSeconds)
+		{
+#if defined(IDFIX_TLS_SESSION_CACHE_OPENSSL)
+			MutexLocker locker(_mutex);
+
+			if ( ! bindContext(tlsContext) )
+			{
+				ESP_LOGE(LOG_TAG, "Could not bind session cache to TLS context at file %s:%d.", __FILE__, __LINE__);
+				return false;
+			}
+
+			_capacity	= capacity;
+			_lifetime	= lifetimeSeconds;
+
+			// drop the least recently used sessions if the capacity was reduced
+			while ( _entries.size() > _capacity )
+			{
+				erase( std::prev(_entries.end()) );
+				_evictions++;
+			}
+
+			if ( capacity == 0 )
+			{
+				SSL_CTX_set_session_cache_mode(tlsContext, SSL_SESS_CACHE_OFF);
+				return true;
+			}
+
+			// the internal cache of the TLS library is disabled, all sessions are managed by this bounded LRU cache
+			SSL_CTX_set_session_cache_mode(tlsContext, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+			SSL_CTX_set_session_id_context(tlsContext, SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+			SSL_CTX_set_timeout(tlsContext, static_cast<long>(lifetimeSeconds) );
+
+			SSL_CTX_sess_set_new_cb(tlsContext, &TLSSessionCache::newSessionCallback);
+			SSL_CTX_sess_set_get_cb(tlsContext, &TLSSessionCache::getSessionCallback);
+			SSL_CTX_sess_set_remove_cb(tlsContext, &TLSSessionCache::removeSessionCallback);
+
+			return true;
+#elif defined(IDFIX_TLS_SESSION_CACHE_MBEDTLS)
+			(void) tlsContext;
+
+			MutexLocker locker(_mutex);
+
+			// SSLs created from now on pick up the new settings in attach
+			_cacheEnabled = capacity > 0;
+
+			mbedtls_ssl_cache_set_max_entries(&_cacheContext, static_cast<int>(capacity) );
+			mbedtls_ssl_cache_set_timeout(&_cacheContext, static_cast<int>(lifetimeSeconds) );
+
+			return true;
+#else
+			ESP_LOGW(LOG_TAG, "Session cache is not supported by the TLS library");
+			return capacity == 0;
+#endif
+		}
+
+		bool TLSSessionCache::setTickets(SSL_CTX *tlsContext, bool enabled, uint32_t keyRotationSeconds)
+		{
+#if defined(IDFIX_TLS_SESSION_TICKETS_OPENSSL)
+			MutexLocker locker(_mutex);
+
+			if ( ! bindContext(tlsContext) )
+			{
+				ESP_LOGE(LOG_TAG, "Could not bind session cache to TLS context at file %s:%d.", __FILE__, __LINE__);
+				return false;
+			}
+
+			if ( ! enabled )
+			{
+				_ticketsEnabled = false;
+				SSL_CTX_set_options(tlsContext, SSL_OP_NO_TICKET);
+				return true;
+			}
+
+			if ( ! createTicketKey(_currentTicketKey) )
+			{
+				return false;
+			}
+
+			_hasPreviousTicketKey	= false;
+			_ticketKeyRotation		= keyRotationSeconds > 0 ? keyRotationSeconds : 1;
+			_ticketKeyRotatesAt		= now() + _ticketKeyRotation;
+			_ticketsEnabled			= true;
+
+			SSL_CTX_clear_options(tlsContext, SSL_OP_NO_TICKET);
+			SSL_CTX_set_tlsext_ticket_key_cb(tlsContext, &TLSSessionCache::ticketKeyCallback);
+
+			return true;
+#elif defined(IDFIX_TLS_SESSION_TICKETS_MBEDTLS)
+			(void) tlsContext;
+
+			MutexLocker locker(_mutex);
+
+			if ( ! enabled )
+			{
+				_ticketsEnabled = false;
+				return true;
+			}
+
+			// mbedtls rotates the ticket keys by itself, a ticket stays valid for up to two rotation periods
+			if ( _ticketContextReady )
+			{
+				mbedtls_ssl_ticket_free(&_ticketContext);
+				_ticketContextReady = false;
+			}
+
+			mbedtls_ssl_ticket_init(&_ticketContext);
+
+			if ( mbedtls_ssl_ticket_setup(&_ticketContext, &TLSSessionCache::randomBytes, nullptr, MBEDTLS_CIPHER_AES_256_GCM, keyRotationSeconds > 0 ? keyRotationSeconds : 1) != 0 )
+			{
+				mbedtls_ssl_ticket_free(&_ticketContext);
+				ESP_LOGE(LOG_TAG, "Could not create session ticket key at file %s:%d.", __FILE__, __LINE__);
+				return false;
+			}
+
+			_ticketContextReady	= true;
+			_ticketsEnabled		= true;
+
+			return true;
+#else
+			ESP_LOGW(LOG_TAG, "Session tickets are not supported by the TLS library");
+			return ! enabled;
+#endif
+		}
+
+		void TLSSessionCache::attach(SSL *tlsPeer)
+		{
+#if defined(IDFIX_TLS_SESSION_CACHE_MBEDTLS) || defined(IDFIX_TLS_SESSION_TICKETS_MBEDTLS)
+			mbedtls_ssl_config *config = platformConfig(tlsPeer);
+
+			if ( config == nullptr )
+			{
+				return;
+			}
+
+			MutexLocker locker(_mutex);
+
+	#if defined(IDFIX_TLS_SESSION_CACHE_MBEDTLS)
+			if ( _cacheEnabled )
+			{
+				mbedtls_ssl_conf_session_cache(config, this, &TLSSessionCache::getCachedSession, &TLSSessionCache::setCachedSession);
+			}
+	#endif
+
+	#if defined(IDFIX_TLS_SESSION_TICKETS_MBEDTLS)
+			if ( _ticketsEnabled )
+			{
+				mbedtls_ssl_conf_session_tickets_cb(config, &TLSSessionCache::writeTicket, &TLSSessionCache::parseTicket, this);
+			}
+	#endif
+#else
+			// the callbacks of the SSL_CTX already apply to all of its SSLs
+			(void) tlsPeer;
+#endif
+		}
+
+		void TLSSessionCache::clear()
+		{
+			MutexLocker locker(_mutex);
+
+#if defined(IDFIX_TLS_SESSION_CACHE_OPENSSL)
+			while ( ! _entries.empty() )
+			{
+				erase( _entries.begin() );
+			}
+#elif defined(IDFIX_TLS_SESSION_CACHE_MBEDTLS)
+			int maxEntries	= _cacheContext.max_entries;
+			int timeout		= _cacheContext.timeout;
+
+			mbedtls_ssl_cache_free(&_cacheContext);
+			mbedtls_ssl_cache_init(&_cacheContext);
+			mbedtls_ssl_cache_set_max_entries(&_cacheContext, maxEntries);
+			mbedtls_ssl_cache_set_timeout(&_cacheContext, timeout);
+#endif
+		}
+
+		TLSSessionCache::Statistics TLSSessionCache::statistics()
+		{
+			Statistics statistics;
+
+			statistics.hits				= _hits;
+			statistics.misses			= _misses;
+			statistics.evictions		= _evictions;
+			statistics.expirations		= _expirations;
+			statistics.ticketsIssued	= _ticketsIssued;
+			statistics.ticketHits		= _ticketHits;
+			statistics.ticketMisses		= _ticketMisses;
+
+			statistics.entries			= 0;
+
+			_mutex.lock();
+#if defined(IDFIX_TLS_SESSION_CACHE_OPENSSL)
+				statistics.entries		= static_cast<uint32_t>( _entries.size() );
+#elif defined(IDFIX_TLS_SESSION_CACHE_MBEDTLS)
+				for ( mbedtls_ssl_cache_entry *entry = _cacheContext.chain; entry != nullptr; entry = entry->next )
+				{
+					statistics.entries++;
+				}
+#endif
+			_mutex.unlock();
+
+			return statistics;
+		}
+
+#if defined(IDFIX_TLS_SESSION_CACHE_OPENSSL)
+
+		void TLSSessionCache::insert(SSL_SESSION *session)
+		{
+			unsigned int idLength;
+			const unsigned char *id = SSL_SESSION_get_id(session, &idLength);
+			std::string key(reinterpret_cast<const char*>(id), idLength);
+
+			MutexLocker locker(_mutex);
+
+			remove(key);
+
+			if ( _capacity == 0 )
+			{
+				SSL_SESSION_free(session);
+				return;
+			}
+
+			if ( _entries.size() >= _capacity )
+			{
+				// evict the least recently used session
+				erase( std::prev(_entries.end()) );
+				_evictions++;
+			}
+
+			_entries.push_front( Entry{ key, session, now() + _lifetime } );
+			_index[key] = _entries.begin();
+		}
+
+		SSL_SESSION *TLSSessionCache::lookup(const std::string &id)
+		{
+			MutexLocker locker(_mutex);
+
+			EntryIndex::iterator it = _index.find(id);
+
+			if ( it == _index.end() )
+			{
+				_misses++;
+				return nullptr;
+			}
+
+			EntryList::iterator entry = it->second;
+
+			if ( entry->expiresAt <= now() )
+			{
+				erase(entry);
+				_expirations++;
+				_misses++;
+				return nullptr;
+			}
+
+			// mark as most recently used
+			_entries.splice(_entries.begin(), _entries, entry);
+			_hits++;
+
+			// take the reference for the caller while still locked, so a concurrent eviction cannot free the session
+			SSL_SESSION_up_ref(entry->session);
+
+			return entry->session;
+		}
+
+		void TLSSessionCache::remove(const std::string &id)
+		{
+			MutexLocker locker(_mutex);
+
+			EntryIndex::iterator it = _index.find(id);
+
+			if ( it != _index.end() )
+			{
+				erase(it->second);
+			}
+		}
+
+		void TLSSessionCache::erase(EntryList::iterator entry)
+		{
+			SSL_SESSION_free(entry->session);
+			_index.erase(entry->id);
+			_entries.erase(entry);
+		}
+
+		int TLSSessionCache::newSessionCallback(SSL *tlsPeer, SSL_SESSION *session)
+		{
+			TLSSessionCache *cache = fromContext( SSL_get_SSL_CTX(tlsPeer) );
+
+			if ( cache == nullptr )
+			{
+				return 0;
+			}
+
+			// returning 1 keeps the reference passed to the callback, it is released on eviction
+			cache->insert(session);
+			return 1;
+		}
+
+		SSL_SESSION *TLSSessionCache::getSessionCallback(SSL *tlsPeer, const unsigned char *id, int idLength, int *copy)
+		{
+			TLSSessionCache *cache = fromContext( SSL_get_SSL_CTX(tlsPeer) );
+
+			// the returned session already carries a reference for the TLS library
+			*copy = 0;
+
+			if ( cache == nullptr || idLength <= 0 )
+			{
+				return nullptr;
+			}
+
+			return cache->lookup( std::string(reinterpret_cast<const char*>(id), static_cast<size_t>(idLength) ) );
+		}
+
+		void TLSSessionCache::removeSessionCallback(SSL_CTX *tlsContext, SSL_SESSION *session)
+		{
+			TLSSessionCache *cache = fromContext(tlsContext);
+
+			if ( cache == nullptr )
+			{
+				return;
+			}
+
+			unsigned int idLength;
+			const unsigned char *id = SSL_SESSION_get_id(session, &idLength);
+			cache->remove( std::string(reinterpret_cast<const char*>(id), idLength) );
+		}
+
+	#if defined(IDFIX_TLS_SESSION_TICKETS_OPENSSL)
+
+		bool TLSSessionCache::createTicketKey(TicketKey &key)
+		{
+			if (	RAND_bytes(key.name, sizeof(key.name) ) != 1
+				||	RAND_bytes(key.aesKey, sizeof(key.aesKey) ) != 1
+				||	RAND_bytes(key.hmacKey, sizeof(key.hmacKey) ) != 1 )
+			{
+				ESP_LOGE(LOG_TAG, "Could not create session ticket key at file %s:%d.", __FILE__, __LINE__);
+				return false;
+			}
+
+			return true;
+		}
+
+		void TLSSessionCache::rotateTicketKeys(int64_t currentTime)
+		{
+			if ( currentTime < _ticketKeyRotatesAt )
+			{
+				return;
+			}
+
+			TicketKey newKey;
+			if ( ! createTicketKey(newKey) )
+			{
+				// keep the current key, we will try again with the next ticket
+				return;
+			}
+
+			_previousTicketKey		= _currentTicketKey;
+			_hasPreviousTicketKey	= true;
+			_currentTicketKey		= newKey;
+			_ticketKeyRotatesAt		= currentTime + _ticketKeyRotation;
+		}
+
+		int TLSSessionCache::ticketKeyCallback(SSL *tlsPeer, unsigned char *keyName, unsigned char *iv, EVP_CIPHER_CTX *cipherContext, HMAC_CTX *hmacContext, int encrypt)
+		{
+			TLSSessionCache *cache = fromContext( SSL_get_SSL_CTX(tlsPeer) );
+
+			if ( cache == nullptr )
+			{
+				return -1;
+			}
+
+			MutexLocker locker(cache->_mutex);
+
+			if ( ! cache->_ticketsEnabled )
+			{
+				return 0;
+			}
+
+			cache->rotateTicketKeys( now() );
+
+			if ( encrypt )
+			{
+				const TicketKey &key = cache->_currentTicketKey;
+
+				if ( RAND_bytes(iv, EVP_CIPHER_iv_length( EVP_aes_128_cbc() ) ) != 1 )
+				{
+					return -1;
+				}
+
+				memcpy(keyName, key.name, sizeof(key.name) );
+				EVP_EncryptInit_ex(cipherContext, EVP_aes_128_cbc(), nullptr, key.aesKey, iv);
+				HMAC_Init_ex(hmacContext, key.hmacKey, sizeof(key.hmacKey), EVP_sha256(), nullptr);
+
+				cache->_ticketsIssued++;
+				return 1;
+			}
+
+			const TicketKey *key = nullptr;
+			int result = 1;
+
+			if ( memcmp(keyName, cache->_currentTicketKey.name, sizeof(TicketKey::name) ) == 0 )
+			{
+				key = &cache->_currentTicketKey;
+			}
+			else if ( cache->_hasPreviousTicketKey && memcmp(keyName, cache->_previousTicketKey.name, sizeof(TicketKey::name) ) == 0 )
+			{
+				// ticket is still valid, but let the client renew it with the current key
+				key = &cache->_previousTicketKey;
+				result = 2;
+			}
+
+			if ( key == nullptr )
+			{
+				// unknown key, fall back to a full handshake
+				cache->_ticketMisses++;
+				return 0;
+			}
+
+			HMAC_Init_ex(hmacContext, key->hmacKey, sizeof(key->hmacKey), EVP_sha256(), nullptr);
+			EVP_DecryptInit_ex(cipherContext, EVP_aes_128_cbc(), nullptr, key->aesKey, iv);
+
+			cache->_ticketHits++;
+			return result;
+		}
+
+	#else
+
+		bool TLSSessionCache::createTicketKey(TicketKey &UNUSED(key))
+		{
+			return false;
+		}
+
+		void TLSSessionCache::rotateTicketKeys(int64_t UNUSED(currentTime))
+		{
+
+		}
+
+	#endif
+
+#endif
+
+#if defined(IDFIX_TLS_SESSION_CACHE_MBEDTLS)
+
+		int TLSSessionCache::getCachedSession(void *cache, mbedtls_ssl_session *session)
+		{
+			TLSSessionCache *sessionCache = static_cast<TLSSessionCache*>(cache);
+
+			MutexLocker locker(sessionCache->_mutex);
+
+			if ( mbedtls_ssl_cache_get(&sessionCache->_cacheContext, session) != 0 )
+			{
+				sessionCache->_misses++;
+				return 1;
+			}
+
+			sessionCache->_hits++;
+			return 0;
+		}
+
+		int TLSSessionCache::setCachedSession(void *cache, const mbedtls_ssl_session *session)
+		{
+			TLSSessionCache *sessionCache = static_cast<TLSSessionCache*>(cache);
+
+			MutexLocker locker(sessionCache->_mutex);
+
+			// a full cache replaces its oldest session
+			return mbedtls_ssl_cache_set(&sessionCache->_cacheContext, session);
+		}
+
+#endif
+
+#if defined(IDFIX_TLS_SESSION_TICKETS_MBEDTLS)
+
+		int TLSSessionCache::writeTicket(void *cache, const mbedtls_ssl_session *session, unsigned char *start, const unsigned char *end, size_t *length, uint32_t *lifetime)
+		{
+			TLSSessionCache *sessionCache = static_cast<TLSSessionCache*>(cache);
+
+			MutexLocker locker(sessionCache->_mutex);
+
+			if ( ! sessionCache->_ticketsEnabled )
+			{
+				// disabled after the SSL was attached, the client receives an empty ticket
+				*length = 0;
+				return 0;
+			}
+
+			int result = mbedtls_ssl_ticket_write(&sessionCache->_ticketContext, session, start, end, length, lifetime);
+
+			if ( result == 0 )
+			{
+				sessionCache->_ticketsIssued++;
+			}
+
+			return result;
+		}
+
+		int TLSSessionCache::parseTicket(void *cache, mbedtls_ssl_session *session, unsigned char *buffer, size_t length)
+		{
+			TLSSessionCache *sessionCache = static_cast<TLSSessionCache*>(cache);
+
+			MutexLocker locker(sessionCache->_mutex);
+
+			if ( ! sessionCache->_ticketsEnabled )
+			{
+				// unknown ticket, fall back to a full handshake
+				return MBEDTLS_ERR_SSL_INVALID_MAC;
+			}
+
+			int result = mbedtls_ssl_ticket_parse(&sessionCache->_ticketContext, session, buffer, length);
+
+			if ( result == 0 )
+			{
+				sessionCache->_ticketHits++;
+			}
+			else
+			{
+				sessionCache->_ticketMisses++;
+			}
+
+			return result;
+		}
+
+		int TLSSessionCache::randomBytes(void *UNUSED(context), unsigned char *buffer, size_t length)
+		{
+			esp_fill_random(buffer, length);
+			return 0;
+		}
+
+#endif
+
+	}
+}
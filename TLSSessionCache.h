@@ -0,0 +1,245 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TLSSESSIONCACHE_H
+#define TLSSESSIONCACHE_H
+
+extern "C"
+{
+	#include <stddef.h>
+	#include <stdint.h>
+	#include "openssl/ssl.h"
+}
+
+#if defined(SSL_SESS_CACHE_NO_INTERNAL)
+
+	// OpenSSL (host builds): the external session cache and the ticket key callbacks of the SSL_CTX
+	#define IDFIX_TLS_SESSION_CACHE_OPENSSL		1
+
+	#if defined(SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB)
+		#define IDFIX_TLS_SESSION_TICKETS_OPENSSL	1
+	#endif
+
+#else
+
+	// the OpenSSL layer of ESP-IDF has no session API, the session cache and the tickets of mbedtls are configured per SSL instead
+	extern "C"
+	{
+		#include <mbedtls/ssl.h>
+		#include <mbedtls/ssl_cache.h>
+		#include <mbedtls/ssl_ticket.h>
+	}
+
+	#if defined(MBEDTLS_SSL_CACHE_C)
+		#define IDFIX_TLS_SESSION_CACHE_MBEDTLS		1
+	#endif
+
+	#if defined(MBEDTLS_SSL_TICKET_C)
+		#define IDFIX_TLS_SESSION_TICKETS_MBEDTLS	1
+	#endif
+
+#endif
+
+#if defined(IDFIX_TLS_SESSION_CACHE_OPENSSL) || defined(IDFIX_TLS_SESSION_CACHE_MBEDTLS)
+	#define IDFIX_TLS_SESSION_CACHE_SUPPORTED	1
+#endif
+
+#if defined(IDFIX_TLS_SESSION_TICKETS_OPENSSL) || defined(IDFIX_TLS_SESSION_TICKETS_MBEDTLS)
+	#define IDFIX_TLS_SESSION_TICKETS_SUPPORTED	1
+#endif
+
+#include <atomic>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include "Mutex.h"
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+        /**
+         * @brief The TLSSessionCache class provides TLS session resumption for a server side SSL_CTX.
+         *
+         * It implements a bounded session cache with least recently used eviction and a configurable session lifetime, which is
+         * hooked into the TLS library by its external session cache callbacks. Optionally, stateless session tickets with rotating
+         * keys can be enabled. A reconnecting client which presents a cached session id or a valid ticket skips the asymmetric part
+         * of the handshake.
+         *
+         * The cache is thread safe, as the handshakes of several TLSServerWorkers may access it concurrently.
+         *
+         * With OpenSSL the cache is hooked into the SSL_CTX. The OpenSSL layer of ESP-IDF has no session API, there the cache wraps the
+         * session cache and the session tickets of mbedtls (\c MBEDTLS_SSL_CACHE_C and \c MBEDTLS_SSL_TICKET_C), which are hooked into
+         * the mbedtls configuration of each SSL by \c attach. mbedtls replaces the oldest session of a full cache and drops expired sessions
+         * without reporting it, so \c evictions and \c expirations stay \c 0 on ESP-IDF.
+         *
+         * \note    Both features depend on the TLS library. If it is not available, \c setCache and \c setTickets fail.
+         */
+		class TLSSessionCache
+		{
+			public:
+
+				struct Statistics
+				{
+					uint32_t	hits;				/**< resumptions by session id */
+					uint32_t	misses;				/**< session ids which were not (or no longer) cached */
+					uint32_t	evictions;			/**< sessions evicted because the cache was full */
+					uint32_t	expirations;		/**< sessions dropped because their lifetime expired */
+					uint32_t	entries;			/**< sessions currently cached */
+					uint32_t	ticketsIssued;		/**< session tickets issued */
+					uint32_t	ticketHits;			/**< resumptions by session ticket */
+					uint32_t	ticketMisses;		/**< tickets encrypted with an unknown (e.g. rotated out) key */
+				};
+
+								TLSSessionCache();
+								~TLSSessionCache();
+
+								TLSSessionCache(const TLSSessionCache&) = delete;
+
+                /**
+                 * @brief Configures the session id cache of the given context.
+                 *
+                 * @param tlsContext        the server SSL_CTX
+                 * @param capacity          the maximum number of cached sessions, \c 0 disables the cache
+                 * @param lifetimeSeconds   the time a session can be resumed after it was established
+                 *
+                 * @return  true on success
+                 * @return  false on failure or if the TLS library does not support external session caches
+                 */
+				bool			setCache(SSL_CTX *tlsContext, size_t capacity, uint32_t lifetimeSeconds);
+
+                /**
+                 * @brief Enables or disables stateless session tickets for the given context.
+                 *
+                 * The ticket key is replaced every \c keyRotationSeconds. Tickets encrypted with the previous key are still accepted
+                 * (and renewed), so a ticket stays valid for at least one and at most two rotation intervals.
+                 *
+                 * @param tlsContext            the server SSL_CTX
+                 * @param enabled               true to issue and accept session tickets
+                 * @param keyRotationSeconds    the lifetime of a ticket key
+                 *
+                 * @return  true on success
+                 * @return  false on failure or if the TLS library does not support session tickets
+                 */
+				bool			setTickets(SSL_CTX *tlsContext, bool enabled, uint32_t keyRotationSeconds);
+
+                /**
+                 * @brief Hooks the cache into a new SSL of the context. Must be called before the handshake of the SSL.
+                 *
+                 * With OpenSSL the callbacks of the SSL_CTX apply to all of its SSLs, so this only affects the mbedtls based layer of ESP-IDF.
+                 *
+                 * @param tlsPeer   the SSL of a new connection
+                 */
+				void			attach(SSL *tlsPeer);
+
+                /**
+                 * @brief Removes all cached sessions
+                 */
+				void			clear(void);
+
+                /**
+                 * @brief Returns a snapshot of the cache counters
+                 */
+				Statistics		statistics(void);
+
+			private:
+
+				static int64_t	now(void);
+
+#if defined(IDFIX_TLS_SESSION_CACHE_OPENSSL)
+
+				struct Entry
+				{
+					std::string		id;
+					SSL_SESSION		*session;
+					int64_t			expiresAt;
+				};
+
+				struct TicketKey
+				{
+					unsigned char	name[16];
+					unsigned char	aesKey[16];
+					unsigned char	hmacKey[16];
+				};
+
+				typedef std::list<Entry>											EntryList;
+				typedef std::unordered_map<std::string, EntryList::iterator>		EntryIndex;
+
+				static TLSSessionCache*	fromContext(SSL_CTX *tlsContext);
+
+				static int				newSessionCallback(SSL *tlsPeer, SSL_SESSION *session);
+				static SSL_SESSION*		getSessionCallback(SSL *tlsPeer, const unsigned char *id, int idLength, int *copy);
+				static void				removeSessionCallback(SSL_CTX *tlsContext, SSL_SESSION *session);
+
+#if defined(IDFIX_TLS_SESSION_TICKETS_OPENSSL)
+				static int				ticketKeyCallback(SSL *tlsPeer, unsigned char *keyName, unsigned char *iv, EVP_CIPHER_CTX *cipherContext, HMAC_CTX *hmacContext, int encrypt);
+#endif
+
+				bool			bindContext(SSL_CTX *tlsContext);
+				void			insert(SSL_SESSION *session);
+				SSL_SESSION*	lookup(const std::string &id);
+				void			remove(const std::string &id);
+				void			erase(EntryList::iterator entry);
+				void			rotateTicketKeys(int64_t currentTime);
+				bool			createTicketKey(TicketKey &key);
+
+				size_t				_capacity = { 0 };
+				int64_t				_lifetime = { 0 };
+				EntryList			_entries = {};
+				EntryIndex			_index = {};
+
+				int64_t				_ticketKeyRotation = { 0 };
+				int64_t				_ticketKeyRotatesAt = { 0 };
+				TicketKey			_currentTicketKey = {};
+				TicketKey			_previousTicketKey = {};
+				bool				_hasPreviousTicketKey = { false };
+
+#endif
+
+#if defined(IDFIX_TLS_SESSION_CACHE_MBEDTLS)
+				static int				getCachedSession(void *cache, mbedtls_ssl_session *session);
+				static int				setCachedSession(void *cache, const mbedtls_ssl_session *session);
+
+				mbedtls_ssl_cache_context	_cacheContext = {};
+				bool				_cacheEnabled = { false };
+#endif
+
+#if defined(IDFIX_TLS_SESSION_TICKETS_MBEDTLS)
+				static int				writeTicket(void *cache, const mbedtls_ssl_session *session, unsigned char *start, const unsigned char *end, size_t *length, uint32_t *lifetime);
+				static int				parseTicket(void *cache, mbedtls_ssl_session *session, unsigned char *buffer, size_t length);
+				static int				randomBytes(void *context, unsigned char *buffer, size_t length);
+
+				mbedtls_ssl_ticket_context	_ticketContext = {};
+				bool				_ticketContextReady = { false };
+#endif
+
+				bool				_ticketsEnabled = { false };
+
+				std::atomic<uint32_t>	_hits = { 0 };
+				std::atomic<uint32_t>	_misses = { 0 };
+				std::atomic<uint32_t>	_evictions = { 0 };
+				std::atomic<uint32_t>	_expirations = { 0 };
+				std::atomic<uint32_t>	_ticketsIssued = { 0 };
+				std::atomic<uint32_t>	_ticketHits = { 0 };
+				std::atomic<uint32_t>	_ticketMisses = { 0 };
+
+				Mutex				_mutex = { Mutex::Recursive };
+		};
+	}
+}
+
+#endif
@@ -18,19 +18,40 @@
 #include "TLSSocket.h"
 #include "auxiliary.h"
 #include "MutexLocker.h"
-#include "TLSServer.h"
+#include "TLSServerWorker.h"
+#include "ProtocolTrace.h"
 
 extern "C"
 {
 	#include <string.h>
 	#include <esp_log.h>
+	#include <esp_timer.h>
 	#include "lwip/sockets.h"
 }
 
+#include <algorithm>
+
 namespace
 {
 	const char*			LOG_TAG				= "IDFix::TLSSocket";
 	const unsigned long INITIAL_BUFFER_SIZE	= 256;
+
+	// the maximum plaintext length of a TLS record
+	const size_t		MAX_RECORD_LENGTH	= 16*1024;
+
+	const size_t		DEFAULT_LOW_WATERMARK	= 2*1024;
+	const size_t		DEFAULT_HIGH_WATERMARK	= 8*1024;
+
+	// writes are split into chunks of at most one TLS record
+	const size_t		MAX_WRITE_LENGTH		= 16*1024;
+
+	// small writes are coalesced into queued segments of this size
+	const size_t		SEGMENT_SIZE			= 1024;
+
+	uint32_t currentTimeMS()
+	{
+		return static_cast<uint32_t>( esp_timer_get_time() / 1000 );
+	}
 }
 
 namespace IDFix
@@ -38,10 +59,20 @@ namespace IDFix
 	namespace Protocols
 	{
 
-		TLSSocket::TLSSocket(int socketDescriptor, SSL *tlsPeer, TLSServer *owner)
-			: _owner(owner), _socketDescriptor(socketDescriptor), _tlsPeer(tlsPeer)
+		TLSSocket::TLSSocket(int socketDescriptor, SSL *tlsPeer, TLSServerWorker *owner)
+			: _owner(owner), _socketDescriptor(socketDescriptor), _tlsPeer(tlsPeer),
+			  _lowWatermark(DEFAULT_LOW_WATERMARK), _highWatermark(DEFAULT_HIGH_WATERMARK),
+			  _connectionTimer(this, false), _applicationTimer(this, true), _lastActivity( currentTimeMS() ),
+			  _connectedTime( currentTimeMS() )
 		{
-
+			// queued bytes are written in chunks (partial writes) and an SSL_write repeated after SSL_ERROR_WANT_WRITE
+			// may pass the same bytes from another address, as the outbound queue may reallocate its segments
+#if defined(SSL_MODE_ENABLE_PARTIAL_WRITE)
+			SSL_set_mode(_tlsPeer, SSL_MODE_ENABLE_PARTIAL_WRITE);
+#endif
+#if defined(SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER)
+			SSL_set_mode(_tlsPeer, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#endif
 		}
 
 		TLSSocket::~TLSSocket()
@@ -55,17 +86,289 @@ namespace IDFix
 			if ( _mutex.lock() )
 			{
 				_eventHandler = eventHandler;
+				_deliverDataViews = eventHandler != nullptr && eventHandler->prefersDataView();
 				_mutex.unlock();
 			}
 		}
 
 		int TLSSocket::write(const char *bytes, size_t len)
 		{
-			MutexLocker locker(_mutex);
+			MutexLocker	locker(_mutex);
+
+			if ( _owner == nullptr || _owner->isLoopTask() )
+			{
+				// the events of updateBackpressure are called without the socket mutex held, so a handler may write to other sockets
+				locker.unlock();
+
+				int result = writeBytes(bytes, len, false);
+				updateBackpressure();
+
+				return result;
+			}
+
+			IDFIX_HOT_LOGV(LOG_TAG, "TLSSocket::write (posted) - %.*s", static_cast<int>(len), bytes);
+
+			struct iovec buffer = { const_cast<char*>(bytes), len };
+
+			locker.unlock();
+			return postWrite(&buffer, 1, len);
+		}
+
+		int TLSSocket::writev(const struct iovec *buffers, int count)
+		{
+			if ( buffers == nullptr || count <= 0 )
+			{
+				return -1;
+			}
+
+			size_t len = 0;
+
+			for ( int index = 0; index < count; index++ )
+			{
+				len += buffers[index].iov_len;
+			}
+
+			if ( len == 0 )
+			{
+				// nothing to write, so neither a command is posted nor the backpressure state is touched
+				return 0;
+			}
+
+			MutexLocker	locker(_mutex);
+
+			if ( _owner == nullptr || _owner->isLoopTask() )
+			{
+				locker.unlock();
+
+				int result = writeGathered(buffers, count, len);
+				updateBackpressure();
+
+				return result;
+			}
+
+			locker.unlock();
+			return postWrite(buffers, count, len);
+		}
+
+		int TLSSocket::write(const TLSSharedPayload &payload)
+		{
+			MutexLocker	locker(_mutex);
+
+			if ( payload == nullptr || payload->empty() )
+			{
+				return 0;
+			}
+
+			if ( _owner == nullptr || _owner->isLoopTask() )
+			{
+				locker.unlock();
+
+				int result = writeBytes(payload->data(), payload->size(), false, payload);
+				updateBackpressure();
+
+				return result;
+			}
+
+			struct iovec buffer = { const_cast<char*>( payload->data() ), payload->size() };
+
+			locker.unlock();
+			return postWrite(&buffer, 1, payload->size(), payload);
+		}
+
+		int TLSSocket::postWrite(const struct iovec *buffers, int count, size_t len, const TLSSharedPayload &sharedPayload)
+		{
+			MutexLocker	locker(_mutex);
+
+			if ( _socketDescriptor == -1 || ! _sslAccepted || _owner == nullptr )
+			{
+				return -1;
+			}
+
+			if ( _backpressure )
+			{
+				// the caller has to wait for the socketWritable event
+				return 0;
+			}
+
+			// hand the bytes over to the worker, so only the worker touches the TLS connection
+			TLSSocket_sharedPtr self = weak_from_this().lock();
+
+			if ( self == nullptr )
+			{
+				return -1;
+			}
+
+			// a shared payload is posted as a reference, other bytes are copied
+			bool isPosted = sharedPayload != nullptr ? _owner->post(TLSCommand::WriteSocket, self, sharedPayload)
+													 : _owner->post(TLSCommand::WriteSocket, self, buffers, count);
+
+			if ( ! isPosted )
+			{
+				return -1;
+			}
+
+			_postedBytes += len;
+
+			if ( _outboundBytes + _postedBytes > _highWatermark )
+			{
+				// the event is sent by the worker once it wrote the posted bytes, so the event handler is only called by the worker
+				_backpressure = true;
+				_backpressureEventPending = true;
+			}
+
+			return static_cast<int>(len);
+		}
+
+		void TLSSocket::writePosted(const char *bytes, size_t len, const TLSSharedPayload &sharedPayload)
+		{
+			_mutex.lock();
+				_postedBytes -= std::min(_postedBytes, len);
+			_mutex.unlock();
+
+			// the bytes were already accepted by write, so they are written even if the socket entered the backpressure state meanwhile
+			// a failed write still has to send the events the posted bytes may have caused
+			writeBytes(bytes, len, true, sharedPayload);
+			updateBackpressure();
+		}
+
+		int TLSSocket::writeBytes(const char *bytes, size_t len, bool isAccepted, const TLSSharedPayload &sharedPayload)
+		{
+			MutexLocker	locker(_mutex);
+			size_t		bytesWritten = 0;
+
+			IDFIX_HOT_LOGV(LOG_TAG, "TLSSocket::write - %.*s", static_cast<int>(len), bytes);
+
+			if ( _socketDescriptor == -1 || ! _sslAccepted )
+			{
+				return -1;
+			}
+
+			if ( _backpressure && ! isAccepted )
+			{
+				// the caller has to wait for the socketWritable event
+				return 0;
+			}
+
+			_lastActivity.store( currentTimeMS(), std::memory_order_relaxed );
+
+			if ( _outboundQueue.empty() )
+			{
+				// nothing is queued, so try to write directly as long as the peer's TCP window allows
+				while ( bytesWritten < len )
+				{
+					int length = static_cast<int>( nextRecordLength(len - bytesWritten) );
+					int result = SSL_write(_tlsPeer, bytes + bytesWritten, length);
+					count(TLSCounters::WriteCalls);
+
+					if ( result > 0 )
+					{
+						bytesWritten += static_cast<size_t>(result);
+						recordWritten( static_cast<size_t>(result) );
+						continue;
+					}
+
+					int error = SSL_get_error(_tlsPeer, result);
+
+					if ( error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ )
+					{
+						// the TLS library requires to repeat SSL_write with the same arguments,
+						// the remaining bytes are queued below and the first chunk is repeated when flushing the queue
+						_retryWriteLength = length;
+						break;
+					}
+
+					ESP_LOGW(LOG_TAG, "SSL_write() failed at file %s:%d.", __FILE__, __LINE__);
+					return -1;
+				}
+			}
+
+			if ( bytesWritten < len )
+			{
+				if ( sharedPayload != nullptr )
+				{
+					enqueueShared(sharedPayload, bytesWritten);
+				}
+				else
+				{
+					enqueue(bytes + bytesWritten, len - bytesWritten);
+				}
+
+				// let the worker flush the queue as soon as the socket is writable
+				setWatchedEvents(_watchedEvents | SocketPoller::Writable);
+
+				if ( ! _backpressure && _outboundBytes + _postedBytes > _highWatermark )
+				{
+					_backpressure = true;
+					_backpressureEventPending = true;
+				}
+			}
+
+			return static_cast<int>(len);
+		}
+
+		int TLSSocket::writeGathered(const struct iovec *buffers, int count, size_t len)
+		{
+			if ( buffers == nullptr || count <= 0 )
+			{
+				return -1;
+			}
+
+			if ( len == 0 )
+			{
+				// an empty message is a successful no-op, even in the backpressure state
+				return 0;
+			}
+
+			MutexLocker	locker(_mutex);
+
+			if ( count == 1 )
+			{
+				// nothing to gather
+				return writeBytes(static_cast<const char*>(buffers[0].iov_base), len, false);
+			}
+
+			// the TLS library copies the plaintext into its record buffer anyway, so gathering the buffers into a staging buffer
+			// costs a copy of the message, but saves the header and MAC of a TLS record per buffer
+			ByteArray	localBuffer;
+			ByteArray	&gatherBuffer = _owner != nullptr ? _owner->_gatherBuffer : localBuffer;
+			int			index = 0;
+			size_t		offset = 0;
+			bool		isAccepted = false;
+
+			gatherBuffer.reserve( std::min(len, MAX_WRITE_LENGTH) );
 
-			ESP_LOGV(LOG_TAG, "TLSSocket::write - %.*s", static_cast<int>(len), bytes);
+			while ( index < count )
+			{
+				gatherBuffer.clear();
+
+				// fill the staging buffer up to the length of one TLS record
+				while ( index < count && gatherBuffer.size() < MAX_WRITE_LENGTH )
+				{
+					const char	*bytes = static_cast<const char*>(buffers[index].iov_base);
+					size_t		length = std::min(buffers[index].iov_len - offset, MAX_WRITE_LENGTH - gatherBuffer.size() );
+
+					gatherBuffer.insert(gatherBuffer.end(), bytes + offset, bytes + offset + length);
+					offset += length;
+
+					if ( offset == buffers[index].iov_len )
+					{
+						index++;
+						offset = 0;
+					}
+				}
 
-			return SSL_write(_tlsPeer, bytes, static_cast<int>(len) );
+				// once the first record was accepted, the rest of the message must not be rejected because of backpressure
+				int result = writeBytes(gatherBuffer.data(), gatherBuffer.size(), isAccepted);
+
+				if ( result <= 0 )
+				{
+					return result;
+				}
+
+				isAccepted = true;
+			}
+
+			return static_cast<int>(len);
 		}
 
 		int TLSSocket::write(const char *string)
@@ -73,12 +376,86 @@ namespace IDFix
 			return write(string, strlen(string) );
 		}
 
+		bool TLSSocket::startTimer(uint32_t timeoutMS)
+		{
+			MutexLocker locker(_mutex);
+
+			if ( _socketDescriptor == -1 || _owner == nullptr )
+			{
+				return false;
+			}
+
+			_owner->_timerWheel.arm(_applicationTimer, timeoutMS);
+			return true;
+		}
+
+		void TLSSocket::stopTimer()
+		{
+			MutexLocker locker(_mutex);
+
+			if ( _owner != nullptr )
+			{
+				_owner->_timerWheel.cancel(_applicationTimer);
+			}
+		}
+
+		void TLSSocket::setWriteBufferWatermarks(size_t lowWatermark, size_t highWatermark)
+		{
+			MutexLocker locker(_mutex);
+
+			_highWatermark = highWatermark;
+			_lowWatermark = std::min(lowWatermark, highWatermark);
+		}
+
+		void TLSSocket::setRecordSizing(size_t smallRecordLength, size_t boostThreshold, uint32_t idleResetMS)
+		{
+			MutexLocker locker(_mutex);
+
+			_smallRecordLength = std::min(smallRecordLength, MAX_WRITE_LENGTH);
+			_recordBoostThreshold = boostThreshold;
+			_recordIdleReset = idleResetMS;
+			_burstBytes = 0;
+		}
+
+		TLSCounters::Statistics TLSSocket::statistics()
+		{
+			return _counters.statistics();
+		}
+
+		size_t TLSSocket::bytesToWrite()
+		{
+			MutexLocker locker(_mutex);
+
+			return _outboundBytes;
+		}
+
 		void TLSSocket::close()
 		{
 			_mutex.lock();
 
 				bool disconnectedNow = false;
 
+				if ( _socketDescriptor != -1 && _owner != nullptr && ! _owner->isLoopTask() )
+				{
+					// only the worker owning the socket closes it, so the socket is never closed while the worker is dispatching its events
+					// there is no shared pointer left if the socket is being destructed, but then it is no longer owned by a worker anyway
+					TLSSocket_sharedPtr self = weak_from_this().lock();
+
+					if ( self != nullptr && _owner->post(TLSCommand::CloseSocket, self) )
+					{
+						_mutex.unlock();
+						return;
+					}
+				}
+
+				if ( _handshakeOffloaded )
+				{
+					// a handshake task still uses the TLS connection, the socket is closed as soon as the handshake task finished
+					_closePending = true;
+					_mutex.unlock();
+					return;
+				}
+
 				if ( _socketDescriptor != -1 )
 				{
 					if ( _owner != nullptr )
@@ -90,10 +467,22 @@ namespace IDFix
 
 					if ( _sslAccepted )
 					{
+						// write what the peer's TCP window still accepts, the rest of the outbound queue is discarded
+						flushOutboundQueue();
+
 						// shut down only if connection was an accepted SSL connection
 						SSL_shutdown(_tlsPeer);
 					}
 
+					uncount(TLSCounters::QueuedBytes, static_cast<uint32_t>(_outboundBytes) );
+
+					_outboundQueue.clear();
+					_outboundOffset = 0;
+					_outboundBytes = 0;
+					_retryWriteLength = 0;
+
+					IDFIX_TRACE(TLSSocketClosed, _socketDescriptor, 0);
+
 					shutdown(_socketDescriptor, SHUT_WR);
 					::close(_socketDescriptor);
 					_socketDescriptor = -1;
@@ -110,106 +499,300 @@ namespace IDFix
 			}
 		}
 
+		int TLSSocket::socketReadyWrite()
+		{
+			MutexLocker locker(_mutex);
+
+			if ( ! _sslAccepted )
+			{
+				// the handshake is waiting for the socket to become writable
+				return acceptSSL();
+			}
+
+			int result = flushOutboundQueue();
+
+			locker.unlock();
+
+			if ( result > 0 )
+			{
+				updateBackpressure();
+			}
+
+			return result;
+		}
+
+		void TLSSocket::updateBackpressure()
+		{
+			bool sendBackpressureEvent;
+			bool sendWritableEvent = false;
+
+			_mutex.lock();
+
+				sendBackpressureEvent = _backpressureEventPending;
+				_backpressureEventPending = false;
+
+				// bytes posted by other tasks are not yet written, so they count against the low watermark as well
+				if ( _backpressure && _outboundBytes + _postedBytes <= _lowWatermark )
+				{
+					_backpressure = false;
+					sendWritableEvent = true;
+				}
+
+			_mutex.unlock();
+
+			if ( _eventHandler == nullptr )
+			{
+				return;
+			}
+
+			if ( sendBackpressureEvent )
+			{
+				_eventHandler->socketBackpressure(*this);
+			}
+
+			if ( sendWritableEvent )
+			{
+				_eventHandler->socketWritable(*this);
+			}
+		}
+
 		int TLSSocket::socketReadyRead()
 		{
-			ByteArray		bytes(INITIAL_BUFFER_SIZE);
+			TLSServerWorker	*owner;
+			bool			deliverDataViews;
+
+			_mutex.lock();
+
+				if ( _socketDescriptor == -1 || _owner == nullptr )
+				{
+					// the socket was closed while the worker dispatched the events
+					_mutex.unlock();
+					return 0;
+				}
+
+				if ( ! _sslAccepted )
+				{
+					if ( _owner->offloadHandshake(this) )
+					{
+						// the client started the handshake, a task of the handshake pool continues it
+						_mutex.unlock();
+						return 1;
+					}
+
+					// SSL connection was not yet accepted (as we waited for any incomming data)
+					int result = acceptSSL();
+					_mutex.unlock();
+					return result;
+				}
+
+				_lastActivity.store( currentTimeMS(), std::memory_order_relaxed );
+
+				owner = _owner;
+				deliverDataViews = _deliverDataViews;
+
+			_mutex.unlock();
+
+			// drain the socket until the TLS library needs more data from the socket, but limit the records and bytes
+			// read per loop iteration, so a single busy socket cannot starve the other sockets of the worker
+			size_t		bytesRead = 0;
+			uint16_t	recordsRead = 0;
+
+			while ( true )
+			{
+				if ( recordsRead >= owner->_readBudgetRecords || bytesRead >= owner->_readBudgetBytes )
+				{
+					// there may be more data, the worker calls this method again in its next iteration
+					return READ_BUDGET_EXHAUSTED;
+				}
+
+				size_t	recordLength = 0;
+				int		result = deliverDataViews ? readDataView(owner->_recordBuffer, recordLength) : readBytes(owner->_bufferPool, recordLength);
+
+				if ( result <= 0 )
+				{
+					return result;
+				}
+
+				if ( recordLength == 0 )
+				{
+					// the socket is drained
+					return 1;
+				}
+
+				bytesRead += recordLength;
+				recordsRead++;
+			}
+		}
+
+		int TLSSocket::readBytes(TLSBufferPool &bufferPool, size_t &recordLength)
+		{
 			int				result = 0;
 			unsigned long	bytesRead = 0;
 			unsigned long	pendingBytes;
-			MutexLocker		locker(_mutex);
+			ByteArray		bytes;
 
-			if ( ! _sslAccepted )
+			_mutex.lock();
+
+			if ( _socketDescriptor == -1 )
 			{
-				// SSL connection was not yet accepted (as we waited for any incomming data)
-				return acceptSSL();
+				// the socket was closed by the event handler
+				_mutex.unlock();
+				return 0;
 			}
 
+			// the receive buffer is taken from the pool of the worker, which calls this method
+			// so receiving a record does not allocate in the steady state
+
 			// SSL_pending(_tlsPeer) is only valid AFTER the first call on SSL_read
 			// so we don't know the final buffer size in before
-			// bytes is initialized with INITIAL_BUFFER_SIZE so bytes.capacity should => bytes.size
+			// we reserve +1 byte, while keeping the actual size() exactly at number of bytes read
+			// we 0 terminate the data afterwards in the additional reserved byte
+			// on binary transfered data, size() will reflect the exact number of transfered bytes - ignoring the 0 termination
+			// however, adding a "transparent" zero termination, allows using bytes.data() for string functions ( strcat, strlen )
+			bufferPool.acquire(bytes, INITIAL_BUFFER_SIZE + 1);
+			bytes.resize(INITIAL_BUFFER_SIZE);
 
 			do
 			{
 				result = SSL_read(_tlsPeer, bytes.data() + bytesRead, static_cast<int>(bytes.size() - bytesRead) );
-				ESP_LOGI(LOG_TAG, "SSL_read result = %d ", result);
-				ESP_LOGI(LOG_TAG, "SSL_pending(_tlsPeer) = %d ", SSL_pending(_tlsPeer));
+				count(TLSCounters::ReadCalls);
+				IDFIX_HOT_LOGV(LOG_TAG, "SSL_read result = %d ", result);
 
 				if ( result <= 0 )
 				{
-					// result < 0 means socket was closed
-					// check if any bytes was read up to this point, send event and return
-					if ( bytesRead != 0 && _eventHandler != nullptr )
+					int error = SSL_get_error(_tlsPeer, result);
+
+					if ( error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE )
 					{
-						bytes.reserve( bytesRead + 1 );
-						bytes.resize(bytesRead);
+						// the socket is non-blocking and all received records were read, this is not an error
+						// keep the connection open and continue as soon as more data arrives
+						result = 1;
+					}
 
-						addNullTermination(bytes, bytesRead);
+					break;
+				}
 
-						locker.unlock();
-						_eventHandler->socketBytesReceived(*this, bytes);
-					}
+				pendingBytes = static_cast<unsigned long>( SSL_pending(_tlsPeer) );
+				bytesRead += static_cast<unsigned long>( result );
 
-					return result;
+				if ( pendingBytes > 0 )
+				{
+					// if the record is larger than the buffer, switch to a buffer of a larger size class
+					bytes.resize(bytesRead);
+					bufferPool.grow(bytes, bytesRead + pendingBytes + 1);
+					bytes.resize(bytesRead + pendingBytes);
 				}
-				else
+			}
+			while( pendingBytes > 0 );
+
+			TLSSocketEventHandler *eventHandler = _eventHandler;
+
+			_mutex.unlock();
+
+			// result <= 0 means socket was closed
+			// check if any bytes was read up to this point and send the event
+			if ( bytesRead != 0 )
+			{
+				bytes.resize(bytesRead);
+				addNullTermination(bytes, bytesRead);
+
+				IDFIX_HOT_LOGD(LOG_TAG, "number of bytes read = %lu ", bytesRead);
+				IDFIX_HOT_LOGV(LOG_TAG, "TLSSocket::read - %.*s", static_cast<int>(bytesRead), bytes.data());
+
+				count(TLSCounters::BytesReceived, static_cast<uint32_t>(bytesRead) );
+				count(TLSCounters::RecordsReceived);
+				IDFIX_TRACE(TLSRecordReceived, _socketDescriptor, bytesRead);
+
+				if ( eventHandler != nullptr )
 				{
-					pendingBytes = static_cast<unsigned long>( SSL_pending(_tlsPeer) );
-					bytesRead += static_cast<unsigned long>( result );
+					int64_t callbackStart = esp_timer_get_time();
+					eventHandler->socketBytesReceived(*this, bytes);
+					countCallback(callbackStart);
+				}
+			}
 
-					if ( pendingBytes > 0 )
-					{
-						// we reserve +1 byte, while keeping the actual size() exactly at number of bytes read
-						// we 0 terminate the data afterwards in the additional reserved byte
-						// on binary transfered data, size() will reflect the exact number of transfered bytes - ignoring the 0 termination
-						// however, adding a "transparent" zero termination, allows using bytes.data() for string functions ( strcat, strlen )
-						bytes.reserve(bytesRead + pendingBytes + 1);
-						bytes.resize(bytesRead + pendingBytes);
-					}
-					else
+			// recycle the buffer, unless the event handler took it
+			bufferPool.release(bytes);
+
+			recordLength = bytesRead;
+			return result;
+		}
+
+		int TLSSocket::readDataView(ByteArray &recordBuffer, size_t &recordLength)
+		{
+			if ( recordBuffer.size() < MAX_RECORD_LENGTH )
+			{
+				// only allocated once per worker
+				recordBuffer.resize(MAX_RECORD_LENGTH);
+			}
+
+			_mutex.lock();
+
+				if ( _socketDescriptor == -1 )
+				{
+					// the socket was closed by the event handler
+					_mutex.unlock();
+					return 0;
+				}
+
+				// the buffer holds a full record, so a single read returns the whole (remaining) record
+				int result = SSL_read(_tlsPeer, recordBuffer.data(), static_cast<int>( recordBuffer.size() ) );
+				count(TLSCounters::ReadCalls);
+				IDFIX_HOT_LOGV(LOG_TAG, "SSL_read result = %d ", result);
+
+				if ( result <= 0 )
+				{
+					int error = SSL_get_error(_tlsPeer, result);
+
+					_mutex.unlock();
+
+					if ( error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE )
 					{
-						bytes.reserve( bytesRead + 1 );
-						bytes.resize(bytesRead);
-
-						// TODO: does it make sense to shrink the array?
-						// not sure if one of the two possibilities prevent/benefit memory fragmentation
-						// bytes.shrink_to_fit();
-
-						// as a first approach, shrink the array if it wastes more than 200 bytes (caused by the initial buffer size)
-						if ( (bytes.capacity() - bytes.size() ) > 200 )
-						{
-							// reserving +1 byte before shrinking for 0 termination
-							bytes.resize( bytesRead + 1 );
-							bytes.shrink_to_fit();
-
-							// keeping the array exact the size of bytes read
-							bytes.resize( bytesRead );
-						}
+						// the socket is non-blocking and all received records were read, this is not an error
+						return 1;
 					}
 
+					// result <= 0 means socket was closed
+					return result;
 				}
 
-			}
-			while( pendingBytes > 0 );
-
-			addNullTermination(bytes, bytesRead);
+				TLSSocketEventHandler *eventHandler = _eventHandler;
 
-			ESP_LOGD(LOG_TAG, "number of bytes read = %lu ", bytesRead);
-			ESP_LOGV(LOG_TAG, "TLSSocket::read - %.*s", static_cast<int>(bytesRead), bytes.data());
+				count(TLSCounters::BytesReceived, static_cast<uint32_t>(result) );
+				count(TLSCounters::RecordsReceived);
+				IDFIX_TRACE(TLSRecordReceived, _socketDescriptor, result);
 
-			locker.unlock();
+			_mutex.unlock();
 
-			if ( _eventHandler )
+			if ( eventHandler != nullptr )
 			{
-				_eventHandler->socketBytesReceived(*this, bytes);
+				int64_t callbackStart = esp_timer_get_time();
+				eventHandler->socketDataReceived(*this, recordBuffer.data(), static_cast<size_t>(result) );
+				countCallback(callbackStart);
 			}
 
-			return result;
+			recordLength = static_cast<size_t>(result);
+			return 1;
 		}
 
 		int TLSSocket::acceptSSL()
 		{
-			if ( ! SSL_accept(_tlsPeer) )
+			int result = SSL_accept(_tlsPeer);
+
+			if ( result <= 0 )
 			{
+				int error = SSL_get_error(_tlsPeer, result);
+
+				if ( error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE )
+				{
+					// the handshake needs more data from the client or the client's TCP window is full
+					// watch the socket for the required event and resume the handshake afterwards
+					setWatchedEvents( error == SSL_ERROR_WANT_READ ? SocketPoller::Readable : SocketPoller::Writable );
+
+					// signals the server that the handshake is still in progress
+					return 1;
+				}
+
 				ESP_LOGE(LOG_TAG, "SSL_accept() failed at file %s:%d.", __FILE__, __LINE__);
 
 				// disable event handler since this was not a fully established connection
@@ -221,19 +804,331 @@ namespace IDFix
 			}
 			else
 			{
-				_sslAccepted = true;
+				connectionEstablished();
 
-				if ( _owner != nullptr )
+				// signals the server that connection is good
+				return 1;
+			}
+		}
+
+		void TLSSocket::connectionEstablished()
+		{
+			_sslAccepted = true;
+
+			uint32_t handshakeTime = currentTimeMS() - _connectedTime;
+
+			count(TLSCounters::Handshakes);
+			count(TLSCounters::HandshakeTimeMS, handshakeTime);
+			IDFIX_TRACE(TLSHandshakeCompleted, _socketDescriptor, handshakeTime);
+
+			if ( _owner != nullptr )
+			{
+				// the handshake deadline is replaced by the idle timeout
+				_lastActivity.store( currentTimeMS(), std::memory_order_relaxed );
+
+				if ( _idleTimeout > 0 )
+				{
+					_owner->_timerWheel.arm(_connectionTimer, _idleTimeout);
+				}
+				else
 				{
-					// as the tls connection now is fully established, send the new connection event (through the server)
-					_owner->sendNewConnectionEvent(this);
+					_owner->_timerWheel.cancel(_connectionTimer);
 				}
+			}
 
-				// signals the server that connection is good
-				return 1;
+			// established connections are only watched for incomming data (and for writability while bytes are queued)
+			setWatchedEvents(SocketPoller::Readable);
+
+			if ( _owner != nullptr )
+			{
+				// as the tls connection now is fully established, send the new connection event (through the server)
+				_owner->sendNewConnectionEvent(this);
+			}
+		}
+
+		void TLSSocket::offloadedHandshakeFinished(bool succeeded)
+		{
+			_mutex.lock();
+
+				if ( _owner != nullptr && ! _closePending )
+				{
+					TLSSocket_sharedPtr self = weak_from_this().lock();
+
+					if ( self != nullptr && _owner->post(succeeded ? TLSCommand::HandshakeSucceeded : TLSCommand::HandshakeFailed, self) )
+					{
+						_mutex.unlock();
+						return;
+					}
+				}
+
+				// the socket was closed meanwhile or the worker is gone, the socket is closed without any events
+				_handshakeOffloaded = false;
+				_eventHandler = nullptr;
+
+			_mutex.unlock();
+
+			close();
+		}
+
+		void TLSSocket::offloadedHandshakeCompleted(bool succeeded)
+		{
+			_mutex.lock();
+
+				_handshakeOffloaded = false;
+
+				if ( ! succeeded || _closePending || _socketDescriptor == -1 || _owner == nullptr )
+				{
+					// do not send any events for a connection which was never established
+					_eventHandler = nullptr;
+					_mutex.unlock();
+
+					close();
+					return;
+				}
+
+				// the worker stopped watching the socket while the handshake was offloaded
+				_owner->_poller.addDescriptor(_socketDescriptor, SocketPoller::Readable);
+				_watchedEvents = SocketPoller::Readable;
+
+				connectionEstablished();
+
+			_mutex.unlock();
+		}
+
+		int TLSSocket::connectionTimerExpired()
+		{
+			MutexLocker locker(_mutex);
+
+			if ( _socketDescriptor == -1 || _owner == nullptr )
+			{
+				return 0;
+			}
+
+			if ( ! _sslAccepted )
+			{
+				ESP_LOGW(LOG_TAG, "TLS handshake timed out (socket: %d)", _socketDescriptor);
+
+				// as for a failed handshake, do not send any events for a connection which was never established
+				_eventHandler = nullptr;
+				return 0;
+			}
+
+			uint32_t idleTime = currentTimeMS() - _lastActivity.load(std::memory_order_relaxed);
+
+			if ( idleTime >= _idleTimeout )
+			{
+				ESP_LOGI(LOG_TAG, "Connection idle timeout (socket: %d)", _socketDescriptor);
+				return 0;
+			}
+
+			// there was some activity since the timer was armed, wait for the rest of the timeout
+			_owner->_timerWheel.arm(_connectionTimer, _idleTimeout - idleTime);
+			return 1;
+		}
+
+		int TLSSocket::applicationTimerExpired()
+		{
+			TLSSocketEventHandler *eventHandler;
+
+			_mutex.lock();
+				eventHandler = _eventHandler;
+			_mutex.unlock();
+
+			if ( eventHandler != nullptr )
+			{
+				eventHandler->socketTimerExpired(*this);
+			}
+
+			return 1;
+		}
+
+		TLSSocket::SocketTimer::SocketTimer(TLSSocket *tlsSocket, bool isApplicationTimer)
+			: _tlsSocket(tlsSocket), _isApplicationTimer(isApplicationTimer)
+		{
+
+		}
+
+		void TLSSocket::SocketTimer::timerExpired()
+		{
+			// the timers are cancelled before the worker releases the socket, so the owner is valid
+			_tlsSocket->_owner->socketTimerExpired(_tlsSocket, _isApplicationTimer);
+		}
+
+		void TLSSocket::setWatchedEvents(uint8_t events)
+		{
+			if ( events != _watchedEvents && _owner != nullptr )
+			{
+				_owner->updateSocketEvents(this, events);
+			}
+
+			_watchedEvents = events;
+		}
+
+		int TLSSocket::flushOutboundQueue()
+		{
+			while ( ! _outboundQueue.empty() )
+			{
+				OutboundSegment &segment = _outboundQueue.front();
+
+				// a write which has to be repeated is repeated with exactly the same length
+				int length = _retryWriteLength;
+
+				if ( length == 0 )
+				{
+					length = static_cast<int>( nextRecordLength(segment.size() - _outboundOffset) );
+				}
+
+				int result = SSL_write(_tlsPeer, segment.data() + _outboundOffset, length);
+				count(TLSCounters::WriteCalls);
+
+				if ( result <= 0 )
+				{
+					int error = SSL_get_error(_tlsPeer, result);
+
+					if ( error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ )
+					{
+						// the peer's TCP window is full, continue when the socket becomes writable again
+						_retryWriteLength = length;
+						return 1;
+					}
+
+					ESP_LOGW(LOG_TAG, "SSL_write() failed at file %s:%d.", __FILE__, __LINE__);
+					return -1;
+				}
+
+				_retryWriteLength = 0;
+				recordWritten( static_cast<size_t>(result) );
+				_outboundOffset += static_cast<size_t>(result);
+				_outboundBytes -= static_cast<size_t>(result);
+				uncount(TLSCounters::QueuedBytes, static_cast<uint32_t>(result) );
+
+				if ( _outboundOffset >= segment.size() )
+				{
+					_outboundQueue.pop_front();
+					_outboundOffset = 0;
+				}
+			}
+
+			// the queue is empty, stop watching the socket for writability
+			setWatchedEvents(SocketPoller::Readable);
+
+			return 1;
+		}
+
+		size_t TLSSocket::nextRecordLength(size_t len)
+		{
+			if ( _smallRecordLength == 0 )
+			{
+				return std::min(len, MAX_WRITE_LENGTH);
+			}
+
+			if ( _recordIdleReset > 0 && currentTimeMS() - _lastWriteTime >= _recordIdleReset )
+			{
+				// after a pause the congestion window of the connection may have shrunk, start over with small records
+				_burstBytes = 0;
+			}
+
+			if ( _burstBytes < _recordBoostThreshold )
+			{
+				return std::min(len, _smallRecordLength);
+			}
+
+			return std::min(len, MAX_WRITE_LENGTH);
+		}
+
+		void TLSSocket::recordWritten(size_t len)
+		{
+			count(TLSCounters::BytesSent, static_cast<uint32_t>(len) );
+			count(TLSCounters::RecordsSent);
+			IDFIX_TRACE(TLSRecordSent, _socketDescriptor, len);
+
+			if ( _smallRecordLength == 0 )
+			{
+				return;
+			}
+
+			_burstBytes = std::min(_burstBytes + len, _recordBoostThreshold);
+			_lastWriteTime = currentTimeMS();
+		}
+
+		void TLSSocket::count(TLSCounters::Counter counter, uint32_t value)
+		{
+			_counters.add(counter, value);
+
+			if ( _owner != nullptr )
+			{
+				_owner->_counters.add(counter, value);
+			}
+		}
+
+		void TLSSocket::uncount(TLSCounters::Counter counter, uint32_t value)
+		{
+			_counters.subtract(counter, value);
+
+			if ( _owner != nullptr )
+			{
+				_owner->_counters.subtract(counter, value);
 			}
 		}
 
+		void TLSSocket::countCallback(int64_t callbackStart)
+		{
+			count(TLSCounters::Callbacks);
+			count(TLSCounters::CallbackTimeUS, static_cast<uint32_t>( esp_timer_get_time() - callbackStart ) );
+		}
+
+		bool TLSSocket::hasPendingWrites()
+		{
+			MutexLocker locker(_mutex);
+
+			return ! _outboundQueue.empty() || _postedBytes > 0;
+		}
+
+		void TLSSocket::enqueue(const char *bytes, size_t len)
+		{
+			_outboundBytes += len;
+			count(TLSCounters::QueuedBytes, static_cast<uint32_t>(len) );
+			IDFIX_TRACE(TLSBytesQueued, _socketDescriptor, _outboundBytes);
+
+			if ( ! _outboundQueue.empty() )
+			{
+				OutboundSegment &lastSegment = _outboundQueue.back();
+
+				// the first segment must not change while an SSL_write on it has to be repeated
+				bool isRetrying = _outboundQueue.size() == 1 && _retryWriteLength > 0;
+
+				if ( ! isRetrying && lastSegment.sharedBytes == nullptr && lastSegment.bytes.size() + len <= SEGMENT_SIZE )
+				{
+					lastSegment.bytes.insert(lastSegment.bytes.end(), bytes, bytes + len);
+					return;
+				}
+			}
+
+			_outboundQueue.emplace_back();
+
+			ByteArray &segment = _outboundQueue.back().bytes;
+			segment.reserve( std::max(len, SEGMENT_SIZE) );
+			segment.insert(segment.end(), bytes, bytes + len);
+		}
+
+		void TLSSocket::enqueueShared(const TLSSharedPayload &payload, size_t offset)
+		{
+			size_t len = payload->size() - offset;
+
+			_outboundBytes += len;
+			count(TLSCounters::QueuedBytes, static_cast<uint32_t>(len) );
+			IDFIX_TRACE(TLSBytesQueued, _socketDescriptor, _outboundBytes);
+
+			if ( _outboundQueue.empty() )
+			{
+				// the payload was partially written directly, so it becomes the first segment with the written bytes skipped
+				_outboundOffset = offset;
+			}
+
+			_outboundQueue.emplace_back();
+			_outboundQueue.back().sharedBytes = payload;
+		}
+
 		void TLSSocket::releaseOwner()
 		{
 			if ( _mutex.lock() )
@@ -19,20 +19,40 @@
 #define TLSSOCKET_H
 
 #include "TLSSocketEventHandler.h"
+#include "SocketPoller.h"
+#include "TimerWheel.h"
+#include "TLSCounters.h"
 #include "Mutex.h"
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
 
 extern "C"
 {
 	#include <stddef.h>
 	#include "openssl/ssl.h"
 	#include <stdint.h>
+	#include <sys/uio.h>
 }
 
 namespace IDFix
 {
 	namespace Protocols
 	{
-		class TLSServer;
+		class TLSServerWorker;
+		class TLSBufferPool;
+		class TLSSocket;
+
+        /**
+         * @brief A payload written to several TLSSockets without being copied per socket, see TLSSocket::write and TLSServer::broadcast
+         */
+		typedef std::shared_ptr<const ByteArray>		TLSSharedPayload;
+
+        /**
+         * @brief Selects the TLSSockets a payload is written to, see TLSServer::multicast
+         */
+		typedef std::function<bool(TLSSocket &tlsSocket)>	TLSSocketFilter;
 
         /**
          * @brief The TLSSocket class provides an TLS encrypted socket for incomming client connections.
@@ -40,9 +60,11 @@ namespace IDFix
          * TLSSocket represents an TLS encrypted connection incomming from a TLSServer. It is used as an
          * interface to receive and send encrypted data over the connection.
          */
-		class TLSSocket
+		class TLSSocket : public std::enable_shared_from_this<TLSSocket>
 		{
 			friend class TLSServer;
+			friend class TLSServerWorker;
+			friend class TLSHandshakePool;
 
             public:
                 /**
@@ -52,9 +74,9 @@ namespace IDFix
                  *
                  * @param socketDescriptor      the socket descriptor of the incomming connection
                  * @param tlsPeer               the SSL peer context
-                 * @param owner                 the TLSServer which manages this TLSSocket
+                 * @param owner                 the TLSServerWorker of the TLSServer which manages this TLSSocket
                  */
-				TLSSocket(int socketDescriptor, SSL *tlsPeer, TLSServer *owner);
+				TLSSocket(int socketDescriptor, SSL *tlsPeer, TLSServerWorker *owner);
 
                 /**
                  * @brief A TLSSocket is managed by a TLSServer and therefore cannot be copied
@@ -73,61 +95,402 @@ namespace IDFix
                 /**
                  * @brief Write bytes to a TLS connection
                  *
+                 * The bytes are written immediately as far as the peer's TCP window allows. Remaining bytes are appended to the outbound
+                 * queue of the socket, which is flushed by the managing TLSServerWorker as soon as the socket becomes writable. Thus the
+                 * calling task never blocks on a slow peer.
+                 *
+                 * If called from another task than the TLSServerWorker owning the socket, the bytes are copied and posted to the worker, which
+                 * writes them in order. So only the worker ever touches the TLS connection.
+                 *
+                 * If the queue exceeds the high watermark (see \c setWriteBufferWatermarks), TLSSocketEventHandler::socketBackpressure is called.
+                 * While the socket is in backpressure state, further writes are rejected until TLSSocketEventHandler::socketWritable
+                 * signals that the queue drained below the low watermark.
+                 *
                  * @param bytes     the buffer containing the data to write
                  * @param len       the number of bytes to write
                  *
-                 * @return          >  \c 0 if write operation was successful, the value is the number of bytes actually written to the connection
-                 * @return          <= \c 0 if the write operation failed, because either the connection was closed or an error occured
+                 * @return          >  \c 0 if write operation was successful, the value is the number of bytes written or queued
+                 * @return          \c 0 if the bytes were rejected, because the outbound queue of the socket is full
+                 * @return          <  \c 0 if the write operation failed, because either the connection was closed or an error occured
                  */
 				int				write(const char* bytes, size_t len);
 
+                /**
+                 * @brief Writes a message consisting of several buffers, e.g. a header, a payload and a trailer, to a TLS connection
+                 *
+                 * The buffers are packed into as few TLS records as possible, instead of one record per buffer, which saves the record
+                 * header and MAC of each additional record on the wire. The buffers are gathered into a staging buffer of the managing
+                 * TLSServerWorker, so the caller neither concatenates them nor allocates. The message is accepted or rejected as a whole,
+                 * otherwise this method behaves like \c write.
+                 *
+                 * A message whose buffers are all empty is not written at all. It returns \c 0 like a rejected message, but it is never
+                 * rejected, so the caller does not have to wait for the socketWritable event.
+                 *
+                 * @param buffers   the buffers to write in order
+                 * @param count     the number of buffers, at least \c 1
+                 *
+                 * @return          >  \c 0 if write operation was successful, the value is the number of bytes written or queued
+                 * @return          \c 0 if the bytes were rejected, because the outbound queue of the socket is full, or if the message is empty
+                 * @return          <  \c 0 if the write operation failed, because either the connection was closed or an error occured, or if
+                 *                  \c buffers is \c nullptr or \c count is not positive
+                 */
+				int				writev(const struct iovec *buffers, int count);
+
+                /**
+                 * @brief Writes a shared payload to a TLS connection without copying it
+                 *
+                 * Behaves like \c write, but bytes which cannot be written immediately are queued as a reference to the payload instead of
+                 * a copy. This also applies if called from another task, in which case the reference is posted to the TLSServerWorker owning
+                 * the socket. The payload must not be modified afterwards.
+                 *
+                 * @param payload   the payload to write
+                 *
+                 * @return          >  \c 0 if write operation was successful, the value is the number of bytes written or queued
+                 * @return          \c 0 if the bytes were rejected, because the outbound queue of the socket is full
+                 * @return          <  \c 0 if the write operation failed, because either the connection was closed or an error occured
+                 */
+				int				write(const TLSSharedPayload &payload);
+
                 /**
                  * @brief Convenient method to write a NULL-terminated string to a TLS connection.
                  *
                  * @param string    a NULL-terminated string
                  *
-                 * @return          >  \c 0 if write operation was successful, the value is the number of bytes actually written to the connection
-                 * @return          <= \c 0 if the write operation failed, because either the connection was closed or an error occured
+                 * @return          >  \c 0 if write operation was successful, the value is the number of bytes written or queued
+                 * @return          \c 0 if the bytes were rejected, because the outbound queue of the socket is full
+                 * @return          <  \c 0 if the write operation failed, because either the connection was closed or an error occured
                  */
 				int				write(const char* string);
 
+                /**
+                 * @brief Sets the limits of the outbound queue.
+                 *
+                 * If more than \c highWatermark bytes are queued, the socket enters the backpressure state. It leaves this state as soon as
+                 * the queue drained to \c lowWatermark bytes or less.
+                 *
+                 * @param lowWatermark      the number of queued bytes at which writing is resumed
+                 * @param highWatermark     the number of queued bytes at which further writes are rejected
+                 */
+				void			setWriteBufferWatermarks(size_t lowWatermark, size_t highWatermark);
+
+                /**
+                 * @brief Sets the record sizing policy of the socket.
+                 *
+                 * The first bytes of a burst are written in small TLS records which fit into a single TCP segment, so the peer can decrypt
+                 * and process them as soon as the first segment arrived. After \c boostThreshold bytes the socket switches to full-size records,
+                 * which have the least overhead for a sustained transfer. A pause of \c idleResetMS without writes starts a new burst.
+                 *
+                 * @param smallRecordLength     the plaintext length of the small records, \c 0 always writes full-size records
+                 * @param boostThreshold        the number of bytes of a burst written in small records
+                 * @param idleResetMS           the time without writes in milliseconds after which small records are written again,
+                 *                              \c 0 never starts a new burst, so only the first \c boostThreshold bytes are written in small records
+                 */
+				void			setRecordSizing(size_t smallRecordLength, size_t boostThreshold, uint32_t idleResetMS);
+
+                /**
+                 * @brief Returns a snapshot of the traffic counters of the connection. Can be called from any task.
+                 *
+                 * \c handshakeTimeMS is the time from accepting the connection until the TLS handshake completed. \c queuedBytes equals
+                 * \c bytesToWrite, \c pendingCommands is always \c 0.
+                 */
+				TLSCounters::Statistics	statistics(void);
+
+                /**
+                 * @brief Returns the number of bytes waiting in the outbound queue
+                 */
+				size_t			bytesToWrite(void);
+
+                /**
+                 * @brief Starts (or restarts) the application timer of the socket.
+                 *
+                 * When the timer expires, TLSSocketEventHandler::socketTimerExpired is called. The timer is driven by the worker owning the
+                 * socket, so this method must be called from the TLSSocketEventHandler callbacks of the socket.
+                 *
+                 * @param timeoutMS     the timeout in milliseconds
+                 *
+                 * @return  true on success
+                 * @return  false if the socket is closed
+                 */
+				bool			startTimer(uint32_t timeoutMS);
+
+                /**
+                 * @brief Stops the application timer of the socket. Must be called from the TLSSocketEventHandler callbacks of the socket.
+                 */
+				void			stopTimer(void);
+
                 /**
                  * @brief Close the TLS connection
+                 *
+                 * If called from another task than the TLSServerWorker owning the socket, the socket is closed asynchronously by the worker.
                  */
 				void			close(void);
 
 			protected:
 
+				/** \brief  Returned by \c socketReadyRead if the read budget was exhausted before the socket was drained */
+				static constexpr int	READ_BUDGET_EXHAUSTED = 2;
+
+                /**
+                 * @brief The SocketTimer class forwards the expiration of a timer of the TLSSocket to the TLSServerWorker owning the socket
+                 */
+				class SocketTimer : public TimerWheel::Timer
+				{
+					public:
+
+										SocketTimer(TLSSocket *tlsSocket, bool isApplicationTimer);
+
+					protected:
+
+						virtual void	timerExpired(void) override;
+
+					private:
+
+						TLSSocket		*_tlsSocket;
+						bool			_isApplicationTimer;
+				};
+
                 /**
                  * @brief This method is called from the TLSServer managing this TLSSocket to indicate that new data arrived at the socket.
                  *
-                 * It reads the arrived bytes and calls the provided event handler. If this method returns a value <= \c 0 (which indicates an error or
-                 * a closed socket) the calling server will close the TLSSocket.
+                 * It reads the arrived records until the socket is drained and calls the provided event handler once per record. To keep the
+                 * other sockets of the worker responsive, at most the read budget of the worker is read per call. If this method returns a value <= \c 0
+                 * (which indicates an error or a closed socket) the calling server will close the TLSSocket.
                  *
-                 * @return          >  \c 0 if read operation was successful, the value is the number of bytes actually read from the connection
-                 * @return          <= \c 0 if the write operation failed, because either the connection was closed or an error occured
+                 * @return          \c READ_BUDGET_EXHAUSTED if the read budget was exhausted and the socket may still have data to read
+                 * @return          >  \c 0 if the socket is still open (data was read or the socket is waiting for the rest of a record or handshake)
+                 * @return          <= \c 0 if the read operation failed, because either the peer closed the connection or an error occured
                  */
 				int				socketReadyRead(void);
 
+                /**
+                 * @brief Reads the next TLS record into a receive buffer of the pool and passes it to TLSSocketEventHandler::socketBytesReceived.
+                 *
+                 * @param bufferPool    the buffer pool of the managing TLSServerWorker
+                 * @param recordLength  set to the number of bytes read, \c 0 if no complete record was available
+                 *
+                 * @return          >  \c 0 if the socket is still open
+                 * @return          <= \c 0 if the connection was closed or an error occured
+                 */
+				int				readBytes(TLSBufferPool &bufferPool, size_t &recordLength);
+
+                /**
+                 * @brief Reads the next TLS record for an event handler preferring a data view.
+                 *
+                 * The record is decrypted into the record buffer of the worker and passed to TLSSocketEventHandler::socketDataReceived
+                 * without being copied. Must be called without holding the socket mutex.
+                 *
+                 * @param recordBuffer  the record buffer of the managing TLSServerWorker
+                 * @param recordLength  set to the number of bytes read, \c 0 if no complete record was available
+                 *
+                 * @return          >  \c 0 if the socket is still open
+                 * @return          <= \c 0 if the connection was closed or an error occured
+                 */
+				int				readDataView(ByteArray &recordBuffer, size_t &recordLength);
+
+                /**
+                 * @brief This method is called from the TLSServer managing this TLSSocket to indicate that the socket became writable.
+                 *
+                 * The TLSServer only watches a socket for writability if the TLSSocket requested it, e.g. while a handshake is
+                 * blocked by a full TCP window or the outbound queue is not empty. If this method returns a value <= \c 0 the calling
+                 * server will close the TLSSocket.
+                 *
+                 * @return          >  \c 0 if the socket is still open
+                 * @return          <= \c 0 if the connection failed
+                 */
+				int				socketReadyWrite(void);
+
                 /**
                  * @brief Accept an incomming TLS connection and process the handshake.
                  *
-                 * If a TLSServer constructed a TLSSocket the TLS handshake will not be processed immediately (this would block the server in case the handshake
-                 * has not yet been received from the client). Instead it waits until the first data is received and \c socketReadyRead is called. On the first call
-                 * of \c socketReadyRead it will then call \c acceptSSL.
+                 * If a TLSServer constructed a TLSSocket the TLS handshake will not be processed immediately. Instead it waits until the first data is
+                 * received and \c socketReadyRead is called, which will then call \c acceptSSL.
+                 *
+                 * As the socket is non-blocking, the handshake is processed as a resumable state machine: whenever the TLS library needs more data
+                 * or the TCP window of the client is full, \c acceptSSL returns immediately and asks the TLSServer to watch the socket for the
+                 * required event. The next \c socketReadyRead or \c socketReadyWrite call resumes the handshake. This way a slow or stalled client
+                 * never blocks the other connections of the server.
                  *
-                 * @return      \c 1 on success
+                 * @return      \c 1 if the handshake succeeded or is still in progress
                  * @return      <= \c 0 if the TLS handshake failed
                  */
 				int				acceptSSL(void);
 
+                /**
+                 * @brief Updates the state of the socket after the TLS handshake succeeded and sends the new connection event.
+                 */
+				void			connectionEstablished(void);
+
+                /**
+                 * @brief Called by the TLSHandshakePool when it finished the handshake of the socket.
+                 *
+                 * Hands the socket back to the owning TLSServerWorker, or closes it if there is no worker any longer.
+                 *
+                 * @param succeeded     true if the TLS connection is established
+                 */
+				void			offloadedHandshakeFinished(bool succeeded);
+
+                /**
+                 * @brief Resumes handling the socket after the TLSHandshakePool finished the handshake. Called by the owning TLSServerWorker.
+                 *
+                 * @param succeeded     true if the TLS connection is established
+                 */
+				void			offloadedHandshakeCompleted(bool succeeded);
+
+                /**
+                 * @brief This method is called from the TLSServerWorker managing this TLSSocket when the handshake deadline or the idle timeout expired.
+                 *
+                 * An idle timeout is only an upper bound, the timer is rearmed if there was any activity in the meantime.
+                 *
+                 * @return          >  \c 0 if the socket is still open
+                 * @return          <= \c 0 if the connection timed out and has to be closed
+                 */
+				int				connectionTimerExpired(void);
+
+                /**
+                 * @brief This method is called from the TLSServerWorker managing this TLSSocket when the application timer expired.
+                 *
+                 * @return          >  \c 0 if the socket is still open
+                 * @return          <= \c 0 if the socket was closed
+                 */
+				int				applicationTimerExpired(void);
+
+                /**
+                 * @brief Asks the managing TLSServer to watch the socket for the given events if they changed.
+                 *
+                 * @param events    combination of SocketPoller::Events
+                 */
+				void			setWatchedEvents(uint8_t events);
+
+                /**
+                 * @brief Writes bytes to the TLS connection, see \c write. Must be called by the TLSServerWorker owning the socket.
+                 *
+                 * The events of a changed backpressure state are not sent, the caller has to call \c updateBackpressure afterwards
+                 * without holding the socket mutex.
+                 *
+                 * @param bytes         the buffer containing the data to write
+                 * @param len           the number of bytes to write
+                 * @param isAccepted    true if the bytes were already accepted by \c write and must not be rejected because of backpressure
+                 * @param sharedPayload the payload \c bytes belongs to, if set the bytes not written immediately are queued as a reference
+                 */
+				int				writeBytes(const char* bytes, size_t len, bool isAccepted, const TLSSharedPayload &sharedPayload = nullptr);
+
+                /**
+                 * @brief Writes the buffers of \c writev record by record. Must be called by the TLSServerWorker owning the socket.
+                 *
+                 * Like \c writeBytes, the backpressure events are left to the caller. An empty message returns \c 0 without being written,
+                 * invalid buffers return \c -1.
+                 *
+                 * @param buffers   the buffers to write in order
+                 * @param count     the number of buffers
+                 * @param len       the total number of bytes of the buffers
+                 */
+				int				writeGathered(const struct iovec *buffers, int count, size_t len);
+
+                /**
+                 * @brief Posts bytes written by another task to the TLSServerWorker owning the socket, see \c write.
+                 *
+                 * @param buffers   the buffers to write in order
+                 * @param count     the number of buffers
+                 * @param len       the total number of bytes of the buffers
+                 * @param sharedPayload the payload the single buffer belongs to, if set only a reference is posted instead of a copy
+                 */
+				int				postWrite(const struct iovec *buffers, int count, size_t len, const TLSSharedPayload &sharedPayload = nullptr);
+
+                /**
+                 * @brief Returns the plaintext length of the next TLS record according to the record sizing policy
+                 *
+                 * @param len       the number of bytes waiting to be written
+                 */
+				size_t			nextRecordLength(size_t len);
+
+                /**
+                 * @brief Accounts written bytes to the current burst of the record sizing policy
+                 *
+                 * @param len       the number of bytes accepted by SSL_write
+                 */
+				void			recordWritten(size_t len);
+
+                /**
+                 * @brief Adds \c value to a counter of the socket and of the TLSServerWorker owning the socket
+                 */
+				void			count(TLSCounters::Counter counter, uint32_t value = 1);
+
+                /**
+                 * @brief Subtracts \c value from a gauge of the socket and of the TLSServerWorker owning the socket
+                 */
+				void			uncount(TLSCounters::Counter counter, uint32_t value);
+
+                /**
+                 * @brief Counts a call of a receive callback of the event handler
+                 *
+                 * @param callbackStart     the time the callback was called, see \c esp_timer_get_time
+                 */
+				void			countCallback(int64_t callbackStart);
+
+                /**
+                 * @brief Returns true if bytes are waiting in the outbound queue or were posted to the worker and are not yet written
+                 */
+				bool			hasPendingWrites(void);
+
+                /**
+                 * @brief Writes bytes posted by \c write from another task. Is called by the TLSServerWorker owning the socket.
+                 */
+				void			writePosted(const char* bytes, size_t len, const TLSSharedPayload &sharedPayload = nullptr);
+
+                /**
+                 * @brief Writes as many queued bytes as the peer's TCP window allows.
+                 *
+                 * Must be called with the socket mutex held.
+                 *
+                 * @return          >  \c 0 if the socket is still open
+                 * @return          <= \c 0 if the connection failed
+                 */
+				int				flushOutboundQueue(void);
+
+                /**
+                 * @brief Sends a pending \c socketBackpressure event and ends the backpressure state once the outbound queue and the posted
+                 * bytes drained to the low watermark. Is called by the TLSServerWorker owning the socket (or the writing task of a socket
+                 * without owner) without the socket mutex held by this method.
+                 */
+				void			updateBackpressure(void);
+
+                /**
+                 * @brief Appends bytes to the outbound queue
+                 *
+                 * Small writes are coalesced into the last queued segment, so a chatty writer does not allocate a segment per write.
+                 *
+                 * @param bytes     the buffer containing the data to queue
+                 * @param len       the number of bytes to queue
+                 */
+				void			enqueue(const char* bytes, size_t len);
+
+                /**
+                 * @brief Appends a reference to a shared payload to the outbound queue
+                 *
+                 * @param payload   the payload to queue
+                 * @param offset    the number of bytes of the payload already written
+                 */
+				void			enqueueShared(const TLSSharedPayload &payload, size_t offset);
+
+                /**
+                 * @brief The OutboundSegment struct holds queued bytes, which are either owned by the segment or a shared payload
+                 */
+				struct OutboundSegment
+				{
+					ByteArray			bytes = {};
+					TLSSharedPayload	sharedBytes = {};
+
+					const char*			data(void) const	{ return sharedBytes != nullptr ? sharedBytes->data() : bytes.data(); }
+					size_t				size(void) const	{ return sharedBytes != nullptr ? sharedBytes->size() : bytes.size(); }
+				};
+
                 /**
                  * @brief Invalidate the pointer to the managing TLSServer.
                  *
                  * This method is called from the managing TLSServer to indicate that the socket is no longer managed by the server (either because the socket was closed
                  * or the server was shut down). Invalidating the owner pointer ensures the following concerns
                  *
-                 * - It prevents calling TLSServer::removeSocket() if the socket was already removed from the server.
+                 * - It prevents calling TLSServerWorker::removeSocket() if the socket was already removed from the server.
                  * - The TLSSocket will not send a new connection event if the TLSServer was shut down (e.g. during a TLS handshake).
                  */
 				void			releaseOwner(void);
@@ -141,11 +504,65 @@ namespace IDFix
 
 			protected:
 
-				TLSServer				*_owner;
+				TLSServerWorker			*_owner;
 				int						_socketDescriptor;
 				SSL						*_tlsPeer;
 				bool					_sslAccepted = { false };
+				uint8_t					_watchedEvents = { SocketPoller::Readable };
 				TLSSocketEventHandler	*_eventHandler = { nullptr };
+				bool					_deliverDataViews = { false };
+
+				/** \brief  Bytes not yet accepted by the TLS library. Bytes of the first segment before \c _outboundOffset are already written */
+				std::deque<OutboundSegment>	_outboundQueue = {};
+				size_t					_outboundOffset = { 0 };
+				size_t					_outboundBytes = { 0 };
+
+				/** \brief  Bytes posted to the worker by other tasks, but not yet written or queued */
+				size_t					_postedBytes = { 0 };
+
+				/** \brief  Length of an SSL_write which has to be repeated (with the same arguments) after SSL_ERROR_WANT_WRITE */
+				int						_retryWriteLength = { 0 };
+
+				size_t					_lowWatermark;
+				size_t					_highWatermark;
+				bool					_backpressure = { false };
+
+				/** \brief  Set if the backpressure state was entered by a posted write, the worker sends the event */
+				bool					_backpressureEventPending = { false };
+
+				/** \brief  Record sizing policy, see \c setRecordSizing */
+				size_t					_smallRecordLength = { 0 };
+				size_t					_recordBoostThreshold = { 0 };
+				uint32_t				_recordIdleReset = { 0 };
+				size_t					_burstBytes = { 0 };
+				uint32_t				_lastWriteTime = { 0 };
+
+				/** \brief  Handshake deadline or idle timeout, see TLSServer::setTimeouts */
+				SocketTimer				_connectionTimer;
+				SocketTimer				_applicationTimer;
+				uint32_t				_idleTimeout = { 0 };
+
+				/** \brief  Time of the last read or write in milliseconds, written by any task writing to the socket */
+				std::atomic<uint32_t>	_lastActivity = { 0 };
+
+				/** \brief  Time the connection was accepted in milliseconds */
+				uint32_t				_connectedTime = { 0 };
+
+				/** \brief  Traffic counters of the connection, see \c statistics */
+				TLSCounters				_counters;
+
+				/** \brief  Admission state, see TLSAdmissionControl. Only accessed by the TLSServerWorker owning the socket */
+				uint32_t				_peerAddress = { 0 };
+				bool					_admitted = { false };
+				bool					_handshakeInProgress = { true };
+
+				/** \brief  True while a TLSHandshakePool task owns the TLS connection, closing the socket is deferred until the handshake finished */
+				bool					_handshakeOffloaded = { false };
+				bool					_closePending = { false };
+
+				/** \brief  True while the socket is queued to be read again by the TLSServerWorker owning the socket */
+				bool					_readRescheduled = { false };
+
 				Mutex					_mutex = { Mutex::Recursive };
 		};
 	}
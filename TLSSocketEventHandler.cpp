@@ -33,10 +33,43 @@ namespace IDFix
 
 		}
 
+		void TLSSocketEventHandler::socketDataReceived(TLSSocket& tlsSocket, const char* data, size_t length)
+		{
+			ByteArray bytes;
+
+			// keep the "transparent" 0 termination of socketBytesReceived
+			bytes.reserve(length + 1);
+			bytes.insert(bytes.end(), data, data + length);
+			bytes.push_back('\0');
+			bytes.pop_back();
+
+			socketBytesReceived(tlsSocket, bytes);
+		}
+
+		bool TLSSocketEventHandler::prefersDataView() const
+		{
+			return false;
+		}
+
 		void TLSSocketEventHandler::socketDisconnected(TLSSocket& UNUSED(tlsSocket) )
 		{
 
 		}
 
+		void TLSSocketEventHandler::socketBackpressure(TLSSocket& UNUSED(tlsSocket) )
+		{
+
+		}
+
+		void TLSSocketEventHandler::socketWritable(TLSSocket& UNUSED(tlsSocket) )
+		{
+
+		}
+
+		void TLSSocketEventHandler::socketTimerExpired(TLSSocket& UNUSED(tlsSocket) )
+		{
+
+		}
+
 	}
 }
@@ -39,17 +39,68 @@ namespace IDFix
                 /**
                  * @brief This event is called every time new bytes are received by the TLSSocket.
                  *
+                 * The buffer is recycled by the TLSSocket after this call returns. To keep the received bytes beyond the callback,
+                 * move or swap them out of \c bytes (e.g. \c myBytes.swap(bytes) ), which takes over the buffer without copying.
+                 *
                  * @param tlsSocket     the TLSSocket which received the bytes
                  * @param bytes         the received bytes as \c ByteArray
                  */
 				virtual void	socketBytesReceived(TLSSocket& tlsSocket, ByteArray &bytes);
 
+                /**
+                 * @brief This event is called instead of \c socketBytesReceived every time new bytes are received, if the handler opted in
+                 * by returning true from \c prefersDataView.
+                 *
+                 * \c data points directly into the buffer the TLS record was decrypted to. It is only valid for the duration of the call and
+                 * it is not NULL-terminated. Compared to \c socketBytesReceived no bytes are copied and no buffer is resized.
+                 *
+                 * The default implementation copies the bytes into a ByteArray and calls \c socketBytesReceived.
+                 *
+                 * @param tlsSocket     the TLSSocket which received the bytes
+                 * @param data          pointer to the received bytes
+                 * @param length        the number of received bytes
+                 */
+				virtual void	socketDataReceived(TLSSocket& tlsSocket, const char* data, size_t length);
+
+                /**
+                 * @brief Return true to receive data by \c socketDataReceived instead of \c socketBytesReceived.
+                 *
+                 * The TLSSocket queries this once when the handler is set by TLSSocket::setEventHandler.
+                 */
+				virtual bool	prefersDataView(void) const;
+
                 /**
                  * @brief The event is called when the socket has been disconnected.
                  *
                  * @param tlsSocket     the TLSSocket which was disconnected
                  */
 				virtual void	socketDisconnected(TLSSocket& tlsSocket);
+
+                /**
+                 * @brief The event is called when the outbound queue of the socket exceeded its high watermark.
+                 *
+                 * Further writes are rejected until \c socketWritable is called. Like all other events, it is called by the TLSServerWorker
+                 * owning the socket, also if the backpressure state was entered by a write of another task.
+                 *
+                 * @param tlsSocket     the TLSSocket which cannot accept more bytes
+                 */
+				virtual void	socketBackpressure(TLSSocket& tlsSocket);
+
+                /**
+                 * @brief The event is called when the outbound queue of a socket in backpressure state drained to its low watermark.
+                 *
+                 * The bytes written by other tasks which the worker did not yet write count against the low watermark as well.
+                 *
+                 * @param tlsSocket     the TLSSocket which accepts bytes again
+                 */
+				virtual void	socketWritable(TLSSocket& tlsSocket);
+
+                /**
+                 * @brief The event is called when the application timer of the socket expired (see TLSSocket::startTimer).
+                 *
+                 * @param tlsSocket     the TLSSocket whose timer expired
+                 */
+				virtual void	socketTimerExpired(TLSSocket& tlsSocket);
 		};
 	}
 }
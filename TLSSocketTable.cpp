@@ -0,0 +1,165 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "TLSSocketTable.h"
+
+extern "C"
+{
+	#include "lwip/sockets.h"
+}
+
+namespace
+{
+	// lwIP hands out descriptors starting at LWIP_SOCKET_OFFSET, so the slots below would never be used
+#if defined(LWIP_SOCKET_OFFSET)
+	const int	FIRST_DESCRIPTOR	= LWIP_SOCKET_OFFSET;
+#else
+	const int	FIRST_DESCRIPTOR	= 0;
+#endif
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+
+		TLSSocketTable::TLSSocketTable()
+		{
+
+		}
+
+		void TLSSocketTable::reserve(size_t socketCount)
+		{
+			if ( _slots.size() < socketCount )
+			{
+				_slots.resize(socketCount);
+			}
+
+			_liveDescriptors.reserve(socketCount);
+		}
+
+		bool TLSSocketTable::slotIndex(int descriptor, size_t &index) const
+		{
+			if ( descriptor < FIRST_DESCRIPTOR )
+			{
+				return false;
+			}
+
+			index = static_cast<size_t>(descriptor - FIRST_DESCRIPTOR);
+			return true;
+		}
+
+		bool TLSSocketTable::insert(int descriptor, TLSSocket_sharedPtr tlsSocket)
+		{
+			size_t index;
+
+			if ( ! slotIndex(descriptor, index) || tlsSocket == nullptr )
+			{
+				return false;
+			}
+
+			if ( index >= _slots.size() )
+			{
+				// only grows up to the highest descriptor ever used
+				_slots.resize(index + 1);
+			}
+
+			Slot &slot = _slots[index];
+
+			if ( slot.liveIndex >= 0 )
+			{
+				return false;
+			}
+
+			slot.tlsSocket	= tlsSocket;
+			slot.liveIndex	= static_cast<int>( _liveDescriptors.size() );
+			_liveDescriptors.push_back(descriptor);
+
+			return true;
+		}
+
+		TLSSocket_sharedPtr TLSSocketTable::find(int descriptor) const
+		{
+			size_t index;
+
+			if ( ! slotIndex(descriptor, index) || index >= _slots.size() )
+			{
+				return nullptr;
+			}
+
+			return _slots[index].tlsSocket;
+		}
+
+		bool TLSSocketTable::erase(int descriptor)
+		{
+			size_t index;
+
+			if ( ! slotIndex(descriptor, index) || index >= _slots.size() || _slots[index].liveIndex < 0 )
+			{
+				return false;
+			}
+
+			Slot &slot = _slots[index];
+
+			// move the last live descriptor into the free position, so erasing stays O(1)
+			int liveIndex		= slot.liveIndex;
+			int lastDescriptor	= _liveDescriptors.back();
+
+			_liveDescriptors[liveIndex] = lastDescriptor;
+			_slots[lastDescriptor - FIRST_DESCRIPTOR].liveIndex = liveIndex;
+			_liveDescriptors.pop_back();
+
+			slot.liveIndex = -1;
+			slot.tlsSocket.reset();
+
+			return true;
+		}
+
+		void TLSSocketTable::clear()
+		{
+			for ( int descriptor : _liveDescriptors )
+			{
+				Slot &slot = _slots[descriptor - FIRST_DESCRIPTOR];
+				slot.liveIndex = -1;
+				slot.tlsSocket.reset();
+			}
+
+			_liveDescriptors.clear();
+		}
+
+		size_t TLSSocketTable::size() const
+		{
+			return _liveDescriptors.size();
+		}
+
+		bool TLSSocketTable::empty() const
+		{
+			return _liveDescriptors.empty();
+		}
+
+		void TLSSocketTable::snapshot(std::vector<TLSSocket_sharedPtr> &sockets) const
+		{
+			sockets.clear();
+
+			for ( int descriptor : _liveDescriptors )
+			{
+				sockets.push_back( _slots[descriptor - FIRST_DESCRIPTOR].tlsSocket );
+			}
+		}
+
+	}
+}
@@ -0,0 +1,121 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TLSSOCKETTABLE_H
+#define TLSSOCKETTABLE_H
+
+#include "auxiliary.h"
+#include <vector>
+
+extern "C"
+{
+	#include <stddef.h>
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+		DeclarePointers(TLSSocket);
+
+        /**
+         * @brief The TLSSocketTable class maps socket descriptors to their TLSSocket objects.
+         *
+         * The table is a flat slot array indexed by the socket descriptor, so lookups are O(1) and inserting or erasing a socket does
+         * not allocate once the table has grown to the highest descriptor in use. Additionally a dense list of the live descriptors
+         * is maintained, so iterating the table only visits live entries.
+         *
+         * The table itself is not thread safe, the owner has to lock it. Erasing an entry while a caller holds a TLSSocket_sharedPtr
+         * obtained by \c find is safe, the socket stays alive until the caller releases it.
+         */
+		class TLSSocketTable
+		{
+			public:
+
+								TLSSocketTable();
+
+                /**
+                 * @brief Preallocates the table for descriptors up to the given number of sockets above the first descriptor.
+                 *
+                 * @param socketCount   the expected maximum number of open sockets
+                 */
+				void			reserve(size_t socketCount);
+
+                /**
+                 * @brief Inserts a TLSSocket for the given descriptor
+                 *
+                 * @param descriptor    the socket descriptor
+                 * @param tlsSocket     the TLSSocket
+                 *
+                 * @return  true on success
+                 * @return  false if the descriptor is invalid or already in use
+                 */
+				bool			insert(int descriptor, TLSSocket_sharedPtr tlsSocket);
+
+                /**
+                 * @brief Returns the TLSSocket of the given descriptor or \c nullptr if there is none
+                 */
+				TLSSocket_sharedPtr	find(int descriptor) const;
+
+                /**
+                 * @brief Removes the TLSSocket of the given descriptor
+                 *
+                 * @return  true if an entry was removed
+                 */
+				bool			erase(int descriptor);
+
+                /**
+                 * @brief Removes all entries, the allocated slots are kept
+                 */
+				void			clear(void);
+
+                /**
+                 * @brief Returns the number of live entries
+                 */
+				size_t			size(void) const;
+
+                /**
+                 * @brief Returns true if there are no live entries
+                 */
+				bool			empty(void) const;
+
+                /**
+                 * @brief Copies all live TLSSockets to \c sockets
+                 *
+                 * Use the copy to iterate, if the iteration may close sockets (and thereby erase entries from the table).
+                 *
+                 * @param sockets       the vector to fill, previous content is replaced
+                 */
+				void			snapshot(std::vector<TLSSocket_sharedPtr> &sockets) const;
+
+			private:
+
+				struct Slot
+				{
+					TLSSocket_sharedPtr	tlsSocket;
+					int					liveIndex = { -1 };		/**< position of the descriptor in _liveDescriptors, -1 if unused */
+				};
+
+				bool			slotIndex(int descriptor, size_t &index) const;
+
+				std::vector<Slot>	_slots = {};
+				std::vector<int>	_liveDescriptors = {};
+		};
+	}
+}
+
+#endif
@@ -0,0 +1,256 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "TimerWheel.h"
+
+extern "C"
+{
+	#include <esp_timer.h>
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+
+		TimerWheel::Timer::Timer()
+		{
+
+		}
+
+		TimerWheel::Timer::~Timer()
+		{
+			if ( _wheel != nullptr )
+			{
+				_wheel->cancel(*this);
+			}
+		}
+
+		bool TimerWheel::Timer::isArmed() const
+		{
+			return _wheel != nullptr;
+		}
+
+		TimerWheel::TimerWheel(uint32_t tickMS) : _tickMS(tickMS > 0 ? tickMS : 1)
+		{
+			_currentTick = currentTime() / _tickMS;
+		}
+
+		TimerWheel::~TimerWheel()
+		{
+			clear();
+		}
+
+		void TimerWheel::arm(Timer &timer, uint32_t timeoutMS)
+		{
+			cancel(timer);
+
+			if ( _size == 0 )
+			{
+				// without armed timers the wheel is not advanced, so catch up with the current time first
+				_currentTick = currentTime() / _tickMS;
+			}
+
+			// expire at the earliest on the next tick, longer timeouts are clamped to the range of the wheel
+			uint64_t ticks		= ( static_cast<uint64_t>(timeoutMS) + _tickMS - 1 ) / _tickMS;
+			uint64_t maxTicks	= ( static_cast<uint64_t>(1) << (SLOT_BITS * LEVEL_COUNT) ) - 1;
+
+			if ( ticks == 0 )
+			{
+				ticks = 1;
+			}
+			else if ( ticks > maxTicks )
+			{
+				ticks = maxTicks;
+			}
+
+			timer._expiresAt = _currentTick + ticks;
+			timer._wheel = this;
+			insert(timer);
+
+			_size++;
+		}
+
+		void TimerWheel::cancel(Timer &timer)
+		{
+			if ( timer._wheel != this )
+			{
+				return;
+			}
+
+			unlink(timer);
+			timer._wheel = nullptr;
+
+			_size--;
+		}
+
+		void TimerWheel::clear()
+		{
+			for ( uint8_t level = 0; level < LEVEL_COUNT; level++ )
+			{
+				for ( uint8_t slot = 0; slot < SLOT_COUNT; slot++ )
+				{
+					while ( _slots[level][slot] != nullptr )
+					{
+						cancel( *_slots[level][slot] );
+					}
+				}
+			}
+		}
+
+		void TimerWheel::advance()
+		{
+			uint64_t currentTick = currentTime() / _tickMS;
+
+			if ( _size == 0 )
+			{
+				_currentTick = currentTick;
+				return;
+			}
+
+			while ( _currentTick < currentTick && _size > 0 )
+			{
+				_currentTick++;
+
+				// whenever a level wrapped around, move the timers of the next slot of the level above one level down
+				for ( uint8_t level = 1; level < LEVEL_COUNT; level++ )
+				{
+					if ( ( _currentTick & ( ( static_cast<uint64_t>(1) << (SLOT_BITS * level) ) - 1 ) ) != 0 )
+					{
+						break;
+					}
+
+					cascade(level);
+				}
+
+				Timer *&expiredTimers = _slots[0][_currentTick & (SLOT_COUNT - 1)];
+
+				// a timer is unlinked before it is called, so the callback may cancel or arm any timer (including itself)
+				while ( expiredTimers != nullptr )
+				{
+					Timer *timer = expiredTimers;
+					cancel(*timer);
+					timer->timerExpired();
+				}
+			}
+
+			if ( _size == 0 )
+			{
+				_currentTick = currentTick;
+			}
+		}
+
+		int TimerWheel::nextTimeout()
+		{
+			if ( _size == 0 )
+			{
+				return -1;
+			}
+
+			// the next non-empty slot of the lowest level, otherwise the next wrap around (when upper timers are moved down)
+			uint64_t ticks = SLOT_COUNT - (_currentTick & (SLOT_COUNT - 1) );
+
+			for ( uint64_t offset = 1; offset < ticks; offset++ )
+			{
+				if ( _slots[0][ (_currentTick + offset) & (SLOT_COUNT - 1) ] != nullptr )
+				{
+					ticks = offset;
+					break;
+				}
+			}
+
+			uint64_t wakeupTime = (_currentTick + ticks) * _tickMS;
+			uint64_t now = currentTime();
+
+			return wakeupTime > now ? static_cast<int>(wakeupTime - now) : 0;
+		}
+
+		size_t TimerWheel::size() const
+		{
+			return _size;
+		}
+
+		uint64_t TimerWheel::currentTime() const
+		{
+			return static_cast<uint64_t>( esp_timer_get_time() / 1000 );
+		}
+
+		void TimerWheel::insert(Timer &timer)
+		{
+			uint64_t ticks = timer._expiresAt > _currentTick ? timer._expiresAt - _currentTick : 0;
+			uint8_t level = 0;
+
+			while ( level < LEVEL_COUNT - 1 && ticks >= ( static_cast<uint64_t>(1) << (SLOT_BITS * (level + 1) ) ) )
+			{
+				level++;
+			}
+
+			uint64_t expiresAt = timer._expiresAt > _currentTick ? timer._expiresAt : _currentTick;
+
+			timer._level	= level;
+			timer._slot		= static_cast<uint8_t>( ( expiresAt >> (SLOT_BITS * level) ) & (SLOT_COUNT - 1) );
+
+			Timer *&head = _slots[timer._level][timer._slot];
+
+			timer._previous	= nullptr;
+			timer._next		= head;
+
+			if ( head != nullptr )
+			{
+				head->_previous = &timer;
+			}
+
+			head = &timer;
+		}
+
+		void TimerWheel::unlink(Timer &timer)
+		{
+			if ( timer._previous != nullptr )
+			{
+				timer._previous->_next = timer._next;
+			}
+			else
+			{
+				_slots[timer._level][timer._slot] = timer._next;
+			}
+
+			if ( timer._next != nullptr )
+			{
+				timer._next->_previous = timer._previous;
+			}
+
+			timer._previous = nullptr;
+			timer._next = nullptr;
+		}
+
+		void TimerWheel::cascade(uint8_t level)
+		{
+			uint8_t slot = static_cast<uint8_t>( ( _currentTick >> (SLOT_BITS * level) ) & (SLOT_COUNT - 1) );
+
+			Timer *timer = _slots[level][slot];
+			_slots[level][slot] = nullptr;
+
+			while ( timer != nullptr )
+			{
+				Timer *next = timer->_next;
+				insert(*timer);
+				timer = next;
+			}
+		}
+
+	}
+}
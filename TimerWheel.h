@@ -0,0 +1,151 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+extern "C"
+{
+	#include <stddef.h>
+	#include <stdint.h>
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+        /**
+         * @brief The TimerWheel class provides a hierarchical timer wheel for the event loop of a TLSServerWorker.
+         *
+         * Timers are kept in intrusive lists in one of four levels of 64 slots each, where level \c n holds the timers expiring within
+         * 64^(n+1) ticks. Arming and cancelling a timer is O(1) and does not allocate, whenever the lowest level wrapped around the
+         * timers of the next slot of the upper level are moved down. So the cost per tick does not depend on the number of armed timers,
+         * only on the number of timers which actually expire.
+         *
+         * With the default tick of 100 ms timeouts of up to about 19 days can be armed, longer timeouts are clamped.
+         *
+         * The wheel is not thread safe, it is only used by the task of the worker owning it.
+         */
+		class TimerWheel
+		{
+			public:
+
+                /**
+                 * @brief The Timer class is the base of every object which can be armed on a TimerWheel.
+                 *
+                 * A timer is cancelled automatically when it is destroyed.
+                 */
+				class Timer
+				{
+					friend class TimerWheel;
+
+					public:
+
+										Timer();
+						virtual			~Timer();
+
+										Timer(const Timer&) = delete;
+
+                        /**
+                         * @brief Returns true if the timer is armed on a TimerWheel
+                         */
+						bool			isArmed(void) const;
+
+					protected:
+
+                        /**
+                         * @brief Is called by the TimerWheel when the timer expired. The timer is no longer armed at this point
+                         * and can be armed again.
+                         */
+						virtual void	timerExpired(void) = 0;
+
+					private:
+
+						TimerWheel		*_wheel = { nullptr };
+						Timer			*_previous = { nullptr };
+						Timer			*_next = { nullptr };
+						uint64_t		_expiresAt = { 0 };
+						uint8_t			_level = { 0 };
+						uint8_t			_slot = { 0 };
+				};
+
+                /**
+                 * @brief Constructs a TimerWheel
+                 *
+                 * @param tickMS    the resolution of the timers in milliseconds
+                 */
+								TimerWheel(uint32_t tickMS = 100);
+								~TimerWheel();
+
+								TimerWheel(const TimerWheel&) = delete;
+
+                /**
+                 * @brief Arms the timer, a timer which is already armed is rearmed.
+                 *
+                 * @param timer         the timer to arm
+                 * @param timeoutMS     the time until the timer expires in milliseconds, rounded up to full ticks
+                 */
+				void			arm(Timer &timer, uint32_t timeoutMS);
+
+                /**
+                 * @brief Cancels the timer, if it is armed
+                 */
+				void			cancel(Timer &timer);
+
+                /**
+                 * @brief Cancels all armed timers
+                 */
+				void			clear(void);
+
+                /**
+                 * @brief Advances the wheel to the current time and calls \c timerExpired for all expired timers.
+                 */
+				void			advance(void);
+
+                /**
+                 * @brief Returns the time until the wheel has to be advanced next, to be used as timeout for waiting on the sockets.
+                 *
+                 * @return  the timeout in milliseconds
+                 * @return  \c -1 if no timer is armed
+                 */
+				int				nextTimeout(void);
+
+                /**
+                 * @brief Returns the number of armed timers
+                 */
+				size_t			size(void) const;
+
+			private:
+
+				static const uint8_t	LEVEL_COUNT = 4;
+				static const uint8_t	SLOT_BITS = 6;
+				static const uint8_t	SLOT_COUNT = 1 << SLOT_BITS;
+
+				uint64_t		currentTime(void) const;
+				void			insert(Timer &timer);
+				void			unlink(Timer &timer);
+				void			cascade(uint8_t level);
+
+				uint32_t		_tickMS;
+				uint64_t		_currentTick = { 0 };
+				size_t			_size = { 0 };
+				Timer			*_slots[LEVEL_COUNT][SLOT_COUNT] = {};
+		};
+	}
+}
+
+#endif
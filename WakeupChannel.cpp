@@ -0,0 +1,188 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "WakeupChannel.h"
+
+extern "C"
+{
+	#include <string.h>
+	#include <errno.h>
+	#include <esp_log.h>
+	#include <fcntl.h>
+	#include "lwip/sockets.h"
+#if defined(__linux__)
+	#include <sys/eventfd.h>
+#endif
+}
+
+namespace
+{
+	const char* LOG_TAG = "IDFix::WakeupChannel";
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+
+		WakeupChannel::WakeupChannel()
+		{
+
+		}
+
+		WakeupChannel::~WakeupChannel()
+		{
+			deinit();
+		}
+
+		int WakeupChannel::descriptor() const
+		{
+			return _descriptor;
+		}
+
+#if defined(__linux__)
+
+		bool WakeupChannel::init()
+		{
+			if ( _descriptor >= 0 )
+			{
+				return true;
+			}
+
+			_descriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+			if ( _descriptor < 0 )
+			{
+				ESP_LOGE(LOG_TAG, "eventfd() failed (errno=%d) at file %s:%d.", errno, __FILE__, __LINE__);
+				return false;
+			}
+
+			_signalPending = false;
+			return true;
+		}
+
+		void WakeupChannel::signal()
+		{
+			if ( _signalPending.exchange(true) )
+			{
+				// the waiting task was already signaled but did not drain the channel yet
+				return;
+			}
+
+			uint64_t value = 1;
+			if ( ::write(_descriptor, &value, sizeof(value) ) < 0 )
+			{
+				_signalPending = false;
+			}
+		}
+
+		void WakeupChannel::drain()
+		{
+			uint64_t value;
+			while ( ::read(_descriptor, &value, sizeof(value) ) > 0 )
+			{
+
+			}
+
+			// clear the flag after reading, a signal suppressed until here is not lost as the caller
+			// processes the pending work after draining the channel
+			_signalPending = false;
+		}
+
+#else
+
+		bool WakeupChannel::init()
+		{
+			if ( _descriptor >= 0 )
+			{
+				return true;
+			}
+
+			_descriptor = socket(AF_INET, SOCK_DGRAM, 0);
+
+			if ( _descriptor < 0 )
+			{
+				ESP_LOGE(LOG_TAG, "Could not create socket at file %s:%d.", __FILE__, __LINE__);
+				return false;
+			}
+
+			struct sockaddr_in socketAddress;
+			memset(&socketAddress, 0, sizeof(socketAddress) );
+			socketAddress.sin_family		= AF_INET;
+			socketAddress.sin_addr.s_addr	= htonl(INADDR_LOOPBACK);
+			socketAddress.sin_port			= 0;
+
+			socklen_t socketAddressLength = sizeof(socketAddress);
+
+			// bind to an ephemeral loopback port and connect the socket to itself, so signal() and drain() work
+			// with plain send() and recv() calls
+			if (	bind(_descriptor, reinterpret_cast<struct sockaddr *>(&socketAddress), sizeof(socketAddress) )
+				||	getsockname(_descriptor, reinterpret_cast<struct sockaddr *>(&socketAddress), &socketAddressLength)
+				||	connect(_descriptor, reinterpret_cast<struct sockaddr *>(&socketAddress), socketAddressLength) )
+			{
+				ESP_LOGE(LOG_TAG, "Could not set up loopback socket at file %s:%d.", __FILE__, __LINE__);
+				deinit();
+				return false;
+			}
+
+			fcntl(_descriptor, F_SETFL, fcntl(_descriptor, F_GETFL, 0) | O_NONBLOCK);
+
+			_signalPending = false;
+			return true;
+		}
+
+		void WakeupChannel::signal()
+		{
+			if ( _signalPending.exchange(true) )
+			{
+				// the waiting task was already signaled but did not drain the channel yet
+				return;
+			}
+
+			uint8_t value = 1;
+			if ( send(_descriptor, &value, sizeof(value), 0) < 0 )
+			{
+				_signalPending = false;
+			}
+		}
+
+		void WakeupChannel::drain()
+		{
+			uint8_t value[8];
+			while ( recv(_descriptor, value, sizeof(value), 0) > 0 )
+			{
+
+			}
+
+			// clear the flag after reading, a signal suppressed until here is not lost as the caller
+			// processes the pending work after draining the channel
+			_signalPending = false;
+		}
+
+#endif
+
+		void WakeupChannel::deinit()
+		{
+			if ( _descriptor >= 0 )
+			{
+				::close(_descriptor);
+				_descriptor = -1;
+			}
+		}
+
+	}
+}
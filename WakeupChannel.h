@@ -0,0 +1,85 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WAKEUPCHANNEL_H
+#define WAKEUPCHANNEL_H
+
+#include <atomic>
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+        /**
+         * @brief The WakeupChannel class provides a descriptor which can be used to interrupt a task blocked in poll(), select() or epoll_wait().
+         *
+         * On the Linux host build the channel is an eventfd, on lwIP (which has no pipes or eventfds by default) it is a non-blocking UDP socket
+         * connected to itself on the loopback interface. The waiting task watches \c descriptor for readability, any other task calls \c signal
+         * to wake it up. Repeated signals are coalesced until the waiting task calls \c drain.
+         */
+		class WakeupChannel
+		{
+			public:
+
+								WakeupChannel();
+								~WakeupChannel();
+
+                /**
+                 * @brief A WakeupChannel owns operating system resources and therefore cannot be copied
+                 */
+								WakeupChannel(const WakeupChannel&) = delete;
+
+                /**
+                 * @brief Creates the underlying descriptor
+                 *
+                 * @return  true on success
+                 * @return  false on failure
+                 */
+				bool			init(void);
+
+                /**
+                 * @brief Closes the underlying descriptor
+                 */
+				void			deinit(void);
+
+                /**
+                 * @brief Returns the descriptor to watch for readability, \c -1 if the channel is not initialized
+                 */
+				int				descriptor(void) const;
+
+                /**
+                 * @brief Wakes up the task waiting on the descriptor. Can be called from any task.
+                 */
+				void			signal(void);
+
+                /**
+                 * @brief Consumes all pending signals. Must be called by the waiting task after the descriptor became readable
+                 * and before it processes the work it was woken up for.
+                 */
+				void			drain(void);
+
+			private:
+
+				int					_descriptor = { -1 };
+
+				/** \brief true while a signal is pending, so only the first of several signals touches the descriptor */
+				std::atomic<bool>	_signalPending = { false };
+		};
+	}
+}
+
+#endif
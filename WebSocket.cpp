@@ -19,12 +19,24 @@
 #include "MutexLocker.h"
 #include "WebSocket.h"
 #include "WebSocketEventHandler.h"
+#include "WebSocketFrameEncoder.h"
 #include "auxiliary.h"
+#include "ProtocolTrace.h"
+#include <algorithm>
 
 extern "C"
 {
     #include <esp_log.h>
+    #include <esp_idf_version.h>
+    #include <esp_timer.h>
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+    #include <esp_random.h>
+#else
+    #include <esp_system.h>
+#endif
+    #include <freertos/task.h>
     #include "http_parser.h"
+    #include "lwip/sockets.h"
 }
 
 namespace
@@ -33,6 +45,7 @@ namespace
     const int       WEBSOCKET_TCP_DEFAULT_PORT      = 80;
     const int       WEBSOCKET_SSL_DEFAULT_PORT      = 443;
     const int       WEBSOCKET_BUFFER_SIZE           = 1024;
+    const size_t    WEBSOCKET_SEND_BUFFER_SIZE      = 4*1024;
     const int       WEBSOCKET_NETWORK_TIMEOUT       = 5*1000; // ms
     const int       TRANSPORT_POLL_TIMEOUT          = 800; // ms
 }
@@ -44,7 +57,7 @@ namespace IDFix
         WebSocket::WebSocket(WebSocketEventHandler *eventHandler) : IDFix::Task("idfix_websocket", 5120),
                                                                     _websocketMutex(Mutex::Recursive), _stateMutex(Mutex::Recursive),
                                                                     _eventHandler(eventHandler), _bufferSize(WEBSOCKET_BUFFER_SIZE),
-                                                                    _networkTimeoutMS(WEBSOCKET_NETWORK_TIMEOUT)
+                                                                    _sendBufferSize(WEBSOCKET_SEND_BUFFER_SIZE), _networkTimeoutMS(WEBSOCKET_NETWORK_TIMEOUT)
 		{
 
         }
@@ -80,15 +93,27 @@ namespace IDFix
                 MutexLocker websocketLocker(_websocketMutex);
 
                 _webSocketEventQueue = xQueueCreate(1, sizeof( WebSocketEvent ) );
-                _sendMessageEventQueue = xQueueCreate(4, sizeof( SendMessageEvent ));
 
-
-                if ( !_webSocketEventQueue || ! _sendMessageEventQueue)
+                if ( !_webSocketEventQueue )
                 {
                     ESP_LOGE(LOG_TAG, "Error create event queue");
                     return false;
                 }
 
+                if ( ! _sendBuffer.init(_sendBufferSize) )
+                {
+                    ESP_LOGE(LOG_TAG, "Failed to allocate send buffer");
+                    cleanup();
+                    return false;
+                }
+
+                if ( ! _wakeupChannel.init() )
+                {
+                    ESP_LOGE(LOG_TAG, "Failed to create wakeup channel");
+                    cleanup();
+                    return false;
+                }
+
                 if ( ! initTransportList() )
                 {
                     cleanup();
@@ -103,7 +128,8 @@ namespace IDFix
                     return false;
                 }
 
-                _txBuffer = new char [ _bufferSize ];
+                // a frame is encoded in one piece, header and masked payload, at the alignment of its payload. A batch of frames is encoded into the same buffer
+                _txBuffer = new char [ std::max(_bufferSize + WebSocketFrameEncoder::MAX_HEADER_LENGTH + WebSocketFrameEncoder::ALIGNMENT_SLACK, _batchSize) ];
                 if ( !_txBuffer )
                 {
                     ESP_LOGE(LOG_TAG, "Failed to allocate tx buffer");
@@ -177,6 +203,7 @@ namespace IDFix
             if ( _txBuffer )
             {
                 delete [] _txBuffer;
+                _txBuffer = nullptr;
             }
 
             if ( _webSocketEventQueue )
@@ -185,11 +212,9 @@ namespace IDFix
                 _webSocketEventQueue = nullptr;
             }
 
-            if ( _sendMessageEventQueue )
-            {
-                vQueueDelete(_sendMessageEventQueue);
-                _sendMessageEventQueue = nullptr;
-            }
+            _sendBuffer.deinit();
+
+            _wakeupChannel.deinit();
         }
 
         void WebSocket::setWebsocketState(WebSocket::WebSocketState newState)
@@ -255,6 +280,53 @@ namespace IDFix
             return result;
         }
 
+        bool WebSocket::setSendBufferSize(size_t bufferSize)
+        {
+            bool result = false;
+
+            _stateMutex.lock();
+                if ( _websocketState == WebSocketState::Stopped )
+                {
+                    _websocketMutex.lock();
+                        _sendBufferSize = bufferSize;
+                    _websocketMutex.unlock();
+
+                    result = true;
+                }
+            _stateMutex.unlock();
+
+            return result;
+        }
+
+        bool WebSocket::setSendBatching(size_t batchSize, uint32_t maxLingerMS)
+        {
+            bool result = false;
+
+            _stateMutex.lock();
+                if ( _websocketState == WebSocketState::Stopped )
+                {
+                    _websocketMutex.lock();
+                        _batchSize = batchSize;
+                        _maxLingerMS = maxLingerMS;
+                    _websocketMutex.unlock();
+
+                    result = true;
+                }
+            _stateMutex.unlock();
+
+            return result;
+        }
+
+        void WebSocket::setSendPolicy(WebSocketSendBuffer::Policy policy, uint32_t timeoutMS)
+        {
+            _sendBuffer.setPolicy(policy, timeoutMS);
+        }
+
+        size_t WebSocket::sendBufferFreeSpace()
+        {
+            return _sendBuffer.freeSpace();
+        }
+
         bool WebSocket::connect(uint32_t delayTime)
         {
 
@@ -314,6 +386,8 @@ namespace IDFix
                     return false;
                 }
 
+                _wakeupChannel.signal();
+
                 ESP_LOGI(LOG_TAG, "Queued disconnect event!");
                 return true;
             }
@@ -346,7 +420,7 @@ namespace IDFix
             }
 
             _websocketMutex.lock();
-                if ( _websocketTransport == nullptr )
+                if ( _websocketTransport == nullptr || _parentTransport == nullptr )
                 {
                     _websocketMutex.unlock();
                     ESP_LOGE(LOG_TAG, "Invalid transport");
@@ -368,10 +442,12 @@ namespace IDFix
                         currentOpcode |= 0x80; // WS_TRANSPORT_OPCODES_FIN is currently only defined in ESP32-IDF
                     }
 
-                    memcpy(_txBuffer, data + writeIndex, needWrite);
+                    // copy and mask the fragment into the tx buffer in one pass and write the whole frame to the tcp or ssl transport
+                    char *frame = WebSocketFrameEncoder::alignedFrameStart(_txBuffer, data + writeIndex, static_cast<size_t>(needWrite) );
+                    int frameLength = static_cast<int>( WebSocketFrameEncoder::encode(frame, static_cast<uint8_t>(currentOpcode), data + writeIndex, static_cast<size_t>(needWrite), esp_random() ) );
 
-                    // send with ws specific way and specific opcode
-                    writeLen = esp_transport_ws_send_raw(_websocketTransport, static_cast<ws_transport_opcodes_t>(currentOpcode), _txBuffer, needWrite, timeout);
+                    writeLen = writeFrame(frame, frameLength, timeout);
+                    IDFIX_TRACE(WebSocketFrameSent, currentOpcode, writeLen);
 
                     if (writeLen <= 0)
                     {
@@ -385,13 +461,32 @@ namespace IDFix
                     }
 
                     currentOpcode = 0; // set the opcode only for the first fragment
-                    writeIndex += writeLen;
+                    writeIndex += needWrite;
                     needWrite = len - writeIndex;
                 }
             _websocketMutex.unlock();
             return writeIndex;
         }
 
+        int WebSocket::writeFrame(const char *frame, int length, int timeout)
+        {
+            int written = 0;
+
+            // the tcp and ssl transports may write less than requested, a frame must not be interleaved with another one
+            while ( written < length )
+            {
+                int writeLen = esp_transport_write(_parentTransport, frame + written, length - written, timeout);
+                if ( writeLen <= 0 )
+                {
+                    return writeLen;
+                }
+
+                written += writeLen;
+            }
+
+            return written;
+        }
+
         int WebSocket::sendTextMessage(const std::string &message)
         {
             if ( getWebsocketState() != WebSocketState::Connected )
@@ -399,25 +494,36 @@ namespace IDFix
                 return -1;
             }
 
-            SendMessageEvent  event;
+            return queueMessage(WS_TRANSPORT_OPCODES_TEXT, message.data(), message.length() );
+        }
 
-            const char* cstring = message.c_str();
+        int WebSocket::sendTextMessage(std::string &&message)
+        {
+            if ( getWebsocketState() != WebSocketState::Connected )
+            {
+                return -1;
+            }
 
-            char *myItem = (char*) malloc(strlen(cstring)+1);
-            strcpy(myItem, cstring);
-            event.data = myItem;
-            event.length = static_cast<int>( message.length());
+            return queueMessage(WS_TRANSPORT_OPCODES_TEXT, WebSocketSendBuffer::Payload( std::move(message) ) );
+        }
 
-            if ( xQueueSend(_sendMessageEventQueue, &event, 0) != pdPASS )
+        int WebSocket::sendBinaryMessage(const char *data, int length)
+        {
+            if ( getWebsocketState() != WebSocketState::Connected )
             {
-                ESP_LOGE(LOG_TAG, "Failed to queue Message event!");
-                free((void*) event.data);
-                return false;
+                ESP_LOGE(LOG_TAG, "Failed to enqueue message. Not connected.");
+                return -1;
             }
-            return true;
+
+            if ( data == nullptr || length <= 0 )
+            {
+                return -1;
+            }
+
+            return queueMessage(WS_TRANSPORT_OPCODES_BINARY, data, static_cast<size_t>(length) );
         }
 
-        int WebSocket::sendBinaryMessage(const char *data, int length)
+        int WebSocket::sendBinaryMessage(std::vector<uint8_t> &&data)
         {
             if ( getWebsocketState() != WebSocketState::Connected )
             {
@@ -425,26 +531,61 @@ namespace IDFix
                 return -1;
             }
 
-            SendMessageEvent  event;
+            return queueMessage(WS_TRANSPORT_OPCODES_BINARY, WebSocketSendBuffer::Payload( std::move(data) ) );
+        }
 
-            char *myItem = (char*) malloc(strlen(data)+1);
-            strcpy(myItem, data);
-            event.data = myItem;
-            event.length = length;
+        int WebSocket::sendBinaryMessage(char *data, size_t length, WebSocketSendBuffer::Payload::Deleter deleter)
+        {
+            // the buffer is owned from now on, even if it is not queued
+            WebSocketSendBuffer::Payload payload(data, length, std::move(deleter) );
 
-            if ( xQueueSend(_sendMessageEventQueue, &event, 0) != pdPASS )
+            if ( getWebsocketState() != WebSocketState::Connected )
             {
-                ESP_LOGE(LOG_TAG, "Failed to queue Stop event!");
-                free((void*) event.data);
-                return false;
+                ESP_LOGE(LOG_TAG, "Failed to enqueue message. Not connected.");
+                return -1;
             }
-            return true;
+
+            return queueMessage(WS_TRANSPORT_OPCODES_BINARY, std::move(payload) );
+        }
+
+        int WebSocket::queueMessage(ws_transport_opcodes_t opcode, const char *data, size_t length)
+        {
+            // the websocket task must not wait for itself to make room in the send buffer
+            bool mayBlock = xTaskGetCurrentTaskHandle() != _websocketTask;
+
+            return messageQueued(opcode, _sendBuffer.push(opcode, data, length, mayBlock) );
+        }
+
+        int WebSocket::queueMessage(ws_transport_opcodes_t opcode, WebSocketSendBuffer::Payload &&payload)
+        {
+            bool mayBlock = xTaskGetCurrentTaskHandle() != _websocketTask;
+
+            return messageQueued(opcode, _sendBuffer.push(opcode, std::move(payload), mayBlock) );
+        }
+
+        int WebSocket::messageQueued(ws_transport_opcodes_t opcode, int result)
+        {
+            if ( result == 0 )
+            {
+                ESP_LOGE(LOG_TAG, "Failed to queue message, send buffer full!");
+                return 0;
+            }
+
+            if ( result > 0 )
+            {
+                IDFIX_TRACE(WebSocketMessageQueued, opcode, result);
+                _wakeupChannel.signal();
+            }
+
+            return result;
         }
 
         void WebSocket::run()
         {
             ESP_LOGV(LOG_TAG, "Start websocket loop");
 
+            _websocketTask = xTaskGetCurrentTaskHandle();
+
             while (true)
             {
                 switch (_websocketState)
@@ -474,12 +615,10 @@ namespace IDFix
                     case WebSocketState::Connected:
 
                         {
-                            waitForSendMessageEvent();
-                            _websocketMutex.lock();
-                                int readSelect = esp_transport_poll_read(_websocketTransport, TRANSPORT_POLL_TIMEOUT);
-                            _websocketMutex.unlock();
+                            int pollTimeout = waitForSendMessageEvent();
+                            int readSelect = waitForTransport(pollTimeout);
 
-                            // readSelect == 0 => no data to process
+                            // readSelect == 0 => no data to process or woken up to send a queued message
 
                             if ( readSelect < 0 )
                             {
@@ -637,14 +776,18 @@ namespace IDFix
             MutexLocker locker(_websocketMutex);
 
             _websocketTransport = nullptr;
+            _parentTransport = nullptr;
 
+            // frames are encoded by the WebSocketFrameEncoder and written to the parent of the ws transport
             if ( _schema == WebSocketURLSchema::WS )
             {
                 _websocketTransport = esp_transport_list_get_transport(_transportList, "ws");
+                _parentTransport = esp_transport_list_get_transport(_transportList, "_tcp");
             }
             else if ( _schema == WebSocketURLSchema::WSS )
             {
                 _websocketTransport = esp_transport_list_get_transport(_transportList, "wss");
+                _parentTransport = esp_transport_list_get_transport(_transportList, "_ssl");
             }
 
             if ( _websocketTransport == nullptr )
@@ -680,6 +823,7 @@ namespace IDFix
             locker.unlock();
 
             ESP_LOGI(LOG_TAG, "Transport connected");
+            IDFIX_TRACE(WebSocketConnected, 0, 0);
             setWebsocketState(WebSocketState::Connected);
 
             if ( _eventHandler )
@@ -688,14 +832,161 @@ namespace IDFix
             }
         }
 
-        void WebSocket::waitForSendMessageEvent()
+        int WebSocket::waitForTransport(int timeoutMS)
         {
-            SendMessageEvent event;
-            while ( xQueueReceive(_sendMessageEventQueue, &event, 0) == pdTRUE ){
-                ESP_LOGV(LOG_TAG, "Message dequeued");
-                sendWithOpcode(WS_TRANSPORT_OPCODES_BINARY, event.data, event.length, _networkTimeoutMS);
-                free((void*) event.data);
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 3, 0)
+            _websocketMutex.lock();
+                // bytes already decrypted by the TLS layer do not make the socket readable, so check the transport first
+                int readSelect = esp_transport_poll_read(_websocketTransport, 0);
+                int transportDescriptor = esp_transport_get_socket(_websocketTransport);
+            _websocketMutex.unlock();
+
+            int wakeupDescriptor = _wakeupChannel.descriptor();
+
+            if ( readSelect != 0 || transportDescriptor < 0 || wakeupDescriptor < 0 )
+            {
+                return readSelect;
+            }
+
+            fd_set readDescriptors;
+            FD_ZERO(&readDescriptors);
+            FD_SET(transportDescriptor, &readDescriptors);
+            FD_SET(wakeupDescriptor, &readDescriptors);
+
+            struct timeval timeout;
+            timeout.tv_sec = timeoutMS / 1000;
+            timeout.tv_usec = (timeoutMS % 1000) * 1000;
+
+            // a queued message or disconnect request interrupts waiting, instead of waiting for the timeout to expire
+            int result = select(std::max(transportDescriptor, wakeupDescriptor) + 1, &readDescriptors, nullptr, nullptr, &timeout);
+
+            if ( result < 0 )
+            {
+                return errno == EINTR ? 0 : result;
+            }
+
+            if ( FD_ISSET(wakeupDescriptor, &readDescriptors) )
+            {
+                _wakeupChannel.drain();
             }
+
+            return FD_ISSET(transportDescriptor, &readDescriptors) ? 1 : 0;
+#else
+            volatile MutexLocker locker(_websocketMutex);
+
+            return esp_transport_poll_read(_websocketTransport, timeoutMS);
+#endif
+        }
+
+        int WebSocket::waitForSendMessageEvent()
+        {
+            WebSocketSendBuffer::Message message;
+
+            // the message is sent or batched straight from the send buffer, it is released afterwards
+            while ( _sendBuffer.front(message) )
+            {
+                IDFIX_HOT_LOGV(LOG_TAG, "Message dequeued");
+
+                if ( _batchSize > 0 )
+                {
+                    batchMessage(message);
+                }
+                else
+                {
+                    sendWithOpcode(static_cast<ws_transport_opcodes_t>(message.opcode), message.data, static_cast<int>(message.length), _networkTimeoutMS);
+                }
+
+                _sendBuffer.pop();
+            }
+
+            if ( _batchLength == 0 )
+            {
+                return TRANSPORT_POLL_TIMEOUT;
+            }
+
+            // wait for further messages until the first message of the batch lingered long enough
+            int64_t lingerTimeMS = ( esp_timer_get_time() - _batchStartTime ) / 1000;
+            if ( lingerTimeMS >= _maxLingerMS )
+            {
+                flushBatch();
+                return TRANSPORT_POLL_TIMEOUT;
+            }
+
+            return static_cast<int>( std::min<int64_t>(_maxLingerMS - lingerTimeMS, TRANSPORT_POLL_TIMEOUT) );
+        }
+
+        void WebSocket::batchMessage(const WebSocketSendBuffer::Message &message)
+        {
+            // the connection was aborted while the remaining messages are taken from the send buffer
+            if ( getWebsocketState() != WebSocketState::Connected )
+            {
+                return;
+            }
+
+            size_t frameLength = WebSocketFrameEncoder::headerLength(message.length) + message.length;
+
+            if ( _batchLength + frameLength > _batchSize )
+            {
+                flushBatch();
+            }
+
+            // a message larger than a batch is sent on its own, fragmented like without batching
+            if ( frameLength > _batchSize )
+            {
+                sendWithOpcode(static_cast<ws_transport_opcodes_t>(message.opcode), message.data, static_cast<int>(message.length), _networkTimeoutMS);
+                return;
+            }
+
+            if ( _batchLength == 0 )
+            {
+                _batchStartTime = esp_timer_get_time();
+                _batchFrames = 0;
+            }
+
+            // the frames of a batch are contiguous, padding them to the alignment of their payloads (see alignedFrameStart) would put
+            // bytes between the frames, which the peer reads as the next frame header. So the payload may not be masked word-wide on the ESP
+            _batchLength += WebSocketFrameEncoder::encode(_txBuffer + _batchLength, message.opcode | 0x80, message.data, message.length, esp_random() );
+            _batchFrames++;
+        }
+
+        void WebSocket::flushBatch()
+        {
+            if ( _batchLength == 0 )
+            {
+                return;
+            }
+
+            int length = static_cast<int>(_batchLength);
+            _batchLength = 0;
+
+            if ( getWebsocketState() != WebSocketState::Connected )
+            {
+                ESP_LOGE(LOG_TAG, "Websocket client is not connected");
+                return;
+            }
+
+            _websocketMutex.lock();
+                if ( _parentTransport == nullptr )
+                {
+                    _websocketMutex.unlock();
+                    ESP_LOGE(LOG_TAG, "Invalid transport");
+                    return;
+                }
+
+                int writeLen = writeFrame(_txBuffer, length, _networkTimeoutMS);
+                IDFIX_TRACE(WebSocketBatchSent, _batchFrames, writeLen);
+
+                if ( writeLen <= 0 )
+                {
+                    _websocketMutex.unlock();
+
+                    ESP_LOGE(LOG_TAG, "Network error: esp_transport_write() returned %d, errno=%d", writeLen, errno);
+
+                    abortConnection();
+
+                    return;
+                }
+            _websocketMutex.unlock();
         }
 
 
@@ -759,6 +1050,8 @@ namespace IDFix
                     opcode          = esp_transport_ws_get_read_opcode(_websocketTransport);
                 _websocketMutex.unlock();
 
+                IDFIX_TRACE(WebSocketFrameReceived, opcode, bytesRead);
+
                 if ( (payloadOffset + bytesRead) < payloadLength )
                 {
                     // websocket payload did not fit into our rx buffer, so we have to process the payload partially
@@ -842,9 +1135,14 @@ namespace IDFix
                 esp_transport_close(_websocketTransport);
             _websocketMutex.unlock();
 
+            // a pending batch is discarded like the messages still queued in the send buffer
+            _batchLength = 0;
+
             setWebsocketState(WebSocketState::Idle);
             xQueueReset(_webSocketEventQueue);
 
+            IDFIX_TRACE(WebSocketDisconnected, 0, 0);
+
             if ( _eventHandler )
             {
                 _eventHandler->webSocketDisconnected();
@@ -862,7 +1160,7 @@ namespace IDFix
                     case WebSocketAction::Disconnect:
 
                         ESP_LOGI(LOG_TAG, "Received queued disconnect event");
-                        xQueueReset(_sendMessageEventQueue);
+                        _sendBuffer.clear();
                         xQueueReset(_webSocketEventQueue);
                         abortConnection();
                         break;
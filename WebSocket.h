@@ -19,8 +19,11 @@
 #define WEBSOCKET_H
 
 #include <string>
+#include <vector>
 #include "IDFixTask.h"
 #include "Mutex.h"
+#include "WakeupChannel.h"
+#include "WebSocketSendBuffer.h"
 
 extern "C"
 {
@@ -98,6 +101,59 @@ namespace IDFix
                  */
                 bool            setBufferSize(const int bufferSize);
 
+                /**
+                 * @brief Sets the size of the buffer holding the messages queued for sending.
+                 *
+                 * The messages are stored in a ring buffer, each with a header of 8 bytes, so a message may be at most \c bufferSize - 8 bytes.
+                 *
+                 * \note    This method can only be called if the socket is stopped.
+                 *
+                 * @param bufferSize    the new send buffer size in bytes.
+                 *
+                 * @return true on success
+                 * @return false on failure
+                 */
+                bool            setSendBufferSize(size_t bufferSize);
+
+                /**
+                 * @brief Enables sending the queued messages in batches, i.e. several frames with a single write to the transport.
+                 *
+                 * Without batching every message is written on its own, which is one TCP segment and with wss one TLS record per message.
+                 * With batching the websocket task encodes each queued message into a batch. The batch is written when the next message
+                 * does not fit, or when no further message is queued and the first message of the batch waited \c maxLingerMS. A message
+                 * which is larger than a batch is sent on its own.
+                 *
+                 * The frames of a batch are written back to back, as the WebSocket protocol allows no padding between frames. Hence only
+                 * the first frame of a batch keeps the alignment of its payload, on the ESP the payloads of the other frames are usually
+                 * masked byte by byte. Batching trades this masking speed for fewer writes, which pays off for many small messages.
+                 *
+                 * \note    This method can only be called if the socket is stopped.
+                 *
+                 * @param batchSize     the maximum number of bytes written at once, including the frame headers, \c 0 disables batching (default)
+                 * @param maxLingerMS   the maximum time a message waits for further messages, with \c 0 only the messages queued at the
+                 *                      moment are batched
+                 *
+                 * @return true on success
+                 * @return false on failure
+                 */
+                bool            setSendBatching(size_t batchSize, uint32_t maxLingerMS = 0);
+
+                /**
+                 * @brief Sets how messages are handled which do not fit into the send buffer. Can be called at any time.
+                 *
+                 * With the \c WebSocketSendBuffer::Block policy, the send methods wait for free space, unless they are called from the
+                 * WebSocketEventHandler, i.e. from the websocket task. Then a message which does not fit is rejected.
+                 *
+                 * @param policy        the policy, \c WebSocketSendBuffer::FailFast by default
+                 * @param timeoutMS     the maximum time to wait for free space with the \c WebSocketSendBuffer::Block policy
+                 */
+                void            setSendPolicy(WebSocketSendBuffer::Policy policy, uint32_t timeoutMS = 0);
+
+                /**
+                 * @brief Returns the length of the largest message which can be queued right now without dropping or waiting
+                 */
+                size_t          sendBufferFreeSpace(void);
+
                 /**
                  * @brief Attempts to connect the websocket.
                  *
@@ -126,24 +182,73 @@ namespace IDFix
                 /**
                  * @brief Sends the given message as text message.
                  *
+                 * The message is copied into the send buffer and sent by the websocket task.
+                 *
                  * @param message   the text message to send
                  *
-                 * @return          >  \c 0 if write operation was successful, the value is the number of bytes actually written to the connection
-                 * @return          <= \c 0 if the write operation failed, because either the connection was closed or an error occured
+                 * @return          >  \c 0 if the message was queued, the value is the number of bytes queued
+                 * @return          \c 0 if the message was rejected, because it does not fit into the send buffer, see \c setSendPolicy
+                 * @return          <  \c 0 if the websocket is not connected or the message is empty or too large for the send buffer
                  */
                 int             sendTextMessage(const std::string &message);
 
+                /**
+                 * @brief Sends the given message as text message without copying it into the send buffer.
+                 *
+                 * The send buffer takes the ownership of the message, only the string object is stored in the buffer. The message is
+                 * released after it was sent or dropped, a rejected message is left untouched.
+                 *
+                 * @param message   the text message to send
+                 *
+                 * @return          >  \c 0 if the message was queued, the value is the number of bytes queued
+                 * @return          \c 0 if the message was rejected, because it does not fit into the send buffer, see \c setSendPolicy
+                 * @return          <  \c 0 if the websocket is not connected or the message is empty
+                 */
+                int             sendTextMessage(std::string &&message);
+
                 /**
                  * @brief Sends the given data as binary message.
                  *
+                 * The data is copied into the send buffer and sent by the websocket task.
+                 *
                  * @param data      the binary data to send.
                  * @param length    the length of the data in bytes.
                  *
-                 * @return          >  \c 0 if write operation was successful, the value is the number of bytes actually written to the connection
-                 * @return          <= \c 0 if the write operation failed, because either the connection was closed or an error occured
+                 * @return          >  \c 0 if the message was queued, the value is the number of bytes queued
+                 * @return          \c 0 if the message was rejected, because it does not fit into the send buffer, see \c setSendPolicy
+                 * @return          <  \c 0 if the websocket is not connected or the message is empty or too large for the send buffer
                  */
                 int             sendBinaryMessage(const char* data, int length);
 
+                /**
+                 * @brief Sends the given data as binary message without copying it into the send buffer.
+                 *
+                 * The send buffer takes the ownership of the data, a rejected message is left untouched.
+                 *
+                 * @param data      the binary data to send.
+                 *
+                 * @return          >  \c 0 if the message was queued, the value is the number of bytes queued
+                 * @return          \c 0 if the message was rejected, because it does not fit into the send buffer, see \c setSendPolicy
+                 * @return          <  \c 0 if the websocket is not connected or the message is empty
+                 */
+                int             sendBinaryMessage(std::vector<uint8_t> &&data);
+
+                /**
+                 * @brief Sends the given buffer as binary message without copying it into the send buffer.
+                 *
+                 * The send buffer takes the ownership of the buffer and calls \c deleter with it after it was sent or if it is dropped or
+                 * rejected, also if this method fails.
+                 *
+                 * @param data      the binary data to send.
+                 * @param length    the length of the data in bytes.
+                 * @param deleter   releases the buffer, it may be called from the websocket task
+                 *
+                 * @return          >  \c 0 if the message was queued, the value is the number of bytes queued
+                 * @return          \c 0 if the message was rejected, because it does not fit into the send buffer, see \c setSendPolicy
+                 * @return          <  \c 0 if the websocket is not connected or the message is empty
+                 */
+                int             sendBinaryMessage(char *data, size_t length, WebSocketSendBuffer::Payload::Deleter deleter);
+
             private:
 
                 enum class WebSocketAction
@@ -163,12 +268,6 @@ namespace IDFix
 
                 };
 
-                struct SendMessageEvent
-                {
-                    uint32_t        length;
-                    const char*     data;
-                };
-
                 enum class WebSocketState
                 {
                     Stopped,
@@ -210,16 +309,42 @@ namespace IDFix
 
                 void            connectTransport(void);
 
+                /**
+                 * @brief Waits until the transport is readable or another task queued a message or a disconnect request
+                 *
+                 * \note    Before ESP-IDF 4.3 the socket of the transport is not accessible, then only the transport is polled.
+                 *
+                 * @param timeoutMS     the maximum time to wait in milliseconds
+                 *
+                 * @return      >  \c 0 if data is available on the transport
+                 * @return      \c 0 if the timeout expired or the task was woken up
+                 * @return      <  \c 0 on a network error
+                 */
+                int             waitForTransport(int timeoutMS);
+
                 /**
                  * @brief Wait for an websocket event on the internal queue and process it
                  */
                 void            waitForWebsocketEvent(void);
 
                 /**
-                * @brief Wait for an sendMessage event on the internal queue and process it
+                * @brief Send the messages queued in the send buffer
+                *
+                * @return       the time in milliseconds to wait for the transport, shorter than the poll timeout if a batch is lingering
                 */
+                int             waitForSendMessageEvent(void);
+
+                /**
+                 * @brief       Encode a message into the pending batch, the batch is written first if the message does not fit
+                 *
+                 * @param message   the message taken from the send buffer
+                 */
+                void            batchMessage(const WebSocketSendBuffer::Message &message);
 
-                void            waitForSendMessageEvent(void);
+                /**
+                 * @brief       Write the pending batch to the parent transport with a single write
+                 */
+                void            flushBatch(void);
 
                 /**
                  * @brief Read available data from the idf transport stream
@@ -239,9 +364,42 @@ namespace IDFix
                  */
                 void            checkForDisconnectEvent(void);
 
+                /**
+                 * @brief       Copy a message into the send buffer and wake up the websocket task
+                 *
+                 * @param opcode    the opcode to use
+                 * @param data      the data to send
+                 * @param length    length of the data in bytes
+                 *
+                 * @return          the result of WebSocketSendBuffer::push
+                 */
+                int             queueMessage(ws_transport_opcodes_t opcode, const char *data, size_t length);
+
+                /**
+                 * @brief       Hand a payload over to the send buffer and wake up the websocket task
+                 *
+                 * @param opcode    the opcode to use
+                 * @param payload   the payload to send, it is only moved if it is queued
+                 *
+                 * @return          the result of WebSocketSendBuffer::push
+                 */
+                int             queueMessage(ws_transport_opcodes_t opcode, WebSocketSendBuffer::Payload &&payload);
+
+                /**
+                 * @brief       Log a rejected message or wake up the websocket task for a queued one
+                 *
+                 * @param opcode    the opcode of the message
+                 * @param result    the result of WebSocketSendBuffer::push
+                 *
+                 * @return          \c result
+                 */
+                int             messageQueued(ws_transport_opcodes_t opcode, int result);
+
                 /**
                  * @brief       Send the data with given opcode
                  *
+                 * Each fragment is copied and masked into the tx buffer in one pass and written as one frame, the data is not modified.
+                 *
                  * @param opcode    the opcode to use
                  * @param data      the data to send
                  * @param len       length of the data in bytes
@@ -252,6 +410,18 @@ namespace IDFix
                  */
                 int             sendWithOpcode(ws_transport_opcodes_t opcode, const char *data, int len, int timeout);
 
+                /**
+                 * @brief       Write encoded frames completely to the parent transport
+                 *
+                 * @param frame     the frame or the frames of a batch
+                 * @param length    length of the frames in bytes
+                 * @param timeout   transfer timeout in milliseconds
+                 *
+                 * @return          \c length on success
+                 * @return          the result of esp_transport_write if it failed
+                 */
+                int             writeFrame(const char *frame, int length, int timeout);
+
 			private:
 
                 WebSocketState                  _websocketState = { WebSocketState::Stopped };
@@ -260,15 +430,32 @@ namespace IDFix
 
                 WebSocketEventHandler*          _eventHandler = {};
                 QueueHandle_t                   _webSocketEventQueue = { nullptr };
-                QueueHandle_t                   _sendMessageEventQueue = { nullptr };
+
+                /** \brief  Interrupts waiting for the transport when a message or a disconnect request is queued */
+                WakeupChannel                   _wakeupChannel;
 
                 const char*                     _websocketCert = { nullptr };
                 int                             _bufferSize;
                 esp_transport_list_handle_t     _transportList = { nullptr };
                 esp_transport_handle_t          _websocketTransport = { nullptr };
+
+                /** \brief  The tcp or ssl transport below \c _websocketTransport, outgoing frames are written to it directly */
+                esp_transport_handle_t          _parentTransport = { nullptr };
                 char*                           _rxBuffer = { nullptr };
                 char*                           _txBuffer = { nullptr };
 
+                /** \brief  Sending in batches, see setSendBatching. The pending batch is encoded into \c _txBuffer */
+                size_t                          _batchSize = { 0 };
+                uint32_t                        _maxLingerMS = { 0 };
+                size_t                          _batchLength = { 0 };
+                uint32_t                        _batchFrames = { 0 };
+                int64_t                         _batchStartTime = { 0 };
+
+                /** \brief  Messages queued by other tasks, sent by the websocket task */
+                WebSocketSendBuffer             _sendBuffer;
+                size_t                          _sendBufferSize;
+                void                            *_websocketTask = { nullptr };
+
                 int                             _networkTimeoutMS;
 
                 WebSocketURLSchema              _schema = { WebSocketURLSchema::Invalid };
@@ -0,0 +1,160 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "WebSocketFrameEncoder.h"
+
+#include <string.h>
+
+#if defined(__linux__) && defined(__SSE2__)
+	#include <emmintrin.h>
+#elif defined(__linux__) && defined(__ARM_NEON)
+	#include <arm_neon.h>
+#endif
+
+namespace
+{
+	// the widest integer the target loads and stores in one instruction, 64 bit on the host and 32 bit on the ESP
+	typedef uintptr_t MaskWord;
+
+	const uint8_t	MASK_BIT			= 0x80;
+	const uint8_t	LENGTH_16_BIT		= 126;
+	const uint8_t	LENGTH_64_BIT		= 127;
+	const size_t	MASKING_KEY_LENGTH	= 4;
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+		size_t WebSocketFrameEncoder::headerLength(size_t payloadLength)
+		{
+			if ( payloadLength < LENGTH_16_BIT )
+			{
+				return 2 + MASKING_KEY_LENGTH;
+			}
+
+			if ( payloadLength <= UINT16_MAX )
+			{
+				return 4 + MASKING_KEY_LENGTH;
+			}
+
+			return 10 + MASKING_KEY_LENGTH;
+		}
+
+		char *WebSocketFrameEncoder::alignedFrameStart(char *buffer, const char *payload, size_t payloadLength)
+		{
+			uintptr_t payloadPosition = reinterpret_cast<uintptr_t>(buffer) + headerLength(payloadLength);
+			size_t offset = ( reinterpret_cast<uintptr_t>(payload) - payloadPosition ) & ( ALIGNMENT_SLACK - 1 );
+
+			return buffer + offset;
+		}
+
+		size_t WebSocketFrameEncoder::encode(char *frame, uint8_t opcode, const char *payload, size_t length, uint32_t maskingKey)
+		{
+			uint8_t *header = reinterpret_cast<uint8_t*>(frame);
+			size_t position = 0;
+
+			header[position++] = opcode;
+
+			if ( length < LENGTH_16_BIT )
+			{
+				header[position++] = MASK_BIT | static_cast<uint8_t>(length);
+			}
+			else if ( length <= UINT16_MAX )
+			{
+				header[position++] = MASK_BIT | LENGTH_16_BIT;
+				header[position++] = static_cast<uint8_t>(length >> 8);
+				header[position++] = static_cast<uint8_t>(length);
+			}
+			else
+			{
+				header[position++] = MASK_BIT | LENGTH_64_BIT;
+
+				uint64_t extendedLength = length;
+				for ( int shift = 56; shift >= 0; shift -= 8 )
+				{
+					header[position++] = static_cast<uint8_t>(extendedLength >> shift);
+				}
+			}
+
+			memcpy(header + position, &maskingKey, MASKING_KEY_LENGTH);
+			position += MASKING_KEY_LENGTH;
+
+			copyMasked(frame + position, payload, length, maskingKey);
+
+			return position + length;
+		}
+
+		void WebSocketFrameEncoder::copyMasked(char *destination, const char *source, size_t length, uint32_t maskingKey)
+		{
+			uint8_t key[MASKING_KEY_LENGTH];
+			memcpy(key, &maskingKey, MASKING_KEY_LENGTH);
+
+			size_t index = 0;
+
+#if defined(__linux__) && defined(__SSE2__)
+			__m128i mask128 = _mm_set1_epi32(static_cast<int>(maskingKey));
+			for ( ; index + sizeof(__m128i) <= length; index += sizeof(__m128i) )
+			{
+				__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + index));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(destination + index), _mm_xor_si128(data, mask128));
+			}
+#elif defined(__linux__) && defined(__ARM_NEON)
+			uint8x16_t mask128 = vreinterpretq_u8_u32(vdupq_n_u32(maskingKey));
+			for ( ; index + sizeof(uint8x16_t) <= length; index += sizeof(uint8x16_t) )
+			{
+				uint8x16_t data = vld1q_u8(reinterpret_cast<const uint8_t*>(source + index));
+				vst1q_u8(reinterpret_cast<uint8_t*>(destination + index), veorq_u8(data, mask128));
+			}
+#endif
+
+			// word-wide loads and stores need the same alignment on both sides, the ESP cannot access unaligned words
+			bool coAligned = ( ( reinterpret_cast<uintptr_t>(destination) ^ reinterpret_cast<uintptr_t>(source) ) & ( sizeof(MaskWord) - 1 ) ) == 0;
+
+			if ( coAligned )
+			{
+				for ( ; index < length && ( reinterpret_cast<uintptr_t>(destination + index) & ( sizeof(MaskWord) - 1 ) ) != 0; index++ )
+				{
+					destination[index] = static_cast<char>(source[index] ^ key[index % MASKING_KEY_LENGTH]);
+				}
+
+				// the key rotated to the current position, repeated over the whole word
+				uint8_t maskBytes[sizeof(MaskWord)];
+				for ( size_t byte = 0; byte < sizeof(MaskWord); byte++ )
+				{
+					maskBytes[byte] = key[(index + byte) % MASKING_KEY_LENGTH];
+				}
+
+				MaskWord mask;
+				memcpy(&mask, maskBytes, sizeof(MaskWord));
+
+				for ( ; index + sizeof(MaskWord) <= length; index += sizeof(MaskWord) )
+				{
+					MaskWord word;
+					memcpy(&word, __builtin_assume_aligned(source + index, sizeof(MaskWord)), sizeof(MaskWord));
+					word ^= mask;
+					memcpy(__builtin_assume_aligned(destination + index, sizeof(MaskWord)), &word, sizeof(MaskWord));
+				}
+			}
+
+			for ( ; index < length; index++ )
+			{
+				destination[index] = static_cast<char>(source[index] ^ key[index % MASKING_KEY_LENGTH]);
+			}
+		}
+	}
+}
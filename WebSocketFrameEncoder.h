@@ -0,0 +1,89 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WEBSOCKETFRAMEENCODER_H
+#define WEBSOCKETFRAMEENCODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+        /**
+         * @brief The WebSocketFrameEncoder class encodes masked client frames (RFC 6455, section 5.2) into a caller provided buffer.
+         *
+         * The payload is copied and masked in a single pass, in native words where source and destination allow it and with
+         * SSE2 or NEON on the Linux host build. Bytes which cannot be handled word-wide (the unaligned head and the tail) are
+         * masked one by one.
+         */
+		class WebSocketFrameEncoder
+		{
+			public:
+
+                /** \brief The maximum length of a client frame header: 2 bytes, 8 bytes extended length and 4 bytes masking key */
+				static constexpr size_t	MAX_HEADER_LENGTH = 14;
+
+                /** \brief The additional space \c alignedFrameStart may skip at the beginning of a buffer */
+				static constexpr size_t	ALIGNMENT_SLACK = sizeof(uint64_t);
+
+                /**
+                 * @brief Returns the length of the header of a client frame
+                 *
+                 * @param payloadLength the length of the payload
+                 */
+				static size_t			headerLength(size_t payloadLength);
+
+                /**
+                 * @brief Returns the position in \c buffer at which a frame should start, so that its payload gets the same
+                 * word alignment as \c payload and can be masked word-wide. The position is at most \c ALIGNMENT_SLACK - 1 bytes
+                 * behind \c buffer.
+                 *
+                 * @param buffer        the buffer the frame will be encoded into
+                 * @param payload       the payload of the frame
+                 * @param payloadLength the length of the payload
+                 */
+				static char*			alignedFrameStart(char *buffer, const char *payload, size_t payloadLength);
+
+                /**
+                 * @brief Encodes a masked frame
+                 *
+                 * @param frame         receives the frame, must hold \c headerLength(length) + \c length bytes
+                 * @param opcode        the opcode, including the FIN bit
+                 * @param payload       the payload, it is not modified
+                 * @param length        the length of the payload
+                 * @param maskingKey    the masking key, its bytes are used in memory order
+                 *
+                 * @return  the length of the frame
+                 */
+				static size_t			encode(char *frame, uint8_t opcode, const char *payload, size_t length, uint32_t maskingKey);
+
+                /**
+                 * @brief Copies \c length bytes from \c source to \c destination and masks them with \c maskingKey
+                 *
+                 * @param destination   the destination, must not overlap \c source
+                 * @param source        the unmasked data
+                 * @param length        the number of bytes to copy
+                 * @param maskingKey    the masking key, its bytes are used in memory order starting with the first byte
+                 */
+				static void				copyMasked(char *destination, const char *source, size_t length, uint32_t maskingKey);
+		};
+	}
+}
+
+#endif
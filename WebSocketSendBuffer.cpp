@@ -0,0 +1,606 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "WebSocketSendBuffer.h"
+#include "MutexLocker.h"
+
+#include <algorithm>
+#include <new>
+
+extern "C"
+{
+	#include <string.h>
+	#include <esp_log.h>
+	#include <freertos/task.h>
+}
+
+namespace
+{
+	const char*		LOG_TAG				= "IDFix::WebSocketSendBuffer";
+
+	// keeps the record headers and the payloads stored in place aligned
+	const size_t	RECORD_ALIGNMENT	= std::max<size_t>(alignof(IDFix::Protocols::WebSocketSendBuffer::Payload), 4);
+
+	// marks the space skipped at the end of the buffer, it is no valid WebSocket opcode
+	const uint8_t	PADDING_OPCODE		= 0xFF;
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+
+		WebSocketSendBuffer::Payload::Payload(std::string &&string) : _storage( std::move(string) )
+		{
+
+		}
+
+		WebSocketSendBuffer::Payload::Payload(std::vector<uint8_t> &&bytes) : _storage( std::move(bytes) )
+		{
+
+		}
+
+		WebSocketSendBuffer::Payload::Payload(char *data, size_t length, Deleter deleter)
+			: _storage( std::in_place_type<Buffer>, data, length, std::move(deleter) )
+		{
+
+		}
+
+		char* WebSocketSendBuffer::Payload::data()
+		{
+			if ( std::string *string = std::get_if<std::string>(&_storage) )
+			{
+				return &(*string)[0];
+			}
+
+			if ( std::vector<uint8_t> *bytes = std::get_if<std::vector<uint8_t>>(&_storage) )
+			{
+				return reinterpret_cast<char*>( bytes->data() );
+			}
+
+			return std::get<Buffer>(_storage)._data;
+		}
+
+		size_t WebSocketSendBuffer::Payload::length() const
+		{
+			if ( const std::string *string = std::get_if<std::string>(&_storage) )
+			{
+				return string->length();
+			}
+
+			if ( const std::vector<uint8_t> *bytes = std::get_if<std::vector<uint8_t>>(&_storage) )
+			{
+				return bytes->size();
+			}
+
+			return std::get<Buffer>(_storage)._length;
+		}
+
+		WebSocketSendBuffer::Payload::Buffer::Buffer(char *data, size_t length, Deleter deleter)
+			: _data(data), _length(length), _deleter( std::move(deleter) )
+		{
+
+		}
+
+		WebSocketSendBuffer::Payload::Buffer::Buffer(Buffer &&other)
+			: _data(other._data), _length(other._length), _deleter( std::move(other._deleter) )
+		{
+			// the moved buffer must not be released twice
+			other._data = nullptr;
+			other._length = 0;
+		}
+
+		WebSocketSendBuffer::Payload::Buffer::~Buffer()
+		{
+			if ( _data != nullptr && _deleter )
+			{
+				_deleter(_data, _length);
+			}
+		}
+
+		WebSocketSendBuffer::WebSocketSendBuffer()
+		{
+			static_assert( sizeof(RecordHeader) % RECORD_ALIGNMENT == 0, "misaligned record payload");
+		}
+
+		WebSocketSendBuffer::~WebSocketSendBuffer()
+		{
+			deinit();
+		}
+
+		bool WebSocketSendBuffer::init(size_t capacity)
+		{
+			MutexLocker locker(_mutex);
+
+			deinit();
+
+			_capacity = capacity & ~(RECORD_ALIGNMENT - 1);
+			_buffer = new (std::nothrow) char[_capacity];
+			_spaceReleased = xSemaphoreCreateBinary();
+
+			if ( _buffer == nullptr || _spaceReleased == nullptr )
+			{
+				ESP_LOGE(LOG_TAG, "Could not allocate send buffer of %zu bytes at file %s:%d.", _capacity, __FILE__, __LINE__);
+				deinit();
+				return false;
+			}
+
+			return true;
+		}
+
+		void WebSocketSendBuffer::deinit()
+		{
+			MutexLocker locker(_mutex);
+
+			if ( _buffer != nullptr )
+			{
+				// release the payloads of the message being sent and of the queued messages
+				if ( _isSending )
+				{
+					destroyPayload(_head);
+				}
+
+				destroyQueuedPayloads();
+
+				delete [] _buffer;
+				_buffer = nullptr;
+			}
+
+			if ( _spaceReleased != nullptr )
+			{
+				vSemaphoreDelete(_spaceReleased);
+				_spaceReleased = nullptr;
+			}
+
+			_capacity = 0;
+			_head = 0;
+			_tail = 0;
+			_readPosition = 0;
+			_usedBytes = 0;
+			_queuedMessages = 0;
+			_isSending = false;
+		}
+
+		void WebSocketSendBuffer::setPolicy(Policy policy, uint32_t timeoutMS)
+		{
+			MutexLocker locker(_mutex);
+
+			_policy = policy;
+			_timeoutMS = timeoutMS;
+		}
+
+		size_t WebSocketSendBuffer::freeSpace()
+		{
+			MutexLocker	locker(_mutex);
+			size_t		contiguousBytes = 0;
+
+			if ( _usedBytes == 0 )
+			{
+				contiguousBytes = _capacity;
+			}
+			else if ( _tail > _head )
+			{
+				contiguousBytes = std::max(_capacity - _tail, _head);
+			}
+			else if ( _tail < _head )
+			{
+				contiguousBytes = _head - _tail;
+			}
+
+			if ( contiguousBytes <= sizeof(RecordHeader) )
+			{
+				return 0;
+			}
+
+			return contiguousBytes - sizeof(RecordHeader);
+		}
+
+		int WebSocketSendBuffer::push(uint8_t opcode, const char *data, size_t length, bool mayBlock)
+		{
+			size_t position;
+
+			if ( length == 0 )
+			{
+				ESP_LOGE(LOG_TAG, "Empty message at file %s:%d.", __FILE__, __LINE__);
+				return -1;
+			}
+
+			_mutex.lock();
+
+				int result = reserve(recordSize(length), mayBlock, position);
+
+				if ( result > 0 )
+				{
+					RecordHeader *header = reinterpret_cast<RecordHeader*>(_buffer + position);
+					header->length = static_cast<uint32_t>(length);
+					header->opcode = opcode;
+					header->isPayload = false;
+					memcpy(_buffer + position + sizeof(RecordHeader), data, length);
+				}
+
+			_mutex.unlock();
+
+			if ( result <= 0 )
+			{
+				return result;
+			}
+
+			releaseWaitingProducer();
+
+			return static_cast<int>(length);
+		}
+
+		int WebSocketSendBuffer::push(uint8_t opcode, Payload &&payload, bool mayBlock)
+		{
+			size_t position;
+			size_t length = payload.length();
+
+			if ( length == 0 )
+			{
+				ESP_LOGE(LOG_TAG, "Empty message at file %s:%d.", __FILE__, __LINE__);
+				return -1;
+			}
+
+			_mutex.lock();
+
+				int result = reserve(recordSize( sizeof(Payload) ), mayBlock, position);
+
+				if ( result > 0 )
+				{
+					RecordHeader *header = reinterpret_cast<RecordHeader*>(_buffer + position);
+					header->length = sizeof(Payload);
+					header->opcode = opcode;
+					header->isPayload = true;
+
+					// only the owner of the payload is moved, not its bytes
+					new (_buffer + position + sizeof(RecordHeader)) Payload( std::move(payload) );
+				}
+
+			_mutex.unlock();
+
+			if ( result <= 0 )
+			{
+				return result;
+			}
+
+			releaseWaitingProducer();
+
+			return static_cast<int>(length);
+		}
+
+		int WebSocketSendBuffer::reserve(size_t size, bool mayBlock, size_t &position)
+		{
+			size_t		skippedBytes;
+			TickType_t	start = xTaskGetTickCount();
+
+			if ( _buffer == nullptr || size > _capacity )
+			{
+				ESP_LOGE(LOG_TAG, "Message exceeds the send buffer at file %s:%d.", __FILE__, __LINE__);
+				return -1;
+			}
+
+			while ( ! findSpace(size, position, skippedBytes) )
+			{
+				if ( _policy == DropOldest && _queuedMessages > 0 )
+				{
+					if ( ! _isSending )
+					{
+						dropOldest();
+						_droppedMessages++;
+						continue;
+					}
+
+					// the message being sent cannot be dropped and the queued messages are behind it, so their space can only be
+					// reused if all of them are dropped
+					if ( fitsWithoutQueuedMessages(size) )
+					{
+						_droppedMessages += _queuedMessages;
+						dropQueued();
+						continue;
+					}
+				}
+
+				TickType_t waitedTicks = xTaskGetTickCount() - start;
+
+				if ( _policy != Block || ! mayBlock || waitedTicks >= pdMS_TO_TICKS(_timeoutMS) )
+				{
+					return 0;
+				}
+
+				_waitingProducers++;
+				_mutex.unlock();
+
+				xSemaphoreTake(_spaceReleased, pdMS_TO_TICKS(_timeoutMS) - waitedTicks);
+
+				_mutex.lock();
+				_waitingProducers--;
+
+				if ( _buffer == nullptr )
+				{
+					return -1;
+				}
+			}
+
+			if ( skippedBytes > 0 && _capacity - _tail >= sizeof(RecordHeader) )
+			{
+				// the message does not fit behind the last one, so the rest of the buffer is skipped
+				RecordHeader *padding = reinterpret_cast<RecordHeader*>(_buffer + _tail);
+				padding->opcode = PADDING_OPCODE;
+			}
+
+			_tail = position + size;
+			_usedBytes += size + skippedBytes;
+			_queuedMessages++;
+
+			return 1;
+		}
+
+		void WebSocketSendBuffer::releaseWaitingProducer()
+		{
+			_mutex.lock();
+				bool wakeNextProducer = _waitingProducers > 0;
+			_mutex.unlock();
+
+			if ( wakeNextProducer )
+			{
+				// only one blocked producer is woken up per released message, let the next one check whether its message fits as well
+				xSemaphoreGive(_spaceReleased);
+			}
+		}
+
+		bool WebSocketSendBuffer::front(Message &message)
+		{
+			MutexLocker locker(_mutex);
+
+			if ( _isSending || _queuedMessages == 0 )
+			{
+				return false;
+			}
+
+			if ( isPadding(_readPosition) )
+			{
+				_readPosition = 0;
+			}
+
+			const RecordHeader	*header = reinterpret_cast<const RecordHeader*>(_buffer + _readPosition);
+			char				*bytes = _buffer + _readPosition + sizeof(RecordHeader);
+
+			if ( header->isPayload )
+			{
+				Payload *payload = reinterpret_cast<Payload*>(bytes);
+
+				message.data = payload->data();
+				message.length = payload->length();
+			}
+			else
+			{
+				message.data = bytes;
+				message.length = header->length;
+			}
+
+			message.opcode = header->opcode;
+
+			_readPosition += recordSize(header->length);
+			_queuedMessages--;
+			_isSending = true;
+			_sendingEnd = _readPosition;
+
+			return true;
+		}
+
+		void WebSocketSendBuffer::pop()
+		{
+			_mutex.lock();
+
+				if ( ! _isSending )
+				{
+					_mutex.unlock();
+					return;
+				}
+
+				releaseHead();
+				_isSending = false;
+
+			_mutex.unlock();
+
+			xSemaphoreGive(_spaceReleased);
+		}
+
+		void WebSocketSendBuffer::clear()
+		{
+			_mutex.lock();
+
+				if ( _buffer == nullptr )
+				{
+					_mutex.unlock();
+					return;
+				}
+
+				if ( _isSending )
+				{
+					dropQueued();
+				}
+
+				while ( _queuedMessages > 0 )
+				{
+					dropOldest();
+				}
+
+			_mutex.unlock();
+
+			xSemaphoreGive(_spaceReleased);
+		}
+
+		uint32_t WebSocketSendBuffer::droppedMessages()
+		{
+			MutexLocker locker(_mutex);
+
+			return _droppedMessages;
+		}
+
+		size_t WebSocketSendBuffer::recordSize(size_t length) const
+		{
+			return ( sizeof(RecordHeader) + length + RECORD_ALIGNMENT - 1 ) & ~(RECORD_ALIGNMENT - 1);
+		}
+
+		bool WebSocketSendBuffer::findSpace(size_t size, size_t &position, size_t &skippedBytes)
+		{
+			skippedBytes = 0;
+
+			if ( _usedBytes == 0 )
+			{
+				// start over at the beginning, so the largest message fits
+				_head = 0;
+				_tail = 0;
+				_readPosition = 0;
+			}
+
+			if ( _tail > _head || _usedBytes == 0 )
+			{
+				if ( _capacity - _tail >= size )
+				{
+					position = _tail;
+					return true;
+				}
+
+				if ( _head >= size )
+				{
+					position = 0;
+					skippedBytes = _capacity - _tail;
+					return true;
+				}
+
+				return false;
+			}
+
+			if ( _tail < _head && _head - _tail >= size )
+			{
+				position = _tail;
+				return true;
+			}
+
+			// head == tail with bytes in use means the buffer is full
+			return false;
+		}
+
+		bool WebSocketSendBuffer::isPadding(size_t position) const
+		{
+			// a rest too small for a header is skipped without being marked
+			return _capacity - position < sizeof(RecordHeader) || reinterpret_cast<const RecordHeader*>(_buffer + position)->opcode == PADDING_OPCODE;
+		}
+
+		void WebSocketSendBuffer::dropOldest()
+		{
+			// the oldest queued message is also the oldest message occupying space, as no message is being sent
+			if ( isPadding(_readPosition) )
+			{
+				_readPosition = 0;
+			}
+
+			const RecordHeader *header = reinterpret_cast<const RecordHeader*>(_buffer + _readPosition);
+
+			_readPosition += recordSize(header->length);
+			_queuedMessages--;
+
+			releaseHead();
+		}
+
+		void WebSocketSendBuffer::dropQueued()
+		{
+			destroyQueuedPayloads();
+			discardBehindSendingMessage();
+		}
+
+		void WebSocketSendBuffer::discardBehindSendingMessage()
+		{
+			// the buffer ends behind the message being sent, including the space skipped in front of it
+			_usedBytes = _sendingEnd > _head ? _sendingEnd - _head : _capacity - _head + _sendingEnd;
+			_tail = _sendingEnd;
+			_readPosition = _sendingEnd;
+			_queuedMessages = 0;
+		}
+
+		bool WebSocketSendBuffer::fitsWithoutQueuedMessages(size_t size)
+		{
+			size_t	tail = _tail;
+			size_t	readPosition = _readPosition;
+			size_t	usedBytes = _usedBytes;
+			size_t	queuedMessages = _queuedMessages;
+			size_t	position;
+			size_t	skippedBytes;
+
+			discardBehindSendingMessage();
+			bool fits = findSpace(size, position, skippedBytes);
+
+			_tail = tail;
+			_readPosition = readPosition;
+			_usedBytes = usedBytes;
+			_queuedMessages = queuedMessages;
+
+			return fits;
+		}
+
+		void WebSocketSendBuffer::releaseHead()
+		{
+			if ( isPadding(_head) )
+			{
+				_usedBytes -= _capacity - _head;
+				_head = 0;
+			}
+
+			const RecordHeader *header = reinterpret_cast<const RecordHeader*>(_buffer + _head);
+			size_t size = recordSize(header->length);
+
+			destroyPayload(_head);
+
+			_head += size;
+			_usedBytes -= size;
+		}
+
+		void WebSocketSendBuffer::destroyPayload(size_t position)
+		{
+			if ( isPadding(position) )
+			{
+				position = 0;
+			}
+
+			const RecordHeader *header = reinterpret_cast<const RecordHeader*>(_buffer + position);
+
+			if ( header->isPayload )
+			{
+				reinterpret_cast<Payload*>(_buffer + position + sizeof(RecordHeader))->~Payload();
+			}
+		}
+
+		void WebSocketSendBuffer::destroyQueuedPayloads()
+		{
+			size_t position = _readPosition;
+
+			for ( size_t index = 0; index < _queuedMessages; index++ )
+			{
+				if ( isPadding(position) )
+				{
+					position = 0;
+				}
+
+				destroyPayload(position);
+				position += recordSize( reinterpret_cast<const RecordHeader*>(_buffer + position)->length );
+			}
+		}
+
+	}
+}
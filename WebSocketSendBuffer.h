@@ -0,0 +1,257 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WEBSOCKETSENDBUFFER_H
+#define WEBSOCKETSENDBUFFER_H
+
+#include "Mutex.h"
+#include <functional>
+#include <string>
+#include <variant>
+#include <vector>
+
+extern "C"
+{
+	#include <stddef.h>
+	#include <stdint.h>
+	#include <freertos/FreeRTOS.h>
+	#include <freertos/semphr.h>
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+        /**
+         * @brief The WebSocketSendBuffer class provides a ring buffer of outbound WebSocket messages with a fixed capacity in bytes.
+         *
+         * The messages are stored contiguously, each one behind a small header, so queueing a message neither allocates nor frees memory.
+         * A message never wraps around the end of the buffer, the space left at the end is skipped instead. Instead of its bytes, a message
+         * may also be a Payload the buffer takes the ownership of, which is stored in place of the bytes.
+         *
+         * Any task may \c push messages. Only the WebSocket task takes them with \c front and releases them with \c pop after they were sent.
+         * The message being sent stays in the buffer until it is released, so its bytes are never overwritten while they are sent. While
+         * a message is sent, the \c DropOldest policy can only reuse the space behind it by dropping all queued messages.
+         */
+		class WebSocketSendBuffer
+		{
+			public:
+
+                /**
+                 * @brief Defines how \c push handles a message which does not fit into the free space
+                 */
+				enum Policy : uint8_t
+				{
+					FailFast,		/**< reject the message */
+					Block,			/**< wait until the message fits or the timeout expires, then reject it */
+					DropOldest		/**< drop the oldest queued messages until the message fits */
+				};
+
+                /**
+                 * @brief The Payload class holds the payload of a message handed over without copying it.
+                 *
+                 * The payload is either a moved string, moved bytes or a buffer released by a deleter, which is called when the message was
+                 * sent, dropped or rejected.
+                 */
+				class Payload
+				{
+					public:
+
+						typedef std::function<void(char *data, size_t length)>	Deleter;
+
+											Payload(std::string &&string);
+											Payload(std::vector<uint8_t> &&bytes);
+											Payload(char *data, size_t length, Deleter deleter);
+
+											Payload(Payload&&) = default;
+											Payload(const Payload&) = delete;
+
+						char*				data(void);
+						size_t				length(void) const;
+
+					private:
+
+						struct Buffer
+						{
+												Buffer(char *data, size_t length, Deleter deleter);
+												Buffer(Buffer &&other);
+												~Buffer();
+
+												Buffer(const Buffer&) = delete;
+
+							char				*_data;
+							size_t				_length;
+							Deleter				_deleter;
+						};
+
+						std::variant<std::string, std::vector<uint8_t>, Buffer>	_storage;
+				};
+
+                /**
+                 * @brief The Message struct refers to a message inside the buffer
+                 */
+				struct Message
+				{
+					const char		*data;		/**< the payload, valid until it is released */
+					size_t			length;		/**< the length of the payload in bytes */
+					uint8_t			opcode;		/**< the WebSocket opcode of the message */
+				};
+
+								WebSocketSendBuffer();
+								~WebSocketSendBuffer();
+
+								WebSocketSendBuffer(const WebSocketSendBuffer&) = delete;
+
+                /**
+                 * @brief Allocates the buffer
+                 *
+                 * @param capacity  the capacity in bytes, including a header of 8 bytes per message
+                 *
+                 * @return  true on success
+                 * @return  false if the buffer could not be allocated
+                 */
+				bool			init(size_t capacity);
+
+                /**
+                 * @brief Frees the buffer and discards all messages
+                 */
+				void			deinit(void);
+
+                /**
+                 * @brief Sets how \c push handles a message which does not fit. Can be called from any task.
+                 *
+                 * @param policy        the policy, \c FailFast by default
+                 * @param timeoutMS     the maximum time a \c push waits for free space with the \c Block policy
+                 */
+				void			setPolicy(Policy policy, uint32_t timeoutMS = 0);
+
+                /**
+                 * @brief Returns the length of the largest message which can be pushed right now without dropping or waiting
+                 *
+                 * A Payload takes \c sizeof(Payload) bytes regardless of its length.
+                 */
+				size_t			freeSpace(void);
+
+                /**
+                 * @brief Copies a message into the buffer. Can be called from any task.
+                 *
+                 * @param opcode    the WebSocket opcode of the message
+                 * @param data      the payload
+                 * @param length    the length of the payload in bytes
+                 * @param mayBlock  false if the calling task must not wait, the \c Block policy then behaves like \c FailFast
+                 *
+                 * @return  >  \c 0 the length of the queued message
+                 * @return  \c 0 if the message was rejected, because it does not fit
+                 * @return  <  \c 0 if the message is empty, exceeds the capacity or the buffer is not initialized
+                 */
+				int				push(uint8_t opcode, const char *data, size_t length, bool mayBlock = true);
+
+                /**
+                 * @brief Queues a message without copying its payload. Can be called from any task.
+                 *
+                 * The payload is moved into the buffer only if the message is queued, otherwise it is left to the caller.
+                 *
+                 * @param opcode    the WebSocket opcode of the message
+                 * @param payload   the payload
+                 * @param mayBlock  false if the calling task must not wait, the \c Block policy then behaves like \c FailFast
+                 *
+                 * @return  >  \c 0 the length of the queued message
+                 * @return  \c 0 if the message was rejected, because it does not fit
+                 * @return  <  \c 0 if the message is empty or the buffer is not initialized
+                 */
+				int				push(uint8_t opcode, Payload &&payload, bool mayBlock = true);
+
+                /**
+                 * @brief Takes the oldest queued message. Must only be called by the WebSocket task.
+                 *
+                 * The message stays valid until it is released with \c pop.
+                 *
+                 * @param message   receives the message
+                 *
+                 * @return  true if a message was taken
+                 * @return  false if no message is queued or the previous message was not released yet
+                 */
+				bool			front(Message &message);
+
+                /**
+                 * @brief Releases the message taken by \c front. Must only be called by the WebSocket task.
+                 */
+				void			pop(void);
+
+                /**
+                 * @brief Discards all queued messages. Must only be called by the WebSocket task.
+                 */
+				void			clear(void);
+
+                /**
+                 * @brief Returns the number of messages dropped by the \c DropOldest policy
+                 */
+				uint32_t		droppedMessages(void);
+
+			private:
+
+				struct RecordHeader
+				{
+					uint32_t	length;			/**< the length of the bytes stored behind the header */
+					uint8_t		opcode;
+					bool		isPayload;		/**< true if a Payload is stored instead of the bytes of the message */
+					uint8_t		reserved[2];
+				};
+
+				int				reserve(size_t recordSize, bool mayBlock, size_t &position);
+				void			releaseWaitingProducer(void);
+				size_t			recordSize(size_t length) const;
+				bool			findSpace(size_t recordSize, size_t &position, size_t &skippedBytes);
+				bool			isPadding(size_t position) const;
+				void			dropOldest(void);
+				void			dropQueued(void);
+				void			discardBehindSendingMessage(void);
+				bool			fitsWithoutQueuedMessages(size_t recordSize);
+				void			releaseHead(void);
+				void			destroyPayload(size_t position);
+				void			destroyQueuedPayloads(void);
+
+				char				*_buffer = { nullptr };
+				size_t				_capacity = { 0 };
+
+				/** \brief  The first occupied byte, the next byte to write and the oldest message not taken yet */
+				size_t				_head = { 0 };
+				size_t				_tail = { 0 };
+				size_t				_readPosition = { 0 };
+
+				/** \brief  Bytes between head and tail, including the space skipped at the end of the buffer */
+				size_t				_usedBytes = { 0 };
+
+				/** \brief  Messages not taken yet and the end of the message being sent, which is the one at \c _head */
+				size_t				_queuedMessages = { 0 };
+				bool				_isSending = { false };
+				size_t				_sendingEnd = { 0 };
+
+				Policy				_policy = { FailFast };
+				uint32_t			_timeoutMS = { 0 };
+				uint32_t			_droppedMessages = { 0 };
+
+				/** \brief  Given when space was released, so a blocked \c push checks the free space again */
+				SemaphoreHandle_t	_spaceReleased = { nullptr };
+				uint16_t			_waitingProducers = { 0 };
+
+				Mutex				_mutex = { Mutex::Recursive };
+		};
+	}
+}
+
+#endif
@@ -0,0 +1,500 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "TLSTestFixture.h"
+#include "MutexLocker.h"
+
+#include <algorithm>
+
+extern "C"
+{
+	#include <esp_netif.h>
+	#include "lwip/sockets.h"
+}
+
+#if ! defined(IDFIX_TLS_SESSION_CACHE_OPENSSL)
+extern "C"
+{
+	#include <mbedtls/ctr_drbg.h>
+	#include <mbedtls/net_sockets.h>
+}
+#endif
+
+namespace
+{
+	// the tests with many connections wait for an event of each connection
+	const UBaseType_t	EVENT_LIMIT		= 1024;
+
+#if ! defined(IDFIX_TLS_SESSION_CACHE_OPENSSL)
+	// mirrors struct ssl_pm of the OpenSSL layer of ESP-IDF (openssl/platform/ssl_pm.c) up to the mbedtls context of an SSL
+	struct PlatformSsl
+	{
+		mbedtls_net_context			fd;
+		mbedtls_net_context			clientFd;
+		mbedtls_ssl_config			config;
+		mbedtls_ctr_drbg_context	randomGenerator;
+		mbedtls_ssl_context			context;
+	};
+
+	mbedtls_ssl_context *platformContext(SSL *tlsPeer)
+	{
+		return &static_cast<PlatformSsl*>(tlsPeer->ssl_pm)->context;
+	}
+#endif
+
+	void initNetwork()
+	{
+		static bool isInitialized = false;
+
+		if ( ! isInitialized )
+		{
+			// the tests only use the loopback interface, so no network interface has to be up
+			esp_netif_init();
+			isInitialized = true;
+		}
+	}
+
+	void setReceiveTimeout(int socket, uint32_t timeoutMS)
+	{
+		struct timeval timeout = { static_cast<time_t>(timeoutMS / 1000), static_cast<suseconds_t>( (timeoutMS % 1000) * 1000 ) };
+		setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout) );
+	}
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+		namespace Test
+		{
+			const unsigned char TEST_CERTIFICATE[] =
+			{
+				0x30, 0x82, 0x01, 0x9c, 0x30, 0x82, 0x01, 0x41, 0xa0, 0x03, 0x02, 0x01, 0x02, 0x02, 0x14, 0x40,
+				0xe5, 0x90, 0xb6, 0xfa, 0x38, 0x76, 0xce, 0xa4, 0xc4, 0x87, 0x63, 0x5f, 0xd7, 0x16, 0x3c, 0xf6,
+				0xbe, 0x69, 0xe8, 0x30, 0x0a, 0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x04, 0x03, 0x02, 0x30,
+				0x14, 0x31, 0x12, 0x30, 0x10, 0x06, 0x03, 0x55, 0x04, 0x03, 0x0c, 0x09, 0x31, 0x32, 0x37, 0x2e,
+				0x30, 0x2e, 0x30, 0x2e, 0x31, 0x30, 0x20, 0x17, 0x0d, 0x32, 0x36, 0x31, 0x30, 0x31, 0x35, 0x30,
+				0x35, 0x30, 0x38, 0x30, 0x34, 0x5a, 0x18, 0x0f, 0x32, 0x31, 0x32, 0x36, 0x30, 0x39, 0x32, 0x31,
+				0x30, 0x35, 0x30, 0x38, 0x30, 0x34, 0x5a, 0x30, 0x14, 0x31, 0x12, 0x30, 0x10, 0x06, 0x03, 0x55,
+				0x04, 0x03, 0x0c, 0x09, 0x31, 0x32, 0x37, 0x2e, 0x30, 0x2e, 0x30, 0x2e, 0x31, 0x30, 0x59, 0x30,
+				0x13, 0x06, 0x07, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01, 0x06, 0x08, 0x2a, 0x86, 0x48, 0xce,
+				0x3d, 0x03, 0x01, 0x07, 0x03, 0x42, 0x00, 0x04, 0xd7, 0x13, 0xdd, 0xb1, 0x52, 0x5b, 0x89, 0x7c,
+				0x0f, 0x31, 0x85, 0x2d, 0x9b, 0x30, 0x91, 0xe1, 0x1a, 0xab, 0x15, 0x35, 0x29, 0xaf, 0x47, 0xd5,
+				0xce, 0x72, 0x31, 0x0a, 0x78, 0xd7, 0xa5, 0xe4, 0xba, 0x33, 0xbe, 0x0d, 0xce, 0x96, 0x26, 0x05,
+				0xd1, 0x9c, 0x8c, 0x7d, 0x52, 0xc8, 0xc2, 0x0e, 0x8e, 0xcf, 0x4e, 0x0d, 0x07, 0x7c, 0xda, 0x0c,
+				0x34, 0x44, 0xed, 0x29, 0xcb, 0x1e, 0xe4, 0xd0, 0xa3, 0x6f, 0x30, 0x6d, 0x30, 0x1d, 0x06, 0x03,
+				0x55, 0x1d, 0x0e, 0x04, 0x16, 0x04, 0x14, 0x6d, 0xa0, 0xa7, 0xe3, 0xc3, 0xdb, 0xa0, 0xeb, 0x34,
+				0x76, 0x15, 0x65, 0x45, 0xaf, 0xd6, 0x4e, 0xd4, 0x16, 0x90, 0xa7, 0x30, 0x1f, 0x06, 0x03, 0x55,
+				0x1d, 0x23, 0x04, 0x18, 0x30, 0x16, 0x80, 0x14, 0x6d, 0xa0, 0xa7, 0xe3, 0xc3, 0xdb, 0xa0, 0xeb,
+				0x34, 0x76, 0x15, 0x65, 0x45, 0xaf, 0xd6, 0x4e, 0xd4, 0x16, 0x90, 0xa7, 0x30, 0x0f, 0x06, 0x03,
+				0x55, 0x1d, 0x13, 0x01, 0x01, 0xff, 0x04, 0x05, 0x30, 0x03, 0x01, 0x01, 0xff, 0x30, 0x1a, 0x06,
+				0x03, 0x55, 0x1d, 0x11, 0x04, 0x13, 0x30, 0x11, 0x82, 0x09, 0x31, 0x32, 0x37, 0x2e, 0x30, 0x2e,
+				0x30, 0x2e, 0x31, 0x87, 0x04, 0x7f, 0x00, 0x00, 0x01, 0x30, 0x0a, 0x06, 0x08, 0x2a, 0x86, 0x48,
+				0xce, 0x3d, 0x04, 0x03, 0x02, 0x03, 0x49, 0x00, 0x30, 0x46, 0x02, 0x21, 0x00, 0xd9, 0x16, 0x20,
+				0x41, 0xda, 0x14, 0x9f, 0xf5, 0xbf, 0x85, 0x7a, 0xa4, 0x04, 0xd2, 0x48, 0xab, 0x7e, 0x77, 0xf4,
+				0x4f, 0xb6, 0x05, 0x25, 0xed, 0x5a, 0xd8, 0x41, 0x20, 0x99, 0xf4, 0x28, 0x73, 0x02, 0x21, 0x00,
+				0xe6, 0x27, 0x70, 0x6f, 0xc8, 0x65, 0x00, 0x9f, 0x7b, 0x39, 0xc5, 0x50, 0x9a, 0xd7, 0x46, 0x46,
+				0x6c, 0xf6, 0xf5, 0xd7, 0x7a, 0x2c, 0xab, 0x85, 0x20, 0xe1, 0x4e, 0x29, 0xcd, 0x90, 0x7b, 0x0e,
+			};
+
+			const long TEST_CERTIFICATE_LENGTH = sizeof(TEST_CERTIFICATE);
+
+			const unsigned char TEST_PRIVATE_KEY[] =
+			{
+				0x30, 0x77, 0x02, 0x01, 0x01, 0x04, 0x20, 0xcd, 0x66, 0xdf, 0xd5, 0xb0, 0xb1, 0xe6, 0x5d, 0x7f,
+				0x74, 0xd0, 0xcd, 0xdd, 0x97, 0xa2, 0x16, 0xd7, 0xce, 0x3a, 0xf1, 0x76, 0x35, 0x89, 0x90, 0xc6,
+				0x98, 0x8d, 0xe9, 0xf9, 0x96, 0x59, 0xd1, 0xa0, 0x0a, 0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d,
+				0x03, 0x01, 0x07, 0xa1, 0x44, 0x03, 0x42, 0x00, 0x04, 0xd7, 0x13, 0xdd, 0xb1, 0x52, 0x5b, 0x89,
+				0x7c, 0x0f, 0x31, 0x85, 0x2d, 0x9b, 0x30, 0x91, 0xe1, 0x1a, 0xab, 0x15, 0x35, 0x29, 0xaf, 0x47,
+				0xd5, 0xce, 0x72, 0x31, 0x0a, 0x78, 0xd7, 0xa5, 0xe4, 0xba, 0x33, 0xbe, 0x0d, 0xce, 0x96, 0x26,
+				0x05, 0xd1, 0x9c, 0x8c, 0x7d, 0x52, 0xc8, 0xc2, 0x0e, 0x8e, 0xcf, 0x4e, 0x0d, 0x07, 0x7c, 0xda,
+				0x0c, 0x34, 0x44, 0xed, 0x29, 0xcb, 0x1e, 0xe4, 0xd0,
+			};
+
+			const long TEST_PRIVATE_KEY_LENGTH = sizeof(TEST_PRIVATE_KEY);
+
+			const char TEST_CERTIFICATE_PEM[] =
+				"-----BEGIN CERTIFICATE-----\n"
+				"MIIBnDCCAUGgAwIBAgIUQOWQtvo4ds6kxIdjX9cWPPa+aegwCgYIKoZIzj0EAwIw\n"
+				"FDESMBAGA1UEAwwJMTI3LjAuMC4xMCAXDTI2MTAxNTA1MDgwNFoYDzIxMjYwOTIx\n"
+				"MDUwODA0WjAUMRIwEAYDVQQDDAkxMjcuMC4wLjEwWTATBgcqhkjOPQIBBggqhkjO\n"
+				"PQMBBwNCAATXE92xUluJfA8xhS2bMJHhGqsVNSmvR9XOcjEKeNel5Lozvg3OliYF\n"
+				"0ZyMfVLIwg6Oz04NB3zaDDRE7SnLHuTQo28wbTAdBgNVHQ4EFgQUbaCn48PboOs0\n"
+				"dhVlRa/WTtQWkKcwHwYDVR0jBBgwFoAUbaCn48PboOs0dhVlRa/WTtQWkKcwDwYD\n"
+				"VR0TAQH/BAUwAwEB/zAaBgNVHREEEzARggkxMjcuMC4wLjGHBH8AAAEwCgYIKoZI\n"
+				"zj0EAwIDSQAwRgIhANkWIEHaFJ/1v4V6pATSSKt+d/RPtgUl7VrYQSCZ9ChzAiEA\n"
+				"5idwb8hlAJ97OcVQmtdGRmz29dd6LKuFIOFOKc2Qew4=\n"
+				"-----END CERTIFICATE-----\n";
+
+			int64_t percentile(std::vector<int64_t> &samples, uint8_t percent)
+			{
+				if ( samples.empty() )
+				{
+					return 0;
+				}
+
+				std::sort(samples.begin(), samples.end() );
+				return samples[ std::min(samples.size() - 1, samples.size() * percent / 100) ];
+			}
+
+			TestServer::TestServer()
+			{
+				_server = new TLSServer(this);
+
+				_connectedSemaphore = xSemaphoreCreateCounting(EVENT_LIMIT, 0);
+				_backpressureSemaphore = xSemaphoreCreateCounting(EVENT_LIMIT, 0);
+				_writableSemaphore = xSemaphoreCreateCounting(EVENT_LIMIT, 0);
+				_disconnectedSemaphore = xSemaphoreCreateCounting(EVENT_LIMIT, 0);
+			}
+
+			TestServer::~TestServer()
+			{
+				stop();
+
+				vSemaphoreDelete(_connectedSemaphore);
+				vSemaphoreDelete(_backpressureSemaphore);
+				vSemaphoreDelete(_writableSemaphore);
+				vSemaphoreDelete(_disconnectedSemaphore);
+			}
+
+			TLSServer &TestServer::server()
+			{
+				return *_server;
+			}
+
+			bool TestServer::start(uint16_t port)
+			{
+				initNetwork();
+
+				return _server->init() && _server->setCertificate(TEST_CERTIFICATE, TEST_CERTIFICATE_LENGTH)
+						&& _server->setPrivateKey(TEST_PRIVATE_KEY, TEST_PRIVATE_KEY_LENGTH) && _server->listen(port);
+			}
+
+			void TestServer::stop()
+			{
+				_server->shutdown();
+
+				// the workers close the connections after leaving their event loops
+				vTaskDelay( pdMS_TO_TICKS(200) );
+
+				MutexLocker locker(_mutex);
+				_connections.clear();
+			}
+
+			void TestServer::setEcho(bool isEnabled)
+			{
+				_isEcho = isEnabled;
+			}
+
+			TLSSocket_sharedPtr TestServer::waitForConnection(uint32_t timeoutMS)
+			{
+				if ( xSemaphoreTake(_connectedSemaphore, pdMS_TO_TICKS(timeoutMS) ) != pdTRUE )
+				{
+					return nullptr;
+				}
+
+				MutexLocker locker(_mutex);
+				return _newConnection;
+			}
+
+			bool TestServer::waitForBackpressure(uint32_t timeoutMS)
+			{
+				return xSemaphoreTake(_backpressureSemaphore, pdMS_TO_TICKS(timeoutMS) ) == pdTRUE;
+			}
+
+			bool TestServer::waitForWritable(uint32_t timeoutMS)
+			{
+				return xSemaphoreTake(_writableSemaphore, pdMS_TO_TICKS(timeoutMS) ) == pdTRUE;
+			}
+
+			bool TestServer::waitForDisconnect(uint32_t timeoutMS)
+			{
+				return xSemaphoreTake(_disconnectedSemaphore, pdMS_TO_TICKS(timeoutMS) ) == pdTRUE;
+			}
+
+			TaskHandle_t TestServer::eventTask()
+			{
+				return _eventTask.load();
+			}
+
+			size_t TestServer::bytesReceived()
+			{
+				return _bytesReceived.load();
+			}
+
+			size_t TestServer::connectionCount()
+			{
+				MutexLocker locker(_mutex);
+				return _connections.size();
+			}
+
+			void TestServer::tlsNewConnection(TLSSocket_weakPtr socket)
+			{
+				TLSSocket_sharedPtr tlsSocket = socket.lock();
+
+				if ( tlsSocket == nullptr )
+				{
+					return;
+				}
+
+				tlsSocket->setEventHandler(this);
+
+				_mutex.lock();
+					_connections.push_back(tlsSocket);
+					_newConnection = tlsSocket;
+				_mutex.unlock();
+
+				xSemaphoreGive(_connectedSemaphore);
+			}
+
+			void TestServer::socketBytesReceived(TLSSocket &tlsSocket, ByteArray &bytes)
+			{
+				_bytesReceived += bytes.size();
+
+				if ( _isEcho )
+				{
+					tlsSocket.write(bytes.data(), bytes.size() );
+				}
+			}
+
+			void TestServer::socketDisconnected(TLSSocket &tlsSocket)
+			{
+				xSemaphoreGive(_disconnectedSemaphore);
+			}
+
+			void TestServer::socketBackpressure(TLSSocket &tlsSocket)
+			{
+				_eventTask = xTaskGetCurrentTaskHandle();
+				xSemaphoreGive(_backpressureSemaphore);
+			}
+
+			void TestServer::socketWritable(TLSSocket &tlsSocket)
+			{
+				_eventTask = xTaskGetCurrentTaskHandle();
+				xSemaphoreGive(_writableSemaphore);
+			}
+
+			TestClient::TestClient()
+			{
+#if ! defined(IDFIX_TLS_SESSION_CACHE_OPENSSL)
+				mbedtls_ssl_session_init(&_session);
+#endif
+			}
+
+			TestClient::~TestClient()
+			{
+				close();
+
+#if defined(IDFIX_TLS_SESSION_CACHE_OPENSSL)
+				if ( _session != nullptr )
+				{
+					SSL_SESSION_free(_session);
+				}
+#else
+				mbedtls_ssl_session_free(&_session);
+#endif
+			}
+
+			bool TestClient::connect(uint16_t port, uint32_t timeoutMS)
+			{
+				close();
+
+				_socket = socket(AF_INET, SOCK_STREAM, 0);
+
+				if ( _socket < 0 )
+				{
+					return false;
+				}
+
+				struct sockaddr_in socketAddress;
+				memset(&socketAddress, 0, sizeof(socketAddress) );
+				socketAddress.sin_family		= AF_INET;
+				socketAddress.sin_addr.s_addr	= htonl(INADDR_LOOPBACK);
+				socketAddress.sin_port			= htons(port);
+
+				if ( ::connect(_socket, reinterpret_cast<struct sockaddr *>(&socketAddress), sizeof(socketAddress) ) != 0 )
+				{
+					return false;
+				}
+
+				setReceiveTimeout(_socket, timeoutMS);
+
+				_tlsContext = SSL_CTX_new( TLSv1_2_client_method() );
+
+				if ( _tlsContext == nullptr )
+				{
+					return false;
+				}
+
+				// the test certificate is self-signed
+				SSL_CTX_set_verify(_tlsContext, SSL_VERIFY_NONE, nullptr);
+
+				_tlsPeer = SSL_new(_tlsContext);
+
+				if ( _tlsPeer == nullptr )
+				{
+					return false;
+				}
+
+				SSL_set_fd(_tlsPeer, _socket);
+
+				if ( _isSessionReuse )
+				{
+#if defined(IDFIX_TLS_SESSION_CACHE_OPENSSL)
+					if ( _session != nullptr )
+					{
+						SSL_set_session(_tlsPeer, _session);
+					}
+#else
+					if ( _hasSession )
+					{
+						mbedtls_ssl_set_session(platformContext(_tlsPeer), &_session);
+					}
+#endif
+				}
+
+				return SSL_connect(_tlsPeer) == 1;
+			}
+
+			int TestClient::write(const char *bytes, size_t len)
+			{
+				size_t bytesWritten = 0;
+
+				while ( bytesWritten < len )
+				{
+					int result = SSL_write(_tlsPeer, bytes + bytesWritten, static_cast<int>(len - bytesWritten) );
+
+					if ( result <= 0 )
+					{
+						return result;
+					}
+
+					bytesWritten += static_cast<size_t>(result);
+				}
+
+				return static_cast<int>(len);
+			}
+
+			bool TestClient::read(char *buffer, size_t len, uint32_t timeoutMS)
+			{
+				size_t		bytesRead = 0;
+				TickType_t	deadline = xTaskGetTickCount() + pdMS_TO_TICKS(timeoutMS);
+
+				while ( bytesRead < len )
+				{
+					int result = SSL_read(_tlsPeer, buffer + bytesRead, static_cast<int>(len - bytesRead) );
+
+					if ( result > 0 )
+					{
+						bytesRead += static_cast<size_t>(result);
+						continue;
+					}
+
+					// the receive timeout of the socket interrupts a read waiting for bytes which never arrive
+					if ( static_cast<int32_t>( xTaskGetTickCount() - deadline ) >= 0 )
+					{
+						return false;
+					}
+
+					int error = SSL_get_error(_tlsPeer, result);
+
+					if ( error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE && error != SSL_ERROR_SYSCALL )
+					{
+						return false;
+					}
+				}
+
+				return true;
+			}
+
+			bool TestClient::skip(size_t len, uint32_t timeoutMS)
+			{
+				char buffer[512];
+
+				while ( len > 0 )
+				{
+					size_t length = std::min(len, sizeof(buffer) );
+
+					if ( ! read(buffer, length, timeoutMS) )
+					{
+						return false;
+					}
+
+					len -= length;
+				}
+
+				return true;
+			}
+
+			bool TestClient::echo(const char *bytes, size_t len, uint32_t timeoutMS)
+			{
+				std::vector<char> buffer(len);
+
+				if ( write(bytes, len) != static_cast<int>(len) || ! read(buffer.data(), len, timeoutMS) )
+				{
+					return false;
+				}
+
+				return memcmp(buffer.data(), bytes, len) == 0;
+			}
+
+			void TestClient::setSessionReuse(bool isEnabled)
+			{
+				_isSessionReuse = isEnabled;
+			}
+
+			void TestClient::close()
+			{
+				if ( _tlsPeer != nullptr )
+				{
+					if ( _isSessionReuse )
+					{
+						// the session is taken before the shutdown, which ends the connection but keeps the session resumable
+#if defined(IDFIX_TLS_SESSION_CACHE_OPENSSL)
+						if ( _session != nullptr )
+						{
+							SSL_SESSION_free(_session);
+						}
+
+						_session = SSL_get1_session(_tlsPeer);
+#else
+						mbedtls_ssl_session_free(&_session);
+						mbedtls_ssl_session_init(&_session);
+						_hasSession = mbedtls_ssl_get_session(platformContext(_tlsPeer), &_session) == 0;
+#endif
+					}
+
+					SSL_shutdown(_tlsPeer);
+					SSL_free(_tlsPeer);
+					_tlsPeer = nullptr;
+				}
+
+				if ( _tlsContext != nullptr )
+				{
+					SSL_CTX_free(_tlsContext);
+					_tlsContext = nullptr;
+				}
+
+				if ( _socket != -1 )
+				{
+					::close(_socket);
+					_socket = -1;
+				}
+			}
+		}
+	}
+}
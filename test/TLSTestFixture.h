@@ -0,0 +1,202 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TLSTESTFIXTURE_H
+#define TLSTESTFIXTURE_H
+
+#include "TLSServer.h"
+#include "TLSServerEventHandler.h"
+#include "TLSSocket.h"
+#include "TLSSocketEventHandler.h"
+#include "Mutex.h"
+
+#include <atomic>
+#include <vector>
+
+extern "C"
+{
+	#include <stdint.h>
+	#include <freertos/FreeRTOS.h>
+	#include <freertos/semphr.h>
+	#include <freertos/task.h>
+	#include <openssl/ssl.h>
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+		namespace Test
+		{
+			/** \brief  DER encoded self-signed certificate for 127.0.0.1 and private key (prime256v1) of the test servers */
+			extern const unsigned char	TEST_CERTIFICATE[];
+			extern const long			TEST_CERTIFICATE_LENGTH;
+			extern const unsigned char	TEST_PRIVATE_KEY[];
+			extern const long			TEST_PRIVATE_KEY_LENGTH;
+
+			/** \brief  The test certificate in PEM format, to verify a test server on the loopback interface */
+			extern const char			TEST_CERTIFICATE_PEM[];
+
+#if defined(CONFIG_LWIP_MAX_SOCKETS)
+			/** \brief  The clients and the server share the sockets of lwIP, the server socket needs one more */
+			const size_t				MAX_TEST_CONNECTIONS = (CONFIG_LWIP_MAX_SOCKETS - 1) / 2;
+#else
+			const size_t				MAX_TEST_CONNECTIONS = 1000;
+#endif
+
+            /**
+             * @brief Returns the sample below which \c percent of the samples are, sorts \c samples
+             */
+			int64_t							percentile(std::vector<int64_t> &samples, uint8_t percent);
+
+            /**
+             * @brief The TestServer class runs a TLSServer on the loopback interface and records the events of its connections.
+             *
+             * Configure the server by \c server before calling \c start. A TLSServer cannot be restarted, so each test uses its own
+             * TestServer on its own port.
+             */
+			class TestServer : public TLSServerEventHandler, public TLSSocketEventHandler
+			{
+				public:
+
+									TestServer();
+									~TestServer();
+
+									TestServer(const TestServer&) = delete;
+
+					TLSServer&		server(void);
+
+                    /**
+                     * @brief Loads the test certificate and starts listening on \c port
+                     */
+					bool			start(uint16_t port);
+
+                    /**
+                     * @brief Shuts the server down and releases the connections
+                     */
+					void			stop(void);
+
+                    /**
+                     * @brief Writes the received bytes back to the connection they were received from
+                     */
+					void			setEcho(bool isEnabled);
+
+                    /**
+                     * @brief Waits until the next connection finished its handshake
+                     *
+                     * @return  the TLSSocket of the connection or \c nullptr after \c timeoutMS
+                     */
+					TLSSocket_sharedPtr	waitForConnection(uint32_t timeoutMS);
+
+					bool			waitForBackpressure(uint32_t timeoutMS);
+					bool			waitForWritable(uint32_t timeoutMS);
+					bool			waitForDisconnect(uint32_t timeoutMS);
+
+                    /**
+                     * @brief Returns the task which called the last socketBackpressure or socketWritable event
+                     */
+					TaskHandle_t	eventTask(void);
+
+					size_t			bytesReceived(void);
+					size_t			connectionCount(void);
+
+					virtual void	tlsNewConnection(TLSSocket_weakPtr socket) override;
+					virtual void	socketBytesReceived(TLSSocket& tlsSocket, ByteArray &bytes) override;
+					virtual void	socketDisconnected(TLSSocket& tlsSocket) override;
+					virtual void	socketBackpressure(TLSSocket& tlsSocket) override;
+					virtual void	socketWritable(TLSSocket& tlsSocket) override;
+
+				private:
+
+					/** \brief  A TLSServer has no teardown, the server is kept after the test like in an application shutting it down */
+					TLSServer		*_server;
+
+					SemaphoreHandle_t	_connectedSemaphore;
+					SemaphoreHandle_t	_backpressureSemaphore;
+					SemaphoreHandle_t	_writableSemaphore;
+					SemaphoreHandle_t	_disconnectedSemaphore;
+
+					std::vector<TLSSocket_sharedPtr>	_connections = {};
+					TLSSocket_sharedPtr	_newConnection = { nullptr };
+					std::atomic<TaskHandle_t>	_eventTask = { nullptr };
+					std::atomic<size_t>	_bytesReceived = { 0 };
+					std::atomic<bool>	_isEcho = { false };
+
+					Mutex			_mutex = { Mutex::Recursive };
+			};
+
+            /**
+             * @brief The TestClient class is a blocking TLS client connecting to a TestServer
+             */
+			class TestClient
+			{
+				public:
+
+									TestClient();
+									~TestClient();
+
+									TestClient(const TestClient&) = delete;
+
+					bool			connect(uint16_t port, uint32_t timeoutMS = 5000);
+					int				write(const char* bytes, size_t len);
+
+                    /**
+                     * @brief Reads \c len bytes into \c buffer
+                     *
+                     * @return  true if all bytes were read before \c timeoutMS
+                     */
+					bool			read(char *buffer, size_t len, uint32_t timeoutMS = 5000);
+
+                    /**
+                     * @brief Reads and discards \c len bytes
+                     */
+					bool			skip(size_t len, uint32_t timeoutMS = 5000);
+
+                    /**
+                     * @brief Writes \c len bytes to an echoing TestServer and reads them back
+                     *
+                     * @return  true if the same bytes were read before \c timeoutMS
+                     */
+					bool			echo(const char* bytes, size_t len, uint32_t timeoutMS = 5000);
+
+					void			close(void);
+
+                    /**
+                     * @brief Keeps the TLS session of a connection when it is closed and offers it to the server on the next \c connect
+                     */
+					void			setSessionReuse(bool isEnabled);
+
+				private:
+
+					SSL_CTX			*_tlsContext = { nullptr };
+					SSL				*_tlsPeer = { nullptr };
+					int				_socket = { -1 };
+
+					bool			_isSessionReuse = { false };
+#if defined(IDFIX_TLS_SESSION_CACHE_OPENSSL)
+					SSL_SESSION		*_session = { nullptr };
+#else
+					/** \brief  The OpenSSL layer of ESP-IDF has no session API, so the session of its mbedtls context is kept */
+					mbedtls_ssl_session	_session;
+					bool			_hasSession = { false };
+#endif
+			};
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,291 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "WebSocketTestFixture.h"
+#include "MutexLocker.h"
+
+#include <cstring>
+#include <string>
+
+extern "C"
+{
+	#include <esp_timer.h>
+	#include "mbedtls/base64.h"
+	#include "mbedtls/sha1.h"
+	#include "mbedtls/version.h"
+}
+
+namespace
+{
+	const char*		WEBSOCKET_GUID		= "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	const char*		KEY_HEADER			= "Sec-WebSocket-Key:";
+
+	const uint8_t	OPCODE_CLOSE		= 0x08;
+	const uint8_t	OPCODE_PING			= 0x09;
+	const uint8_t	OPCODE_PONG			= 0x0A;
+
+	bool acceptKey(const std::string &key, std::string &acceptKey)
+	{
+		std::string		keyAndGuid = key + WEBSOCKET_GUID;
+		unsigned char	hash[20];
+		unsigned char	encodedHash[32];
+		size_t			encodedLength = 0;
+
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+		if ( mbedtls_sha1(reinterpret_cast<const unsigned char*>( keyAndGuid.data() ), keyAndGuid.size(), hash) != 0 )
+#else
+		if ( mbedtls_sha1_ret(reinterpret_cast<const unsigned char*>( keyAndGuid.data() ), keyAndGuid.size(), hash) != 0 )
+#endif
+		{
+			return false;
+		}
+
+		if ( mbedtls_base64_encode(encodedHash, sizeof(encodedHash), &encodedLength, hash, sizeof(hash) ) != 0 )
+		{
+			return false;
+		}
+
+		acceptKey.assign(reinterpret_cast<const char*>(encodedHash), encodedLength);
+		return true;
+	}
+}
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+		namespace Test
+		{
+			WebSocketTestServer::WebSocketTestServer()
+			{
+
+			}
+
+			bool WebSocketTestServer::waitForMessages(size_t count, uint32_t timeoutMS)
+			{
+				int64_t deadline = esp_timer_get_time() + static_cast<int64_t>(timeoutMS) * 1000;
+
+				while ( true )
+				{
+					_messageMutex.lock();
+						size_t messageCount = _messages.size();
+					_messageMutex.unlock();
+
+					if ( messageCount >= count )
+					{
+						return true;
+					}
+
+					if ( esp_timer_get_time() > deadline )
+					{
+						return false;
+					}
+
+					vTaskDelay( pdMS_TO_TICKS(1) );
+				}
+			}
+
+			std::vector<WebSocketTestServer::Message> WebSocketTestServer::messages()
+			{
+				MutexLocker locker(_messageMutex);
+				return _messages;
+			}
+
+			void WebSocketTestServer::tlsNewConnection(TLSSocket_weakPtr socket)
+			{
+				_messageMutex.lock();
+					_inbound.clear();
+					_isUpgraded = false;
+					_messages.clear();
+				_messageMutex.unlock();
+
+				TestServer::tlsNewConnection(socket);
+			}
+
+			void WebSocketTestServer::socketBytesReceived(TLSSocket &tlsSocket, ByteArray &bytes)
+			{
+				TestServer::socketBytesReceived(tlsSocket, bytes);
+
+				MutexLocker locker(_messageMutex);
+
+				_inbound.insert(_inbound.end(), bytes.begin(), bytes.end() );
+
+				if ( ! _isUpgraded && ! upgrade(tlsSocket) )
+				{
+					return;
+				}
+
+				parseFrames(tlsSocket);
+			}
+
+			bool WebSocketTestServer::upgrade(TLSSocket &tlsSocket)
+			{
+				std::string	request(_inbound.begin(), _inbound.end() );
+				size_t		requestEnd = request.find("\r\n\r\n");
+
+				if ( requestEnd == std::string::npos )
+				{
+					return false;
+				}
+
+				size_t keyStart = request.find(KEY_HEADER);
+
+				if ( keyStart == std::string::npos )
+				{
+					tlsSocket.close();
+					return false;
+				}
+
+				keyStart = request.find_first_not_of(' ', keyStart + strlen(KEY_HEADER) );
+				size_t keyEnd = request.find("\r\n", keyStart);
+
+				std::string key;
+
+				if ( ! acceptKey(request.substr(keyStart, keyEnd - keyStart), key) )
+				{
+					tlsSocket.close();
+					return false;
+				}
+
+				std::string response = "HTTP/1.1 101 Switching Protocols\r\n"
+									   "Upgrade: websocket\r\n"
+									   "Connection: Upgrade\r\n"
+									   "Sec-WebSocket-Accept: " + key + "\r\n\r\n";
+
+				tlsSocket.write(response.data(), response.size() );
+
+				_inbound.erase(_inbound.begin(), _inbound.begin() + static_cast<long>(requestEnd + 4) );
+				_isUpgraded = true;
+
+				return true;
+			}
+
+			void WebSocketTestServer::parseFrames(TLSSocket &tlsSocket)
+			{
+				size_t offset = 0;
+
+				// the frames of a client are always masked
+				while ( _inbound.size() - offset >= 2 )
+				{
+					const uint8_t	*frame = reinterpret_cast<const uint8_t*>( _inbound.data() + offset );
+					size_t			available = _inbound.size() - offset;
+					uint8_t			opcode = frame[0] & 0x0F;
+					uint64_t		payloadLength = frame[1] & 0x7F;
+					size_t			headerLength = 2;
+
+					if ( payloadLength == 126 )
+					{
+						headerLength += 2;
+					}
+					else if ( payloadLength == 127 )
+					{
+						headerLength += 8;
+					}
+
+					if ( available < headerLength + 4 )
+					{
+						break;
+					}
+
+					if ( payloadLength >= 126 )
+					{
+						payloadLength = 0;
+
+						for ( size_t index = 2; index < headerLength; index++ )
+						{
+							payloadLength = (payloadLength << 8) | frame[index];
+						}
+					}
+
+					if ( available - headerLength - 4 < payloadLength )
+					{
+						break;
+					}
+
+					const uint8_t	*mask = frame + headerLength;
+					const uint8_t	*maskedPayload = mask + 4;
+					Message			message;
+
+					message.receiveTime = esp_timer_get_time();
+					message.payload.resize( static_cast<size_t>(payloadLength) );
+
+					for ( size_t index = 0; index < payloadLength; index++ )
+					{
+						message.payload[index] = static_cast<char>( maskedPayload[index] ^ mask[index % 4] );
+					}
+
+					offset += headerLength + 4 + static_cast<size_t>(payloadLength);
+
+					if ( opcode == OPCODE_CLOSE )
+					{
+						// answer with the status code of the client, the server frames are not masked
+						char closeFrame[4] = { static_cast<char>(0x80 | OPCODE_CLOSE), 0 };
+						size_t closeLength = 2;
+
+						if ( message.payload.size() >= 2 )
+						{
+							closeFrame[1] = 2;
+							closeFrame[2] = message.payload[0];
+							closeFrame[3] = message.payload[1];
+							closeLength = 4;
+						}
+
+						tlsSocket.write(closeFrame, closeLength);
+					}
+					else if ( opcode != OPCODE_PING && opcode != OPCODE_PONG )
+					{
+						_messages.push_back( std::move(message) );
+					}
+				}
+
+				_inbound.erase(_inbound.begin(), _inbound.begin() + static_cast<long>(offset) );
+			}
+
+			TestWebSocketHandler::TestWebSocketHandler()
+			{
+				_connectedSemaphore = xSemaphoreCreateCounting(16, 0);
+				_disconnectedSemaphore = xSemaphoreCreateCounting(16, 0);
+			}
+
+			TestWebSocketHandler::~TestWebSocketHandler()
+			{
+				vSemaphoreDelete(_connectedSemaphore);
+				vSemaphoreDelete(_disconnectedSemaphore);
+			}
+
+			bool TestWebSocketHandler::waitForConnected(uint32_t timeoutMS)
+			{
+				return xSemaphoreTake(_connectedSemaphore, pdMS_TO_TICKS(timeoutMS) ) == pdTRUE;
+			}
+
+			bool TestWebSocketHandler::waitForDisconnected(uint32_t timeoutMS)
+			{
+				return xSemaphoreTake(_disconnectedSemaphore, pdMS_TO_TICKS(timeoutMS) ) == pdTRUE;
+			}
+
+			void TestWebSocketHandler::webSocketConnected()
+			{
+				xSemaphoreGive(_connectedSemaphore);
+			}
+
+			void TestWebSocketHandler::webSocketDisconnected()
+			{
+				xSemaphoreGive(_disconnectedSemaphore);
+			}
+		}
+	}
+}
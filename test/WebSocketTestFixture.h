@@ -0,0 +1,107 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WEBSOCKETTESTFIXTURE_H
+#define WEBSOCKETTESTFIXTURE_H
+
+#include "TLSTestFixture.h"
+#include "WebSocket.h"
+#include "WebSocketEventHandler.h"
+
+#include <vector>
+
+namespace IDFix
+{
+	namespace Protocols
+	{
+		namespace Test
+		{
+            /**
+             * @brief The WebSocketTestServer class is a wss server on the loopback interface recording the messages of a WebSocket client.
+             *
+             * The server answers the opening handshake and unmasks the frames of the client, the messages are not answered. It serves one
+             * client at a time, a new connection discards the messages of the previous one. Connect with \c TEST_CERTIFICATE_PEM as CA
+             * certificate to wss://127.0.0.1:<port>.
+             */
+			class WebSocketTestServer : public TestServer
+			{
+				public:
+
+					struct Message
+					{
+						int64_t		receiveTime;	/**< esp_timer_get_time() when the frame was parsed */
+						ByteArray	payload;
+					};
+
+									WebSocketTestServer();
+
+                    /**
+                     * @brief Waits until \c count messages of the current client were received
+                     */
+					bool			waitForMessages(size_t count, uint32_t timeoutMS);
+
+					std::vector<Message>	messages(void);
+
+					virtual void	tlsNewConnection(TLSSocket_weakPtr socket) override;
+					virtual void	socketBytesReceived(TLSSocket& tlsSocket, ByteArray &bytes) override;
+
+				private:
+
+                    /**
+                     * @brief Answers the opening handshake once the request is complete
+                     *
+                     * @return  false if the request is incomplete or invalid
+                     */
+					bool			upgrade(TLSSocket& tlsSocket);
+
+					void			parseFrames(TLSSocket& tlsSocket);
+
+					ByteArray		_inbound = {};
+					bool			_isUpgraded = { false };
+					std::vector<Message>	_messages = {};
+
+					Mutex			_messageMutex = { Mutex::Recursive };
+			};
+
+            /**
+             * @brief The TestWebSocketHandler class records the connection events of a WebSocket
+             */
+			class TestWebSocketHandler : public WebSocketEventHandler
+			{
+				public:
+
+									TestWebSocketHandler();
+									~TestWebSocketHandler();
+
+									TestWebSocketHandler(const TestWebSocketHandler&) = delete;
+
+					bool			waitForConnected(uint32_t timeoutMS);
+					bool			waitForDisconnected(uint32_t timeoutMS);
+
+					virtual void	webSocketConnected(void) override;
+					virtual void	webSocketDisconnected(void) override;
+
+				private:
+
+					SemaphoreHandle_t	_connectedSemaphore;
+					SemaphoreHandle_t	_disconnectedSemaphore;
+			};
+		}
+	}
+}
+
+#endif
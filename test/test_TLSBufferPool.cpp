@@ -0,0 +1,83 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unity.h"
+#include "TLSTestFixture.h"
+
+#include <vector>
+
+extern "C"
+{
+	#include <stdio.h>
+	#include <esp_timer.h>
+}
+
+using namespace IDFix::Protocols;
+using namespace IDFix::Protocols::Test;
+
+namespace
+{
+	const uint16_t	ALLOCATION_TEST_PORT	= 8466;
+
+	const size_t	MESSAGE_COUNT			= 1000;
+	const size_t	MESSAGE_LENGTHS[]		= { 32, 512, 1400, 4096, 16384 };
+
+	// a few buffers per size class, without the pool every message costs at least one allocation
+	const size_t	MAX_ALLOCATIONS			= 16;
+}
+
+TEST_CASE("TLSServer receive buffer allocations for a 1000 message stream", "[idfix-protocols][tls][perf]")
+{
+	TestServer	server;
+	TestClient	client;
+
+	TEST_ASSERT_TRUE( server.start(ALLOCATION_TEST_PORT) );
+	TEST_ASSERT_TRUE( client.connect(ALLOCATION_TEST_PORT) );
+	TEST_ASSERT_NOT_NULL( server.waitForConnection(5000).get() );
+
+	std::vector<char>	message(MESSAGE_LENGTHS[sizeof(MESSAGE_LENGTHS) / sizeof(MESSAGE_LENGTHS[0]) - 1], 'm');
+	size_t				bytesSent = 0;
+	size_t				allocations = server.server().statistics().bufferAllocations;
+
+	// the lengths vary, so every size class of the pool is used
+	for ( size_t index = 0; index < MESSAGE_COUNT; index++ )
+	{
+		size_t length = MESSAGE_LENGTHS[index % (sizeof(MESSAGE_LENGTHS) / sizeof(MESSAGE_LENGTHS[0]) )];
+
+		TEST_ASSERT_EQUAL( length, client.write(message.data(), length) );
+		bytesSent += length;
+	}
+
+	int64_t deadline = esp_timer_get_time() + 5000000;
+
+	while ( server.bytesReceived() < bytesSent && esp_timer_get_time() < deadline )
+	{
+		vTaskDelay( pdMS_TO_TICKS(1) );
+	}
+
+	TEST_ASSERT_EQUAL( bytesSent, server.bytesReceived() );
+
+	allocations = server.server().statistics().bufferAllocations - allocations;
+
+	printf("TLSServer receive buffer allocations for %u messages (%u bytes): %u\n",
+		   static_cast<unsigned>(MESSAGE_COUNT), static_cast<unsigned>(bytesSent), static_cast<unsigned>(allocations) );
+
+	TEST_ASSERT_LESS_OR_EQUAL( MAX_ALLOCATIONS, allocations );
+
+	client.close();
+	server.stop();
+}
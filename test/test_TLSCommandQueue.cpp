@@ -0,0 +1,134 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unity.h"
+#include "TLSCommandQueue.h"
+
+#include <vector>
+
+extern "C"
+{
+	#include <string.h>
+	#include <freertos/FreeRTOS.h>
+	#include <freertos/semphr.h>
+	#include <freertos/task.h>
+}
+
+using namespace IDFix::Protocols;
+
+namespace
+{
+	const uint32_t	PRODUCER_COUNT			= 4;
+	const uint32_t	COMMANDS_PER_PRODUCER	= 5000;
+
+	struct Producer
+	{
+		TLSCommandQueue		*queue;
+		uint32_t			id;
+		SemaphoreHandle_t	finished;
+	};
+
+	void produce(void *parameter)
+	{
+		Producer *producer = static_cast<Producer*>(parameter);
+
+		for ( uint32_t sequence = 0; sequence < COMMANDS_PER_PRODUCER; sequence++ )
+		{
+			TLSCommand *command = new TLSCommand();
+			uint32_t stamp[2] = { producer->id, sequence };
+
+			command->type = TLSCommand::WriteSocket;
+			command->payload.resize( sizeof(stamp) );
+			memcpy(command->payload.data(), stamp, sizeof(stamp) );
+
+			producer->queue->push(command);
+
+			if ( sequence % 500 == 0 )
+			{
+				// interleave the producers
+				vTaskDelay(1);
+			}
+		}
+
+		xSemaphoreGive(producer->finished);
+		vTaskDelete(nullptr);
+	}
+}
+
+TEST_CASE("TLSCommandQueue keeps the order of every producer", "[idfix-protocols][tls]")
+{
+	TLSCommandQueue queue;
+
+	TEST_ASSERT_NULL( queue.pop() );
+
+	SemaphoreHandle_t finished = xSemaphoreCreateCounting(PRODUCER_COUNT, 0);
+	TEST_ASSERT_NOT_NULL( finished );
+
+	Producer producers[PRODUCER_COUNT];
+
+	for ( uint32_t index = 0; index < PRODUCER_COUNT; index++ )
+	{
+		producers[index] = Producer{ &queue, index, finished };
+		TEST_ASSERT_EQUAL( pdPASS, xTaskCreate(&produce, "producer", 3072, &producers[index], 5, nullptr) );
+	}
+
+	// the single consumer pops while the producers push
+	std::vector<uint32_t> nextSequence(PRODUCER_COUNT, 0);
+	uint32_t finishedProducers = 0;
+	uint32_t received = 0;
+
+	while ( received < PRODUCER_COUNT * COMMANDS_PER_PRODUCER )
+	{
+		TLSCommand *command = queue.pop();
+
+		if ( command == nullptr )
+		{
+			// once all producers finished their pushes, an empty queue means commands were lost
+			TEST_ASSERT_TRUE_MESSAGE( finishedProducers < PRODUCER_COUNT, "commands lost" );
+
+			// a producer in the middle of a push is picked up with the next pop
+			if ( xSemaphoreTake(finished, 1) == pdTRUE )
+			{
+				finishedProducers++;
+			}
+
+			continue;
+		}
+
+		uint32_t stamp[2];
+		TEST_ASSERT_EQUAL( sizeof(stamp), command->payload.size() );
+		memcpy(stamp, command->payload.data(), sizeof(stamp) );
+
+		TEST_ASSERT_LESS_THAN( PRODUCER_COUNT, stamp[0] );
+		TEST_ASSERT_EQUAL_UINT32( nextSequence[ stamp[0] ], stamp[1] );
+
+		nextSequence[ stamp[0] ]++;
+		received++;
+
+		delete command;
+	}
+
+	while ( finishedProducers < PRODUCER_COUNT )
+	{
+		TEST_ASSERT_EQUAL( pdTRUE, xSemaphoreTake(finished, pdMS_TO_TICKS(5000) ) );
+		finishedProducers++;
+	}
+
+	TEST_ASSERT_NULL( queue.pop() );
+
+	vSemaphoreDelete(finished);
+}
@@ -0,0 +1,156 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unity.h"
+#include "TLSCounters.h"
+#include "Mutex.h"
+
+extern "C"
+{
+	#include <inttypes.h>
+	#include <stdio.h>
+	#include <esp_timer.h>
+	#include <freertos/FreeRTOS.h>
+	#include <freertos/semphr.h>
+	#include <freertos/task.h>
+}
+
+using namespace IDFix;
+using namespace IDFix::Protocols;
+
+namespace
+{
+	const uint32_t	TASK_COUNT			= 2;
+	const uint32_t	INCREMENTS_PER_TASK	= 100000;
+
+	struct Incrementer
+	{
+		TLSCounters			*counters;
+		SemaphoreHandle_t	finished;
+	};
+
+	void increment(void *parameter)
+	{
+		Incrementer *incrementer = static_cast<Incrementer*>(parameter);
+
+		for ( uint32_t index = 0; index < INCREMENTS_PER_TASK; index++ )
+		{
+			incrementer->counters->add(TLSCounters::BytesSent, 2);
+			incrementer->counters->add(TLSCounters::RecordsSent);
+		}
+
+		xSemaphoreGive(incrementer->finished);
+		vTaskDelete(nullptr);
+	}
+}
+
+TEST_CASE("TLSCounters counts, aggregates and wraps around", "[idfix-protocols][tls]")
+{
+	TLSCounters first;
+	TLSCounters second;
+
+	TEST_ASSERT_EQUAL_UINT32( 0, first.statistics().bytesSent );
+
+	first.add(TLSCounters::BytesReceived, 100);
+	first.add(TLSCounters::RecordsReceived);
+	first.add(TLSCounters::QueuedBytes, 50);
+	first.subtract(TLSCounters::QueuedBytes, 20);
+
+	second.add(TLSCounters::BytesReceived, 1);
+	second.add(TLSCounters::QueuedBytes, 5);
+
+	TLSCounters::Statistics statistics = first.statistics();
+	TEST_ASSERT_EQUAL_UINT32( 100, statistics.bytesReceived );
+	TEST_ASSERT_EQUAL_UINT32( 1, statistics.recordsReceived );
+	TEST_ASSERT_EQUAL_UINT32( 30, statistics.queuedBytes );
+
+	// the workers of a server are aggregated into one snapshot
+	second.accumulate(statistics);
+	TEST_ASSERT_EQUAL_UINT32( 101, statistics.bytesReceived );
+	TEST_ASSERT_EQUAL_UINT32( 35, statistics.queuedBytes );
+
+	// 32 bit counters wrap around, the difference of two snapshots stays correct
+	uint32_t before = first.statistics().bytesSent;
+	first.add(TLSCounters::BytesSent, UINT32_MAX);
+	first.add(TLSCounters::BytesSent, 10);
+	TEST_ASSERT_EQUAL_UINT32( 9, first.statistics().bytesSent - before );
+}
+
+TEST_CASE("TLSCounters loses no increments of concurrent tasks", "[idfix-protocols][tls]")
+{
+	TLSCounters counters;
+	SemaphoreHandle_t finished = xSemaphoreCreateCounting(TASK_COUNT, 0);
+	Incrementer incrementer = { &counters, finished };
+
+	for ( uint32_t index = 0; index < TASK_COUNT; index++ )
+	{
+		TEST_ASSERT_EQUAL( pdPASS, xTaskCreate(&increment, "incrementer", 2048, &incrementer, 5, nullptr) );
+	}
+
+	for ( uint32_t index = 0; index < TASK_COUNT; index++ )
+	{
+		TEST_ASSERT_EQUAL( pdTRUE, xSemaphoreTake(finished, pdMS_TO_TICKS(10000) ) );
+	}
+
+	TEST_ASSERT_EQUAL_UINT32( 2 * TASK_COUNT * INCREMENTS_PER_TASK, counters.statistics().bytesSent );
+	TEST_ASSERT_EQUAL_UINT32( TASK_COUNT * INCREMENTS_PER_TASK, counters.statistics().recordsSent );
+
+	vSemaphoreDelete(finished);
+}
+
+TEST_CASE("TLSCounters cost per count", "[idfix-protocols][tls][perf]")
+{
+	TLSCounters counters;
+	Mutex mutex(Mutex::Recursive);
+	uint32_t lockedCounter = 0;
+
+	int64_t start = esp_timer_get_time();
+
+	for ( uint32_t index = 0; index < INCREMENTS_PER_TASK; index++ )
+	{
+		counters.add(TLSCounters::BytesSent, index);
+	}
+
+	int64_t atomicTime = esp_timer_get_time() - start;
+
+	// a counter guarded by a mutex, like the socket state of a TLSSocket
+	start = esp_timer_get_time();
+
+	for ( uint32_t index = 0; index < INCREMENTS_PER_TASK; index++ )
+	{
+		mutex.lock();
+			lockedCounter += index;
+		mutex.unlock();
+	}
+
+	int64_t mutexTime = esp_timer_get_time() - start;
+
+	start = esp_timer_get_time();
+
+	for ( uint32_t index = 0; index < INCREMENTS_PER_TASK / 100; index++ )
+	{
+		TLSCounters::Statistics statistics = counters.statistics();
+		lockedCounter += statistics.bytesSent;
+	}
+
+	int64_t snapshotTime = esp_timer_get_time() - start;
+
+	TEST_ASSERT_NOT_EQUAL( 0, lockedCounter );
+
+	printf("TLSCounters: add %" PRId64 " ns (mutex guarded counter %" PRId64 " ns), snapshot %" PRId64 " ns\n",
+		   atomicTime * 1000 / INCREMENTS_PER_TASK, mutexTime * 1000 / INCREMENTS_PER_TASK, snapshotTime * 1000 / (INCREMENTS_PER_TASK / 100) );
+}
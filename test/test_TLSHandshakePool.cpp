@@ -0,0 +1,220 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unity.h"
+#include "TLSHandshakePool.h"
+#include "TLSTestFixture.h"
+
+#include <atomic>
+#include <vector>
+
+extern "C"
+{
+	#include <inttypes.h>
+	#include <stdio.h>
+	#include <esp_timer.h>
+	#include "lwip/sockets.h"
+}
+
+using namespace IDFix::Protocols;
+using namespace IDFix::Protocols::Test;
+
+namespace
+{
+	const uint16_t	STALLED_HANDSHAKE_TEST_PORT	= 8442;
+	const uint16_t	LATENCY_TEST_PORT			= 8451;		// and 8452
+	const uint16_t	DRAINED_HANDSHAKE_TEST_PORT	= 8458;
+
+	const size_t	MESSAGE_LENGTH				= 32;
+	const size_t	ROUND_TRIPS					= 500;
+	const uint32_t	CHURN_CONNECTIONS			= 100;
+
+	struct ConnectionChurn
+	{
+		uint16_t				port;
+		std::atomic<bool>		isStopping;
+		std::atomic<uint32_t>	connections;
+		SemaphoreHandle_t		finished;
+	};
+
+	void churnConnections(void *parameter)
+	{
+		ConnectionChurn *churn = static_cast<ConnectionChurn*>(parameter);
+		TestClient client;
+
+		// every connection costs the server a full handshake, the client disconnects right after it
+		while ( ! churn->isStopping && churn->connections < CHURN_CONNECTIONS )
+		{
+			if ( client.connect(churn->port) )
+			{
+				churn->connections++;
+			}
+
+			client.close();
+		}
+
+		xSemaphoreGive(churn->finished);
+		vTaskDelete(nullptr);
+	}
+}
+
+TEST_CASE("TLSHandshakePool can be restarted after stop", "[idfix-protocols][tls][leaks]")
+{
+	TLSHandshakePool pool;
+
+	TEST_ASSERT_TRUE( pool.start(2, 4) );
+	TEST_ASSERT_TRUE( pool.isRunning() );
+
+	pool.stop();
+	TEST_ASSERT_FALSE( pool.isRunning() );
+
+	// the stopped tasks are resumed instead of started a second time
+	TEST_ASSERT_TRUE( pool.start(3, 2) );
+	pool.stop();
+	TEST_ASSERT_FALSE( pool.isRunning() );
+}
+
+TEST_CASE("TLSServer shutdown cancels a stalled handshake", "[idfix-protocols][tls][leaks]")
+{
+	TestServer server;
+
+	TEST_ASSERT_TRUE( server.server().setHandshakeTasks(1) );
+	TEST_ASSERT_TRUE( server.start(STALLED_HANDSHAKE_TEST_PORT) );
+
+	int client = socket(AF_INET, SOCK_STREAM, 0);
+	TEST_ASSERT_GREATER_OR_EQUAL( 0, client );
+
+	struct sockaddr_in socketAddress;
+	memset(&socketAddress, 0, sizeof(socketAddress) );
+	socketAddress.sin_family		= AF_INET;
+	socketAddress.sin_addr.s_addr	= htonl(INADDR_LOOPBACK);
+	socketAddress.sin_port			= htons(STALLED_HANDSHAKE_TEST_PORT);
+	TEST_ASSERT_EQUAL( 0, connect(client, reinterpret_cast<struct sockaddr *>(&socketAddress), sizeof(socketAddress) ) );
+
+	// the start of a record header hands the connection to the handshake task, which then waits for the rest forever
+	const char recordStart[] = { 0x16, 0x03, 0x01 };
+	TEST_ASSERT_EQUAL( sizeof(recordStart), send(client, recordStart, sizeof(recordStart), 0) );
+	vTaskDelay( pdMS_TO_TICKS(200) );
+
+	int64_t shutdownStart = esp_timer_get_time();
+	server.server().shutdown();
+
+	// the handshake is cancelled at its next cancellation check instead of blocking the shutdown
+	TEST_ASSERT_LESS_THAN( 1000, (esp_timer_get_time() - shutdownStart) / 1000 );
+
+	close(client);
+}
+
+TEST_CASE("TLSServer drain closes a stalled handshake without blocking", "[idfix-protocols][tls][leaks]")
+{
+	TestServer server;
+
+	TEST_ASSERT_TRUE( server.server().setHandshakeTasks(1) );
+	TEST_ASSERT_TRUE( server.start(DRAINED_HANDSHAKE_TEST_PORT) );
+
+	int client = socket(AF_INET, SOCK_STREAM, 0);
+	TEST_ASSERT_GREATER_OR_EQUAL( 0, client );
+
+	struct sockaddr_in socketAddress;
+	memset(&socketAddress, 0, sizeof(socketAddress) );
+	socketAddress.sin_family		= AF_INET;
+	socketAddress.sin_addr.s_addr	= htonl(INADDR_LOOPBACK);
+	socketAddress.sin_port			= htons(DRAINED_HANDSHAKE_TEST_PORT);
+	TEST_ASSERT_EQUAL( 0, connect(client, reinterpret_cast<struct sockaddr *>(&socketAddress), sizeof(socketAddress) ) );
+
+	const char recordStart[] = { 0x16, 0x03, 0x01 };
+	TEST_ASSERT_EQUAL( sizeof(recordStart), send(client, recordStart, sizeof(recordStart), 0) );
+	vTaskDelay( pdMS_TO_TICKS(200) );
+
+	// drain neither waits for the handshake task nor cancels the handshake itself
+	int64_t drainStart = esp_timer_get_time();
+	TEST_ASSERT_TRUE( server.server().drain(5000, 8, 10) );
+	TEST_ASSERT_LESS_THAN( 20, (esp_timer_get_time() - drainStart) / 1000 );
+
+	// the first batch closes the connection, which its handshake task notices at the next cancellation check
+	struct timeval timeout = { 2, 0 };
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout) );
+
+	char byte;
+	TEST_ASSERT_EQUAL( 0, recv(client, &byte, sizeof(byte), 0) );
+
+	close(client);
+	server.stop();
+}
+
+TEST_CASE("TLSServer round trip percentiles during handshakes", "[idfix-protocols][tls][perf]")
+{
+	const uint8_t	handshakeTaskCounts[] = { 0, 2 };
+	uint16_t		port = LATENCY_TEST_PORT;
+	char			message[MESSAGE_LENGTH];
+
+	memset(message, 'x', sizeof(message) );
+
+	for ( uint8_t handshakeTasks : handshakeTaskCounts )
+	{
+		TestServer server;
+		server.setEcho(true);
+		TEST_ASSERT_TRUE( server.server().setHandshakeTasks(handshakeTasks) );
+		TEST_ASSERT_TRUE( server.start(port) );
+
+		TestClient client;
+		TEST_ASSERT_TRUE( client.connect(port) );
+		TEST_ASSERT_NOT_NULL( server.waitForConnection(5000).get() );
+
+		ConnectionChurn churn;
+		churn.port = port;
+		churn.isStopping = false;
+		churn.connections = 0;
+		churn.finished = xSemaphoreCreateBinary();
+
+		std::vector<int64_t> idleRoundTrips;
+		std::vector<int64_t> churnRoundTrips;
+
+		for ( size_t roundTrip = 0; roundTrip < ROUND_TRIPS; roundTrip++ )
+		{
+			int64_t start = esp_timer_get_time();
+			TEST_ASSERT_TRUE( client.echo(message, sizeof(message) ) );
+			idleRoundTrips.push_back( esp_timer_get_time() - start );
+		}
+
+		TEST_ASSERT_EQUAL( pdPASS, xTaskCreate(&churnConnections, "churn", 4096, &churn, 5, nullptr) );
+
+		// the steady connection keeps sending while the other clients connect
+		while ( churnRoundTrips.size() < ROUND_TRIPS || churn.connections < CHURN_CONNECTIONS / 2 )
+		{
+			int64_t start = esp_timer_get_time();
+			TEST_ASSERT_TRUE( client.echo(message, sizeof(message) ) );
+			churnRoundTrips.push_back( esp_timer_get_time() - start );
+		}
+
+		churn.isStopping = true;
+		TEST_ASSERT_EQUAL( pdTRUE, xSemaphoreTake(churn.finished, pdMS_TO_TICKS(10000) ) );
+		vSemaphoreDelete(churn.finished);
+
+		TEST_ASSERT_GREATER_THAN( 0, churn.connections.load() );
+
+		printf("TLSServer with %u handshake tasks: round trip median %" PRId64 " us, 99th percentile %" PRId64 " us without handshakes, "
+			   "median %" PRId64 " us, 99th percentile %" PRId64 " us, max %" PRId64 " us during %u handshakes\n",
+			   handshakeTasks, percentile(idleRoundTrips, 50), percentile(idleRoundTrips, 99),
+			   percentile(churnRoundTrips, 50), percentile(churnRoundTrips, 99), percentile(churnRoundTrips, 100),
+			   static_cast<unsigned>( churn.connections.load() ) );
+
+		client.close();
+		server.stop();
+		port++;
+	}
+}
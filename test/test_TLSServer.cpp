@@ -0,0 +1,400 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unity.h"
+#include "TLSTestFixture.h"
+
+#include <memory>
+#include <vector>
+
+extern "C"
+{
+	#include <inttypes.h>
+	#include <stdio.h>
+	#include <esp_heap_caps.h>
+	#include <esp_timer.h>
+	#include "lwip/sockets.h"
+}
+
+using namespace IDFix::Protocols;
+using namespace IDFix::Protocols::Test;
+
+namespace
+{
+	const uint16_t	DRAIN_TEST_PORT		= 8443;
+	const uint16_t	WAKEUP_TEST_PORT	= 8444;
+	const uint16_t	ACCEPT_TEST_PORT	= 8445;		// and 8446
+	const uint16_t	FANOUT_TEST_PORT	= 8453;
+	const uint16_t	SCALING_TEST_PORT	= 8461;		// to 8463
+
+	const size_t	MESSAGE_LENGTH		= 32;
+	const size_t	ROUND_TRIPS			= 200;
+	const size_t	RECONNECT_WAVE		= 32;
+	const size_t	RECONNECT_ROUNDS	= 20;
+	const size_t	FANOUT_CONNECTIONS	= 100;
+	const size_t	FANOUT_LENGTH		= 1024;
+	const size_t	FANOUT_ROUNDS		= 10;
+
+	const size_t	SCALING_CLIENTS		= 4;
+	const size_t	SCALING_LENGTH		= 1024;
+	const size_t	SCALING_ROUND_TRIPS	= 500;
+
+	struct EchoLoad
+	{
+		TestClient			client;
+		bool				isSucceeded;
+		SemaphoreHandle_t	finished;
+	};
+
+	void runEchoLoad(void *parameter)
+	{
+		EchoLoad *load = static_cast<EchoLoad*>(parameter);
+		std::vector<char> message(SCALING_LENGTH, 's');
+
+		load->isSucceeded = true;
+
+		for ( size_t roundTrip = 0; roundTrip < SCALING_ROUND_TRIPS && load->isSucceeded; roundTrip++ )
+		{
+			load->isSucceeded = load->client.echo(message.data(), message.size() );
+		}
+
+		xSemaphoreGive(load->finished);
+		vTaskDelete(nullptr);
+	}
+
+	int connectRaw(uint16_t port)
+	{
+		int client = socket(AF_INET, SOCK_STREAM, 0);
+
+		struct sockaddr_in socketAddress;
+		memset(&socketAddress, 0, sizeof(socketAddress) );
+		socketAddress.sin_family		= AF_INET;
+		socketAddress.sin_addr.s_addr	= htonl(INADDR_LOOPBACK);
+		socketAddress.sin_port			= htons(port);
+
+		if ( client >= 0 && connect(client, reinterpret_cast<struct sockaddr *>(&socketAddress), sizeof(socketAddress) ) != 0 )
+		{
+			close(client);
+			return -1;
+		}
+
+		return client;
+	}
+
+	bool waitForAdmissions(TLSServer &server, uint32_t admitted, int64_t timeoutUS)
+	{
+		int64_t deadline = esp_timer_get_time() + timeoutUS;
+
+		while ( server.admissionStatistics().admitted < admitted )
+		{
+			if ( esp_timer_get_time() > deadline )
+			{
+				return false;
+			}
+
+			// a delay of 0 only yields, so the server task accepts as soon as it is ready
+			vTaskDelay(0);
+		}
+
+		return true;
+	}
+}
+
+TEST_CASE("TLSServer rejects broadcasts after a drain finished", "[idfix-protocols][tls][leaks]")
+{
+	TestServer server;
+
+	TEST_ASSERT_TRUE( server.server().setWorkerCount(2) );
+	TEST_ASSERT_TRUE( server.start(DRAIN_TEST_PORT) );
+
+	TestClient client;
+	TEST_ASSERT_TRUE( client.connect(DRAIN_TEST_PORT) );
+	TEST_ASSERT_NOT_NULL( server.waitForConnection(5000).get() );
+
+	ByteArray bytes;
+	bytes.assign(16, 'x');
+	TLSSharedPayload payload = std::make_shared<const ByteArray>(bytes);
+	TEST_ASSERT_TRUE( server.server().broadcast(payload) );
+	TEST_ASSERT_TRUE( client.skip(16) );
+
+	TEST_ASSERT_TRUE( server.server().drain(1000, 8, 10) );
+	TEST_ASSERT_TRUE( server.waitForDisconnect(2000) );
+
+	// the server task leaves its loop shortly after the workers finished the drain
+	int64_t deadline = esp_timer_get_time() + 2000000;
+	bool isRejected = false;
+
+	while ( ! isRejected && esp_timer_get_time() < deadline )
+	{
+		isRejected = ! server.server().broadcast(payload);
+		vTaskDelay( pdMS_TO_TICKS(10) );
+	}
+
+	TEST_ASSERT_TRUE( isRejected );
+	TEST_ASSERT_FALSE( server.server().drain(1000) );
+
+	client.close();
+	server.stop();
+}
+
+TEST_CASE("TLSServer wakeup latency with idle connections", "[idfix-protocols][tls][perf]")
+{
+	TestServer server;
+	server.setEcho(true);
+	TEST_ASSERT_TRUE( server.start(WAKEUP_TEST_PORT) );
+
+	// the active connection gets the lowest descriptor, so a scan over all descriptors would not end with it
+	TestClient client;
+	TEST_ASSERT_TRUE( client.connect(WAKEUP_TEST_PORT) );
+	TEST_ASSERT_NOT_NULL( server.waitForConnection(5000).get() );
+
+	std::vector<std::unique_ptr<TestClient>>	idleClients;
+	const size_t	idleConnectionCounts[] = { 10, 100, 1000 };
+	char			message[MESSAGE_LENGTH];
+
+	memset(message, 'x', sizeof(message) );
+
+	for ( size_t idleConnections : idleConnectionCounts )
+	{
+		idleConnections = std::min(idleConnections, MAX_TEST_CONNECTIONS - 1);
+
+		while ( idleClients.size() < idleConnections )
+		{
+			idleClients.emplace_back( new TestClient() );
+			TEST_ASSERT_TRUE( idleClients.back()->connect(WAKEUP_TEST_PORT) );
+			TEST_ASSERT_NOT_NULL( server.waitForConnection(5000).get() );
+		}
+
+		std::vector<int64_t> roundTripTimes;
+
+		for ( size_t roundTrip = 0; roundTrip < ROUND_TRIPS; roundTrip++ )
+		{
+			int64_t start = esp_timer_get_time();
+			TEST_ASSERT_TRUE( client.echo(message, sizeof(message) ) );
+			roundTripTimes.push_back( esp_timer_get_time() - start );
+		}
+
+		printf("TLSServer with %u idle connections: round trip median %" PRId64 " us, 99th percentile %" PRId64 " us, max %" PRId64 " us\n",
+			   static_cast<unsigned>(idleConnections), percentile(roundTripTimes, 50), percentile(roundTripTimes, 99), percentile(roundTripTimes, 100) );
+	}
+
+	client.close();
+	idleClients.clear();
+	server.stop();
+}
+
+TEST_CASE("TLSServer accepts per second in a reconnect storm", "[idfix-protocols][tls][perf]")
+{
+	const uint8_t	acceptBatchLimits[] = { 1, 16 };
+	const size_t	wave = std::min(RECONNECT_WAVE, MAX_TEST_CONNECTIONS);
+	uint16_t		port = ACCEPT_TEST_PORT;
+
+	for ( uint8_t acceptBatchLimit : acceptBatchLimits )
+	{
+		// a TLSServer cannot be restarted, so every configuration gets its own server and port
+		TestServer server;
+		server.server().setAcceptBatchLimit(acceptBatchLimit);
+		TEST_ASSERT_TRUE( server.server().setListenBacklog(RECONNECT_WAVE) );
+		TEST_ASSERT_TRUE( server.start(port) );
+
+		std::vector<int>	clients;
+		int64_t				acceptTime = 0;
+
+		for ( size_t round = 0; round < RECONNECT_ROUNDS; round++ )
+		{
+			uint32_t admitted = server.server().admissionStatistics().admitted;
+			int64_t start = esp_timer_get_time();
+
+			// the clients only connect, so the benchmark measures accepting and not the handshakes
+			for ( size_t index = 0; index < wave; index++ )
+			{
+				clients.push_back( connectRaw(port) );
+				TEST_ASSERT_GREATER_OR_EQUAL( 0, clients.back() );
+			}
+
+			TEST_ASSERT_TRUE( waitForAdmissions(server.server(), admitted + wave, 5000000) );
+			acceptTime += esp_timer_get_time() - start;
+
+			for ( int client : clients )
+			{
+				close(client);
+			}
+
+			clients.clear();
+
+			// the server closes the connections before the next wave, so the sockets of lwIP are available again
+			int64_t deadline = esp_timer_get_time() + 5000000;
+
+			while ( server.server().admissionStatistics().connections > 0 && esp_timer_get_time() < deadline )
+			{
+				vTaskDelay( pdMS_TO_TICKS(1) );
+			}
+
+			TEST_ASSERT_EQUAL_UINT32( 0, server.server().admissionStatistics().connections );
+		}
+
+		printf("TLSServer with an accept batch limit of %u: %" PRId64 " accepts/s\n",
+			   acceptBatchLimit, static_cast<int64_t>(wave * RECONNECT_ROUNDS) * 1000000 / std::max<int64_t>(acceptTime, 1) );
+
+		server.stop();
+		port++;
+	}
+}
+
+TEST_CASE("TLSServer fan-out time and heap", "[idfix-protocols][tls][perf]")
+{
+	TestServer server;
+	TEST_ASSERT_TRUE( server.start(FANOUT_TEST_PORT) );
+
+	const size_t	connections = std::min(FANOUT_CONNECTIONS, MAX_TEST_CONNECTIONS);
+	std::vector<std::unique_ptr<TestClient>>	clients;
+	std::vector<TLSSocket_sharedPtr>			tlsSockets;
+
+	while ( clients.size() < connections )
+	{
+		clients.emplace_back( new TestClient() );
+		TEST_ASSERT_TRUE( clients.back()->connect(FANOUT_TEST_PORT) );
+
+		tlsSockets.push_back( server.waitForConnection(5000) );
+		TEST_ASSERT_NOT_NULL( tlsSockets.back().get() );
+	}
+
+	ByteArray bytes;
+	bytes.assign(FANOUT_LENGTH, 'x');
+	TLSSharedPayload payload = std::make_shared<const ByteArray>(bytes);
+
+	std::vector<char> received(FANOUT_LENGTH);
+	int64_t	callTimes[2] = { 0, 0 };
+	int64_t	deliveryTimes[2] = { 0, 0 };
+	size_t	heapInUse[2] = { 0, 0 };
+
+	for ( int mode = 0; mode < 2; mode++ )
+	{
+		// the first round after a pause is slower (delayed acknowledgements), so it is not measured
+		for ( size_t round = 0; round <= FANOUT_ROUNDS; round++ )
+		{
+			size_t heapBefore = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+			int64_t start = esp_timer_get_time();
+
+			if ( mode == 0 )
+			{
+				TEST_ASSERT_TRUE( server.server().broadcast(payload) );
+			}
+			else
+			{
+				// the loop an application needs without broadcast, every write copies the bytes for the worker
+				for ( TLSSocket_sharedPtr &tlsSocket : tlsSockets )
+				{
+					TEST_ASSERT_EQUAL( bytes.size(), tlsSocket->write(bytes.data(), bytes.size() ) );
+				}
+			}
+
+			int64_t callTime = esp_timer_get_time() - start;
+			size_t heapAfter = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+
+			for ( std::unique_ptr<TestClient> &client : clients )
+			{
+				TEST_ASSERT_TRUE( client->read(received.data(), received.size() ) );
+				TEST_ASSERT_EQUAL_MEMORY( bytes.data(), received.data(), received.size() );
+			}
+
+			if ( round > 0 )
+			{
+				callTimes[mode] += callTime;
+				deliveryTimes[mode] += esp_timer_get_time() - start;
+				heapInUse[mode] += heapBefore > heapAfter ? heapBefore - heapAfter : 0;
+			}
+		}
+	}
+
+	const char *modeNames[] = { "broadcast", "write per socket" };
+
+	for ( int mode = 0; mode < 2; mode++ )
+	{
+		printf("TLSServer fan-out of %u bytes to %u connections with %s: call %" PRId64 " us, delivered after %" PRId64 " us, heap in use %u bytes\n",
+			   static_cast<unsigned>(FANOUT_LENGTH), static_cast<unsigned>(connections), modeNames[mode],
+			   callTimes[mode] / static_cast<int64_t>(FANOUT_ROUNDS), deliveryTimes[mode] / static_cast<int64_t>(FANOUT_ROUNDS),
+			   static_cast<unsigned>(heapInUse[mode] / FANOUT_ROUNDS) );
+	}
+
+	tlsSockets.clear();
+	clients.clear();
+	server.stop();
+}
+
+TEST_CASE("TLSServer echo throughput per worker count", "[idfix-protocols][tls][perf]")
+{
+	const uint8_t	workerCounts[] = { 0, 1, 2 };
+	uint16_t		port = SCALING_TEST_PORT;
+	int64_t			baseline = 0;
+
+	for ( uint8_t workerCount : workerCounts )
+	{
+		// a TLSServer cannot be restarted, so every configuration gets its own server and port
+		TestServer server;
+		server.setEcho(true);
+		TEST_ASSERT_TRUE( server.server().setWorkerCount(workerCount) );
+		TEST_ASSERT_TRUE( server.start(port) );
+
+		// the clients are connected in advance, so the benchmark measures the event loops and not the handshakes
+		std::vector<std::unique_ptr<EchoLoad>> loads;
+		SemaphoreHandle_t finished = xSemaphoreCreateCounting(SCALING_CLIENTS, 0);
+
+		while ( loads.size() < SCALING_CLIENTS )
+		{
+			loads.emplace_back( new EchoLoad() );
+			loads.back()->finished = finished;
+			TEST_ASSERT_TRUE( loads.back()->client.connect(port) );
+			TEST_ASSERT_NOT_NULL( server.waitForConnection(5000).get() );
+		}
+
+		int64_t start = esp_timer_get_time();
+
+		for ( std::unique_ptr<EchoLoad> &load : loads )
+		{
+			TEST_ASSERT_EQUAL( pdPASS, xTaskCreate(&runEchoLoad, "echo-load", 4096, load.get(), 5, nullptr) );
+		}
+
+		for ( size_t index = 0; index < SCALING_CLIENTS; index++ )
+		{
+			TEST_ASSERT_EQUAL( pdTRUE, xSemaphoreTake(finished, pdMS_TO_TICKS(60000) ) );
+		}
+
+		int64_t duration = std::max<int64_t>(esp_timer_get_time() - start, 1);
+
+		for ( std::unique_ptr<EchoLoad> &load : loads )
+		{
+			TEST_ASSERT_TRUE( load->isSucceeded );
+		}
+
+		// the bytes are counted in both directions
+		int64_t throughput = static_cast<int64_t>(2 * SCALING_CLIENTS * SCALING_ROUND_TRIPS * SCALING_LENGTH) * 1000000 / duration;
+
+		if ( workerCount == 0 )
+		{
+			baseline = throughput;
+		}
+
+		printf("TLSServer with %u workers and %u clients: %" PRId64 " bytes/s echoed, %" PRId64 " %% of the server task alone\n",
+			   workerCount, static_cast<unsigned>(SCALING_CLIENTS), throughput, throughput * 100 / std::max<int64_t>(baseline, 1) );
+
+		loads.clear();
+		vSemaphoreDelete(finished);
+		server.stop();
+		port++;
+	}
+}
@@ -0,0 +1,107 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unity.h"
+#include "TLSTestFixture.h"
+
+extern "C"
+{
+	#include <inttypes.h>
+	#include <stdio.h>
+	#include <esp_timer.h>
+}
+
+using namespace IDFix::Protocols;
+using namespace IDFix::Protocols::Test;
+
+namespace
+{
+	const uint16_t	RESUMPTION_TEST_PORT	= 8464;		// and 8465
+
+	const size_t	HANDSHAKES				= 50;
+
+	/**
+	 * Returns the average time of \c HANDSHAKES connects, the first connect of a reusing client only stores the session
+	 */
+	int64_t measureHandshakes(TestServer &server, uint16_t port, bool isResumed)
+	{
+		TestClient client;
+		client.setSessionReuse(isResumed);
+
+		if ( isResumed )
+		{
+			TEST_ASSERT_TRUE( client.connect(port) );
+			TEST_ASSERT_NOT_NULL( server.waitForConnection(5000).get() );
+			client.close();
+		}
+
+		int64_t handshakeTime = 0;
+
+		for ( size_t handshake = 0; handshake < HANDSHAKES; handshake++ )
+		{
+			int64_t start = esp_timer_get_time();
+			TEST_ASSERT_TRUE( client.connect(port) );
+			handshakeTime += esp_timer_get_time() - start;
+
+			TEST_ASSERT_NOT_NULL( server.waitForConnection(5000).get() );
+			client.close();
+		}
+
+		return handshakeTime / static_cast<int64_t>(HANDSHAKES);
+	}
+}
+
+TEST_CASE("TLSServer full and resumed handshake time", "[idfix-protocols][tls][perf]")
+{
+	const char	*modeNames[] = { "session cache", "session tickets" };
+	uint16_t	port = RESUMPTION_TEST_PORT;
+
+	for ( int mode = 0; mode < 2; mode++ )
+	{
+		// a TLSServer cannot be restarted, so every configuration gets its own server and port
+		TestServer server;
+		TEST_ASSERT_TRUE( server.start(port) );
+
+		// the TLS context is created by start, the connections attach to the cache when they are accepted
+		if ( mode == 0 )
+		{
+			TEST_ASSERT_TRUE( server.server().setSessionCache(HANDSHAKES) );
+			TEST_ASSERT_TRUE( server.server().setSessionTickets(false) );
+		}
+		else
+		{
+			TEST_ASSERT_TRUE( server.server().setSessionTickets(true) );
+		}
+
+		int64_t fullTime = measureHandshakes(server, port, false);
+
+		TLSSessionCache::Statistics before = server.server().sessionCacheStatistics();
+		int64_t resumedTime = measureHandshakes(server, port, true);
+		TLSSessionCache::Statistics after = server.server().sessionCacheStatistics();
+
+		uint32_t resumptions = mode == 0 ? after.hits - before.hits : after.ticketHits - before.ticketHits;
+
+		printf("TLSServer with %s: full handshake %" PRId64 " us, resumed handshake %" PRId64 " us, %u of %u handshakes resumed\n",
+			   modeNames[mode], fullTime, resumedTime, static_cast<unsigned>(resumptions), static_cast<unsigned>(HANDSHAKES) );
+
+		// every reconnect offered the session of the previous connection
+		TEST_ASSERT_EQUAL_UINT32( HANDSHAKES, resumptions );
+
+		server.stop();
+		port++;
+	}
+}
@@ -0,0 +1,590 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unity.h"
+#include "TLSTestFixture.h"
+#include "TLSSocketEventHandler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+extern "C"
+{
+	#include <inttypes.h>
+	#include <stdio.h>
+	#include <sys/uio.h>
+	#include <esp_timer.h>
+	#include "lwip/sockets.h"
+}
+
+using namespace IDFix::Protocols;
+using namespace IDFix::Protocols::Test;
+
+namespace
+{
+	const uint16_t	BACKPRESSURE_TEST_PORT	= 8441;
+	const uint16_t	WRITEV_TEST_PORT		= 8447;		// and 8448
+	const uint16_t	RECORD_SIZING_TEST_PORT	= 8449;		// and 8450
+	const uint16_t	EVENT_LOCK_TEST_PORT	= 8457;
+	const uint16_t	STALLED_HELLO_TEST_PORT	= 8459;
+	const uint16_t	READ_BUDGET_TEST_PORT	= 8467;		// and 8468
+	const uint32_t	EVENT_TIMEOUT			= 5000; // ms
+
+	const size_t	HEADER_LENGTH			= 8;
+	const size_t	PAYLOAD_LENGTH			= 256;
+	const size_t	TRAILER_LENGTH			= 4;
+	const size_t	MESSAGE_COUNT			= 1000;
+
+	const size_t	TRANSFER_LENGTH			= 256 * 1024;
+	const size_t	TRANSFER_COUNT			= 5;
+
+	const size_t	ECHO_LENGTH				= 32;
+	const size_t	ECHO_ROUND_TRIPS		= 100;
+	const int64_t	MAX_ECHO_TIME			= 250; // ms
+
+	const size_t	CHUNK_LENGTH			= 16 * 1024;
+	const size_t	MAX_FLOOD_LENGTH		= 16 * 1024 * 1024;
+
+	const size_t	FLOOD_BURST_LENGTH		= 64 * 1024;
+	const int64_t	MAX_FLOODED_ECHO_TIME	= 100; // ms, 99th percentile
+
+	struct Flood
+	{
+		uint16_t			port;
+		std::atomic<bool>	isStopping;
+		std::atomic<size_t>	bytesFlooded;
+		SemaphoreHandle_t	finished;
+	};
+
+	void runFlood(void *parameter)
+	{
+		Flood *flood = static_cast<Flood*>(parameter);
+		TestClient client;
+		std::vector<char> burst(FLOOD_BURST_LENGTH, 'f');
+
+		// the echo is never read, so the server rejects it under backpressure but still has to read everything the client sends
+		if ( client.connect(flood->port) )
+		{
+			while ( ! flood->isStopping && client.write(burst.data(), burst.size() ) == static_cast<int>( burst.size() ) )
+			{
+				flood->bytesFlooded += burst.size();
+			}
+		}
+
+		client.close();
+		xSemaphoreGive(flood->finished);
+		vTaskDelete(nullptr);
+	}
+
+	/**
+	 * Writes on the worker task until the socket enters the backpressure state, then checks from another task
+	 * whether the socket mutex is free while the socketBackpressure event is running.
+	 */
+	class ProbingHandler : public TLSSocketEventHandler
+	{
+		public:
+
+			ProbingHandler()
+			{
+				_probeSemaphore = xSemaphoreCreateCounting(4, 0);
+				_finishedSemaphore = xSemaphoreCreateCounting(4, 0);
+			}
+
+			~ProbingHandler()
+			{
+				vSemaphoreDelete(_probeSemaphore);
+				vSemaphoreDelete(_finishedSemaphore);
+			}
+
+			virtual void socketBytesReceived(TLSSocket& tlsSocket, ByteArray &bytes) override
+			{
+				std::vector<char>	chunk(CHUNK_LENGTH, 'x');
+				size_t				bytesWritten = 0;
+
+				// the client does not read, so the bytes are eventually queued
+				while ( ! isBackpressureSeen && bytesWritten < MAX_FLOOD_LENGTH )
+				{
+					int result = tlsSocket.write(chunk.data(), chunk.size() );
+
+					if ( result <= 0 )
+					{
+						break;
+					}
+
+					bytesWritten += static_cast<size_t>(result);
+				}
+
+				xSemaphoreGive(_finishedSemaphore);
+			}
+
+			virtual void socketBackpressure(TLSSocket& tlsSocket) override
+			{
+				isBackpressureSeen = true;
+				_probedSocket = &tlsSocket;
+
+				if ( xTaskCreate(&probe, "probe", 4096, this, 5, nullptr) == pdPASS )
+				{
+					isMutexFree = xSemaphoreTake(_probeSemaphore, pdMS_TO_TICKS(1000) ) == pdTRUE;
+				}
+			}
+
+			bool waitForFlood(uint32_t timeoutMS)
+			{
+				return xSemaphoreTake(_finishedSemaphore, pdMS_TO_TICKS(timeoutMS) ) == pdTRUE;
+			}
+
+			std::atomic<bool>	isBackpressureSeen = { false };
+			std::atomic<bool>	isMutexFree = { false };
+
+		private:
+
+			static void probe(void *parameter)
+			{
+				ProbingHandler *handler = static_cast<ProbingHandler*>(parameter);
+
+				// blocks on the socket mutex if the event is called with the mutex held
+				handler->_probedSocket->bytesToWrite();
+				xSemaphoreGive(handler->_probeSemaphore);
+
+				vTaskDelete(nullptr);
+			}
+
+			SemaphoreHandle_t	_probeSemaphore;
+			SemaphoreHandle_t	_finishedSemaphore;
+			TLSSocket			*_probedSocket = { nullptr };
+	};
+
+	enum WriteMode
+	{
+		Gathered,
+		Concatenated,
+		Separate
+	};
+
+	const char*		WRITE_MODE_NAMES[]		= { "writev", "concatenated write", "separate writes" };
+
+	int writeMessage(TLSSocket &tlsSocket, WriteMode mode, const struct iovec *buffers, int count)
+	{
+		switch ( mode )
+		{
+			case Gathered:
+				return tlsSocket.writev(buffers, count);
+
+			case Concatenated:
+			{
+				std::vector<char> message;
+
+				for ( int index = 0; index < count; index++ )
+				{
+					const char *bytes = static_cast<const char*>(buffers[index].iov_base);
+					message.insert(message.end(), bytes, bytes + buffers[index].iov_len);
+				}
+
+				return tlsSocket.write(message.data(), message.size() );
+			}
+
+			case Separate:
+			{
+				int bytesWritten = 0;
+
+				for ( int index = 0; index < count; index++ )
+				{
+					bytesWritten += tlsSocket.write(static_cast<const char*>(buffers[index].iov_base), buffers[index].iov_len);
+				}
+
+				return bytesWritten;
+			}
+		}
+
+		return -1;
+	}
+}
+
+TEST_CASE("TLSSocket leaves the backpressure state after a write of another task", "[idfix-protocols][tls][leaks]")
+{
+	TestServer server;
+	TestClient client;
+
+	TEST_ASSERT_TRUE( server.start(BACKPRESSURE_TEST_PORT) );
+	TEST_ASSERT_TRUE( client.connect(BACKPRESSURE_TEST_PORT) );
+
+	TLSSocket_sharedPtr tlsSocket = server.waitForConnection(EVENT_TIMEOUT);
+	TEST_ASSERT_NOT_NULL( tlsSocket.get() );
+
+	// the message exceeds the high watermark, but fits into the TCP send buffer, so the worker writes it without queueing
+	tlsSocket->setWriteBufferWatermarks(512, 1024);
+	std::vector<char> message(2048, 'x');
+
+	// the test task does not own the socket, so the message is posted to the worker
+	TEST_ASSERT_EQUAL( message.size(), tlsSocket->write(message.data(), message.size() ) );
+
+	// the posted bytes entered the backpressure state, writing them directly has to end it again
+	TEST_ASSERT_TRUE( server.waitForBackpressure(EVENT_TIMEOUT) );
+	TEST_ASSERT_TRUE( server.waitForWritable(EVENT_TIMEOUT) );
+	TEST_ASSERT_TRUE( client.skip( message.size() ) );
+
+	// the events are called by the worker, not by the writing task
+	TEST_ASSERT_NOT_EQUAL( xTaskGetCurrentTaskHandle(), server.eventTask() );
+
+	TEST_ASSERT_EQUAL( message.size(), tlsSocket->write(message.data(), message.size() ) );
+	TEST_ASSERT_TRUE( client.skip( message.size() ) );
+
+	client.close();
+	server.stop();
+}
+
+TEST_CASE("TLSSocket writes gathered buffers in one record", "[idfix-protocols][tls]")
+{
+	TestServer server;
+	TestClient client;
+
+	TEST_ASSERT_TRUE( server.start(WRITEV_TEST_PORT) );
+	TEST_ASSERT_TRUE( client.connect(WRITEV_TEST_PORT) );
+
+	TLSSocket_sharedPtr tlsSocket = server.waitForConnection(EVENT_TIMEOUT);
+	TEST_ASSERT_NOT_NULL( tlsSocket.get() );
+
+	char header[HEADER_LENGTH];
+	char payload[PAYLOAD_LENGTH];
+	char trailer[TRAILER_LENGTH];
+
+	memset(header, 'h', sizeof(header) );
+	memset(payload, 'p', sizeof(payload) );
+	memset(trailer, 't', sizeof(trailer) );
+
+	struct iovec buffers[] = { { header, sizeof(header) }, { payload, sizeof(payload) }, { trailer, sizeof(trailer) } };
+	uint32_t recordsSent = tlsSocket->statistics().recordsSent;
+
+	TEST_ASSERT_EQUAL( sizeof(header) + sizeof(payload) + sizeof(trailer), tlsSocket->writev(buffers, 3) );
+
+	char received[HEADER_LENGTH + PAYLOAD_LENGTH + TRAILER_LENGTH];
+	TEST_ASSERT_TRUE( client.read(received, sizeof(received) ) );
+	TEST_ASSERT_EQUAL_MEMORY( header, received, sizeof(header) );
+	TEST_ASSERT_EQUAL_MEMORY( payload, received + sizeof(header), sizeof(payload) );
+	TEST_ASSERT_EQUAL_MEMORY( trailer, received + sizeof(header) + sizeof(payload), sizeof(trailer) );
+
+	// the worker counts the record after it was written, so the client may read it first
+	vTaskDelay( pdMS_TO_TICKS(20) );
+	TEST_ASSERT_EQUAL_UINT32( 1, tlsSocket->statistics().recordsSent - recordsSent );
+
+	// invalid buffers are an error, an empty message is a no-op which sends no record
+	struct iovec emptyBuffers[] = { { header, 0 }, { payload, 0 } };
+	recordsSent = tlsSocket->statistics().recordsSent;
+
+	TEST_ASSERT_EQUAL( -1, tlsSocket->writev(nullptr, 1) );
+	TEST_ASSERT_EQUAL( -1, tlsSocket->writev(buffers, 0) );
+	TEST_ASSERT_EQUAL( 0, tlsSocket->writev(emptyBuffers, 2) );
+
+	vTaskDelay( pdMS_TO_TICKS(20) );
+	TEST_ASSERT_EQUAL_UINT32( 0, tlsSocket->statistics().recordsSent - recordsSent );
+	TEST_ASSERT_EQUAL_UINT32( 0, tlsSocket->bytesToWrite() );
+
+	client.close();
+	server.stop();
+}
+
+TEST_CASE("TLSSocket records and time per gathered message", "[idfix-protocols][tls][perf]")
+{
+	TestServer server;
+	TestClient client;
+
+	TEST_ASSERT_TRUE( server.start(WRITEV_TEST_PORT + 1) );
+	TEST_ASSERT_TRUE( client.connect(WRITEV_TEST_PORT + 1) );
+
+	TLSSocket_sharedPtr tlsSocket = server.waitForConnection(EVENT_TIMEOUT);
+	TEST_ASSERT_NOT_NULL( tlsSocket.get() );
+
+	char header[HEADER_LENGTH];
+	char payload[PAYLOAD_LENGTH];
+	char trailer[TRAILER_LENGTH];
+
+	memset(header, 'h', sizeof(header) );
+	memset(payload, 'p', sizeof(payload) );
+	memset(trailer, 't', sizeof(trailer) );
+
+	struct iovec	buffers[] = { { header, sizeof(header) }, { payload, sizeof(payload) }, { trailer, sizeof(trailer) } };
+	const size_t	messageLength = sizeof(header) + sizeof(payload) + sizeof(trailer);
+	const WriteMode	modes[] = { Gathered, Concatenated, Separate };
+
+	// the first messages of a connection are slower (TCP slow start and delayed acknowledgements), so they are not measured
+	for ( size_t message = 0; message < MESSAGE_COUNT; message++ )
+	{
+		TEST_ASSERT_EQUAL( messageLength, writeMessage(*tlsSocket, Gathered, buffers, 3) );
+		TEST_ASSERT_TRUE( client.skip(messageLength) );
+	}
+
+	for ( WriteMode mode : modes )
+	{
+		uint32_t recordsSent = tlsSocket->statistics().recordsSent;
+		int64_t start = esp_timer_get_time();
+
+		// the client reads in between, so the queued bytes stay below the TCP send buffer
+		for ( size_t message = 0; message < MESSAGE_COUNT; message++ )
+		{
+			TEST_ASSERT_EQUAL( messageLength, writeMessage(*tlsSocket, mode, buffers, 3) );
+			TEST_ASSERT_TRUE( client.skip(messageLength) );
+		}
+
+		int64_t time = esp_timer_get_time() - start;
+
+		vTaskDelay( pdMS_TO_TICKS(20) );
+		uint32_t records = tlsSocket->statistics().recordsSent - recordsSent;
+
+		printf("TLSSocket with %s: %" PRId64 ".%02" PRId64 " records and %" PRId64 " us per message\n",
+			   WRITE_MODE_NAMES[mode], static_cast<int64_t>(records) / static_cast<int64_t>(MESSAGE_COUNT),
+			   static_cast<int64_t>(records) * 100 / static_cast<int64_t>(MESSAGE_COUNT) % 100, time / static_cast<int64_t>(MESSAGE_COUNT) );
+	}
+
+	client.close();
+	server.stop();
+}
+
+TEST_CASE("TLSSocket writes the start of a burst in small records", "[idfix-protocols][tls]")
+{
+	TestServer server;
+	TestClient client;
+
+	TEST_ASSERT_TRUE( server.start(RECORD_SIZING_TEST_PORT) );
+	TEST_ASSERT_TRUE( client.connect(RECORD_SIZING_TEST_PORT) );
+
+	TLSSocket_sharedPtr tlsSocket = server.waitForConnection(EVENT_TIMEOUT);
+	TEST_ASSERT_NOT_NULL( tlsSocket.get() );
+
+	std::vector<char> bytes(8192, 'x');
+
+	// 4096 bytes in records of 1400 bytes, then the rest in one full-size record
+	tlsSocket->setRecordSizing(1400, 4096, 0);
+	uint32_t recordsSent = tlsSocket->statistics().recordsSent;
+	TEST_ASSERT_EQUAL( bytes.size(), tlsSocket->write(bytes.data(), bytes.size() ) );
+	TEST_ASSERT_TRUE( client.skip( bytes.size() ) );
+
+	vTaskDelay( pdMS_TO_TICKS(20) );
+	TEST_ASSERT_EQUAL_UINT32( 4, tlsSocket->statistics().recordsSent - recordsSent );
+
+	// the burst continues, without an idle reset the small records are not written again
+	recordsSent = tlsSocket->statistics().recordsSent;
+	TEST_ASSERT_EQUAL( bytes.size(), tlsSocket->write(bytes.data(), bytes.size() ) );
+	TEST_ASSERT_TRUE( client.skip( bytes.size() ) );
+
+	vTaskDelay( pdMS_TO_TICKS(20) );
+	TEST_ASSERT_EQUAL_UINT32( 1, tlsSocket->statistics().recordsSent - recordsSent );
+
+	tlsSocket->setRecordSizing(0, 4096, 0);
+	recordsSent = tlsSocket->statistics().recordsSent;
+	TEST_ASSERT_EQUAL( bytes.size(), tlsSocket->write(bytes.data(), bytes.size() ) );
+	TEST_ASSERT_TRUE( client.skip( bytes.size() ) );
+
+	vTaskDelay( pdMS_TO_TICKS(20) );
+	TEST_ASSERT_EQUAL_UINT32( 1, tlsSocket->statistics().recordsSent - recordsSent );
+
+	client.close();
+	server.stop();
+}
+
+TEST_CASE("TLSSocket time to first byte and throughput", "[idfix-protocols][tls][perf]")
+{
+	TestServer server;
+	TestClient client;
+
+	TEST_ASSERT_TRUE( server.start(RECORD_SIZING_TEST_PORT + 1) );
+	TEST_ASSERT_TRUE( client.connect(RECORD_SIZING_TEST_PORT + 1) );
+
+	TLSSocket_sharedPtr tlsSocket = server.waitForConnection(EVENT_TIMEOUT);
+	TEST_ASSERT_NOT_NULL( tlsSocket.get() );
+
+	// a shared payload is posted to the worker without copying it, so only the writing of the records is measured
+	ByteArray			bytes;
+	bytes.assign(TRANSFER_LENGTH, 'x');
+	TLSSharedPayload	payload = std::make_shared<const ByteArray>(bytes);
+	const size_t		smallRecordLengths[] = { 1400, 0 };
+
+	for ( size_t smallRecordLength : smallRecordLengths )
+	{
+		std::vector<int64_t>	firstByteTimes;
+		std::vector<int64_t>	transferTimes;
+
+		for ( size_t transfer = 0; transfer < TRANSFER_COUNT; transfer++ )
+		{
+			// every transfer starts a new burst, like a transfer after an idle period
+			tlsSocket->setRecordSizing(smallRecordLength, 32 * 1024, 1000);
+
+			char	firstByte;
+			int64_t	start = esp_timer_get_time();
+
+			TEST_ASSERT_EQUAL( bytes.size(), tlsSocket->write(payload) );
+			TEST_ASSERT_TRUE( client.read(&firstByte, 1) );
+			firstByteTimes.push_back( esp_timer_get_time() - start );
+
+			TEST_ASSERT_TRUE( client.skip(bytes.size() - 1) );
+			transferTimes.push_back( esp_timer_get_time() - start );
+
+			// the socket leaves the backpressure state once the worker wrote the bytes
+			TEST_ASSERT_TRUE( server.waitForWritable(EVENT_TIMEOUT) );
+		}
+
+		int64_t transferTime = std::max<int64_t>(percentile(transferTimes, 50), 1);
+
+		printf("TLSSocket with small records of %u bytes: time to first byte %" PRId64 " us, throughput %" PRId64 " KB/s\n",
+			   static_cast<unsigned>(smallRecordLength), percentile(firstByteTimes, 50), static_cast<int64_t>(TRANSFER_LENGTH) * 1000000 / 1024 / transferTime );
+	}
+
+	client.close();
+	server.stop();
+}
+
+TEST_CASE("TLSSocket sends the backpressure event of a worker write without the socket mutex", "[idfix-protocols][tls]")
+{
+	TestServer		server;
+	TestClient		client;
+	ProbingHandler	handler;
+
+	TEST_ASSERT_TRUE( server.start(EVENT_LOCK_TEST_PORT) );
+	TEST_ASSERT_TRUE( client.connect(EVENT_LOCK_TEST_PORT) );
+
+	TLSSocket_sharedPtr tlsSocket = server.waitForConnection(EVENT_TIMEOUT);
+	TEST_ASSERT_NOT_NULL( tlsSocket.get() );
+
+	tlsSocket->setWriteBufferWatermarks(CHUNK_LENGTH, 2 * CHUNK_LENGTH);
+	tlsSocket->setEventHandler(&handler);
+
+	// the received byte lets the worker write from its own task
+	TEST_ASSERT_EQUAL( 1, client.write("x", 1) );
+	TEST_ASSERT_TRUE( handler.waitForFlood(EVENT_TIMEOUT) );
+
+	TEST_ASSERT_TRUE( handler.isBackpressureSeen.load() );
+	TEST_ASSERT_TRUE( handler.isMutexFree.load() );
+
+	tlsSocket->setEventHandler(nullptr);
+	client.close();
+	server.stop();
+}
+
+TEST_CASE("TLSSocket keeps established connections flowing during a stalled handshake", "[idfix-protocols][tls]")
+{
+	TestServer	server;
+	TestClient	client;
+	char		message[ECHO_LENGTH];
+
+	// the handshake runs on the event loop of the server task, which also serves the established connection
+	server.setEcho(true);
+	TEST_ASSERT_TRUE( server.start(STALLED_HELLO_TEST_PORT) );
+	TEST_ASSERT_TRUE( client.connect(STALLED_HELLO_TEST_PORT) );
+	TEST_ASSERT_NOT_NULL( server.waitForConnection(EVENT_TIMEOUT).get() );
+
+	int stalledClient = socket(AF_INET, SOCK_STREAM, 0);
+	TEST_ASSERT_GREATER_OR_EQUAL( 0, stalledClient );
+
+	struct sockaddr_in socketAddress;
+	memset(&socketAddress, 0, sizeof(socketAddress) );
+	socketAddress.sin_family		= AF_INET;
+	socketAddress.sin_addr.s_addr	= htonl(INADDR_LOOPBACK);
+	socketAddress.sin_port			= htons(STALLED_HELLO_TEST_PORT);
+	TEST_ASSERT_EQUAL( 0, connect(stalledClient, reinterpret_cast<struct sockaddr *>(&socketAddress), sizeof(socketAddress) ) );
+
+	// a record announcing a 64 byte ClientHello, of which only the handshake header and the client version are sent
+	const char partialHello[] = { 0x16, 0x03, 0x01, 0x00, 0x40, 0x01, 0x00, 0x00, 0x3c, 0x03, 0x03 };
+	TEST_ASSERT_EQUAL( sizeof(partialHello), send(stalledClient, partialHello, sizeof(partialHello), 0) );
+	vTaskDelay( pdMS_TO_TICKS(100) );
+
+	memset(message, 'e', sizeof(message) );
+	int64_t maxEchoTime = 0;
+
+	for ( size_t roundTrip = 0; roundTrip < ECHO_ROUND_TRIPS; roundTrip++ )
+	{
+		int64_t start = esp_timer_get_time();
+		TEST_ASSERT_TRUE( client.echo(message, sizeof(message), EVENT_TIMEOUT) );
+		maxEchoTime = std::max(maxEchoTime, esp_timer_get_time() - start);
+	}
+
+	printf("Echo round trips during a stalled handshake: %zu, max %" PRId64 " us\n", ECHO_ROUND_TRIPS, maxEchoTime);
+
+	// a handshake blocking the event loop delays every round trip until the handshake gives up
+	TEST_ASSERT_LESS_THAN( MAX_ECHO_TIME * 1000, maxEchoTime );
+
+	// the stalled handshake is still waiting for the rest of the ClientHello
+	TEST_ASSERT_EQUAL( 1, server.connectionCount() );
+
+	close(stalledClient);
+	client.close();
+	server.stop();
+}
+
+TEST_CASE("TLSSocket read budget keeps a flooding client from starving others", "[idfix-protocols][tls]")
+{
+	const size_t	budgetBytes[] = { 1024, 1024 * 1024 };
+	const uint16_t	budgetRecords[] = { 1, 1024 };
+	uint16_t		port = READ_BUDGET_TEST_PORT;
+	char			message[ECHO_LENGTH];
+
+	memset(message, 'e', sizeof(message) );
+
+	for ( int budget = 0; budget < 2; budget++ )
+	{
+		// a TLSServer cannot be restarted, so every configuration gets its own server and port
+		TestServer server;
+		server.setEcho(true);
+		TEST_ASSERT_TRUE( server.server().setReadBudget(budgetBytes[budget], budgetRecords[budget]) );
+		TEST_ASSERT_TRUE( server.start(port) );
+
+		TestClient client;
+		TEST_ASSERT_TRUE( client.connect(port) );
+		TEST_ASSERT_NOT_NULL( server.waitForConnection(EVENT_TIMEOUT).get() );
+
+		Flood flood;
+		flood.port = port;
+		flood.isStopping = false;
+		flood.bytesFlooded = 0;
+		flood.finished = xSemaphoreCreateBinary();
+
+		TEST_ASSERT_EQUAL( pdPASS, xTaskCreate(&runFlood, "flood", 4096, &flood, 5, nullptr) );
+		TEST_ASSERT_NOT_NULL( server.waitForConnection(EVENT_TIMEOUT).get() );
+
+		// the flood is running before the first round trip
+		while ( flood.bytesFlooded == 0 )
+		{
+			vTaskDelay( pdMS_TO_TICKS(1) );
+		}
+
+		std::vector<int64_t> echoTimes;
+
+		for ( size_t roundTrip = 0; roundTrip < ECHO_ROUND_TRIPS; roundTrip++ )
+		{
+			int64_t start = esp_timer_get_time();
+			TEST_ASSERT_TRUE( client.echo(message, sizeof(message), EVENT_TIMEOUT) );
+			echoTimes.push_back( esp_timer_get_time() - start );
+
+			// spreads the round trips over the flood instead of measuring them between two bursts
+			vTaskDelay(1);
+		}
+
+		flood.isStopping = true;
+		TEST_ASSERT_EQUAL( pdTRUE, xSemaphoreTake(flood.finished, pdMS_TO_TICKS(EVENT_TIMEOUT) ) );
+		vSemaphoreDelete(flood.finished);
+
+		printf("TLSSocket with a read budget of %u bytes and %u records: echo median %" PRId64 " us, 99th percentile %" PRId64 " us, %u bytes flooded\n",
+			   static_cast<unsigned>(budgetBytes[budget]), budgetRecords[budget], percentile(echoTimes, 50), percentile(echoTimes, 99),
+			   static_cast<unsigned>(flood.bytesFlooded) );
+
+		TEST_ASSERT_LESS_THAN( MAX_FLOODED_ECHO_TIME * 1000, percentile(echoTimes, 99) );
+
+		client.close();
+		server.stop();
+		port++;
+	}
+}
@@ -0,0 +1,224 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unity.h"
+#include "TLSSocket.h"
+#include "TLSSocketTable.h"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+extern "C"
+{
+	#include <inttypes.h>
+	#include <stdio.h>
+	#include <esp_timer.h>
+	#include <openssl/ssl.h>
+	#include "lwip/sockets.h"
+}
+
+using namespace IDFix::Protocols;
+
+namespace
+{
+#if defined(LWIP_SOCKET_OFFSET)
+	const int		FIRST_DESCRIPTOR	= LWIP_SOCKET_OFFSET;
+#else
+	const int		FIRST_DESCRIPTOR	= 0;
+#endif
+
+	// the table only stores the sockets, so a few real sockets are inserted under many descriptors
+	const size_t	SOCKET_COUNT		= 4;
+	const int		DESCRIPTOR_RANGE	= 64;
+	const size_t	CHURN_OPERATIONS	= 2000;
+	const size_t	BENCHMARK_LOOKUPS	= 10000;
+
+	class TestSockets
+	{
+		public:
+
+			TestSockets()
+			{
+				_tlsContext = SSL_CTX_new( TLSv1_2_server_method() );
+
+				for ( size_t index = 0; index < SOCKET_COUNT; index++ )
+				{
+					sockets.push_back( std::make_shared<TLSSocket>(socket(AF_INET, SOCK_STREAM, 0), SSL_new(_tlsContext), nullptr) );
+				}
+			}
+
+			~TestSockets()
+			{
+				sockets.clear();
+				SSL_CTX_free(_tlsContext);
+			}
+
+			std::vector<TLSSocket_sharedPtr>	sockets = {};
+
+		private:
+
+			SSL_CTX		*_tlsContext = { nullptr };
+	};
+
+	uint32_t nextRandom(uint32_t &state)
+	{
+		// xorshift, so the churn pattern is the same in every run
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	void assertSameEntries(const TLSSocketTable &table, const std::map<int, TLSSocket_sharedPtr> &reference)
+	{
+		TEST_ASSERT_EQUAL( reference.size(), table.size() );
+		TEST_ASSERT_EQUAL( reference.empty(), table.empty() );
+
+		std::vector<TLSSocket_sharedPtr> snapshot;
+		table.snapshot(snapshot);
+		TEST_ASSERT_EQUAL( reference.size(), snapshot.size() );
+
+		for ( int descriptor = FIRST_DESCRIPTOR; descriptor < FIRST_DESCRIPTOR + DESCRIPTOR_RANGE; descriptor++ )
+		{
+			std::map<int, TLSSocket_sharedPtr>::const_iterator it = reference.find(descriptor);
+			TEST_ASSERT_EQUAL_PTR( it != reference.end() ? it->second.get() : nullptr, table.find(descriptor).get() );
+		}
+	}
+}
+
+TEST_CASE("TLSSocketTable keeps its entries through churn", "[idfix-protocols][tls]")
+{
+	TestSockets				testSockets;
+	TLSSocketTable			table;
+	std::map<int, TLSSocket_sharedPtr>	reference;
+	uint32_t				random = 0x2f6b1c3d;
+
+	table.reserve(8);
+
+	TEST_ASSERT_FALSE( table.insert(FIRST_DESCRIPTOR - 1, testSockets.sockets[0]) );
+	TEST_ASSERT_NULL( table.find(FIRST_DESCRIPTOR - 1).get() );
+	TEST_ASSERT_FALSE( table.erase(FIRST_DESCRIPTOR) );
+
+	for ( size_t operation = 0; operation < CHURN_OPERATIONS; operation++ )
+	{
+		int descriptor = FIRST_DESCRIPTOR + static_cast<int>( nextRandom(random) % DESCRIPTOR_RANGE );
+		TLSSocket_sharedPtr tlsSocket = testSockets.sockets[ nextRandom(random) % SOCKET_COUNT ];
+		bool isLive = reference.count(descriptor) > 0;
+
+		if ( nextRandom(random) % 2 == 0 )
+		{
+			// an occupied descriptor is never replaced
+			TEST_ASSERT_EQUAL( ! isLive, table.insert(descriptor, tlsSocket) );
+			reference.emplace(descriptor, tlsSocket);
+		}
+		else
+		{
+			TEST_ASSERT_EQUAL( isLive, table.erase(descriptor) );
+			reference.erase(descriptor);
+		}
+
+		if ( operation % 100 == 0 )
+		{
+			assertSameEntries(table, reference);
+		}
+	}
+
+	assertSameEntries(table, reference);
+
+	// a socket found before it was erased stays valid
+	int descriptor = reference.begin()->first;
+	TLSSocket_sharedPtr found = table.find(descriptor);
+	TEST_ASSERT_TRUE( table.erase(descriptor) );
+	TEST_ASSERT_NOT_NULL( found.get() );
+	reference.erase(descriptor);
+	assertSameEntries(table, reference);
+
+	table.clear();
+	reference.clear();
+	assertSameEntries(table, reference);
+}
+
+TEST_CASE("TLSSocketTable lookup and churn cost", "[idfix-protocols][tls][perf]")
+{
+	TestSockets			testSockets;
+	const size_t		connectionCounts[] = { 10, 100, 1000 };
+
+	for ( size_t connections : connectionCounts )
+	{
+		TLSSocketTable		table;
+		std::map<int, TLSSocket_sharedPtr>	map;
+
+		table.reserve(connections);
+
+		for ( size_t index = 0; index < connections; index++ )
+		{
+			int descriptor = FIRST_DESCRIPTOR + static_cast<int>(index);
+			table.insert(descriptor, testSockets.sockets[index % SOCKET_COUNT]);
+			map.emplace(descriptor, testSockets.sockets[index % SOCKET_COUNT]);
+		}
+
+		size_t hits = 0;
+		int64_t start = esp_timer_get_time();
+
+		for ( size_t lookup = 0; lookup < BENCHMARK_LOOKUPS; lookup++ )
+		{
+			hits += table.find( FIRST_DESCRIPTOR + static_cast<int>( (lookup * 7) % connections ) ) != nullptr;
+		}
+
+		int64_t tableLookups = esp_timer_get_time() - start;
+		start = esp_timer_get_time();
+
+		for ( size_t lookup = 0; lookup < BENCHMARK_LOOKUPS; lookup++ )
+		{
+			hits += map.find( FIRST_DESCRIPTOR + static_cast<int>( (lookup * 7) % connections ) ) != map.end();
+		}
+
+		int64_t mapLookups = esp_timer_get_time() - start;
+
+		TEST_ASSERT_EQUAL( 2 * BENCHMARK_LOOKUPS, hits );
+
+		// a reconnecting client: the descriptor is released and reused right away
+		start = esp_timer_get_time();
+
+		for ( size_t operation = 0; operation < BENCHMARK_LOOKUPS; operation++ )
+		{
+			int descriptor = FIRST_DESCRIPTOR + static_cast<int>( (operation * 7) % connections );
+			table.erase(descriptor);
+			table.insert(descriptor, testSockets.sockets[0]);
+		}
+
+		int64_t tableChurn = esp_timer_get_time() - start;
+		start = esp_timer_get_time();
+
+		for ( size_t operation = 0; operation < BENCHMARK_LOOKUPS; operation++ )
+		{
+			int descriptor = FIRST_DESCRIPTOR + static_cast<int>( (operation * 7) % connections );
+			map.erase(descriptor);
+			map.emplace(descriptor, testSockets.sockets[0]);
+		}
+
+		int64_t mapChurn = esp_timer_get_time() - start;
+
+		TEST_ASSERT_EQUAL( connections, table.size() );
+
+		printf("TLSSocketTable with %u connections: lookup %" PRId64 " ns (std::map %" PRId64 " ns), erase and insert %" PRId64 " ns (std::map %" PRId64 " ns)\n",
+			   static_cast<unsigned>(connections),
+			   tableLookups * 1000 / static_cast<int64_t>(BENCHMARK_LOOKUPS), mapLookups * 1000 / static_cast<int64_t>(BENCHMARK_LOOKUPS),
+			   tableChurn * 1000 / static_cast<int64_t>(BENCHMARK_LOOKUPS), mapChurn * 1000 / static_cast<int64_t>(BENCHMARK_LOOKUPS) );
+	}
+}
@@ -0,0 +1,184 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unity.h"
+#include "TimerWheel.h"
+
+extern "C"
+{
+	#include <inttypes.h>
+	#include <stdio.h>
+	#include <esp_timer.h>
+	#include <freertos/FreeRTOS.h>
+	#include <freertos/task.h>
+}
+
+using namespace IDFix::Protocols;
+
+namespace
+{
+	// the scheduler tick of the target, timers may expire this much later than due
+	const int64_t	EXPIRY_TOLERANCE_MS	= 20;
+	const size_t	BENCHMARK_TIMERS	= 1000;
+
+	int64_t nowMS()
+	{
+		return esp_timer_get_time() / 1000;
+	}
+
+	class RecordingTimer : public TimerWheel::Timer
+	{
+		public:
+
+			int64_t			armedAt = { -1 };
+			int64_t			expiredAt = { -1 };
+			uint32_t		expirations = { 0 };
+
+		protected:
+
+			virtual void	timerExpired() override
+			{
+				expiredAt = nowMS();
+				expirations++;
+			}
+	};
+
+	void runWheel(TimerWheel &wheel, uint32_t timeoutMS)
+	{
+		int64_t deadline = nowMS() + timeoutMS;
+
+		while ( wheel.size() > 0 && nowMS() < deadline )
+		{
+			int timeout = wheel.nextTimeout();
+			vTaskDelay( pdMS_TO_TICKS( timeout > 10 ? 10 : timeout ) );
+			wheel.advance();
+		}
+	}
+
+	void armRecording(TimerWheel &wheel, RecordingTimer &timer, uint32_t timeoutMS)
+	{
+		timer.armedAt = nowMS();
+		wheel.arm(timer, timeoutMS);
+	}
+
+	void assertExpiredAfter(const RecordingTimer &timer, uint32_t timeoutMS)
+	{
+		TEST_ASSERT_EQUAL_UINT32( 1, timer.expirations );
+		TEST_ASSERT_GREATER_OR_EQUAL( timer.armedAt + timeoutMS, timer.expiredAt );
+		TEST_ASSERT_LESS_OR_EQUAL( timer.armedAt + timeoutMS + EXPIRY_TOLERANCE_MS, timer.expiredAt );
+	}
+}
+
+TEST_CASE("TimerWheel expires timers of all levels in time", "[idfix-protocols][timer]")
+{
+	// with a tick of 1 ms the timeouts are placed in the levels 0, 1, 1 and 2 and reach level 0 by cascading
+	TimerWheel wheel(1);
+	RecordingTimer timers[4];
+	const uint32_t timeouts[4] = { 5, 100, 1000, 4200 };
+
+	for ( size_t index = 0; index < 4; index++ )
+	{
+		armRecording(wheel, timers[index], timeouts[index]);
+	}
+
+	TEST_ASSERT_EQUAL( 4, wheel.size() );
+
+	runWheel(wheel, 5000);
+
+	TEST_ASSERT_EQUAL( 0, wheel.size() );
+	TEST_ASSERT_EQUAL( -1, wheel.nextTimeout() );
+
+	for ( size_t index = 0; index < 4; index++ )
+	{
+		assertExpiredAfter(timers[index], timeouts[index]);
+	}
+}
+
+TEST_CASE("TimerWheel cancels and rearms timers", "[idfix-protocols][timer]")
+{
+	TimerWheel wheel(1);
+	RecordingTimer cancelled;
+	RecordingTimer rearmed;
+
+	armRecording(wheel, cancelled, 50);
+	armRecording(wheel, rearmed, 500);
+
+	{
+		RecordingTimer temporary;
+		wheel.arm(temporary, 50);
+		TEST_ASSERT_TRUE( temporary.isArmed() );
+	}
+
+	// a destroyed timer is no longer armed
+	TEST_ASSERT_EQUAL( 2, wheel.size() );
+
+	wheel.cancel(cancelled);
+	TEST_ASSERT_FALSE( cancelled.isArmed() );
+
+	armRecording(wheel, rearmed, 80);
+	TEST_ASSERT_EQUAL( 1, wheel.size() );
+
+	runWheel(wheel, 1000);
+
+	TEST_ASSERT_EQUAL_UINT32( 0, cancelled.expirations );
+	assertExpiredAfter(rearmed, 80);
+}
+
+TEST_CASE("TimerWheel arm and cancel cost", "[idfix-protocols][timer][perf]")
+{
+	TimerWheel wheel(100);
+	RecordingTimer *timers = new RecordingTimer[BENCHMARK_TIMERS];
+
+	// the idle timeouts of a worker: many connections with timeouts spread over all levels
+	int64_t start = esp_timer_get_time();
+
+	for ( size_t index = 0; index < BENCHMARK_TIMERS; index++ )
+	{
+		wheel.arm(timers[index], static_cast<uint32_t>( (index * 7919) % 600000 ) + 1000);
+	}
+
+	int64_t armed = esp_timer_get_time();
+
+	// rearming is what every received record does to the idle timeout
+	for ( size_t index = 0; index < BENCHMARK_TIMERS; index++ )
+	{
+		wheel.arm(timers[index], static_cast<uint32_t>( (index * 104729) % 600000 ) + 1000);
+	}
+
+	int64_t rearmed = esp_timer_get_time();
+
+	wheel.advance();
+	int64_t advanced = esp_timer_get_time();
+
+	for ( size_t index = 0; index < BENCHMARK_TIMERS; index++ )
+	{
+		wheel.cancel(timers[index]);
+	}
+
+	int64_t cancelled = esp_timer_get_time();
+
+	TEST_ASSERT_EQUAL( 0, wheel.size() );
+
+	printf("TimerWheel with %u timers: arm %" PRId64 " ns, rearm %" PRId64 " ns, cancel %" PRId64 " ns per timer, advance %" PRId64 " us\n",
+		   static_cast<unsigned>(BENCHMARK_TIMERS),
+		   (armed - start) * 1000 / static_cast<int64_t>(BENCHMARK_TIMERS),
+		   (rearmed - armed) * 1000 / static_cast<int64_t>(BENCHMARK_TIMERS),
+		   (cancelled - advanced) * 1000 / static_cast<int64_t>(BENCHMARK_TIMERS),
+		   advanced - rearmed);
+
+	delete [] timers;
+}
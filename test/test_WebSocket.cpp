@@ -0,0 +1,243 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unity.h"
+#include "WebSocketTestFixture.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+	#include <inttypes.h>
+	#include <stdio.h>
+	#include <esp_timer.h>
+}
+
+using namespace IDFix::Protocols;
+using namespace IDFix::Protocols::Test;
+
+namespace
+{
+	const uint16_t	ORDER_TEST_PORT			= 8454;
+	const uint16_t	LATENCY_TEST_PORT		= 8455;
+	const uint16_t	BATCHING_TEST_PORT		= 8456;
+
+	const uint32_t	EVENT_TIMEOUT			= 10000; // ms
+	const size_t	MESSAGE_LENGTH			= 32;
+	const size_t	ORDERED_MESSAGES		= 500;
+	const size_t	LATENCY_MESSAGES		= 200;
+	const size_t	BATCHED_MESSAGES		= 2000;
+
+	// upper bounds of the latency histogram in microseconds, the last bucket takes the rest
+	const int64_t	HISTOGRAM_BOUNDS[]		= { 100, 1000, 10000, 100000, 800000 };
+	const size_t	HISTOGRAM_BUCKETS		= sizeof(HISTOGRAM_BOUNDS) / sizeof(HISTOGRAM_BOUNDS[0]) + 1;
+
+	struct BatchingConfiguration
+	{
+		size_t		batchSize;
+		uint32_t	maxLingerMS;
+	};
+
+	const BatchingConfiguration	BATCHING_CONFIGURATIONS[] = { { 0, 0 }, { 1400, 0 }, { 1400, 5 } };
+
+	std::string testURL(uint16_t port)
+	{
+		return "wss://127.0.0.1:" + std::to_string(port);
+	}
+
+	bool connectWebSocket(WebSocket &webSocket, TestWebSocketHandler &handler, uint16_t port)
+	{
+		return webSocket.start() && webSocket.setURL( testURL(port) ) && webSocket.setCaCertificate(TEST_CERTIFICATE_PEM)
+				&& webSocket.connect() && handler.waitForConnected(EVENT_TIMEOUT);
+	}
+
+	void stampMessage(char *message, uint32_t sequence)
+	{
+		// the enqueue time and the sequence number lead the message, the rest is filler
+		int64_t enqueueTime = esp_timer_get_time();
+
+		memset(message, 'x', MESSAGE_LENGTH);
+		memcpy(message, &enqueueTime, sizeof(enqueueTime) );
+		memcpy(message + sizeof(enqueueTime), &sequence, sizeof(sequence) );
+	}
+
+	int64_t enqueueTime(const WebSocketTestServer::Message &message)
+	{
+		int64_t enqueueTime;
+		memcpy(&enqueueTime, message.payload.data(), sizeof(enqueueTime) );
+		return enqueueTime;
+	}
+
+	uint32_t sequence(const WebSocketTestServer::Message &message)
+	{
+		uint32_t sequence;
+		memcpy(&sequence, message.payload.data() + sizeof(int64_t), sizeof(sequence) );
+		return sequence;
+	}
+}
+
+TEST_CASE("WebSocket delivers the queued messages in order", "[idfix-protocols][websocket]")
+{
+	WebSocketTestServer		server;
+	TestWebSocketHandler	handler;
+	WebSocket				webSocket(&handler);
+	char					message[MESSAGE_LENGTH];
+
+	TEST_ASSERT_TRUE( server.start(ORDER_TEST_PORT) );
+	TEST_ASSERT_TRUE( connectWebSocket(webSocket, handler, ORDER_TEST_PORT) );
+
+	// a full send buffer makes the sender wait for the websocket task instead of dropping messages
+	webSocket.setSendPolicy(WebSocketSendBuffer::Block, EVENT_TIMEOUT);
+
+	for ( uint32_t index = 0; index < ORDERED_MESSAGES; index++ )
+	{
+		stampMessage(message, index);
+		TEST_ASSERT_GREATER_THAN( 0, webSocket.sendBinaryMessage(message, sizeof(message) ) );
+	}
+
+	TEST_ASSERT_TRUE( server.waitForMessages(ORDERED_MESSAGES, EVENT_TIMEOUT) );
+
+	std::vector<WebSocketTestServer::Message> messages = server.messages();
+	TEST_ASSERT_EQUAL( ORDERED_MESSAGES, messages.size() );
+
+	for ( uint32_t index = 0; index < ORDERED_MESSAGES; index++ )
+	{
+		TEST_ASSERT_EQUAL( MESSAGE_LENGTH, messages[index].payload.size() );
+		TEST_ASSERT_EQUAL_UINT32( index, sequence(messages[index]) );
+	}
+
+	TEST_ASSERT_TRUE( webSocket.disconnect() );
+	TEST_ASSERT_TRUE( handler.waitForDisconnected(EVENT_TIMEOUT) );
+	server.stop();
+}
+
+TEST_CASE("WebSocket enqueue to wire latency", "[idfix-protocols][websocket][perf]")
+{
+	WebSocketTestServer		server;
+	TestWebSocketHandler	handler;
+	WebSocket				webSocket(&handler);
+	char					message[MESSAGE_LENGTH];
+
+	TEST_ASSERT_TRUE( server.start(LATENCY_TEST_PORT) );
+	TEST_ASSERT_TRUE( connectWebSocket(webSocket, handler, LATENCY_TEST_PORT) );
+
+	// every message is queued while the websocket task waits for the transport, which used to delay it up to the poll timeout
+	for ( uint32_t index = 0; index < LATENCY_MESSAGES; index++ )
+	{
+		vTaskDelay( pdMS_TO_TICKS(5) );
+		stampMessage(message, index);
+		TEST_ASSERT_GREATER_THAN( 0, webSocket.sendBinaryMessage(message, sizeof(message) ) );
+	}
+
+	TEST_ASSERT_TRUE( server.waitForMessages(LATENCY_MESSAGES, EVENT_TIMEOUT) );
+
+	std::vector<WebSocketTestServer::Message>	messages = server.messages();
+	std::vector<int64_t>						latencies;
+	size_t										histogram[HISTOGRAM_BUCKETS] = {};
+
+	for ( const WebSocketTestServer::Message &receivedMessage : messages )
+	{
+		int64_t latency = receivedMessage.receiveTime - enqueueTime(receivedMessage);
+		size_t bucket = 0;
+
+		while ( bucket < HISTOGRAM_BUCKETS - 1 && latency >= HISTOGRAM_BOUNDS[bucket] )
+		{
+			bucket++;
+		}
+
+		histogram[bucket]++;
+		latencies.push_back(latency);
+	}
+
+	printf("WebSocket enqueue to wire latency: median %" PRId64 " us, 99th percentile %" PRId64 " us, max %" PRId64 " us\n",
+		   percentile(latencies, 50), percentile(latencies, 99), percentile(latencies, 100) );
+
+	for ( size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++ )
+	{
+		if ( bucket < HISTOGRAM_BUCKETS - 1 )
+		{
+			printf("  < %7" PRId64 " us: %u\n", HISTOGRAM_BOUNDS[bucket], static_cast<unsigned>(histogram[bucket]) );
+		}
+		else
+		{
+			printf(" >= %7" PRId64 " us: %u\n", HISTOGRAM_BOUNDS[bucket - 1], static_cast<unsigned>(histogram[bucket]) );
+		}
+	}
+
+	// without the wakeup a message waited for the poll timeout of 800 ms
+	TEST_ASSERT_LESS_THAN( 100000, percentile(latencies, 99) );
+
+	TEST_ASSERT_TRUE( webSocket.disconnect() );
+	TEST_ASSERT_TRUE( handler.waitForDisconnected(EVENT_TIMEOUT) );
+	server.stop();
+}
+
+TEST_CASE("WebSocket message rate and records per message with batching", "[idfix-protocols][websocket][perf]")
+{
+	WebSocketTestServer		server;
+	char					message[MESSAGE_LENGTH];
+
+	TEST_ASSERT_TRUE( server.start(BATCHING_TEST_PORT) );
+
+	for ( const BatchingConfiguration &configuration : BATCHING_CONFIGURATIONS )
+	{
+		// the batching can only be configured while the websocket is stopped
+		TestWebSocketHandler	handler;
+		WebSocket				webSocket(&handler);
+
+		TEST_ASSERT_TRUE( webSocket.setSendBatching(configuration.batchSize, configuration.maxLingerMS) );
+		TEST_ASSERT_TRUE( connectWebSocket(webSocket, handler, BATCHING_TEST_PORT) );
+
+		TLSSocket_sharedPtr tlsSocket = server.waitForConnection(EVENT_TIMEOUT);
+		TEST_ASSERT_NOT_NULL( tlsSocket.get() );
+
+		webSocket.setSendPolicy(WebSocketSendBuffer::Block, EVENT_TIMEOUT);
+
+		// the opening handshake is complete, from now on the client only sends the messages
+		uint32_t recordsReceived = tlsSocket->statistics().recordsReceived;
+		int64_t start = esp_timer_get_time();
+
+		for ( uint32_t index = 0; index < BATCHED_MESSAGES; index++ )
+		{
+			stampMessage(message, index);
+			TEST_ASSERT_GREATER_THAN( 0, webSocket.sendBinaryMessage(message, sizeof(message) ) );
+		}
+
+		TEST_ASSERT_TRUE( server.waitForMessages(BATCHED_MESSAGES, EVENT_TIMEOUT) );
+
+		std::vector<WebSocketTestServer::Message> messages = server.messages();
+		int64_t time = std::max<int64_t>(messages.back().receiveTime - start, 1);
+		uint32_t records = tlsSocket->statistics().recordsReceived - recordsReceived;
+
+		for ( uint32_t index = 0; index < BATCHED_MESSAGES; index++ )
+		{
+			TEST_ASSERT_EQUAL_UINT32( index, sequence(messages[index]) );
+		}
+
+		printf("WebSocket with a batch size of %u bytes and a linger time of %u ms: %" PRId64 " msgs/s, %" PRId64 ".%02" PRId64 " TLS records per message\n",
+			   static_cast<unsigned>(configuration.batchSize), static_cast<unsigned>(configuration.maxLingerMS),
+			   static_cast<int64_t>(BATCHED_MESSAGES) * 1000000 / time, static_cast<int64_t>(records) / static_cast<int64_t>(BATCHED_MESSAGES),
+			   static_cast<int64_t>(records) * 100 / static_cast<int64_t>(BATCHED_MESSAGES) % 100 );
+
+		TEST_ASSERT_TRUE( webSocket.disconnect() );
+		TEST_ASSERT_TRUE( handler.waitForDisconnected(EVENT_TIMEOUT) );
+	}
+
+	server.stop();
+}
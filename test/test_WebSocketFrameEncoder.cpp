@@ -0,0 +1,245 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unity.h"
+#include "WebSocketFrameEncoder.h"
+
+#include <new>
+
+extern "C"
+{
+	#include <inttypes.h>
+	#include <stdio.h>
+	#include <string.h>
+	#include <esp_timer.h>
+}
+
+using namespace IDFix::Protocols;
+
+namespace
+{
+	// covers all three length encodings and the word-wide loop with every head and tail length
+	const size_t	FRAME_LENGTHS[]			= { 0, 1, 3, 7, 15, 16, 17, 33, 125, 126, 127, 1000, 65535, 65536 };
+	const size_t	MAX_FRAME_LENGTH		= 65536;
+	const size_t	BENCHMARK_LENGTHS[]		= { 64, 1024, 65536 };
+	const size_t	BENCHMARK_BYTES			= 4 * 1024 * 1024;
+
+	uint32_t nextRandom(uint32_t &state)
+	{
+		// xorshift, so the payloads are the same in every run
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	void referenceMask(char *destination, const char *source, size_t length, uint32_t maskingKey)
+	{
+		const uint8_t *key = reinterpret_cast<const uint8_t*>(&maskingKey);
+
+		for ( size_t index = 0; index < length; index++ )
+		{
+			destination[index] = static_cast<char>( source[index] ^ key[index % 4] );
+		}
+	}
+
+	void assertFrame(const char *frame, size_t frameLength, uint8_t opcode, const char *payload, size_t length, uint32_t maskingKey)
+	{
+		const uint8_t *bytes = reinterpret_cast<const uint8_t*>(frame);
+		uint8_t expectedHeader[14];
+		size_t headerLength = 0;
+
+		expectedHeader[headerLength++] = opcode;
+
+		if ( length < 126 )
+		{
+			expectedHeader[headerLength++] = 0x80 | static_cast<uint8_t>(length);
+		}
+		else if ( length <= UINT16_MAX )
+		{
+			expectedHeader[headerLength++] = 0x80 | 126;
+			expectedHeader[headerLength++] = static_cast<uint8_t>(length >> 8);
+			expectedHeader[headerLength++] = static_cast<uint8_t>(length);
+		}
+		else
+		{
+			expectedHeader[headerLength++] = 0x80 | 127;
+
+			for ( int shift = 56; shift >= 0; shift -= 8 )
+			{
+				expectedHeader[headerLength++] = static_cast<uint8_t>( static_cast<uint64_t>(length) >> shift );
+			}
+		}
+
+		memcpy(expectedHeader + headerLength, &maskingKey, 4);
+		headerLength += 4;
+
+		TEST_ASSERT_EQUAL( headerLength, WebSocketFrameEncoder::headerLength(length) );
+		TEST_ASSERT_EQUAL( headerLength + length, frameLength );
+		TEST_ASSERT_EQUAL_MEMORY( expectedHeader, bytes, headerLength );
+
+		for ( size_t index = 0; index < length; index++ )
+		{
+			uint8_t unmasked = bytes[headerLength + index] ^ expectedHeader[headerLength - 4 + index % 4];
+
+			// only reported on a mismatch, the assertion per byte would dominate the run time on the target
+			if ( unmasked != static_cast<uint8_t>(payload[index]) )
+			{
+				TEST_ASSERT_EQUAL_UINT8( static_cast<uint8_t>(payload[index]), unmasked );
+			}
+		}
+	}
+}
+
+TEST_CASE("WebSocketFrameEncoder encodes frames like a byte-wise encoder", "[idfix-protocols][websocket]")
+{
+	char *source = new (std::nothrow) char[MAX_FRAME_LENGTH + 8];
+	char *frame = new (std::nothrow) char[MAX_FRAME_LENGTH + WebSocketFrameEncoder::MAX_HEADER_LENGTH + 8];
+	uint32_t random = 0xc0ffee;
+
+	TEST_ASSERT_NOT_NULL( source );
+	TEST_ASSERT_NOT_NULL( frame );
+
+	for ( size_t index = 0; index < MAX_FRAME_LENGTH + 8; index++ )
+	{
+		source[index] = static_cast<char>( nextRandom(random) );
+	}
+
+	// every combination of source and destination alignment, so the word-wide and the byte-wise paths are both taken
+	for ( size_t length : FRAME_LENGTHS )
+	{
+		for ( size_t sourceOffset = 0; sourceOffset < 8; sourceOffset++ )
+		{
+			for ( size_t frameOffset = 0; frameOffset < 8; frameOffset++ )
+			{
+				uint32_t maskingKey = nextRandom(random);
+				size_t frameLength = WebSocketFrameEncoder::encode(frame + frameOffset, 0x82, source + sourceOffset, length, maskingKey);
+
+				assertFrame(frame + frameOffset, frameLength, 0x82, source + sourceOffset, length, maskingKey);
+			}
+		}
+	}
+
+	delete [] frame;
+	delete [] source;
+}
+
+TEST_CASE("WebSocketFrameEncoder copyMasked matches a byte-wise mask", "[idfix-protocols][websocket]")
+{
+	char source[80];
+	char masked[80];
+	char expected[80];
+	uint32_t random = 0xfeed;
+
+	for ( char &byte : source )
+	{
+		byte = static_cast<char>( nextRandom(random) );
+	}
+
+	for ( size_t length = 0; length <= 64; length++ )
+	{
+		for ( size_t sourceOffset = 0; sourceOffset < 8; sourceOffset++ )
+		{
+			for ( size_t destinationOffset = 0; destinationOffset < 8; destinationOffset++ )
+			{
+				uint32_t maskingKey = nextRandom(random);
+
+				memset(masked, 0x5a, sizeof(masked) );
+				memset(expected, 0x5a, sizeof(expected) );
+
+				WebSocketFrameEncoder::copyMasked(masked + destinationOffset, source + sourceOffset, length, maskingKey);
+				referenceMask(expected + destinationOffset, source + sourceOffset, length, maskingKey);
+
+				// the bytes around the destination are not touched
+				TEST_ASSERT_EQUAL_MEMORY( expected, masked, sizeof(masked) );
+			}
+		}
+	}
+}
+
+TEST_CASE("WebSocketFrameEncoder alignedFrameStart aligns the payload of the frame", "[idfix-protocols][websocket]")
+{
+	alignas(8) char buffer[64 + WebSocketFrameEncoder::ALIGNMENT_SLACK];
+	alignas(8) char payload[16];
+
+	for ( size_t length : FRAME_LENGTHS )
+	{
+		for ( size_t payloadOffset = 0; payloadOffset < 8; payloadOffset++ )
+		{
+			char *frame = WebSocketFrameEncoder::alignedFrameStart(buffer, payload + payloadOffset, length);
+			uintptr_t framePayload = reinterpret_cast<uintptr_t>(frame) + WebSocketFrameEncoder::headerLength(length);
+
+			TEST_ASSERT_LESS_THAN( WebSocketFrameEncoder::ALIGNMENT_SLACK, static_cast<size_t>(frame - buffer) );
+			TEST_ASSERT_EQUAL( 0, ( framePayload - reinterpret_cast<uintptr_t>(payload + payloadOffset) ) % WebSocketFrameEncoder::ALIGNMENT_SLACK );
+		}
+	}
+}
+
+TEST_CASE("WebSocketFrameEncoder masking throughput", "[idfix-protocols][websocket][perf]")
+{
+	size_t maxLength = BENCHMARK_LENGTHS[ sizeof(BENCHMARK_LENGTHS) / sizeof(BENCHMARK_LENGTHS[0]) - 1 ];
+	char *source = new (std::nothrow) char[maxLength + 8];
+	char *frame = new (std::nothrow) char[maxLength + WebSocketFrameEncoder::MAX_HEADER_LENGTH + WebSocketFrameEncoder::ALIGNMENT_SLACK];
+
+	TEST_ASSERT_NOT_NULL( source );
+	TEST_ASSERT_NOT_NULL( frame );
+	memset(source, 0x42, maxLength + 8);
+
+	for ( size_t length : BENCHMARK_LENGTHS )
+	{
+		size_t rounds = BENCHMARK_BYTES / length;
+
+		// aligned: the frame starts where its payload gets the alignment of the source, as the websocket task encodes single messages
+		char *alignedFrame = WebSocketFrameEncoder::alignedFrameStart(frame, source, length);
+		int64_t start = esp_timer_get_time();
+
+		for ( size_t round = 0; round < rounds; round++ )
+		{
+			WebSocketFrameEncoder::encode(alignedFrame, 0x82, source, length, static_cast<uint32_t>(round) );
+		}
+
+		int64_t alignedTime = esp_timer_get_time() - start;
+
+		// misaligned: like the frames of a batch, which are encoded back to back
+		char *misalignedFrame = WebSocketFrameEncoder::alignedFrameStart(frame, source + 1, length);
+		start = esp_timer_get_time();
+
+		for ( size_t round = 0; round < rounds; round++ )
+		{
+			WebSocketFrameEncoder::encode(misalignedFrame, 0x82, source, length, static_cast<uint32_t>(round) );
+		}
+
+		int64_t misalignedTime = esp_timer_get_time() - start;
+		start = esp_timer_get_time();
+
+		for ( size_t round = 0; round < rounds; round++ )
+		{
+			referenceMask(frame + WebSocketFrameEncoder::headerLength(length), source, length, static_cast<uint32_t>(round) );
+		}
+
+		int64_t referenceTime = esp_timer_get_time() - start;
+		int64_t bytes = static_cast<int64_t>(rounds * length);
+
+		printf("WebSocketFrameEncoder with %u byte payloads: aligned %" PRId64 " MB/s, misaligned %" PRId64 " MB/s, byte-wise %" PRId64 " MB/s\n",
+			   static_cast<unsigned>(length),
+			   bytes / (alignedTime > 0 ? alignedTime : 1), bytes / (misalignedTime > 0 ? misalignedTime : 1),
+			   bytes / (referenceTime > 0 ? referenceTime : 1) );
+	}
+
+	delete [] frame;
+	delete [] source;
+}
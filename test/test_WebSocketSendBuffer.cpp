@@ -0,0 +1,391 @@
+/*   2log.io
+ *   Copyright (C) 2021 - 2log.io | mail@2log.io,  sascha@2log.io
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unity.h"
+#include "WebSocketSendBuffer.h"
+
+#include <cstring>
+#include <deque>
+#include <string>
+
+extern "C"
+{
+	#include <inttypes.h>
+	#include <stdio.h>
+	#include <esp_heap_caps.h>
+	#include <esp_timer.h>
+	#include <freertos/FreeRTOS.h>
+	#include <freertos/queue.h>
+	#include <freertos/semphr.h>
+	#include <freertos/task.h>
+}
+
+using namespace IDFix::Protocols;
+
+namespace
+{
+	const uint8_t	TEXT_OPCODE			= 0x01;
+	const uint8_t	BINARY_OPCODE		= 0x02;
+	const size_t	BENCHMARK_MESSAGES	= 20000;
+	const size_t	BENCHMARK_LENGTH	= 64;
+
+	// the capacity of the queue WebSocket used before the send buffer, both paths are drained when it is full
+	const size_t	LEGACY_QUEUE_LENGTH	= 4;
+
+	/** \brief  The item of the legacy queue, a heap copy of the message */
+	struct LegacyMessage
+	{
+		uint32_t		length;
+		const char*		data;
+	};
+
+	uint32_t nextRandom(uint32_t &state)
+	{
+		// xorshift, so the message pattern is the same in every run
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	std::string makeMessage(size_t length, uint32_t &random)
+	{
+		std::string message(length, '\0');
+
+		for ( char &byte : message )
+		{
+			byte = static_cast<char>( nextRandom(random) );
+		}
+
+		return message;
+	}
+
+	void assertFront(WebSocketSendBuffer &buffer, uint8_t opcode, const std::string &expected)
+	{
+		WebSocketSendBuffer::Message message;
+
+		TEST_ASSERT_TRUE( buffer.front(message) );
+		TEST_ASSERT_EQUAL_UINT8( opcode, message.opcode );
+		TEST_ASSERT_EQUAL( expected.length(), message.length );
+		TEST_ASSERT_EQUAL_MEMORY( expected.data(), message.data, expected.length() );
+	}
+
+	struct Consumer
+	{
+		WebSocketSendBuffer	*buffer;
+		uint32_t			delayMS;
+		SemaphoreHandle_t	finished;
+	};
+
+	void consumeOne(void *parameter)
+	{
+		Consumer *consumer = static_cast<Consumer*>(parameter);
+		WebSocketSendBuffer::Message message;
+
+		vTaskDelay( pdMS_TO_TICKS(consumer->delayMS) );
+
+		if ( consumer->buffer->front(message) )
+		{
+			consumer->buffer->pop();
+		}
+
+		xSemaphoreGive(consumer->finished);
+		vTaskDelete(nullptr);
+	}
+}
+
+TEST_CASE("WebSocketSendBuffer keeps the messages in order when wrapping around", "[idfix-protocols][websocket]")
+{
+	WebSocketSendBuffer buffer;
+	std::deque<std::pair<uint8_t, std::string>> queued;
+	uint32_t random = 0x1badb002;
+	size_t pushed = 0;
+
+	TEST_ASSERT_TRUE( buffer.init(256) );
+
+	// random lengths make the messages end at every position, so the space at the end of the buffer is skipped again and again
+	for ( size_t iteration = 0; iteration < 5000; iteration++ )
+	{
+		if ( nextRandom(random) % 3 != 0 )
+		{
+			std::string message = makeMessage(1 + nextRandom(random) % 100, random);
+			uint8_t opcode = nextRandom(random) % 2 == 0 ? TEXT_OPCODE : BINARY_OPCODE;
+			bool fits = message.length() <= buffer.freeSpace();
+			int result = buffer.push(opcode, message.data(), message.length() );
+
+			if ( fits )
+			{
+				TEST_ASSERT_EQUAL( static_cast<int>( message.length() ), result );
+			}
+
+			if ( result > 0 )
+			{
+				queued.emplace_back(opcode, message);
+				pushed++;
+			}
+			else
+			{
+				// FailFast never waits or drops
+				TEST_ASSERT_EQUAL( 0, result );
+			}
+		}
+		else if ( ! queued.empty() )
+		{
+			assertFront(buffer, queued.front().first, queued.front().second);
+			buffer.pop();
+			queued.pop_front();
+		}
+		else
+		{
+			WebSocketSendBuffer::Message message;
+			TEST_ASSERT_FALSE( buffer.front(message) );
+		}
+	}
+
+	TEST_ASSERT_GREATER_THAN( 1000, pushed );
+	TEST_ASSERT_EQUAL_UINT32( 0, buffer.droppedMessages() );
+
+	while ( ! queued.empty() )
+	{
+		assertFront(buffer, queued.front().first, queued.front().second);
+		buffer.pop();
+		queued.pop_front();
+	}
+
+	TEST_ASSERT_EQUAL( 256 - 8, buffer.freeSpace() );
+	TEST_ASSERT_EQUAL( -1, buffer.push(TEXT_OPCODE, "x", 0) );
+	TEST_ASSERT_EQUAL( -1, buffer.push(TEXT_OPCODE, std::string(512, 'x').data(), 512) );
+}
+
+TEST_CASE("WebSocketSendBuffer DropOldest drops the oldest queued messages", "[idfix-protocols][websocket]")
+{
+	WebSocketSendBuffer buffer;
+	std::deque<std::string> queued;
+	uint32_t random = 0x5eed;
+
+	TEST_ASSERT_TRUE( buffer.init(256) );
+	buffer.setPolicy(WebSocketSendBuffer::DropOldest);
+
+	// the first message is being sent, so it must neither be dropped nor overwritten
+	std::string sending = makeMessage(40, random);
+	TEST_ASSERT_EQUAL( 40, buffer.push(TEXT_OPCODE, sending.data(), sending.length() ) );
+
+	WebSocketSendBuffer::Message sendingMessage;
+	TEST_ASSERT_TRUE( buffer.front(sendingMessage) );
+
+	for ( size_t index = 0; index < 4; index++ )
+	{
+		queued.push_back( makeMessage(40, random) );
+		TEST_ASSERT_EQUAL( 40, buffer.push(TEXT_OPCODE, queued.back().data(), 40) );
+	}
+
+	// does not fit behind the queued messages, so the queued messages are dropped while the message being sent is kept
+	std::string large = makeMessage(120, random);
+	TEST_ASSERT_EQUAL( 120, buffer.push(BINARY_OPCODE, large.data(), large.length() ) );
+	TEST_ASSERT_EQUAL_UINT32( 4, buffer.droppedMessages() );
+	TEST_ASSERT_EQUAL_MEMORY( sending.data(), sendingMessage.data, sending.length() );
+
+	buffer.pop();
+	assertFront(buffer, BINARY_OPCODE, large);
+	buffer.pop();
+
+	// without a message being sent only as many messages as needed are dropped, oldest first
+	queued.clear();
+
+	for ( size_t index = 0; index < 4; index++ )
+	{
+		queued.push_back( makeMessage(40, random) );
+		TEST_ASSERT_EQUAL( 40, buffer.push(TEXT_OPCODE, queued.back().data(), 40) );
+	}
+
+	uint32_t droppedBefore = buffer.droppedMessages();
+
+	while ( buffer.droppedMessages() == droppedBefore )
+	{
+		queued.push_back( makeMessage(40, random) );
+		TEST_ASSERT_EQUAL( 40, buffer.push(TEXT_OPCODE, queued.back().data(), 40) );
+	}
+
+	uint32_t dropped = buffer.droppedMessages() - droppedBefore;
+	TEST_ASSERT_LESS_THAN( queued.size(), dropped );
+
+	for ( size_t index = dropped; index < queued.size(); index++ )
+	{
+		assertFront(buffer, TEXT_OPCODE, queued[index]);
+		buffer.pop();
+	}
+
+	WebSocketSendBuffer::Message message;
+	TEST_ASSERT_FALSE( buffer.front(message) );
+}
+
+TEST_CASE("WebSocketSendBuffer Block waits until a message was sent", "[idfix-protocols][websocket]")
+{
+	WebSocketSendBuffer buffer;
+	std::string message(100, 'b');
+
+	TEST_ASSERT_TRUE( buffer.init(256) );
+	buffer.setPolicy(WebSocketSendBuffer::Block, 100);
+
+	while ( buffer.push(TEXT_OPCODE, message.data(), message.length(), false) > 0 )
+	{
+	}
+
+	// without a consumer the push gives up after the timeout
+	int64_t start = esp_timer_get_time();
+	TEST_ASSERT_EQUAL( 0, buffer.push(TEXT_OPCODE, message.data(), message.length() ) );
+	TEST_ASSERT_GREATER_OR_EQUAL( 90, (esp_timer_get_time() - start) / 1000 );
+
+	// a task which must not wait is rejected right away
+	start = esp_timer_get_time();
+	TEST_ASSERT_EQUAL( 0, buffer.push(TEXT_OPCODE, message.data(), message.length(), false) );
+	TEST_ASSERT_LESS_THAN( 50, (esp_timer_get_time() - start) / 1000 );
+
+	// a message sent meanwhile releases the blocked push
+	buffer.setPolicy(WebSocketSendBuffer::Block, 2000);
+
+	SemaphoreHandle_t finished = xSemaphoreCreateBinary();
+	Consumer consumer = { &buffer, 50, finished };
+	TEST_ASSERT_EQUAL( pdPASS, xTaskCreate(&consumeOne, "consumer", 3072, &consumer, 5, nullptr) );
+
+	start = esp_timer_get_time();
+	TEST_ASSERT_EQUAL( 100, buffer.push(TEXT_OPCODE, message.data(), message.length() ) );
+	TEST_ASSERT_LESS_THAN( 1000, (esp_timer_get_time() - start) / 1000 );
+
+	TEST_ASSERT_EQUAL( pdTRUE, xSemaphoreTake(finished, pdMS_TO_TICKS(2000) ) );
+	vSemaphoreDelete(finished);
+}
+
+TEST_CASE("WebSocketSendBuffer releases every Payload exactly once", "[idfix-protocols][websocket]")
+{
+	int released = 0;
+	WebSocketSendBuffer::Payload::Deleter deleter = [&released](char *data, size_t)
+	{
+		delete [] data;
+		released++;
+	};
+
+	{
+		WebSocketSendBuffer buffer;
+		TEST_ASSERT_TRUE( buffer.init(4 * (8 + sizeof(WebSocketSendBuffer::Payload) ) ) );
+
+		// sent
+		TEST_ASSERT_EQUAL( 16, buffer.push(BINARY_OPCODE, WebSocketSendBuffer::Payload(new char[16], 16, deleter) ) );
+
+		WebSocketSendBuffer::Message message;
+		TEST_ASSERT_TRUE( buffer.front(message) );
+		TEST_ASSERT_EQUAL( 16, message.length );
+		buffer.pop();
+		TEST_ASSERT_EQUAL( 1, released );
+
+		// rejected, the payload is left to the caller
+		while ( buffer.push(BINARY_OPCODE, WebSocketSendBuffer::Payload(std::string(32, 's') ) ) > 0 )
+		{
+		}
+
+		WebSocketSendBuffer::Payload rejected(new char[16], 16, deleter);
+		TEST_ASSERT_EQUAL( 0, buffer.push(BINARY_OPCODE, std::move(rejected) ) );
+		TEST_ASSERT_EQUAL( 1, released );
+
+		// dropped
+		buffer.clear();
+		buffer.setPolicy(WebSocketSendBuffer::DropOldest);
+
+		for ( size_t index = 0; index < 6; index++ )
+		{
+			TEST_ASSERT_EQUAL( 16, buffer.push(BINARY_OPCODE, WebSocketSendBuffer::Payload(new char[16], 16, deleter) ) );
+		}
+
+		TEST_ASSERT_EQUAL( 1 + buffer.droppedMessages(), released );
+
+		// the rejected payload is still owned by the caller, the queued payloads are released with the buffer
+	}
+
+	TEST_ASSERT_EQUAL( 8, released );
+}
+
+TEST_CASE("WebSocketSendBuffer message rate and heap churn", "[idfix-protocols][websocket][perf]")
+{
+	WebSocketSendBuffer buffer;
+	QueueHandle_t legacyQueue = xQueueCreate(LEGACY_QUEUE_LENGTH, sizeof(LegacyMessage) );
+	std::string message(BENCHMARK_LENGTH, 'm');
+	WebSocketSendBuffer::Message front;
+
+	TEST_ASSERT_TRUE( buffer.init(16 * 1024) );
+	TEST_ASSERT_NOT_NULL( legacyQueue );
+
+	// the queue a message takes between the sending task and the websocket task, once with the ring buffer and once like
+	// before, with a malloc'd copy per message whose pointer is passed through a FreeRTOS queue of 4 entries
+	size_t heapBefore = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+	size_t heapMinimum = heapBefore;
+	int64_t start = esp_timer_get_time();
+
+	for ( size_t index = 0; index < BENCHMARK_MESSAGES; index++ )
+	{
+		buffer.push(TEXT_OPCODE, message.data(), message.length() );
+
+		if ( index % LEGACY_QUEUE_LENGTH == LEGACY_QUEUE_LENGTH - 1 )
+		{
+			heapMinimum = std::min(heapMinimum, heap_caps_get_free_size(MALLOC_CAP_8BIT) );
+
+			while ( buffer.front(front) )
+			{
+				buffer.pop();
+			}
+		}
+	}
+
+	int64_t bufferTime = esp_timer_get_time() - start;
+	size_t bufferChurn = heapBefore - heapMinimum;
+
+	heapMinimum = heapBefore;
+	start = esp_timer_get_time();
+
+	for ( size_t index = 0; index < BENCHMARK_MESSAGES; index++ )
+	{
+		LegacyMessage legacyMessage;
+		char *copy = static_cast<char*>( malloc(message.length() + 1) );
+
+		TEST_ASSERT_NOT_NULL( copy );
+		strcpy(copy, message.c_str() );
+		legacyMessage.data = copy;
+		legacyMessage.length = static_cast<uint32_t>( message.length() );
+
+		TEST_ASSERT_EQUAL( pdPASS, xQueueSend(legacyQueue, &legacyMessage, 0) );
+
+		if ( index % LEGACY_QUEUE_LENGTH == LEGACY_QUEUE_LENGTH - 1 )
+		{
+			heapMinimum = std::min(heapMinimum, heap_caps_get_free_size(MALLOC_CAP_8BIT) );
+
+			while ( xQueueReceive(legacyQueue, &legacyMessage, 0) == pdTRUE )
+			{
+				free( const_cast<char*>(legacyMessage.data) );
+			}
+		}
+	}
+
+	int64_t legacyTime = esp_timer_get_time() - start;
+	size_t legacyChurn = heapBefore - heapMinimum;
+
+	vQueueDelete(legacyQueue);
+
+	printf("WebSocketSendBuffer with %u byte messages: %" PRId64 " msgs/s, heap in use %u bytes (malloc'd copies in a queue of %u entries: %" PRId64 " msgs/s, %u bytes)\n",
+		   static_cast<unsigned>(BENCHMARK_LENGTH),
+		   static_cast<int64_t>(BENCHMARK_MESSAGES) * 1000000 / (bufferTime > 0 ? bufferTime : 1), static_cast<unsigned>(bufferChurn),
+		   static_cast<unsigned>(LEGACY_QUEUE_LENGTH),
+		   static_cast<int64_t>(BENCHMARK_MESSAGES) * 1000000 / (legacyTime > 0 ? legacyTime : 1), static_cast<unsigned>(legacyChurn) );
+}